@@ -0,0 +1,169 @@
+/**
+ *	umsftpd - User-mode SFTP application.
+ *	Copyright (C) 2021-2021 Johannes Bauer
+ *
+ *	This file is part of umsftpd.
+ *
+ *	umsftpd is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; this program is ONLY licensed under
+ *	version 3 of the License, later versions are explicitly excluded.
+ *
+ *	umsftpd is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with umsftpd; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *	Johannes Bauer <JohannesBauer@gmx.de>
+**/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "atomtable.h"
+
+#define ATOMTABLE_INITIAL_BUCKETS		64
+
+uint32_t atomtable_hash(const char *string, size_t length) {
+	/* FNV-1a */
+	uint32_t hash = 0x811c9dc5;
+	for (size_t i = 0; i < length; i++) {
+		hash ^= (uint8_t)string[i];
+		hash *= 0x01000193;
+	}
+	return hash;
+}
+
+struct atomtable_t* atomtable_new(void) {
+	struct atomtable_t *table = calloc(1, sizeof(struct atomtable_t));
+	if (!table) {
+		return NULL;
+	}
+	table->bucket_count = ATOMTABLE_INITIAL_BUCKETS;
+	table->buckets = calloc(table->bucket_count, sizeof(unsigned int));
+	if (!table->buckets) {
+		free(table);
+		return NULL;
+	}
+	return table;
+}
+
+/* Buckets contain atom + 1, zero denotes an empty bucket. Collisions are
+ * resolved by linear probing. */
+static void atomtable_bucket_insert(unsigned int *buckets, unsigned int bucket_count, uint32_t hash, unsigned int atom) {
+	unsigned int index = hash & (bucket_count - 1);
+	while (buckets[index]) {
+		index = (index + 1) & (bucket_count - 1);
+	}
+	buckets[index] = atom + 1;
+}
+
+static bool atomtable_rehash(struct atomtable_t *table) {
+	unsigned int new_bucket_count = table->bucket_count * 2;
+	unsigned int *new_buckets = calloc(new_bucket_count, sizeof(unsigned int));
+	if (!new_buckets) {
+		return false;
+	}
+	for (unsigned int atom = 0; atom < table->count; atom++) {
+		atomtable_bucket_insert(new_buckets, new_bucket_count, table->hashes[atom], atom);
+	}
+	free(table->buckets);
+	table->buckets = new_buckets;
+	table->bucket_count = new_bucket_count;
+	return true;
+}
+
+bool atomtable_lookup_hashed(const struct atomtable_t *table, const char *string, size_t length, uint32_t hash, unsigned int *atom) {
+	unsigned int index = hash & (table->bucket_count - 1);
+	while (table->buckets[index]) {
+		unsigned int candidate = table->buckets[index] - 1;
+		if ((table->hashes[candidate] == hash) && (table->lengths[candidate] == length) && !memcmp(table->strings[candidate], string, length)) {
+			*atom = candidate;
+			return true;
+		}
+		index = (index + 1) & (table->bucket_count - 1);
+	}
+	return false;
+}
+
+bool atomtable_lookup(const struct atomtable_t *table, const char *string, size_t length, unsigned int *atom) {
+	return atomtable_lookup_hashed(table, string, length, atomtable_hash(string, length), atom);
+}
+
+bool atomtable_intern(struct atomtable_t *table, const char *string, size_t length, unsigned int *atom) {
+	uint32_t hash = atomtable_hash(string, length);
+	if (atomtable_lookup_hashed(table, string, length, hash, atom)) {
+		return true;
+	}
+
+	/* Keep load factor below 1/2 */
+	if (2 * (table->count + 1) > table->bucket_count) {
+		if (!atomtable_rehash(table)) {
+			return false;
+		}
+	}
+
+	if (table->count == table->alloced_count) {
+		unsigned int new_alloced_count = table->alloced_count ? (table->alloced_count * 2) : 16;
+
+		char **new_strings = realloc(table->strings, sizeof(char*) * new_alloced_count);
+		if (!new_strings) {
+			return false;
+		}
+		table->strings = new_strings;
+
+		size_t *new_lengths = realloc(table->lengths, sizeof(size_t) * new_alloced_count);
+		if (!new_lengths) {
+			return false;
+		}
+		table->lengths = new_lengths;
+
+		uint32_t *new_hashes = realloc(table->hashes, sizeof(uint32_t) * new_alloced_count);
+		if (!new_hashes) {
+			return false;
+		}
+		table->hashes = new_hashes;
+
+		table->alloced_count = new_alloced_count;
+	}
+
+	char *string_copy = malloc(length + 1);
+	if (!string_copy) {
+		return false;
+	}
+	memcpy(string_copy, string, length);
+	string_copy[length] = 0;
+
+	*atom = table->count;
+	table->strings[*atom] = string_copy;
+	table->lengths[*atom] = length;
+	table->hashes[*atom] = hash;
+	table->count++;
+	atomtable_bucket_insert(table->buckets, table->bucket_count, hash, *atom);
+	return true;
+}
+
+const char *atomtable_string(const struct atomtable_t *table, unsigned int atom) {
+	if (atom >= table->count) {
+		return NULL;
+	}
+	return table->strings[atom];
+}
+
+void atomtable_free(struct atomtable_t *table) {
+	if (!table) {
+		return;
+	}
+	for (unsigned int i = 0; i < table->count; i++) {
+		free(table->strings[i]);
+	}
+	free(table->strings);
+	free(table->lengths);
+	free(table->hashes);
+	free(table->buckets);
+	free(table);
+}
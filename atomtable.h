@@ -0,0 +1,54 @@
+/**
+ *	umsftpd - User-mode SFTP application.
+ *	Copyright (C) 2021-2021 Johannes Bauer
+ *
+ *	This file is part of umsftpd.
+ *
+ *	umsftpd is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; this program is ONLY licensed under
+ *	version 3 of the License, later versions are explicitly excluded.
+ *
+ *	umsftpd is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with umsftpd; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *	Johannes Bauer <JohannesBauer@gmx.de>
+**/
+
+#ifndef __ATOMTABLE_H__
+#define __ATOMTABLE_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Maps strings to small integer IDs ("atoms"), so that equality of interned
+ * strings becomes an integer comparison. Atoms are numbered consecutively
+ * starting at zero. */
+struct atomtable_t {
+	unsigned int count;
+	unsigned int alloced_count;
+	char **strings;
+	size_t *lengths;
+	uint32_t *hashes;
+	unsigned int bucket_count;
+	unsigned int *buckets;
+};
+
+/*************** AUTO GENERATED SECTION FOLLOWS ***************/
+uint32_t atomtable_hash(const char *string, size_t length);
+struct atomtable_t* atomtable_new(void);
+bool atomtable_lookup_hashed(const struct atomtable_t *table, const char *string, size_t length, uint32_t hash, unsigned int *atom);
+bool atomtable_lookup(const struct atomtable_t *table, const char *string, size_t length, unsigned int *atom);
+bool atomtable_intern(struct atomtable_t *table, const char *string, size_t length, unsigned int *atom);
+const char *atomtable_string(const struct atomtable_t *table, unsigned int atom);
+void atomtable_free(struct atomtable_t *table);
+/***************  AUTO GENERATED SECTION ENDS   ***************/
+
+#endif
@@ -0,0 +1,185 @@
+/**
+ *	umsftpd - User-mode SFTP application.
+ *	Copyright (C) 2021-2021 Johannes Bauer
+ *
+ *	This file is part of umsftpd.
+ *
+ *	umsftpd is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; this program is ONLY licensed under
+ *	version 3 of the License, later versions are explicitly excluded.
+ *
+ *	umsftpd is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with umsftpd; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *	Johannes Bauer <JohannesBauer@gmx.de>
+**/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include "blockcache.h"
+#include "atomtable.h"
+#include "logging.h"
+
+struct blockcache_t *blockcache_new(size_t max_memory, uint64_t max_file_size) {
+	size_t set_size = BLOCKCACHE_WAYS * (sizeof(struct blockcache_slot_t) + BLOCKCACHE_BLOCK_SIZE) + sizeof(atomic_uint);
+	unsigned int set_count = max_memory / set_size;
+	if (set_count == 0) {
+		logmsg(LLVL_ERROR, "blockcache_new() needs at least %zu bytes of memory", set_size);
+		return NULL;
+	}
+
+	struct blockcache_t *cache = calloc(1, sizeof(struct blockcache_t));
+	if (!cache) {
+		return NULL;
+	}
+
+	unsigned int slot_count = set_count * BLOCKCACHE_WAYS;
+	size_t stats_size = sizeof(struct blockcache_stats_t);
+	size_t hands_size = sizeof(atomic_uint) * set_count;
+	size_t slots_offset = (stats_size + hands_size + 63) & ~(size_t)63;
+	size_t data_offset = (slots_offset + (sizeof(struct blockcache_slot_t) * slot_count) + 4095) & ~(size_t)4095;
+	cache->memory_size = data_offset + ((size_t)BLOCKCACHE_BLOCK_SIZE * slot_count);
+
+	/* Anonymous shared mappings are zero-filled, which is an empty cache */
+	cache->memory = mmap(NULL, cache->memory_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (cache->memory == MAP_FAILED) {
+		logmsg(LLVL_ERROR, "blockcache_new() failed to map %zu bytes of shared memory: %s", cache->memory_size, strerror(errno));
+		free(cache);
+		return NULL;
+	}
+	cache->set_count = set_count;
+	cache->max_file_size = max_file_size;
+	cache->stats = (struct blockcache_stats_t*)cache->memory;
+	cache->clock_hands = (atomic_uint*)((uint8_t*)cache->memory + stats_size);
+	cache->slots = (struct blockcache_slot_t*)((uint8_t*)cache->memory + slots_offset);
+	cache->data = (uint8_t*)cache->memory + data_offset;
+	return cache;
+}
+
+bool blockcache_file_cacheable(const struct blockcache_t *cache, const struct blockcache_file_t *file) {
+	return file->size <= cache->max_file_size;
+}
+
+static unsigned int blockcache_set(const struct blockcache_t *cache, const struct blockcache_file_t *file, uint64_t block) {
+	struct {
+		struct blockcache_file_t file;
+		uint64_t block;
+	} key = {
+		.file = *file,
+		.block = block,
+	};
+	return atomtable_hash((const char*)&key, sizeof(key)) % cache->set_count;
+}
+
+static bool blockcache_key_equal(const struct blockcache_slot_t *slot, const struct blockcache_file_t *file, uint64_t block) {
+	return (slot->block == block) && (slot->file.dev == file->dev) && (slot->file.ino == file->ino) && (slot->file.mtime_sec == file->mtime_sec) && (slot->file.mtime_nsec == file->mtime_nsec) && (slot->file.size == file->size);
+}
+
+/* Copies up to length bytes starting at block_offset within the given block.
+ * Returns the number of bytes copied, which is short only at the end of the
+ * file, or -1 if the block is not cached. */
+ssize_t blockcache_read(struct blockcache_t *cache, const struct blockcache_file_t *file, uint64_t block, size_t block_offset, void *dest, size_t length) {
+	unsigned int set = blockcache_set(cache, file, block);
+	for (unsigned int way = 0; way < BLOCKCACHE_WAYS; way++) {
+		unsigned int slot_index = (set * BLOCKCACHE_WAYS) + way;
+		struct blockcache_slot_t *slot = &cache->slots[slot_index];
+
+		unsigned int sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+		if ((sequence == 0) || (sequence & 1)) {
+			/* Empty or being written */
+			continue;
+		}
+		if (!blockcache_key_equal(slot, file, block)) {
+			continue;
+		}
+
+		uint32_t block_length = slot->length;
+		size_t copy_length = 0;
+		if (block_offset < block_length) {
+			copy_length = block_length - block_offset;
+			if (copy_length > length) {
+				copy_length = length;
+			}
+			memcpy(dest, cache->data + ((size_t)slot_index * BLOCKCACHE_BLOCK_SIZE) + block_offset, copy_length);
+		}
+
+		atomic_thread_fence(memory_order_acquire);
+		if (atomic_load_explicit(&slot->sequence, memory_order_relaxed) != sequence) {
+			/* Replaced while we were copying, data is torn */
+			break;
+		}
+		atomic_store_explicit(&slot->referenced, true, memory_order_relaxed);
+		atomic_fetch_add_explicit(&cache->stats->hits, 1, memory_order_relaxed);
+		return copy_length;
+	}
+	atomic_fetch_add_explicit(&cache->stats->misses, 1, memory_order_relaxed);
+	return -1;
+}
+
+/* Tries to acquire a victim slot of the set for writing; returns the slot
+ * index or -1 if all candidates are currently being written by others. */
+static int blockcache_acquire_victim(struct blockcache_t *cache, unsigned int set, unsigned int *old_sequence) {
+	for (unsigned int attempt = 0; attempt < 2 * BLOCKCACHE_WAYS; attempt++) {
+		unsigned int way = atomic_fetch_add_explicit(&cache->clock_hands[set], 1, memory_order_relaxed) % BLOCKCACHE_WAYS;
+		unsigned int slot_index = (set * BLOCKCACHE_WAYS) + way;
+		struct blockcache_slot_t *slot = &cache->slots[slot_index];
+
+		unsigned int sequence = atomic_load_explicit(&slot->sequence, memory_order_relaxed);
+		if (sequence & 1) {
+			continue;
+		}
+		if ((sequence != 0) && atomic_exchange_explicit(&slot->referenced, false, memory_order_relaxed)) {
+			/* Recently used, second chance */
+			continue;
+		}
+		if (atomic_compare_exchange_strong_explicit(&slot->sequence, &sequence, sequence + 1, memory_order_acquire, memory_order_relaxed)) {
+			*old_sequence = sequence;
+			return slot_index;
+		}
+	}
+	return -1;
+}
+
+void blockcache_insert(struct blockcache_t *cache, const struct blockcache_file_t *file, uint64_t block, const void *data, size_t length) {
+	if (length > BLOCKCACHE_BLOCK_SIZE) {
+		return;
+	}
+
+	unsigned int set = blockcache_set(cache, file, block);
+	unsigned int old_sequence;
+	int slot_index = blockcache_acquire_victim(cache, set, &old_sequence);
+	if (slot_index == -1) {
+		return;
+	}
+
+	struct blockcache_slot_t *slot = &cache->slots[slot_index];
+	atomic_thread_fence(memory_order_release);
+	if (old_sequence != 0) {
+		atomic_fetch_add_explicit(&cache->stats->evictions, 1, memory_order_relaxed);
+	}
+	slot->file = *file;
+	slot->block = block;
+	slot->length = length;
+	memcpy(cache->data + ((size_t)slot_index * BLOCKCACHE_BLOCK_SIZE), data, length);
+	atomic_store_explicit(&slot->referenced, false, memory_order_relaxed);
+	atomic_store_explicit(&slot->sequence, old_sequence + 2, memory_order_release);
+	atomic_fetch_add_explicit(&cache->stats->insertions, 1, memory_order_relaxed);
+}
+
+void blockcache_free(struct blockcache_t *cache) {
+	if (!cache) {
+		return;
+	}
+	munmap(cache->memory, cache->memory_size);
+	free(cache);
+}
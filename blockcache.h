@@ -0,0 +1,82 @@
+/**
+ *	umsftpd - User-mode SFTP application.
+ *	Copyright (C) 2021-2021 Johannes Bauer
+ *
+ *	This file is part of umsftpd.
+ *
+ *	umsftpd is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; this program is ONLY licensed under
+ *	version 3 of the License, later versions are explicitly excluded.
+ *
+ *	umsftpd is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with umsftpd; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *	Johannes Bauer <JohannesBauer@gmx.de>
+**/
+
+#ifndef __BLOCKCACHE_H__
+#define __BLOCKCACHE_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+
+#define BLOCKCACHE_BLOCK_SIZE				(16 * 1024)
+#define BLOCKCACHE_WAYS						8
+
+/* Identity of the file version that a cached block belongs to */
+struct blockcache_file_t {
+	uint64_t dev, ino;
+	int64_t mtime_sec;
+	uint64_t mtime_nsec;
+	uint64_t size;
+};
+
+/* Lives in shared memory. The sequence number is odd while a writer owns the
+ * slot; readers validate that it did not change while they copied. */
+struct blockcache_slot_t {
+	atomic_uint sequence;
+	atomic_bool referenced;
+	uint32_t length;
+	uint64_t block;
+	struct blockcache_file_t file;
+};
+
+struct blockcache_stats_t {
+	atomic_ullong hits, misses;
+	atomic_ullong insertions, evictions;
+};
+
+/* Fixed-size cache of file blocks in an anonymous shared mapping. It has to
+ * be created before worker processes are forked; all of them then share the
+ * same blocks. Blocks are placed set-associatively and replaced using a clock
+ * per set. Lookups are lock-free. */
+struct blockcache_t {
+	void *memory;
+	size_t memory_size;
+	unsigned int set_count;
+	uint64_t max_file_size;
+	struct blockcache_stats_t *stats;
+	atomic_uint *clock_hands;
+	struct blockcache_slot_t *slots;
+	uint8_t *data;
+};
+
+/*************** AUTO GENERATED SECTION FOLLOWS ***************/
+struct blockcache_t *blockcache_new(size_t max_memory, uint64_t max_file_size);
+bool blockcache_file_cacheable(const struct blockcache_t *cache, const struct blockcache_file_t *file);
+ssize_t blockcache_read(struct blockcache_t *cache, const struct blockcache_file_t *file, uint64_t block, size_t block_offset, void *dest, size_t length);
+void blockcache_insert(struct blockcache_t *cache, const struct blockcache_file_t *file, uint64_t block, const void *data, size_t length);
+void blockcache_free(struct blockcache_t *cache);
+/***************  AUTO GENERATED SECTION ENDS   ***************/
+
+#endif
@@ -0,0 +1,305 @@
+/**
+ *	umsftpd - User-mode SFTP application.
+ *	Copyright (C) 2021-2021 Johannes Bauer
+ *
+ *	This file is part of umsftpd.
+ *
+ *	umsftpd is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; this program is ONLY licensed under
+ *	version 3 of the License, later versions are explicitly excluded.
+ *
+ *	umsftpd is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with umsftpd; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *	Johannes Bauer <JohannesBauer@gmx.de>
+**/
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include "changejournal.h"
+#include "logging.h"
+
+static void changejournal_entry_free(struct changejournal_entry_t *entry) {
+	free(entry->path);
+	free(entry->old_path);
+	entry->path = NULL;
+	entry->old_path = NULL;
+}
+
+/* Takes ownership of the paths of the entry; the oldest entry is dropped if
+ * the ring is full */
+static void changejournal_push(struct changejournal_t *journal, const struct changejournal_entry_t *entry) {
+	unsigned int index;
+	if (journal->count == journal->max_entries) {
+		index = journal->first;
+		changejournal_entry_free(&journal->entries[index]);
+		journal->first = (journal->first + 1) % journal->max_entries;
+	} else {
+		index = (journal->first + journal->count) % journal->max_entries;
+		journal->count++;
+	}
+	journal->entries[index] = *entry;
+	journal->next_cursor = entry->cursor + 1;
+}
+
+static bool changejournal_write_record(FILE *f, const struct changejournal_entry_t *entry) {
+	struct changejournal_record_t record = {
+		.cursor = entry->cursor,
+		.timestamp = entry->timestamp,
+		.kind = entry->kind,
+		.path_length = strlen(entry->path),
+		.old_path_length = entry->old_path ? strlen(entry->old_path) : 0,
+	};
+	bool success = (fwrite(&record, sizeof(record), 1, f) == 1);
+	success = success && (fwrite(entry->path, 1, record.path_length, f) == record.path_length);
+	if (record.old_path_length) {
+		success = success && (fwrite(entry->old_path, 1, record.old_path_length, f) == record.old_path_length);
+	}
+	return success;
+}
+
+static char *changejournal_read_path(FILE *f, unsigned int length) {
+	char *path = malloc(length + 1);
+	if (!path) {
+		return NULL;
+	}
+	if (fread(path, 1, length, f) != length) {
+		free(path);
+		return NULL;
+	}
+	path[length] = 0;
+	return path;
+}
+
+/* Reads all complete records; a torn record at the end (e.g., after a crash
+ * while appending) is cut off so that new records follow the last good one */
+static bool changejournal_load(struct changejournal_t *journal) {
+	struct changejournal_header_t header;
+	if (fread(&header, sizeof(header), 1, journal->file) != 1) {
+		logmsg(LLVL_ERROR, "changejournal \"%s\" has no valid header", journal->filename);
+		return false;
+	}
+	if (memcmp(header.magic, CHANGEJOURNAL_MAGIC, sizeof(header.magic)) || (header.version != CHANGEJOURNAL_VERSION)) {
+		logmsg(LLVL_ERROR, "changejournal \"%s\" has unsupported format", journal->filename);
+		return false;
+	}
+	journal->next_cursor = header.base_cursor;
+
+	off_t good_offset = ftello(journal->file);
+	while (true) {
+		struct changejournal_record_t record;
+		if (fread(&record, sizeof(record), 1, journal->file) != 1) {
+			break;
+		}
+		if ((record.cursor < journal->next_cursor) || (record.kind < CHANGEJOURNAL_CREATE) || (record.kind > CHANGEJOURNAL_REMOVE)) {
+			break;
+		}
+		struct changejournal_entry_t entry = {
+			.cursor = record.cursor,
+			.timestamp = record.timestamp,
+			.kind = record.kind,
+			.path = changejournal_read_path(journal->file, record.path_length),
+		};
+		if (entry.path && record.old_path_length) {
+			entry.old_path = changejournal_read_path(journal->file, record.old_path_length);
+			if (!entry.old_path) {
+				changejournal_entry_free(&entry);
+			}
+		}
+		if (!entry.path) {
+			break;
+		}
+		changejournal_push(journal, &entry);
+		journal->file_records++;
+		good_offset = ftello(journal->file);
+	}
+
+	if (ftruncate(fileno(journal->file), good_offset) || fseeko(journal->file, good_offset, SEEK_SET)) {
+		logmsg(LLVL_ERROR, "changejournal \"%s\" cannot be truncated: %s", journal->filename, strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+/* Rewrites the file with only the changes still in the ring and atomically
+ * replaces the old file with it */
+static bool changejournal_compact(struct changejournal_t *journal) {
+	size_t filename_length = strlen(journal->filename);
+	char tmp_filename[filename_length + 5];
+	strcpy(tmp_filename, journal->filename);
+	strcpy(tmp_filename + filename_length, ".tmp");
+
+	FILE *f = fopen(tmp_filename, "w+");
+	if (!f) {
+		logmsg(LLVL_ERROR, "changejournal cannot create \"%s\": %s", tmp_filename, strerror(errno));
+		return false;
+	}
+	struct changejournal_header_t header = {
+		.version = CHANGEJOURNAL_VERSION,
+		.base_cursor = journal->count ? journal->entries[journal->first].cursor : journal->next_cursor,
+	};
+	memcpy(header.magic, CHANGEJOURNAL_MAGIC, sizeof(header.magic));
+	bool success = (fwrite(&header, sizeof(header), 1, f) == 1);
+	for (unsigned int i = 0; success && (i < journal->count); i++) {
+		success = changejournal_write_record(f, &journal->entries[(journal->first + i) % journal->max_entries]);
+	}
+	success = success && !fflush(f);
+	if (success && rename(tmp_filename, journal->filename)) {
+		logmsg(LLVL_ERROR, "changejournal cannot rename \"%s\": %s", tmp_filename, strerror(errno));
+		success = false;
+	}
+	if (!success) {
+		fclose(f);
+		unlink(tmp_filename);
+		return false;
+	}
+	if (journal->file) {
+		fclose(journal->file);
+	}
+	journal->file = f;
+	journal->file_records = journal->count;
+	return true;
+}
+
+/* Opens the journal persisted in filename, creating it if it does not exist
+ * yet. Without a filename, the journal only lives in memory. */
+struct changejournal_t *changejournal_open(const char *filename, unsigned int max_entries) {
+	if (max_entries == 0) {
+		return NULL;
+	}
+	struct changejournal_t *journal = calloc(1, sizeof(struct changejournal_t));
+	if (!journal) {
+		return NULL;
+	}
+	journal->max_entries = max_entries;
+	journal->next_cursor = 1;
+	journal->entries = calloc(max_entries, sizeof(struct changejournal_entry_t));
+	if (!journal->entries) {
+		changejournal_free(journal);
+		return NULL;
+	}
+	if (!filename) {
+		return journal;
+	}
+
+	journal->filename = strdup(filename);
+	if (!journal->filename) {
+		changejournal_free(journal);
+		return NULL;
+	}
+	journal->file = fopen(filename, "r+");
+	if (journal->file) {
+		if (!changejournal_load(journal)) {
+			changejournal_free(journal);
+			return NULL;
+		}
+	} else if ((errno != ENOENT) || !changejournal_compact(journal)) {
+		logmsg(LLVL_ERROR, "changejournal cannot open \"%s\": %s", filename, strerror(errno));
+		changejournal_free(journal);
+		return NULL;
+	}
+	return journal;
+}
+
+/* Returns false if the change could not be persisted; it is kept in memory
+ * regardless */
+bool changejournal_record(struct changejournal_t *journal, enum changejournal_kind_t kind, const char *path, const char *old_path) {
+	if ((strlen(path) > CHANGEJOURNAL_MAX_PATH_LENGTH) || (old_path && (strlen(old_path) > CHANGEJOURNAL_MAX_PATH_LENGTH))) {
+		logmsg(LLVL_WARN, "changejournal cannot record change with overlong path");
+		return false;
+	}
+
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	struct changejournal_entry_t entry = {
+		.cursor = journal->next_cursor,
+		.timestamp = now.tv_sec,
+		.kind = kind,
+		.path = strdup(path),
+		.old_path = old_path ? strdup(old_path) : NULL,
+	};
+	if (!entry.path || (old_path && !entry.old_path)) {
+		changejournal_entry_free(&entry);
+		return false;
+	}
+	changejournal_push(journal, &entry);
+
+	if (!journal->file) {
+		return true;
+	}
+	if (journal->file_records >= 2 * journal->max_entries) {
+		return changejournal_compact(journal);
+	}
+	if (!changejournal_write_record(journal->file, &entry) || fflush(journal->file)) {
+		logmsg(LLVL_ERROR, "changejournal failed writing \"%s\": %s", journal->filename, strerror(errno));
+		return false;
+	}
+	journal->file_records++;
+	return true;
+}
+
+/* The cursor of the most recent change, to be used as the starting point
+ * after a full scan */
+uint64_t changejournal_cursor(const struct changejournal_t *journal) {
+	return journal->next_cursor - 1;
+}
+
+static bool changejournal_below(const char *path, const char *prefix, size_t prefix_length) {
+	if (prefix_length == 0) {
+		return true;
+	}
+	return path && !strncmp(path, prefix, prefix_length) && ((path[prefix_length] == 0) || (path[prefix_length] == '/'));
+}
+
+/* Passes all changes after the cursor that affect the given relative path or
+ * anything below it to the callback, which may stop the iteration by
+ * returning false. The cursor is advanced to the last change that was
+ * considered. Returns false if changes after the cursor have already been
+ * dropped; the cursor is then set to the most recent change. */
+bool changejournal_since(const struct changejournal_t *journal, uint64_t *cursor, const char *prefix, size_t prefix_length, changejournal_callback_t callback, void *ctx) {
+	uint64_t oldest_known = journal->count ? journal->entries[journal->first].cursor - 1 : changejournal_cursor(journal);
+	if ((*cursor < oldest_known) || (*cursor > changejournal_cursor(journal))) {
+		*cursor = changejournal_cursor(journal);
+		return false;
+	}
+
+	for (unsigned int i = 0; i < journal->count; i++) {
+		const struct changejournal_entry_t *entry = &journal->entries[(journal->first + i) % journal->max_entries];
+		if (entry->cursor <= *cursor) {
+			continue;
+		}
+		if (changejournal_below(entry->path, prefix, prefix_length) || changejournal_below(entry->old_path, prefix, prefix_length)) {
+			if (!callback(ctx, entry)) {
+				*cursor = entry->cursor;
+				return true;
+			}
+		}
+		*cursor = entry->cursor;
+	}
+	return true;
+}
+
+void changejournal_free(struct changejournal_t *journal) {
+	if (!journal) {
+		return;
+	}
+	if (journal->file) {
+		fclose(journal->file);
+	}
+	for (unsigned int i = 0; i < journal->count; i++) {
+		changejournal_entry_free(&journal->entries[(journal->first + i) % journal->max_entries]);
+	}
+	free(journal->entries);
+	free(journal->filename);
+	free(journal);
+}
@@ -0,0 +1,97 @@
+/**
+ *	umsftpd - User-mode SFTP application.
+ *	Copyright (C) 2021-2021 Johannes Bauer
+ *
+ *	This file is part of umsftpd.
+ *
+ *	umsftpd is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; this program is ONLY licensed under
+ *	version 3 of the License, later versions are explicitly excluded.
+ *
+ *	umsftpd is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with umsftpd; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *	Johannes Bauer <JohannesBauer@gmx.de>
+**/
+
+#ifndef __CHANGEJOURNAL_H__
+#define __CHANGEJOURNAL_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#define CHANGEJOURNAL_MAGIC					"UMSFTPCJ"
+#define CHANGEJOURNAL_VERSION				1
+#define CHANGEJOURNAL_MAX_PATH_LENGTH		UINT16_MAX
+
+enum changejournal_kind_t {
+	CHANGEJOURNAL_CREATE = 1,
+	CHANGEJOURNAL_MODIFY = 2,
+	CHANGEJOURNAL_RENAME = 3,
+	CHANGEJOURNAL_REMOVE = 4,
+};
+
+/* One change below a mountpoint. Paths are relative to the mountpoint and
+ * have no leading slash; old_path is only set for renames. */
+struct changejournal_entry_t {
+	uint64_t cursor;
+	int64_t timestamp;
+	enum changejournal_kind_t kind;
+	char *path;
+	char *old_path;
+};
+
+/* On-disk layout: header, then one record per change, each followed by the
+ * path and the old path without NUL terminators. All values are in host
+ * byte order. The base cursor is the first cursor that will be handed out
+ * after the file has been (re-)written. */
+struct changejournal_header_t {
+	char magic[8];
+	uint32_t version;
+	uint32_t reserved;
+	uint64_t base_cursor;
+};
+
+struct changejournal_record_t {
+	uint64_t cursor;
+	int64_t timestamp;
+	uint32_t kind;
+	uint16_t path_length;
+	uint16_t old_path_length;
+};
+
+/* The most recent max_entries changes, kept in a ring buffer and optionally
+ * persisted to an append-only file that is compacted once it holds twice as
+ * many records as the ring. Cursors are strictly increasing; a reader that
+ * holds a cursor older than the oldest retained change has missed changes
+ * and needs to rescan. Not thread-safe. */
+struct changejournal_t {
+	char *filename;
+	FILE *file;
+	unsigned int file_records;
+	unsigned int max_entries;
+	struct changejournal_entry_t *entries;
+	unsigned int first, count;
+	uint64_t next_cursor;
+};
+
+typedef bool (*changejournal_callback_t)(void *ctx, const struct changejournal_entry_t *entry);
+
+/*************** AUTO GENERATED SECTION FOLLOWS ***************/
+struct changejournal_t *changejournal_open(const char *filename, unsigned int max_entries);
+bool changejournal_record(struct changejournal_t *journal, enum changejournal_kind_t kind, const char *path, const char *old_path);
+uint64_t changejournal_cursor(const struct changejournal_t *journal);
+bool changejournal_since(const struct changejournal_t *journal, uint64_t *cursor, const char *prefix, size_t prefix_length, changejournal_callback_t callback, void *ctx);
+void changejournal_free(struct changejournal_t *journal);
+/***************  AUTO GENERATED SECTION ENDS   ***************/
+
+#endif
@@ -0,0 +1,432 @@
+/**
+ *	umsftpd - User-mode SFTP application.
+ *	Copyright (C) 2021-2021 Johannes Bauer
+ *
+ *	This file is part of umsftpd.
+ *
+ *	umsftpd is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; this program is ONLY licensed under
+ *	version 3 of the License, later versions are explicitly excluded.
+ *
+ *	umsftpd is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with umsftpd; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *	Johannes Bauer <JohannesBauer@gmx.de>
+**/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "contentindex.h"
+#include "strings.h"
+#include "logging.h"
+
+struct contentindex_build_entry_t {
+	struct contentindex_entry_t entry;
+	char *path;
+};
+
+struct contentindex_builder_t {
+	unsigned int count, alloced_count;
+	struct contentindex_build_entry_t *entries;
+	bool follow_symlinks;
+};
+
+static void contentindex_entry_from_stat(struct contentindex_entry_t *entry, const struct stat *statbuf) {
+	entry->mode = statbuf->st_mode;
+	entry->uid = statbuf->st_uid;
+	entry->gid = statbuf->st_gid;
+	entry->size = statbuf->st_size;
+	entry->mtime_sec = statbuf->st_mtim.tv_sec;
+	entry->mtime_nsec = statbuf->st_mtim.tv_nsec;
+	entry->ctime_sec = statbuf->st_ctim.tv_sec;
+	entry->ctime_nsec = statbuf->st_ctim.tv_nsec;
+	entry->atime_sec = statbuf->st_atim.tv_sec;
+	entry->atime_nsec = statbuf->st_atim.tv_nsec;
+}
+
+static int contentindex_memcmp_len(const char *str1, size_t len1, const char *str2, size_t len2) {
+	int result = memcmp(str1, str2, (len1 < len2) ? len1 : len2);
+	if (result) {
+		return result;
+	}
+	return (len1 > len2) - (len1 < len2);
+}
+
+static void contentindex_split(const char *path, size_t path_length, size_t dir_length, const char **name, size_t *name_length) {
+	size_t name_start = dir_length ? (dir_length + 1) : 0;
+	*name = path + name_start;
+	*name_length = path_length - name_start;
+}
+
+static int contentindex_keycmp(const char *path1, size_t path_length1, size_t dir_length1, const char *path2, size_t path_length2, size_t dir_length2) {
+	int result = contentindex_memcmp_len(path1, dir_length1, path2, dir_length2);
+	if (result) {
+		return result;
+	}
+	const char *name1, *name2;
+	size_t name_length1, name_length2;
+	contentindex_split(path1, path_length1, dir_length1, &name1, &name_length1);
+	contentindex_split(path2, path_length2, dir_length2, &name2, &name_length2);
+	return contentindex_memcmp_len(name1, name_length1, name2, name_length2);
+}
+
+static int contentindex_build_entry_cmp(const void *velem1, const void *velem2) {
+	const struct contentindex_build_entry_t *elem1 = (const struct contentindex_build_entry_t*)velem1;
+	const struct contentindex_build_entry_t *elem2 = (const struct contentindex_build_entry_t*)velem2;
+	return contentindex_keycmp(elem1->path, elem1->entry.path_length, elem1->entry.dir_length, elem2->path, elem2->entry.path_length, elem2->entry.dir_length);
+}
+
+static bool contentindex_builder_add(struct contentindex_builder_t *builder, const char *dir_path, const char *name, const struct stat *statbuf) {
+	if (builder->count == builder->alloced_count) {
+		unsigned int new_alloced_count = builder->alloced_count ? (builder->alloced_count * 2) : 256;
+		struct contentindex_build_entry_t *new_entries = realloc(builder->entries, sizeof(struct contentindex_build_entry_t) * new_alloced_count);
+		if (!new_entries) {
+			return false;
+		}
+		builder->entries = new_entries;
+		builder->alloced_count = new_alloced_count;
+	}
+
+	size_t dir_length = strlen(dir_path);
+	size_t name_length = strlen(name);
+	size_t path_length = dir_length ? (dir_length + 1 + name_length) : name_length;
+	if (path_length > UINT32_MAX / 2) {
+		return false;
+	}
+	char *path = malloc(path_length + 1);
+	if (!path) {
+		return false;
+	}
+	if (dir_length) {
+		memcpy(path, dir_path, dir_length);
+		path[dir_length] = '/';
+		strcpy(path + dir_length + 1, name);
+	} else {
+		strcpy(path, name);
+	}
+
+	struct contentindex_build_entry_t *build_entry = &builder->entries[builder->count++];
+	*build_entry = (struct contentindex_build_entry_t) {
+		.entry.path_length = path_length,
+		.entry.dir_length = dir_length,
+		.path = path,
+	};
+	contentindex_entry_from_stat(&build_entry->entry, statbuf);
+	return true;
+}
+
+/* Takes ownership of the directory file descriptor */
+static bool contentindex_scan(struct contentindex_builder_t *builder, int dir_fd, const char *dir_path, unsigned int depth) {
+	DIR *dir = fdopendir(dir_fd);
+	if (!dir) {
+		logmsg(LLVL_ERROR, "contentindex failed to open directory \"%s\": %s", dir_path, strerror(errno));
+		close(dir_fd);
+		return false;
+	}
+
+	bool success = true;
+	while (success) {
+		errno = 0;
+		struct dirent *dirent = readdir(dir);
+		if (!dirent) {
+			if (errno) {
+				logmsg(LLVL_ERROR, "contentindex failed to read directory \"%s\": %s", dir_path, strerror(errno));
+				success = false;
+			}
+			break;
+		}
+
+		if (!strcmp(dirent->d_name, ".") || !strcmp(dirent->d_name, "..")) {
+			continue;
+		}
+
+		struct stat statbuf;
+		if (fstatat(dirfd(dir), dirent->d_name, &statbuf, builder->follow_symlinks ? 0 : AT_SYMLINK_NOFOLLOW)) {
+			/* Not accessible, therefore not listed */
+			continue;
+		}
+
+		/* Like vfs_readdir(), only regular files and directories are shown.
+		 * When symlinks are not followed, they are omitted entirely. */
+		if (!S_ISREG(statbuf.st_mode) && !S_ISDIR(statbuf.st_mode)) {
+			continue;
+		}
+
+		if (!contentindex_builder_add(builder, dir_path, dirent->d_name, &statbuf)) {
+			logmsg(LLVL_ERROR, "contentindex out of memory while indexing \"%s\"", dir_path);
+			success = false;
+			break;
+		}
+
+		if (S_ISDIR(statbuf.st_mode)) {
+			if (depth >= CONTENTINDEX_MAX_DEPTH) {
+				logmsg(LLVL_WARN, "contentindex not descending into \"%s/%s\", maximum depth reached", dir_path, dirent->d_name);
+				continue;
+			}
+			int child_fd = openat(dirfd(dir), dirent->d_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC | (builder->follow_symlinks ? 0 : O_NOFOLLOW));
+			if (child_fd == -1) {
+				/* Listed, but contents are not accessible */
+				continue;
+			}
+			success = contentindex_scan(builder, child_fd, builder->entries[builder->count - 1].path, depth + 1);
+		}
+	}
+	closedir(dir);
+	return success;
+}
+
+static bool contentindex_write(const struct contentindex_builder_t *builder, const struct contentindex_header_t *header, const char *filename) {
+	FILE *f = fopen(filename, "w");
+	if (!f) {
+		logmsg(LLVL_ERROR, "contentindex cannot create \"%s\": %s", filename, strerror(errno));
+		return false;
+	}
+
+	bool success = (fwrite(header, sizeof(struct contentindex_header_t), 1, f) == 1);
+	for (unsigned int i = 0; success && (i < builder->count); i++) {
+		success = (fwrite(&builder->entries[i].entry, sizeof(struct contentindex_entry_t), 1, f) == 1);
+	}
+	for (unsigned int i = 0; success && (i < builder->count); i++) {
+		success = (fwrite(builder->entries[i].path, builder->entries[i].entry.path_length + 1, 1, f) == 1);
+	}
+	if (fclose(f)) {
+		success = false;
+	}
+	if (!success) {
+		logmsg(LLVL_ERROR, "contentindex failed writing \"%s\"", filename);
+	}
+	return success;
+}
+
+/* Scans the directory tree below root_path and atomically replaces the index
+ * file with the result. */
+bool contentindex_build(const char *root_path, const char *index_filename, bool follow_symlinks) {
+	if (!follow_symlinks) {
+		struct symlink_check_response_t symlink = path_contains_symlink(root_path);
+		if (symlink.critical_error || symlink.file_not_found || symlink.contains_symlink) {
+			logmsg(LLVL_ERROR, "contentindex refusing to index \"%s\": not accessible or contains symlinks", root_path);
+			return false;
+		}
+	}
+
+	struct contentindex_header_t header = {
+		.version = CONTENTINDEX_VERSION,
+		.flags = follow_symlinks ? CONTENTINDEX_FLAG_FOLLOW_SYMLINKS : 0,
+	};
+	memcpy(header.magic, CONTENTINDEX_MAGIC, sizeof(header.magic));
+
+	int root_fd = open(root_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (root_fd == -1) {
+		logmsg(LLVL_ERROR, "contentindex cannot open \"%s\": %s", root_path, strerror(errno));
+		return false;
+	}
+	struct stat statbuf;
+	if (fstat(root_fd, &statbuf)) {
+		logmsg(LLVL_ERROR, "contentindex cannot stat \"%s\": %s", root_path, strerror(errno));
+		close(root_fd);
+		return false;
+	}
+	contentindex_entry_from_stat(&header.root, &statbuf);
+
+	struct contentindex_builder_t builder = {
+		.follow_symlinks = follow_symlinks,
+	};
+	bool success = contentindex_scan(&builder, root_fd, "", 0);
+	if (success && (builder.count > 0)) {
+		qsort(builder.entries, builder.count, sizeof(struct contentindex_build_entry_t), contentindex_build_entry_cmp);
+	}
+
+	uint64_t string_offset = 0;
+	for (unsigned int i = 0; i < builder.count; i++) {
+		builder.entries[i].entry.path_offset = string_offset;
+		string_offset += builder.entries[i].entry.path_length + 1;
+		if (string_offset > UINT32_MAX) {
+			logmsg(LLVL_ERROR, "contentindex of \"%s\" has too large string table", root_path);
+			success = false;
+			break;
+		}
+	}
+	header.entry_count = builder.count;
+	header.strings_offset = sizeof(struct contentindex_header_t) + ((uint64_t)builder.count * sizeof(struct contentindex_entry_t));
+	header.strings_length = string_offset;
+
+	if (success) {
+		size_t filename_length = strlen(index_filename);
+		char tmp_filename[filename_length + 5];
+		strcpy(tmp_filename, index_filename);
+		strcpy(tmp_filename + filename_length, ".tmp");
+		success = contentindex_write(&builder, &header, tmp_filename);
+		if (success && rename(tmp_filename, index_filename)) {
+			logmsg(LLVL_ERROR, "contentindex cannot rename \"%s\": %s", tmp_filename, strerror(errno));
+			success = false;
+		}
+		if (!success) {
+			unlink(tmp_filename);
+		}
+	}
+
+	for (unsigned int i = 0; i < builder.count; i++) {
+		free(builder.entries[i].path);
+	}
+	free(builder.entries);
+	if (success) {
+		logmsg(LLVL_INFO, "contentindex of \"%s\" has %u entries", root_path, header.entry_count);
+	}
+	return success;
+}
+
+static bool contentindex_validate(const struct contentindex_t *index) {
+	const struct contentindex_header_t *header = index->header;
+	if (index->map_length < sizeof(struct contentindex_header_t)) {
+		return false;
+	}
+	if (memcmp(header->magic, CONTENTINDEX_MAGIC, sizeof(header->magic)) || (header->version != CONTENTINDEX_VERSION)) {
+		return false;
+	}
+	uint64_t entries_end = sizeof(struct contentindex_header_t) + ((uint64_t)header->entry_count * sizeof(struct contentindex_entry_t));
+	if ((header->strings_offset < entries_end) || (header->strings_offset > index->map_length) || (header->strings_length > index->map_length - header->strings_offset)) {
+		return false;
+	}
+	for (unsigned int i = 0; i < header->entry_count; i++) {
+		const struct contentindex_entry_t *entry = &index->entries[i];
+		if (((uint64_t)entry->path_offset + entry->path_length + 1 > header->strings_length) || (entry->dir_length > entry->path_length)) {
+			return false;
+		}
+		if (index->strings[entry->path_offset + entry->path_length] != 0) {
+			return false;
+		}
+	}
+	return true;
+}
+
+struct contentindex_t *contentindex_open(const char *index_filename) {
+	struct contentindex_t *index = calloc(1, sizeof(struct contentindex_t));
+	if (!index) {
+		return NULL;
+	}
+
+	int fd = open(index_filename, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		logmsg(LLVL_ERROR, "contentindex cannot open \"%s\": %s", index_filename, strerror(errno));
+		free(index);
+		return NULL;
+	}
+
+	struct stat statbuf;
+	if (fstat(fd, &statbuf) || (statbuf.st_size == 0)) {
+		logmsg(LLVL_ERROR, "contentindex cannot use \"%s\"", index_filename);
+		close(fd);
+		free(index);
+		return NULL;
+	}
+
+	index->map_length = statbuf.st_size;
+	index->map = mmap(NULL, index->map_length, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (index->map == MAP_FAILED) {
+		logmsg(LLVL_ERROR, "contentindex cannot map \"%s\": %s", index_filename, strerror(errno));
+		free(index);
+		return NULL;
+	}
+
+	index->header = (const struct contentindex_header_t*)index->map;
+	index->entries = (const struct contentindex_entry_t*)((const uint8_t*)index->map + sizeof(struct contentindex_header_t));
+	index->strings = (const char*)index->map + ((index->map_length >= sizeof(struct contentindex_header_t)) ? index->header->strings_offset : 0);
+	if (!contentindex_validate(index)) {
+		logmsg(LLVL_ERROR, "contentindex \"%s\" is corrupt", index_filename);
+		contentindex_close(index);
+		return NULL;
+	}
+	return index;
+}
+
+static const char *contentindex_entry_path(const struct contentindex_t *index, const struct contentindex_entry_t *entry) {
+	return index->strings + entry->path_offset;
+}
+
+const struct contentindex_entry_t *contentindex_lookup(const struct contentindex_t *index, const char *path, size_t length) {
+	if (length == 0) {
+		return &index->header->root;
+	}
+
+	size_t dir_length = 0;
+	for (size_t i = length; i > 0; i--) {
+		if (path[i - 1] == '/') {
+			dir_length = i - 1;
+			break;
+		}
+	}
+
+	unsigned int low = 0;
+	unsigned int high = index->header->entry_count;
+	while (low < high) {
+		unsigned int mid = low + (high - low) / 2;
+		const struct contentindex_entry_t *entry = &index->entries[mid];
+		int cmp = contentindex_keycmp(contentindex_entry_path(index, entry), entry->path_length, entry->dir_length, path, length, dir_length);
+		if (cmp == 0) {
+			return entry;
+		} else if (cmp < 0) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+	return NULL;
+}
+
+/* Returns the first index at which the directory part is not smaller than
+ * (or, if inclusive, not smaller or equal to) the given directory */
+static unsigned int contentindex_dir_bound(const struct contentindex_t *index, const char *path, size_t length, bool inclusive) {
+	unsigned int low = 0;
+	unsigned int high = index->header->entry_count;
+	while (low < high) {
+		unsigned int mid = low + (high - low) / 2;
+		const struct contentindex_entry_t *entry = &index->entries[mid];
+		int cmp = contentindex_memcmp_len(contentindex_entry_path(index, entry), entry->dir_length, path, length);
+		if ((cmp < 0) || (inclusive && (cmp == 0))) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+	return low;
+}
+
+bool contentindex_dir_range(const struct contentindex_t *index, const char *path, size_t length, unsigned int *first, unsigned int *end) {
+	const struct contentindex_entry_t *entry = contentindex_lookup(index, path, length);
+	if (!entry || !S_ISDIR(entry->mode)) {
+		return false;
+	}
+	*first = contentindex_dir_bound(index, path, length, false);
+	*end = contentindex_dir_bound(index, path, length, true);
+	return true;
+}
+
+const char *contentindex_entry_name(const struct contentindex_t *index, const struct contentindex_entry_t *entry, size_t *length) {
+	const char *name;
+	contentindex_split(contentindex_entry_path(index, entry), entry->path_length, entry->dir_length, &name, length);
+	return name;
+}
+
+void contentindex_close(struct contentindex_t *index) {
+	if (!index) {
+		return;
+	}
+	munmap(index->map, index->map_length);
+	free(index);
+}
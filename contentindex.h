@@ -0,0 +1,83 @@
+/**
+ *	umsftpd - User-mode SFTP application.
+ *	Copyright (C) 2021-2021 Johannes Bauer
+ *
+ *	This file is part of umsftpd.
+ *
+ *	umsftpd is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; this program is ONLY licensed under
+ *	version 3 of the License, later versions are explicitly excluded.
+ *
+ *	umsftpd is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with umsftpd; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *	Johannes Bauer <JohannesBauer@gmx.de>
+**/
+
+#ifndef __CONTENTINDEX_H__
+#define __CONTENTINDEX_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define CONTENTINDEX_MAGIC					"UMSFTPIX"
+#define CONTENTINDEX_VERSION				1
+#define CONTENTINDEX_MAX_DEPTH				64
+
+#define CONTENTINDEX_FLAG_FOLLOW_SYMLINKS	(1 << 0)
+
+/* Attributes of one node below the indexed directory. The path is relative
+ * to the indexed directory and has no leading slash; its directory part is
+ * path[0 .. dir_length), the name follows after the separating slash. */
+struct contentindex_entry_t {
+	uint32_t path_offset;
+	uint32_t path_length;
+	uint32_t dir_length;
+	uint32_t mode;
+	uint32_t uid, gid;
+	uint64_t size;
+	int64_t mtime_sec, ctime_sec, atime_sec;
+	uint32_t mtime_nsec, ctime_nsec, atime_nsec;
+	uint32_t reserved;
+};
+
+/* On-disk layout: header, entries sorted by (directory, name), then the
+ * string table of NUL-terminated paths. All values are in host byte order.
+ * The root entry describes the indexed directory itself. */
+struct contentindex_header_t {
+	char magic[8];
+	uint32_t version;
+	uint32_t flags;
+	uint32_t entry_count;
+	uint32_t reserved;
+	uint64_t strings_offset;
+	uint64_t strings_length;
+	struct contentindex_entry_t root;
+};
+
+struct contentindex_t {
+	void *map;
+	size_t map_length;
+	const struct contentindex_header_t *header;
+	const struct contentindex_entry_t *entries;
+	const char *strings;
+};
+
+/*************** AUTO GENERATED SECTION FOLLOWS ***************/
+bool contentindex_build(const char *root_path, const char *index_filename, bool follow_symlinks);
+struct contentindex_t *contentindex_open(const char *index_filename);
+const struct contentindex_entry_t *contentindex_lookup(const struct contentindex_t *index, const char *path, size_t length);
+bool contentindex_dir_range(const struct contentindex_t *index, const char *path, size_t length, unsigned int *first, unsigned int *end);
+const char *contentindex_entry_name(const struct contentindex_t *index, const struct contentindex_entry_t *entry, size_t *length);
+void contentindex_close(struct contentindex_t *index);
+/***************  AUTO GENERATED SECTION ENDS   ***************/
+
+#endif
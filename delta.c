@@ -0,0 +1,130 @@
+/**
+ *	umsftpd - User-mode SFTP application.
+ *	Copyright (C) 2021-2021 Johannes Bauer
+ *
+ *	This file is part of umsftpd.
+ *
+ *	umsftpd is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; this program is ONLY licensed under
+ *	version 3 of the License, later versions are explicitly excluded.
+ *
+ *	umsftpd is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with umsftpd; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *	Johannes Bauer <JohannesBauer@gmx.de>
+**/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "delta.h"
+
+void delta_rolling_init(struct delta_rolling_t *rolling) {
+	memset(rolling, 0, sizeof(struct delta_rolling_t));
+}
+
+void delta_rolling_update(struct delta_rolling_t *rolling, const void *data, size_t length) {
+	const uint8_t *bytes = (const uint8_t*)data;
+	for (size_t i = 0; i < length; i++) {
+		rolling->a += bytes[i];
+		rolling->b += rolling->a;
+	}
+	rolling->length += length;
+}
+
+/* Moves the window by one byte, dropping "out" from its start and appending
+ * "in" at its end */
+void delta_rolling_roll(struct delta_rolling_t *rolling, uint8_t out, uint8_t in) {
+	rolling->a += in - out;
+	rolling->b += rolling->a - (rolling->length * out);
+}
+
+uint32_t delta_rolling_digest(const struct delta_rolling_t *rolling) {
+	return (rolling->a & 0xffff) | (rolling->b << 16);
+}
+
+uint32_t delta_weak_checksum(const void *data, size_t length) {
+	struct delta_rolling_t rolling;
+	delta_rolling_init(&rolling);
+	delta_rolling_update(&rolling, data, length);
+	return delta_rolling_digest(&rolling);
+}
+
+/* The strong checksum may be truncated to strong_length bytes, trading
+ * collision resistance for signature size; zero uses the full digest */
+struct delta_signer_t *delta_signer_new(uint32_t block_size, enum filehash_algorithm_t algorithm, unsigned int strong_length, delta_signature_callback_t callback, void *callback_ctx) {
+	if ((block_size < DELTA_MIN_BLOCK_SIZE) || (block_size > DELTA_MAX_BLOCK_SIZE)) {
+		return NULL;
+	}
+
+	struct delta_signer_t *signer = calloc(1, sizeof(struct delta_signer_t));
+	if (!signer) {
+		return NULL;
+	}
+	signer->strong = filehash_new(algorithm, 0);
+	if (!signer->strong) {
+		free(signer);
+		return NULL;
+	}
+	if ((strong_length == 0) || (strong_length > signer->strong->digest_length)) {
+		strong_length = signer->strong->digest_length;
+	}
+	signer->block_size = block_size;
+	signer->strong_length = strong_length;
+	signer->callback = callback;
+	signer->callback_ctx = callback_ctx;
+	delta_rolling_init(&signer->weak);
+	return signer;
+}
+
+static bool delta_signer_emit(struct delta_signer_t *signer) {
+	if (!filehash_finish(signer->strong)) {
+		return false;
+	}
+	signer->callback(signer->callback_ctx, signer->block_index, delta_rolling_digest(&signer->weak), signer->strong->digests, signer->strong_length);
+	signer->block_index++;
+	delta_rolling_init(&signer->weak);
+	return filehash_reset(signer->strong);
+}
+
+bool delta_signer_update(struct delta_signer_t *signer, const void *data, size_t length) {
+	const uint8_t *bytes = (const uint8_t*)data;
+	while (length) {
+		size_t chunk_length = signer->block_size - signer->weak.length;
+		if (chunk_length > length) {
+			chunk_length = length;
+		}
+		delta_rolling_update(&signer->weak, bytes, chunk_length);
+		if (!filehash_update(signer->strong, bytes, chunk_length)) {
+			return false;
+		}
+		bytes += chunk_length;
+		length -= chunk_length;
+		if ((signer->weak.length == signer->block_size) && !delta_signer_emit(signer)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/* Emits the last, short block if there is one */
+bool delta_signer_finish(struct delta_signer_t *signer) {
+	if (signer->weak.length) {
+		return delta_signer_emit(signer);
+	}
+	return true;
+}
+
+void delta_signer_free(struct delta_signer_t *signer) {
+	if (!signer) {
+		return;
+	}
+	filehash_free(signer->strong);
+	free(signer);
+}
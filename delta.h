@@ -0,0 +1,67 @@
+/**
+ *	umsftpd - User-mode SFTP application.
+ *	Copyright (C) 2021-2021 Johannes Bauer
+ *
+ *	This file is part of umsftpd.
+ *
+ *	umsftpd is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; this program is ONLY licensed under
+ *	version 3 of the License, later versions are explicitly excluded.
+ *
+ *	umsftpd is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with umsftpd; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *	Johannes Bauer <JohannesBauer@gmx.de>
+**/
+#ifndef __DELTA_H__
+#define __DELTA_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "filehash.h"
+
+#define DELTA_MIN_BLOCK_SIZE				512
+#define DELTA_MAX_BLOCK_SIZE				(128 * 1024)
+
+typedef void (*delta_signature_callback_t)(void *ctx, uint64_t block_index, uint32_t weak, const uint8_t *strong, unsigned int strong_length);
+
+/* rsync-style weak checksum over a window of bytes which can be moved along
+ * by one byte in constant time */
+struct delta_rolling_t {
+	uint32_t a, b;
+	uint32_t length;
+};
+
+/* Produces the block signatures of a file as it is streamed through, one
+ * callback per block. Memory use is independent of the file size. */
+struct delta_signer_t {
+	uint32_t block_size;
+	unsigned int strong_length;
+	struct filehash_t *strong;
+	struct delta_rolling_t weak;
+	uint64_t block_index;
+	delta_signature_callback_t callback;
+	void *callback_ctx;
+};
+
+/*************** AUTO GENERATED SECTION FOLLOWS ***************/
+void delta_rolling_init(struct delta_rolling_t *rolling);
+void delta_rolling_update(struct delta_rolling_t *rolling, const void *data, size_t length);
+void delta_rolling_roll(struct delta_rolling_t *rolling, uint8_t out, uint8_t in);
+uint32_t delta_rolling_digest(const struct delta_rolling_t *rolling);
+uint32_t delta_weak_checksum(const void *data, size_t length);
+struct delta_signer_t *delta_signer_new(uint32_t block_size, enum filehash_algorithm_t algorithm, unsigned int strong_length, delta_signature_callback_t callback, void *callback_ctx);
+bool delta_signer_update(struct delta_signer_t *signer, const void *data, size_t length);
+bool delta_signer_finish(struct delta_signer_t *signer);
+void delta_signer_free(struct delta_signer_t *signer);
+/***************  AUTO GENERATED SECTION ENDS   ***************/
+
+#endif
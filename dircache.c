@@ -0,0 +1,300 @@
+/**
+ *	umsftpd - User-mode SFTP application.
+ *	Copyright (C) 2021-2021 Johannes Bauer
+ *
+ *	This file is part of umsftpd.
+ *
+ *	umsftpd is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; this program is ONLY licensed under
+ *	version 3 of the License, later versions are explicitly excluded.
+ *
+ *	umsftpd is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with umsftpd; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *	Johannes Bauer <JohannesBauer@gmx.de>
+**/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include "dircache.h"
+#include "atomtable.h"
+#include "logging.h"
+
+#define DIRCACHE_WATCH_MASK		(IN_CREATE | IN_DELETE | IN_MODIFY | IN_ATTRIB | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+struct dircache_t *dircache_new(size_t max_memory) {
+	struct dircache_t *cache = calloc(1, sizeof(struct dircache_t));
+	if (!cache) {
+		return NULL;
+	}
+	cache->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (cache->inotify_fd == -1) {
+		logmsg(LLVL_ERROR, "dircache_new() failed to initialize inotify: %s", strerror(errno));
+		free(cache);
+		return NULL;
+	}
+	cache->max_memory = max_memory;
+	return cache;
+}
+
+static void dircache_listing_free(struct dircache_listing_t *listing) {
+	free(listing->path);
+	free(listing->entries);
+	free(listing);
+}
+
+static void dircache_lru_unlink(struct dircache_t *cache, struct dircache_listing_t *listing) {
+	if (listing->lru_prev) {
+		listing->lru_prev->lru_next = listing->lru_next;
+	} else {
+		cache->lru_head = listing->lru_next;
+	}
+	if (listing->lru_next) {
+		listing->lru_next->lru_prev = listing->lru_prev;
+	} else {
+		cache->lru_tail = listing->lru_prev;
+	}
+	listing->lru_prev = NULL;
+	listing->lru_next = NULL;
+}
+
+static void dircache_lru_push_front(struct dircache_t *cache, struct dircache_listing_t *listing) {
+	listing->lru_prev = NULL;
+	listing->lru_next = cache->lru_head;
+	if (cache->lru_head) {
+		cache->lru_head->lru_prev = listing;
+	} else {
+		cache->lru_tail = listing;
+	}
+	cache->lru_head = listing;
+}
+
+static void dircache_bucket_unlink(struct dircache_t *cache, struct dircache_listing_t *listing) {
+	struct dircache_listing_t **next_ptr = &cache->buckets[listing->hash % DIRCACHE_BUCKET_COUNT];
+	while (*next_ptr) {
+		if (*next_ptr == listing) {
+			*next_ptr = listing->bucket_next;
+			break;
+		}
+		next_ptr = &(*next_ptr)->bucket_next;
+	}
+	listing->bucket_next = NULL;
+}
+
+static bool dircache_wd_in_use(const struct dircache_t *cache, int wd) {
+	for (const struct dircache_listing_t *listing = cache->lru_head; listing; listing = listing->lru_next) {
+		if (listing->wd == wd) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/* Removes a listing from the cache; it is freed as soon as the last handle
+ * referencing it has released it. */
+static void dircache_remove(struct dircache_t *cache, struct dircache_listing_t *listing) {
+	if (listing->committed) {
+		dircache_bucket_unlink(cache, listing);
+		cache->used_memory -= listing->memory;
+		listing->committed = false;
+	}
+	if (listing->listed) {
+		dircache_lru_unlink(cache, listing);
+		listing->listed = false;
+		if (!dircache_wd_in_use(cache, listing->wd)) {
+			inotify_rm_watch(cache->inotify_fd, listing->wd);
+		}
+	}
+	if (listing->refcount == 0) {
+		dircache_listing_free(listing);
+	}
+}
+
+static void dircache_invalidate_wd(struct dircache_t *cache, int wd) {
+	struct dircache_listing_t *listing = cache->lru_head;
+	while (listing) {
+		struct dircache_listing_t *next = listing->lru_next;
+		if ((wd == -1) || (listing->wd == wd)) {
+			logmsg(LLVL_TRACE, "dircache invalidating listing of %s", listing->path);
+			listing->invalid = true;
+			cache->stats.invalidations++;
+			dircache_remove(cache, listing);
+		}
+		listing = next;
+	}
+}
+
+void dircache_process_events(struct dircache_t *cache) {
+	char buffer[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	while (true) {
+		ssize_t length = read(cache->inotify_fd, buffer, sizeof(buffer));
+		if (length <= 0) {
+			if ((length == -1) && (errno != EAGAIN)) {
+				logmsg(LLVL_ERROR, "dircache failed to read inotify events: %s", strerror(errno));
+			}
+			break;
+		}
+
+		const struct inotify_event *event;
+		for (char *ptr = buffer; ptr < buffer + length; ptr += sizeof(struct inotify_event) + event->len) {
+			event = (const struct inotify_event*)ptr;
+			if (event->mask & IN_Q_OVERFLOW) {
+				/* Events were lost, nothing can be trusted anymore */
+				dircache_invalidate_wd(cache, -1);
+			} else {
+				dircache_invalidate_wd(cache, event->wd);
+			}
+		}
+	}
+}
+
+static struct dircache_listing_t *dircache_lookup(struct dircache_t *cache, uint32_t hash, const char *path) {
+	for (struct dircache_listing_t *listing = cache->buckets[hash % DIRCACHE_BUCKET_COUNT]; listing; listing = listing->bucket_next) {
+		if ((listing->hash == hash) && !strcmp(listing->path, path)) {
+			return listing;
+		}
+	}
+	return NULL;
+}
+
+struct dircache_listing_t *dircache_get(struct dircache_t *cache, const char *path) {
+	dircache_process_events(cache);
+
+	struct dircache_listing_t *listing = dircache_lookup(cache, atomtable_hash(path, strlen(path)), path);
+	if (!listing) {
+		cache->stats.misses++;
+		return NULL;
+	}
+	cache->stats.hits++;
+	listing->refcount++;
+	dircache_lru_unlink(cache, listing);
+	dircache_lru_push_front(cache, listing);
+	return listing;
+}
+
+struct dircache_listing_t *dircache_prepare(struct dircache_t *cache, const char *path) {
+	struct dircache_listing_t *listing = calloc(1, sizeof(struct dircache_listing_t));
+	if (!listing) {
+		return NULL;
+	}
+	listing->path = strdup(path);
+	if (!listing->path) {
+		free(listing);
+		return NULL;
+	}
+
+	/* The watch is established before the directory is read so that no
+	 * modification can slip through while the listing is being filled */
+	listing->wd = inotify_add_watch(cache->inotify_fd, path, DIRCACHE_WATCH_MASK);
+	if (listing->wd == -1) {
+		logmsg(LLVL_DEBUG, "dircache cannot watch %s: %s", path, strerror(errno));
+		cache->stats.uncacheable++;
+		dircache_listing_free(listing);
+		return NULL;
+	}
+
+	listing->hash = atomtable_hash(path, strlen(path));
+	listing->refcount = 1;
+	listing->memory = sizeof(struct dircache_listing_t) + strlen(path) + 1;
+	listing->listed = true;
+	dircache_lru_push_front(cache, listing);
+	return listing;
+}
+
+bool dircache_listing_append(struct dircache_t *cache, struct dircache_listing_t *listing, const struct vfs_dirent_t *dirent) {
+	if (listing->count == listing->alloced_count) {
+		unsigned int new_alloced_count = listing->alloced_count ? (listing->alloced_count * 2) : 16;
+		size_t new_memory = listing->memory + (sizeof(struct vfs_dirent_t) * (new_alloced_count - listing->alloced_count));
+		if (new_memory > cache->max_memory) {
+			/* Would never fit into the cache */
+			return false;
+		}
+
+		struct vfs_dirent_t *new_entries = realloc(listing->entries, sizeof(struct vfs_dirent_t) * new_alloced_count);
+		if (!new_entries) {
+			return false;
+		}
+		listing->entries = new_entries;
+		listing->alloced_count = new_alloced_count;
+		listing->memory = new_memory;
+	}
+	listing->entries[listing->count++] = *dirent;
+	return true;
+}
+
+bool dircache_commit(struct dircache_t *cache, struct dircache_listing_t *listing) {
+	dircache_process_events(cache);
+	if (listing->invalid) {
+		/* Directory changed while we were reading it */
+		return false;
+	}
+	if (dircache_lookup(cache, listing->hash, listing->path)) {
+		/* Another handle listed the same directory concurrently and was
+		 * first to commit; keep that one */
+		return false;
+	}
+
+	/* Make room by evicting least recently used listings */
+	struct dircache_listing_t *victim = cache->lru_tail;
+	while (victim && (cache->used_memory + listing->memory > cache->max_memory)) {
+		struct dircache_listing_t *prev = victim->lru_prev;
+		if (victim->committed) {
+			cache->stats.evictions++;
+			dircache_remove(cache, victim);
+		}
+		victim = prev;
+	}
+	if (cache->used_memory + listing->memory > cache->max_memory) {
+		cache->stats.uncacheable++;
+		return false;
+	}
+
+	struct dircache_listing_t **bucket = &cache->buckets[listing->hash % DIRCACHE_BUCKET_COUNT];
+	listing->bucket_next = *bucket;
+	*bucket = listing;
+	listing->committed = true;
+	cache->used_memory += listing->memory;
+	return true;
+}
+
+void dircache_release(struct dircache_t *cache, struct dircache_listing_t *listing) {
+	if (!listing) {
+		return;
+	}
+	listing->refcount--;
+	if (listing->refcount == 0) {
+		if (!listing->committed) {
+			/* Never made it into the cache or was invalidated/evicted */
+			dircache_remove(cache, listing);
+		}
+	}
+}
+
+/* All listings obtained from the cache must have been released before it is
+ * freed, i.e., all VFS handles that use it must have been closed. */
+void dircache_free(struct dircache_t *cache) {
+	if (!cache) {
+		return;
+	}
+	while (cache->lru_head) {
+		struct dircache_listing_t *listing = cache->lru_head;
+		if (listing->refcount) {
+			logmsg(LLVL_ERROR, "dircache_free() called while listing of %s is still referenced %u time(s)", listing->path, listing->refcount);
+		}
+		listing->refcount = 0;
+		dircache_remove(cache, listing);
+	}
+	close(cache->inotify_fd);
+	free(cache);
+}
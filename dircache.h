@@ -0,0 +1,76 @@
+/**
+ *	umsftpd - User-mode SFTP application.
+ *	Copyright (C) 2021-2021 Johannes Bauer
+ *
+ *	This file is part of umsftpd.
+ *
+ *	umsftpd is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; this program is ONLY licensed under
+ *	version 3 of the License, later versions are explicitly excluded.
+ *
+ *	umsftpd is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with umsftpd; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *	Johannes Bauer <JohannesBauer@gmx.de>
+**/
+
+#ifndef __DIRCACHE_H__
+#define __DIRCACHE_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "vfs.h"
+
+#define DIRCACHE_BUCKET_COUNT				256
+
+/* A cached listing of one mapped directory. Entries are stored without any
+ * VFS flags applied. Listings are reference counted so that handles can
+ * keep iterating over a listing that has been invalidated in the meantime. */
+struct dircache_listing_t {
+	char *path;
+	uint32_t hash;
+	int wd;
+	unsigned int refcount;
+	bool listed, committed, invalid;
+	unsigned int count, alloced_count;
+	struct vfs_dirent_t *entries;
+	size_t memory;
+	struct dircache_listing_t *bucket_next;
+	struct dircache_listing_t *lru_prev, *lru_next;
+};
+
+/* Memory-bounded cache of directory listings which can be shared among all
+ * VFS instances (i.e., sessions) of the process. Listings are invalidated
+ * through inotify watches on the cached directories. Not thread-safe. */
+struct dircache_t {
+	int inotify_fd;
+	size_t max_memory, used_memory;
+	struct dircache_listing_t *buckets[DIRCACHE_BUCKET_COUNT];
+	struct dircache_listing_t *lru_head, *lru_tail;
+	struct {
+		uint64_t hits, misses;
+		uint64_t invalidations, evictions;
+		uint64_t uncacheable;
+	} stats;
+};
+
+/*************** AUTO GENERATED SECTION FOLLOWS ***************/
+struct dircache_t *dircache_new(size_t max_memory);
+void dircache_process_events(struct dircache_t *cache);
+struct dircache_listing_t *dircache_get(struct dircache_t *cache, const char *path);
+struct dircache_listing_t *dircache_prepare(struct dircache_t *cache, const char *path);
+bool dircache_listing_append(struct dircache_t *cache, struct dircache_listing_t *listing, const struct vfs_dirent_t *dirent);
+bool dircache_commit(struct dircache_t *cache, struct dircache_listing_t *listing);
+void dircache_release(struct dircache_t *cache, struct dircache_listing_t *listing);
+void dircache_free(struct dircache_t *cache);
+/***************  AUTO GENERATED SECTION ENDS   ***************/
+
+#endif
@@ -0,0 +1,225 @@
+/**
+ *	umsftpd - User-mode SFTP application.
+ *	Copyright (C) 2021-2021 Johannes Bauer
+ *
+ *	This file is part of umsftpd.
+ *
+ *	umsftpd is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; this program is ONLY licensed under
+ *	version 3 of the License, later versions are explicitly excluded.
+ *
+ *	umsftpd is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with umsftpd; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *	Johannes Bauer <JohannesBauer@gmx.de>
+**/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "fdcache.h"
+#include "atomtable.h"
+#include "logging.h"
+
+struct fdcache_t *fdcache_new(unsigned int max_entries) {
+	struct fdcache_t *cache = calloc(1, sizeof(struct fdcache_t));
+	if (!cache) {
+		return NULL;
+	}
+	cache->max_entries = max_entries;
+	return cache;
+}
+
+static void fdcache_entry_free(struct fdcache_entry_t *entry) {
+	close(entry->fd);
+	free(entry->path);
+	free(entry);
+}
+
+static void fdcache_lru_unlink(struct fdcache_t *cache, struct fdcache_entry_t *entry) {
+	if (entry->lru_prev) {
+		entry->lru_prev->lru_next = entry->lru_next;
+	} else {
+		cache->lru_head = entry->lru_next;
+	}
+	if (entry->lru_next) {
+		entry->lru_next->lru_prev = entry->lru_prev;
+	} else {
+		cache->lru_tail = entry->lru_prev;
+	}
+	entry->lru_prev = NULL;
+	entry->lru_next = NULL;
+}
+
+static void fdcache_lru_push_front(struct fdcache_t *cache, struct fdcache_entry_t *entry) {
+	entry->lru_prev = NULL;
+	entry->lru_next = cache->lru_head;
+	if (cache->lru_head) {
+		cache->lru_head->lru_prev = entry;
+	} else {
+		cache->lru_tail = entry;
+	}
+	cache->lru_head = entry;
+}
+
+static void fdcache_bucket_unlink(struct fdcache_t *cache, struct fdcache_entry_t *entry) {
+	struct fdcache_entry_t **next_ptr = &cache->buckets[entry->hash % FDCACHE_BUCKET_COUNT];
+	while (*next_ptr) {
+		if (*next_ptr == entry) {
+			*next_ptr = entry->bucket_next;
+			break;
+		}
+		next_ptr = &(*next_ptr)->bucket_next;
+	}
+	entry->bucket_next = NULL;
+}
+
+/* Removes an entry from the cache; its descriptor is closed as soon as the
+ * last handle referencing it has released it. */
+static void fdcache_remove(struct fdcache_t *cache, struct fdcache_entry_t *entry) {
+	if (entry->cached) {
+		fdcache_bucket_unlink(cache, entry);
+		fdcache_lru_unlink(cache, entry);
+		cache->entry_count--;
+		entry->cached = false;
+	}
+	if (entry->refcount == 0) {
+		fdcache_entry_free(entry);
+	}
+}
+
+/* The identity of a file is given by device, inode, size and modification
+ * time. An inode number of zero in the expected identity (e.g., when it
+ * originates from a content index) only compares size and time. */
+static bool fdcache_entry_matches(const struct fdcache_entry_t *entry, const struct stat *expected) {
+	if (expected->st_ino && ((entry->dev != expected->st_dev) || (entry->ino != expected->st_ino))) {
+		return false;
+	}
+	return (entry->size == expected->st_size) && (entry->mtime.tv_sec == expected->st_mtim.tv_sec) && (entry->mtime.tv_nsec == expected->st_mtim.tv_nsec);
+}
+
+static struct fdcache_entry_t *fdcache_lookup(struct fdcache_t *cache, const char *path, uint32_t hash) {
+	for (struct fdcache_entry_t *entry = cache->buckets[hash % FDCACHE_BUCKET_COUNT]; entry; entry = entry->bucket_next) {
+		if ((entry->hash == hash) && !strcmp(entry->path, path)) {
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+static void fdcache_insert(struct fdcache_t *cache, struct fdcache_entry_t *entry) {
+	/* Make room by evicting least recently used entries */
+	while (cache->lru_tail && (cache->entry_count >= cache->max_entries)) {
+		cache->stats.evictions++;
+		fdcache_remove(cache, cache->lru_tail);
+	}
+	if (cache->entry_count >= cache->max_entries) {
+		return;
+	}
+
+	struct fdcache_entry_t **bucket = &cache->buckets[entry->hash % FDCACHE_BUCKET_COUNT];
+	entry->bucket_next = *bucket;
+	*bucket = entry;
+	fdcache_lru_push_front(cache, entry);
+	entry->cached = true;
+	cache->entry_count++;
+}
+
+/* Returns a referenced entry for the file at the given (already mapped and
+ * checked) path, provided that it still has the expected identity. On
+ * failure, NULL is returned and errno is set; ESTALE means that the file
+ * no longer has the expected identity. */
+struct fdcache_entry_t *fdcache_open(struct fdcache_t *cache, const char *path, const struct stat *expected) {
+	uint32_t hash = atomtable_hash(path, strlen(path));
+	struct fdcache_entry_t *entry = fdcache_lookup(cache, path, hash);
+	if (entry) {
+		if (fdcache_entry_matches(entry, expected)) {
+			cache->stats.hits++;
+			entry->refcount++;
+			fdcache_lru_unlink(cache, entry);
+			fdcache_lru_push_front(cache, entry);
+			return entry;
+		}
+		/* File was modified or replaced since it was opened */
+		logmsg(LLVL_TRACE, "fdcache dropping stale descriptor of %s", path);
+		cache->stats.stale++;
+		fdcache_remove(cache, entry);
+	}
+	cache->stats.misses++;
+
+	int fd = open(path, O_RDONLY | O_CLOEXEC | O_NOCTTY);
+	if (fd == -1) {
+		return NULL;
+	}
+	struct stat statbuf;
+	if (fstat(fd, &statbuf)) {
+		int saved_errno = errno;
+		close(fd);
+		errno = saved_errno;
+		return NULL;
+	}
+
+	entry = calloc(1, sizeof(struct fdcache_entry_t));
+	if (!entry) {
+		close(fd);
+		errno = ENOMEM;
+		return NULL;
+	}
+	entry->path = strdup(path);
+	if (!entry->path) {
+		close(fd);
+		free(entry);
+		errno = ENOMEM;
+		return NULL;
+	}
+	entry->hash = hash;
+	entry->fd = fd;
+	entry->dev = statbuf.st_dev;
+	entry->ino = statbuf.st_ino;
+	entry->size = statbuf.st_size;
+	entry->mtime = statbuf.st_mtim;
+	if (!fdcache_entry_matches(entry, expected)) {
+		/* File was modified or replaced after the caller checked it */
+		logmsg(LLVL_TRACE, "fdcache refusing descriptor of %s that does not have the expected identity", path);
+		cache->stats.stale++;
+		fdcache_entry_free(entry);
+		errno = ESTALE;
+		return NULL;
+	}
+	entry->refcount = 1;
+	fdcache_insert(cache, entry);
+	return entry;
+}
+
+void fdcache_release(struct fdcache_t *cache, struct fdcache_entry_t *entry) {
+	if (!entry) {
+		return;
+	}
+	entry->refcount--;
+	if ((entry->refcount == 0) && !entry->cached) {
+		/* Never made it into the cache or was evicted/found stale */
+		fdcache_entry_free(entry);
+	}
+}
+
+/* Entries that are still referenced are only detached from the cache; their
+ * descriptors are closed when the last handle releases them. */
+void fdcache_free(struct fdcache_t *cache) {
+	if (!cache) {
+		return;
+	}
+	while (cache->lru_head) {
+		fdcache_remove(cache, cache->lru_head);
+	}
+	free(cache);
+}
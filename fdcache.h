@@ -0,0 +1,73 @@
+/**
+ *	umsftpd - User-mode SFTP application.
+ *	Copyright (C) 2021-2021 Johannes Bauer
+ *
+ *	This file is part of umsftpd.
+ *
+ *	umsftpd is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; this program is ONLY licensed under
+ *	version 3 of the License, later versions are explicitly excluded.
+ *
+ *	umsftpd is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with umsftpd; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *	Johannes Bauer <JohannesBauer@gmx.de>
+**/
+
+#ifndef __FDCACHE_H__
+#define __FDCACHE_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#define FDCACHE_BUCKET_COUNT				256
+
+/* One read-only file descriptor, keyed by the mapped path and the identity of
+ * the file it was opened for. Reference counted so that an entry which is
+ * evicted or found stale stays usable until the last handle releases it. */
+struct fdcache_entry_t {
+	char *path;
+	uint32_t hash;
+	int fd;
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	struct timespec mtime;
+	unsigned int refcount;
+	bool cached;
+	struct fdcache_entry_t *bucket_next;
+	struct fdcache_entry_t *lru_prev, *lru_next;
+};
+
+/* Bounded LRU cache of read-only file descriptors which can be shared among
+ * all VFS instances (i.e., sessions) of the process. Reads through a shared
+ * descriptor must use pread() since the file offset is shared as well. Not
+ * thread-safe. */
+struct fdcache_t {
+	unsigned int max_entries, entry_count;
+	struct fdcache_entry_t *buckets[FDCACHE_BUCKET_COUNT];
+	struct fdcache_entry_t *lru_head, *lru_tail;
+	struct {
+		uint64_t hits, misses;
+		uint64_t stale, evictions;
+	} stats;
+};
+
+/*************** AUTO GENERATED SECTION FOLLOWS ***************/
+struct fdcache_t *fdcache_new(unsigned int max_entries);
+struct fdcache_entry_t *fdcache_open(struct fdcache_t *cache, const char *path, const struct stat *expected);
+void fdcache_release(struct fdcache_t *cache, struct fdcache_entry_t *entry);
+void fdcache_free(struct fdcache_t *cache);
+/***************  AUTO GENERATED SECTION ENDS   ***************/
+
+#endif
@@ -0,0 +1,153 @@
+/**
+ *	umsftpd - User-mode SFTP application.
+ *	Copyright (C) 2021-2021 Johannes Bauer
+ *
+ *	This file is part of umsftpd.
+ *
+ *	umsftpd is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; this program is ONLY licensed under
+ *	version 3 of the License, later versions are explicitly excluded.
+ *
+ *	umsftpd is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with umsftpd; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *	Johannes Bauer <JohannesBauer@gmx.de>
+**/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "filehash.h"
+
+static const struct {
+	const char *name;
+	const EVP_MD *(*md)(void);
+} filehash_algorithms[] = {
+	[FILEHASH_MD5] = { "md5", EVP_md5 },
+	[FILEHASH_SHA1] = { "sha1", EVP_sha1 },
+	[FILEHASH_SHA224] = { "sha224", EVP_sha224 },
+	[FILEHASH_SHA256] = { "sha256", EVP_sha256 },
+	[FILEHASH_SHA384] = { "sha384", EVP_sha384 },
+	[FILEHASH_SHA512] = { "sha512", EVP_sha512 },
+	[FILEHASH_BLAKE2B512] = { "blake2b512", EVP_blake2b512 },
+};
+
+bool filehash_algorithm_from_name(const char *name, enum filehash_algorithm_t *algorithm) {
+	for (unsigned int i = 0; i < sizeof(filehash_algorithms) / sizeof(filehash_algorithms[0]); i++) {
+		if (!strcmp(filehash_algorithms[i].name, name)) {
+			*algorithm = i;
+			return true;
+		}
+	}
+	return false;
+}
+
+const char *filehash_algorithm_name(enum filehash_algorithm_t algorithm) {
+	return filehash_algorithms[algorithm].name;
+}
+
+struct filehash_t *filehash_new(enum filehash_algorithm_t algorithm, uint64_t block_size) {
+	struct filehash_t *hash = calloc(1, sizeof(struct filehash_t));
+	if (!hash) {
+		return NULL;
+	}
+	hash->algorithm = algorithm;
+	hash->md = filehash_algorithms[algorithm].md();
+	hash->block_size = block_size;
+	hash->digest_length = EVP_MD_size(hash->md);
+	hash->ctx = EVP_MD_CTX_new();
+	if (!hash->ctx || !EVP_DigestInit_ex(hash->ctx, hash->md, NULL)) {
+		EVP_MD_CTX_free(hash->ctx);
+		free(hash);
+		return NULL;
+	}
+	return hash;
+}
+
+static bool filehash_finish_block(struct filehash_t *hash) {
+	if (hash->digest_count == hash->alloced_count) {
+		unsigned int new_alloced_count = hash->alloced_count ? (hash->alloced_count * 2) : 4;
+		uint8_t *new_digests = realloc(hash->digests, (size_t)new_alloced_count * hash->digest_length);
+		if (!new_digests) {
+			return false;
+		}
+		hash->digests = new_digests;
+		hash->alloced_count = new_alloced_count;
+	}
+	if (!EVP_DigestFinal_ex(hash->ctx, hash->digests + ((size_t)hash->digest_count * hash->digest_length), NULL)) {
+		return false;
+	}
+	hash->digest_count++;
+	hash->block_filled = 0;
+	return EVP_DigestInit_ex(hash->ctx, hash->md, NULL);
+}
+
+bool filehash_update(struct filehash_t *hash, const void *data, size_t length) {
+	const uint8_t *bytes = (const uint8_t*)data;
+	while (length) {
+		size_t chunk_length = length;
+		if (hash->block_size && (chunk_length > hash->block_size - hash->block_filled)) {
+			chunk_length = hash->block_size - hash->block_filled;
+		}
+		if (!EVP_DigestUpdate(hash->ctx, bytes, chunk_length)) {
+			return false;
+		}
+		hash->block_filled += chunk_length;
+		bytes += chunk_length;
+		length -= chunk_length;
+		if (hash->block_size && (hash->block_filled == hash->block_size)) {
+			if (!filehash_finish_block(hash)) {
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+/* Finalizes the last, possibly short, block. Without any blocks (i.e., for
+ * an empty range), the digest of no data is produced. */
+bool filehash_finish(struct filehash_t *hash) {
+	if (hash->block_filled || (hash->digest_count == 0)) {
+		return filehash_finish_block(hash);
+	}
+	return true;
+}
+
+/* Sets the single digest of a hash without a block size from a previously
+ * computed value, e.g., one stored along with the file */
+bool filehash_set_digest(struct filehash_t *hash, const uint8_t *digest) {
+	if (hash->block_size || hash->digest_count) {
+		return false;
+	}
+	hash->digests = malloc(hash->digest_length);
+	if (!hash->digests) {
+		return false;
+	}
+	memcpy(hash->digests, digest, hash->digest_length);
+	hash->alloced_count = 1;
+	hash->digest_count = 1;
+	return true;
+}
+
+/* Discards all digests and data hashed so far, keeping the allocations */
+bool filehash_reset(struct filehash_t *hash) {
+	hash->digest_count = 0;
+	hash->block_filled = 0;
+	return EVP_DigestInit_ex(hash->ctx, hash->md, NULL);
+}
+
+void filehash_free(struct filehash_t *hash) {
+	if (!hash) {
+		return;
+	}
+	EVP_MD_CTX_free(hash->ctx);
+	free(hash->digests);
+	free(hash);
+}
@@ -0,0 +1,66 @@
+/**
+ *	umsftpd - User-mode SFTP application.
+ *	Copyright (C) 2021-2021 Johannes Bauer
+ *
+ *	This file is part of umsftpd.
+ *
+ *	umsftpd is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; this program is ONLY licensed under
+ *	version 3 of the License, later versions are explicitly excluded.
+ *
+ *	umsftpd is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with umsftpd; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *	Johannes Bauer <JohannesBauer@gmx.de>
+**/
+
+#ifndef __FILEHASH_H__
+#define __FILEHASH_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <openssl/evp.h>
+
+enum filehash_algorithm_t {
+	FILEHASH_MD5,
+	FILEHASH_SHA1,
+	FILEHASH_SHA224,
+	FILEHASH_SHA256,
+	FILEHASH_SHA384,
+	FILEHASH_SHA512,
+	FILEHASH_BLAKE2B512,
+};
+
+/* Streaming hash over a byte range, optionally split into blocks of fixed
+ * size with one digest each (as the "check-file" SFTP extension reports
+ * them). A block size of zero yields a single digest. */
+struct filehash_t {
+	enum filehash_algorithm_t algorithm;
+	EVP_MD_CTX *ctx;
+	const EVP_MD *md;
+	uint64_t block_size, block_filled;
+	unsigned int digest_length;
+	unsigned int digest_count, alloced_count;
+	uint8_t *digests;
+};
+
+/*************** AUTO GENERATED SECTION FOLLOWS ***************/
+bool filehash_algorithm_from_name(const char *name, enum filehash_algorithm_t *algorithm);
+const char *filehash_algorithm_name(enum filehash_algorithm_t algorithm);
+struct filehash_t *filehash_new(enum filehash_algorithm_t algorithm, uint64_t block_size);
+bool filehash_update(struct filehash_t *hash, const void *data, size_t length);
+bool filehash_finish(struct filehash_t *hash);
+bool filehash_set_digest(struct filehash_t *hash, const uint8_t *digest);
+bool filehash_reset(struct filehash_t *hash);
+void filehash_free(struct filehash_t *hash);
+/***************  AUTO GENERATED SECTION ENDS   ***************/
+
+#endif
@@ -0,0 +1,389 @@
+/**
+ *	umsftpd - User-mode SFTP application.
+ *	Copyright (C) 2021-2021 Johannes Bauer
+ *
+ *	This file is part of umsftpd.
+ *
+ *	umsftpd is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; this program is ONLY licensed under
+ *	version 3 of the License, later versions are explicitly excluded.
+ *
+ *	umsftpd is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with umsftpd; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *	Johannes Bauer <JohannesBauer@gmx.de>
+**/
+
+#include <stdlib.h>
+#include <string.h>
+#include <fnmatch.h>
+#include "globfilter.h"
+
+static bool globfilter_is_special(char c) {
+	return (c == '*') || (c == '?') || (c == '[') || (c == '\\');
+}
+
+struct globfilter_t *globfilter_new(const char *pattern) {
+	struct globfilter_t *filter = calloc(1, sizeof(struct globfilter_t));
+	if (!filter) {
+		return NULL;
+	}
+	filter->pattern = strdup(pattern);
+	if (!filter->pattern) {
+		free(filter);
+		return NULL;
+	}
+
+	size_t length = strlen(pattern);
+	unsigned int stars = 0, others = 0;
+	for (size_t i = 0; i < length; i++) {
+		if (pattern[i] == '*') {
+			stars++;
+		} else if (globfilter_is_special(pattern[i])) {
+			others++;
+		}
+	}
+
+	bool leading_star = (length > 0) && (pattern[0] == '*');
+	bool trailing_star = (length > 0) && (pattern[length - 1] == '*');
+	filter->kind = GLOBFILTER_FNMATCH;
+	if (others == 0) {
+		if (stars == 0) {
+			filter->kind = GLOBFILTER_LITERAL;
+			filter->literal = filter->pattern;
+			filter->literal_length = length;
+		} else if ((stars == length) && (length > 0)) {
+			filter->kind = GLOBFILTER_MATCH_ALL;
+		} else if ((stars == 1) && trailing_star) {
+			filter->kind = GLOBFILTER_PREFIX;
+			filter->literal = filter->pattern;
+			filter->literal_length = length - 1;
+		} else if ((stars == 1) && leading_star) {
+			filter->kind = GLOBFILTER_SUFFIX;
+			filter->literal = filter->pattern + 1;
+			filter->literal_length = length - 1;
+		} else if ((stars == 2) && leading_star && trailing_star) {
+			filter->kind = GLOBFILTER_SUBSTRING;
+			filter->pattern[length - 1] = 0;
+			filter->literal = filter->pattern + 1;
+			filter->literal_length = length - 2;
+		}
+	}
+	return filter;
+}
+
+bool globfilter_match(const struct globfilter_t *filter, const char *name) {
+	switch (filter->kind) {
+		case GLOBFILTER_MATCH_ALL:
+			return true;
+
+		case GLOBFILTER_LITERAL:
+			return !strcmp(name, filter->literal);
+
+		case GLOBFILTER_PREFIX:
+			return !strncmp(name, filter->literal, filter->literal_length);
+
+		case GLOBFILTER_SUFFIX: {
+			size_t name_length = strlen(name);
+			return (name_length >= filter->literal_length) && !memcmp(name + name_length - filter->literal_length, filter->literal, filter->literal_length);
+		}
+
+		case GLOBFILTER_SUBSTRING:
+			return strstr(name, filter->literal) != NULL;
+
+		case GLOBFILTER_FNMATCH:
+			return fnmatch(filter->pattern, name, 0) == 0;
+	}
+	return false;
+}
+
+void globfilter_free(struct globfilter_t *filter) {
+	if (!filter) {
+		return;
+	}
+	free(filter->pattern);
+	free(filter);
+}
+
+/* One element of a pattern, i.e., a star or the set of bytes that a single
+ * character of the name may be */
+struct globset_atom_t {
+	bool star;
+	uint8_t bytes[32];
+};
+
+struct globset_nfa_t {
+	struct globset_atom_t *atoms;
+	unsigned int atom_count;
+	unsigned int *accept_label;
+	unsigned int words;
+};
+
+struct globset_builder_t {
+	const struct globset_nfa_t *nfa;
+	struct globset_t *set;
+	uint64_t *state_positions;
+	unsigned int alloced_states;
+	unsigned int *buckets;
+	unsigned int bucket_count;
+};
+
+static void globset_atom_add(struct globset_atom_t *atom, uint8_t c) {
+	atom->bytes[c / 8] |= 1 << (c % 8);
+}
+
+static bool globset_atom_has(const struct globset_atom_t *atom, uint8_t c) {
+	return (atom->bytes[c / 8] >> (c % 8)) & 1;
+}
+
+/* Parses a bracket expression starting after the '['; returns the position
+ * after the closing ']' or NULL if there is none, in which case fnmatch(3)
+ * treats the '[' literally */
+static const char *globset_parse_bracket(const char *p, struct globset_atom_t *atom) {
+	bool negate = (*p == '!') || (*p == '^');
+	if (negate) {
+		p++;
+	}
+	const char *start = p;
+	while (*p && ((*p != ']') || (p == start))) {
+		uint8_t first = *p;
+		if ((p[1] == '-') && p[2] && (p[2] != ']')) {
+			for (unsigned int c = first; c <= (uint8_t)p[2]; c++) {
+				globset_atom_add(atom, c);
+			}
+			p += 3;
+		} else {
+			globset_atom_add(atom, first);
+			p++;
+		}
+	}
+	if (!*p) {
+		return NULL;
+	}
+	if (negate) {
+		for (unsigned int i = 0; i < sizeof(atom->bytes); i++) {
+			atom->bytes[i] = ~atom->bytes[i];
+		}
+	}
+	return p + 1;
+}
+
+static bool globset_parse(struct globset_nfa_t *nfa, const char *pattern, uint32_t label) {
+	for (const char *p = pattern; *p; ) {
+		if (nfa->atom_count + 1 >= GLOBSET_MAX_ATOMS) {
+			return false;
+		}
+		struct globset_atom_t *atom = &nfa->atoms[nfa->atom_count];
+		memset(atom, 0, sizeof(*atom));
+		if (*p == '*') {
+			p++;
+			if ((nfa->atom_count > 0) && nfa->atoms[nfa->atom_count - 1].star) {
+				/* Consecutive stars are the same as one */
+				continue;
+			}
+			atom->star = true;
+		} else if (*p == '?') {
+			memset(atom->bytes, 0xff, sizeof(atom->bytes));
+			p++;
+		} else if ((*p == '[') && (strstr(p, "[:") == p + 1)) {
+			/* Character classes are not supported */
+			return false;
+		} else if (*p == '[') {
+			const char *end = globset_parse_bracket(p + 1, atom);
+			if (end) {
+				p = end;
+			} else {
+				memset(atom, 0, sizeof(*atom));
+				globset_atom_add(atom, '[');
+				p++;
+			}
+		} else if ((*p == '\\') && p[1]) {
+			globset_atom_add(atom, p[1]);
+			p += 2;
+		} else {
+			globset_atom_add(atom, *p);
+			p++;
+		}
+		nfa->accept_label[nfa->atom_count] = 0;
+		nfa->atom_count++;
+	}
+
+	/* The position after the last atom accepts */
+	memset(&nfa->atoms[nfa->atom_count], 0, sizeof(struct globset_atom_t));
+	nfa->accept_label[nfa->atom_count] = label;
+	nfa->atom_count++;
+	return true;
+}
+
+/* A star may also match nothing, so the position after it is reached too */
+static void globset_closure(const struct globset_nfa_t *nfa, uint64_t *positions) {
+	for (unsigned int i = 0; i + 1 < nfa->atom_count; i++) {
+		if (((positions[i / 64] >> (i % 64)) & 1) && nfa->atoms[i].star) {
+			positions[(i + 1) / 64] |= 1ULL << ((i + 1) % 64);
+		}
+	}
+}
+
+static uint32_t globset_hash(const uint64_t *positions, unsigned int words) {
+	uint32_t hash = 2166136261;
+	for (unsigned int i = 0; i < words; i++) {
+		hash = (hash ^ (uint32_t)positions[i] ^ (uint32_t)(positions[i] >> 32)) * 16777619;
+	}
+	return hash;
+}
+
+/* Returns the state for a set of positions, creating it if it is new; 0 if
+ * the DFA grows too large */
+static unsigned int globset_state(struct globset_builder_t *builder, const uint64_t *positions) {
+	const struct globset_nfa_t *nfa = builder->nfa;
+	unsigned int bucket = globset_hash(positions, nfa->words) % builder->bucket_count;
+	while (builder->buckets[bucket]) {
+		unsigned int state = builder->buckets[bucket];
+		if (!memcmp(&builder->state_positions[state * nfa->words], positions, nfa->words * sizeof(uint64_t))) {
+			return state;
+		}
+		bucket = (bucket + 1) % builder->bucket_count;
+	}
+
+	struct globset_t *set = builder->set;
+	if (set->state_count == GLOBSET_MAX_STATES) {
+		return 0;
+	}
+	unsigned int state = set->state_count++;
+	memcpy(&builder->state_positions[state * nfa->words], positions, nfa->words * sizeof(uint64_t));
+	builder->buckets[bucket] = state;
+	set->labels[state] = 0;
+	for (unsigned int i = 0; i < nfa->atom_count; i++) {
+		if ((positions[i / 64] >> (i % 64)) & 1) {
+			set->labels[state] |= nfa->accept_label[i];
+		}
+	}
+	return state;
+}
+
+static bool globset_build(struct globset_builder_t *builder) {
+	const struct globset_nfa_t *nfa = builder->nfa;
+	struct globset_t *set = builder->set;
+	uint64_t positions[nfa->words];
+
+	/* Dead state, then the start state at the beginning of every pattern */
+	memset(positions, 0, sizeof(positions));
+	set->state_count = 1;
+	memset(set->transitions[0], 0, sizeof(set->transitions[0]));
+	set->labels[0] = 0;
+	for (unsigned int i = 0; i < nfa->atom_count; i++) {
+		if ((i == 0) || nfa->accept_label[i - 1]) {
+			positions[i / 64] |= 1ULL << (i % 64);
+		}
+	}
+	globset_closure(nfa, positions);
+	globset_state(builder, positions);
+
+	/* Every state is expanded exactly once, in the order of creation */
+	for (unsigned int state = 1; state < set->state_count; state++) {
+		const uint64_t *current = &builder->state_positions[state * nfa->words];
+		for (unsigned int c = 0; c < 256; c++) {
+			memset(positions, 0, sizeof(positions));
+			bool any = false;
+			for (unsigned int i = 0; i < nfa->atom_count; i++) {
+				if (!((current[i / 64] >> (i % 64)) & 1) || nfa->accept_label[i]) {
+					continue;
+				}
+				if (nfa->atoms[i].star) {
+					positions[i / 64] |= 1ULL << (i % 64);
+					any = true;
+				} else if ((c != 0) && globset_atom_has(&nfa->atoms[i], c)) {
+					positions[(i + 1) / 64] |= 1ULL << ((i + 1) % 64);
+					any = true;
+				}
+			}
+			if (!any) {
+				set->transitions[state][c] = 0;
+				continue;
+			}
+			globset_closure(nfa, positions);
+			unsigned int next = globset_state(builder, positions);
+			if (!next) {
+				return false;
+			}
+			set->transitions[state][c] = next;
+		}
+	}
+	return true;
+}
+
+/* Compiles the patterns, each with its own non-zero label, into one DFA.
+ * Returns NULL if a pattern is not supported (character classes) or if the
+ * combination of patterns would need too many states. */
+struct globset_t *globset_compile(const char *const *patterns, const uint32_t *labels, unsigned int pattern_count) {
+	struct globset_nfa_t nfa = {
+		.atoms = malloc(GLOBSET_MAX_ATOMS * sizeof(struct globset_atom_t)),
+		.accept_label = malloc(GLOBSET_MAX_ATOMS * sizeof(unsigned int)),
+	};
+	struct globset_t *set = calloc(1, sizeof(struct globset_t));
+	struct globset_builder_t builder = {
+		.nfa = &nfa,
+		.set = set,
+		.bucket_count = 2 * GLOBSET_MAX_STATES,
+	};
+	bool success = nfa.atoms && nfa.accept_label && set;
+	for (unsigned int i = 0; success && (i < pattern_count); i++) {
+		success = (labels[i] != 0) && globset_parse(&nfa, patterns[i], labels[i]);
+		if (success) {
+			set->all_labels |= labels[i];
+		}
+	}
+
+	if (success) {
+		nfa.words = (nfa.atom_count + 63) / 64;
+		set->transitions = malloc(GLOBSET_MAX_STATES * sizeof(set->transitions[0]));
+		set->labels = malloc(GLOBSET_MAX_STATES * sizeof(uint32_t));
+		builder.state_positions = malloc((size_t)GLOBSET_MAX_STATES * nfa.words * sizeof(uint64_t));
+		builder.buckets = calloc(builder.bucket_count, sizeof(unsigned int));
+		success = set->transitions && set->labels && builder.state_positions && builder.buckets && globset_build(&builder);
+	}
+
+	free(builder.state_positions);
+	free(builder.buckets);
+	free(nfa.atoms);
+	free(nfa.accept_label);
+	if (!success) {
+		globset_free(set);
+		return NULL;
+	}
+
+	/* Only keep as many states as were actually needed */
+	uint16_t (*transitions)[256] = realloc(set->transitions, set->state_count * sizeof(set->transitions[0]));
+	if (transitions) {
+		set->transitions = transitions;
+	}
+	uint32_t *state_labels = realloc(set->labels, set->state_count * sizeof(uint32_t));
+	if (state_labels) {
+		set->labels = state_labels;
+	}
+	return set;
+}
+
+uint32_t globset_match(const struct globset_t *set, const char *name, size_t length) {
+	unsigned int state = 1;
+	for (size_t i = 0; (i < length) && state; i++) {
+		state = set->transitions[state][(uint8_t)name[i]];
+	}
+	return set->labels[state];
+}
+
+void globset_free(struct globset_t *set) {
+	if (!set) {
+		return;
+	}
+	free(set->transitions);
+	free(set->labels);
+	free(set);
+}
@@ -0,0 +1,75 @@
+/**
+ *	umsftpd - User-mode SFTP application.
+ *	Copyright (C) 2021-2021 Johannes Bauer
+ *
+ *	This file is part of umsftpd.
+ *
+ *	umsftpd is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; this program is ONLY licensed under
+ *	version 3 of the License, later versions are explicitly excluded.
+ *
+ *	umsftpd is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with umsftpd; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *	Johannes Bauer <JohannesBauer@gmx.de>
+**/
+
+#ifndef __GLOBFILTER_H__
+#define __GLOBFILTER_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Most patterns used in practice ("*.done", "upload_*", "report.txt") can be
+ * matched without calling fnmatch(3) at all. */
+enum globfilter_kind_t {
+	GLOBFILTER_MATCH_ALL,
+	GLOBFILTER_LITERAL,
+	GLOBFILTER_PREFIX,
+	GLOBFILTER_SUFFIX,
+	GLOBFILTER_SUBSTRING,
+	GLOBFILTER_FNMATCH,
+};
+
+/* A glob pattern for a single path component, compiled once and then
+ * matched against many names. Wildcards also match a leading dot. */
+struct globfilter_t {
+	enum globfilter_kind_t kind;
+	char *pattern;
+	const char *literal;
+	size_t literal_length;
+};
+
+#define GLOBSET_MAX_STATES					4096
+#define GLOBSET_MAX_ATOMS					1024
+
+/* Any number of glob patterns compiled into a single DFA over the bytes of a
+ * name, so that matching costs one table lookup per character regardless of
+ * the number of patterns. Every pattern carries a label; matching returns
+ * the union of the labels of all patterns that match the name. State 0 is
+ * the dead state, matching starts in state 1. */
+struct globset_t {
+	unsigned int state_count;
+	uint16_t (*transitions)[256];
+	uint32_t *labels;
+	uint32_t all_labels;
+};
+
+/*************** AUTO GENERATED SECTION FOLLOWS ***************/
+struct globfilter_t *globfilter_new(const char *pattern);
+bool globfilter_match(const struct globfilter_t *filter, const char *name);
+void globfilter_free(struct globfilter_t *filter);
+struct globset_t *globset_compile(const char *const *patterns, const uint32_t *labels, unsigned int pattern_count);
+uint32_t globset_match(const struct globset_t *set, const char *name, size_t length);
+void globset_free(struct globset_t *set);
+/***************  AUTO GENERATED SECTION ENDS   ***************/
+
+#endif
@@ -0,0 +1,660 @@
+/**
+ *	umsftpd - User-mode SFTP application.
+ *	Copyright (C) 2021-2021 Johannes Bauer
+ *
+ *	This file is part of umsftpd.
+ *
+ *	umsftpd is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; this program is ONLY licensed under
+ *	version 3 of the License, later versions are explicitly excluded.
+ *
+ *	umsftpd is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with umsftpd; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *	Johannes Bauer <JohannesBauer@gmx.de>
+**/
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "memfs.h"
+#include "atomtable.h"
+
+static struct timespec memfs_now(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	return now;
+}
+
+static uint32_t memfs_hash(const struct memfs_node_t *parent, const char *name, size_t name_length) {
+	return atomtable_hash(name, name_length) ^ (uint32_t)(parent->ino * 0x9e3779b1);
+}
+
+static struct memfs_node_t **memfs_bucket(struct memfs_t *memfs, uint32_t hash) {
+	return &memfs->index.buckets[hash & (memfs->index.bucket_count - 1)];
+}
+
+static struct memfs_node_t *memfs_find(struct memfs_t *memfs, const struct memfs_node_t *parent, const char *name, size_t name_length) {
+	uint32_t hash = memfs_hash(parent, name, name_length);
+	for (struct memfs_node_t *node = *memfs_bucket(memfs, hash); node; node = node->hash_next) {
+		if ((node->hash == hash) && (node->parent == parent) && (node->name_length == name_length) && !memcmp(node->name, name, name_length)) {
+			return node;
+		}
+	}
+	return NULL;
+}
+
+/* The table is kept at a load factor of at most one; if it cannot grow,
+ * chains simply become longer */
+static void memfs_index_insert(struct memfs_t *memfs, struct memfs_node_t *node) {
+	if (memfs->index.node_count >= memfs->index.bucket_count) {
+		unsigned int new_bucket_count = memfs->index.bucket_count * 2;
+		struct memfs_node_t **new_buckets = calloc(new_bucket_count, sizeof(struct memfs_node_t*));
+		if (new_buckets) {
+			for (unsigned int i = 0; i < memfs->index.bucket_count; i++) {
+				struct memfs_node_t *next;
+				for (struct memfs_node_t *moved = memfs->index.buckets[i]; moved; moved = next) {
+					next = moved->hash_next;
+					unsigned int index = moved->hash & (new_bucket_count - 1);
+					moved->hash_next = new_buckets[index];
+					new_buckets[index] = moved;
+				}
+			}
+			free(memfs->index.buckets);
+			memfs->index.buckets = new_buckets;
+			memfs->index.bucket_count = new_bucket_count;
+		}
+	}
+	node->hash = memfs_hash(node->parent, node->name, node->name_length);
+	struct memfs_node_t **bucket = memfs_bucket(memfs, node->hash);
+	node->hash_next = *bucket;
+	*bucket = node;
+	memfs->index.node_count++;
+}
+
+static void memfs_index_remove(struct memfs_t *memfs, struct memfs_node_t *node) {
+	for (struct memfs_node_t **link = memfs_bucket(memfs, node->hash); *link; link = &(*link)->hash_next) {
+		if (*link == node) {
+			*link = node->hash_next;
+			memfs->index.node_count--;
+			return;
+		}
+	}
+}
+
+static uint8_t *memfs_chunk_alloc(struct memfs_t *memfs) {
+	if (memfs->storage.used_chunks >= memfs->storage.max_chunks) {
+		errno = ENOSPC;
+		return NULL;
+	}
+	if (!memfs->storage.free_chunks) {
+		struct memfs_slab_t *slab = malloc(sizeof(struct memfs_slab_t) + (MEMFS_SLAB_CHUNKS * MEMFS_CHUNK_SIZE));
+		if (!slab) {
+			errno = ENOMEM;
+			return NULL;
+		}
+		slab->next = memfs->storage.slabs;
+		memfs->storage.slabs = slab;
+		for (unsigned int i = MEMFS_SLAB_CHUNKS; i > 0; i--) {
+			struct memfs_chunk_t *chunk = (struct memfs_chunk_t*)(slab->data + ((i - 1) * MEMFS_CHUNK_SIZE));
+			chunk->next_free = memfs->storage.free_chunks;
+			memfs->storage.free_chunks = chunk;
+		}
+	}
+	struct memfs_chunk_t *chunk = memfs->storage.free_chunks;
+	memfs->storage.free_chunks = chunk->next_free;
+	memfs->storage.used_chunks++;
+	memset(chunk, 0, MEMFS_CHUNK_SIZE);
+	return (uint8_t*)chunk;
+}
+
+static void memfs_chunk_free(struct memfs_t *memfs, uint8_t *data) {
+	struct memfs_chunk_t *chunk = (struct memfs_chunk_t*)data;
+	chunk->next_free = memfs->storage.free_chunks;
+	memfs->storage.free_chunks = chunk;
+	memfs->storage.used_chunks--;
+}
+
+static void memfs_truncate(struct memfs_t *memfs, struct memfs_node_t *node) {
+	for (uint64_t i = 0; i < node->data.chunk_count; i++) {
+		if (node->data.chunks[i]) {
+			memfs_chunk_free(memfs, node->data.chunks[i]);
+		}
+	}
+	free(node->data.chunks);
+	node->data.chunks = NULL;
+	node->data.chunk_count = 0;
+	node->data.size = 0;
+}
+
+static void memfs_node_free(struct memfs_t *memfs, struct memfs_node_t *node) {
+	for (unsigned int i = 0; i < node->children.count; i++) {
+		memfs_node_free(memfs, node->children.entries[i]);
+	}
+	memfs_truncate(memfs, node);
+	free(node->children.entries);
+	free(node->name);
+	free(node);
+}
+
+static bool memfs_children_reserve(struct memfs_node_t *dir) {
+	if (dir->children.count < dir->children.alloced_count) {
+		return true;
+	}
+	unsigned int new_alloced_count = dir->children.alloced_count ? (2 * dir->children.alloced_count) : 8;
+	struct memfs_node_t **new_entries = realloc(dir->children.entries, new_alloced_count * sizeof(struct memfs_node_t*));
+	if (!new_entries) {
+		errno = ENOMEM;
+		return false;
+	}
+	dir->children.entries = new_entries;
+	dir->children.alloced_count = new_alloced_count;
+	return true;
+}
+
+/* Requires room for the child, see memfs_children_reserve() */
+static void memfs_attach(struct memfs_t *memfs, struct memfs_node_t *dir, struct memfs_node_t *node) {
+	node->parent = dir;
+	node->child_index = dir->children.count;
+	dir->children.entries[dir->children.count++] = node;
+	memfs_index_insert(memfs, node);
+	dir->mtime = dir->ctime = memfs_now();
+}
+
+/* Listings of the parent that are in progress may miss the entry moved into
+ * the vacated position */
+static void memfs_detach(struct memfs_t *memfs, struct memfs_node_t *node) {
+	struct memfs_node_t *dir = node->parent;
+	memfs_index_remove(memfs, node);
+	struct memfs_node_t *last = dir->children.entries[--dir->children.count];
+	dir->children.entries[node->child_index] = last;
+	last->child_index = node->child_index;
+	dir->mtime = dir->ctime = memfs_now();
+}
+
+static void memfs_release(struct memfs_t *memfs, struct memfs_node_t *node) {
+	node->references--;
+	if (node->detached && !node->references) {
+		memfs_node_free(memfs, node);
+	}
+}
+
+/* Removes a node from the tree; it is freed once it is no longer open */
+static void memfs_remove(struct memfs_t *memfs, struct memfs_node_t *node) {
+	memfs_detach(memfs, node);
+	node->detached = true;
+	if (!node->references) {
+		memfs_node_free(memfs, node);
+	}
+}
+
+static struct memfs_node_t *memfs_node_new(struct memfs_t *memfs, struct memfs_node_t *dir, const char *name, size_t name_length, mode_t mode) {
+	if (dir && !memfs_children_reserve(dir)) {
+		return NULL;
+	}
+	struct memfs_node_t *node = calloc(1, sizeof(struct memfs_node_t));
+	if (!node) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	node->name = strndup(name, name_length);
+	if (!node->name) {
+		free(node);
+		errno = ENOMEM;
+		return NULL;
+	}
+	node->name_length = name_length;
+	node->ino = memfs->next_ino++;
+	node->mode = mode;
+	node->uid = getuid();
+	node->gid = getgid();
+	node->mtime = node->ctime = node->atime = memfs_now();
+	if (dir) {
+		memfs_attach(memfs, dir, node);
+	}
+	return node;
+}
+
+/* Looks up a path, or with a name pointer given, the parent directory of
+ * the last component and that component. Empty components are skipped, so
+ * that the mapped path of a mount at "/" (e.g., "//file") resolves, too. */
+static struct memfs_node_t *memfs_resolve(struct memfs_t *memfs, const char *path, const char **name, size_t *name_length) {
+	struct memfs_node_t *node = memfs->root;
+	while (true) {
+		while (*path == '/') {
+			path++;
+		}
+		if (!*path) {
+			break;
+		}
+		size_t component_length = strcspn(path, "/");
+		const char *next = path + component_length;
+		while (*next == '/') {
+			next++;
+		}
+		if (!S_ISDIR(node->mode)) {
+			errno = ENOTDIR;
+			return NULL;
+		}
+		if (name && !*next) {
+			*name = path;
+			*name_length = component_length;
+			return node;
+		}
+		node = memfs_find(memfs, node, path, component_length);
+		if (!node) {
+			errno = ENOENT;
+			return NULL;
+		}
+		path = next;
+	}
+	if (name) {
+		/* The root has no parent */
+		errno = EBUSY;
+		return NULL;
+	}
+	return node;
+}
+
+static void memfs_node_stat(const struct memfs_node_t *node, struct stat *statbuf) {
+	*statbuf = (struct stat) {
+		.st_ino = node->ino,
+		.st_mode = node->mode,
+		.st_nlink = S_ISDIR(node->mode) ? 2 : 1,
+		.st_uid = node->uid,
+		.st_gid = node->gid,
+		.st_size = node->data.size,
+		.st_blksize = MEMFS_CHUNK_SIZE,
+		.st_mtim = node->mtime,
+		.st_ctim = node->ctime,
+		.st_atim = node->atime,
+	};
+	for (uint64_t i = 0; i < node->data.chunk_count; i++) {
+		if (node->data.chunks[i]) {
+			statbuf->st_blocks += MEMFS_CHUNK_SIZE / 512;
+		}
+	}
+}
+
+static int memfs_stat(void *ctx, const char *path, struct stat *statbuf) {
+	struct memfs_node_t *node = memfs_resolve((struct memfs_t*)ctx, path, NULL, NULL);
+	if (!node) {
+		return -1;
+	}
+	memfs_node_stat(node, statbuf);
+	return 0;
+}
+
+static void *memfs_opendir(void *ctx, const char *path) {
+	struct memfs_node_t *node = memfs_resolve((struct memfs_t*)ctx, path, NULL, NULL);
+	if (!node) {
+		return NULL;
+	}
+	if (!S_ISDIR(node->mode)) {
+		errno = ENOTDIR;
+		return NULL;
+	}
+	struct memfs_dir_t *dir = calloc(1, sizeof(struct memfs_dir_t));
+	if (!dir) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	dir->node = node;
+	node->references++;
+	return dir;
+}
+
+static int memfs_readdir(void *ctx, void *vdir, char *name, size_t name_size, struct stat *statbuf) {
+	struct memfs_dir_t *dir = (struct memfs_dir_t*)vdir;
+	while (dir->position < dir->node->children.count) {
+		const struct memfs_node_t *child = dir->node->children.entries[dir->position++];
+		if (child->name_length >= name_size) {
+			continue;
+		}
+		memcpy(name, child->name, child->name_length + 1);
+		memfs_node_stat(child, statbuf);
+		return 1;
+	}
+	return 0;
+}
+
+static void memfs_closedir(void *ctx, void *vdir) {
+	struct memfs_dir_t *dir = (struct memfs_dir_t*)vdir;
+	memfs_release((struct memfs_t*)ctx, dir->node);
+	free(dir);
+}
+
+static void *memfs_open(void *ctx, const char *path, int flags, mode_t mode) {
+	struct memfs_t *memfs = (struct memfs_t*)ctx;
+	const char *name;
+	size_t name_length;
+	struct memfs_node_t *dir = memfs_resolve(memfs, path, &name, &name_length);
+	if (!dir) {
+		if (errno == EBUSY) {
+			errno = EISDIR;
+		}
+		return NULL;
+	}
+
+	struct memfs_file_t *file = calloc(1, sizeof(struct memfs_file_t));
+	if (!file) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	file->flags = flags;
+	file->node = memfs_find(memfs, dir, name, name_length);
+	if (!file->node) {
+		if (!(flags & O_CREAT)) {
+			errno = ENOENT;
+		} else {
+			file->node = memfs_node_new(memfs, dir, name, name_length, S_IFREG | (mode & 0777 & ~MEMFS_UMASK));
+		}
+	} else if ((flags & O_CREAT) && (flags & O_EXCL)) {
+		file->node = NULL;
+		errno = EEXIST;
+	} else if (S_ISDIR(file->node->mode)) {
+		file->node = NULL;
+		errno = EISDIR;
+	} else if ((flags & O_TRUNC) && ((flags & O_ACCMODE) != O_RDONLY)) {
+		memfs_truncate(memfs, file->node);
+		file->node->mtime = file->node->ctime = memfs_now();
+	}
+	if (!file->node) {
+		free(file);
+		return NULL;
+	}
+	file->node->references++;
+	return file;
+}
+
+static int memfs_fstat(void *ctx, void *vfile, struct stat *statbuf) {
+	memfs_node_stat(((struct memfs_file_t*)vfile)->node, statbuf);
+	return 0;
+}
+
+static ssize_t memfs_pread(void *ctx, void *vfile, void *buf, size_t length, uint64_t offset) {
+	const struct memfs_file_t *file = (const struct memfs_file_t*)vfile;
+	const struct memfs_node_t *node = file->node;
+	if ((file->flags & O_ACCMODE) == O_WRONLY) {
+		errno = EBADF;
+		return -1;
+	}
+	if (offset >= node->data.size) {
+		return 0;
+	}
+	if (length > node->data.size - offset) {
+		length = node->data.size - offset;
+	}
+
+	size_t total = 0;
+	while (total < length) {
+		uint64_t position = offset + total;
+		uint64_t chunk_offset = position % MEMFS_CHUNK_SIZE;
+		size_t chunk_length = MEMFS_CHUNK_SIZE - chunk_offset;
+		if (chunk_length > length - total) {
+			chunk_length = length - total;
+		}
+		const uint8_t *chunk = node->data.chunks[position / MEMFS_CHUNK_SIZE];
+		if (chunk) {
+			memcpy((uint8_t*)buf + total, chunk + chunk_offset, chunk_length);
+		} else {
+			memset((uint8_t*)buf + total, 0, chunk_length);
+		}
+		total += chunk_length;
+	}
+	return total;
+}
+
+/* No file can be larger than the whole filesystem, which also bounds the
+ * chunk table of sparse files. Short writes happen once space runs out. */
+static ssize_t memfs_pwrite(void *ctx, void *vfile, const void *buf, size_t length, uint64_t offset) {
+	struct memfs_t *memfs = (struct memfs_t*)ctx;
+	struct memfs_file_t *file = (struct memfs_file_t*)vfile;
+	struct memfs_node_t *node = file->node;
+	if ((file->flags & O_ACCMODE) == O_RDONLY) {
+		errno = EBADF;
+		return -1;
+	}
+	if (file->flags & O_APPEND) {
+		offset = node->data.size;
+	}
+	if (length == 0) {
+		return 0;
+	}
+	uint64_t max_size = memfs->storage.max_chunks * MEMFS_CHUNK_SIZE;
+	if ((offset > max_size) || (length > max_size - offset)) {
+		errno = EFBIG;
+		return -1;
+	}
+
+	uint64_t chunk_count = (offset + length + MEMFS_CHUNK_SIZE - 1) / MEMFS_CHUNK_SIZE;
+	if (chunk_count > node->data.chunk_count) {
+		uint8_t **new_chunks = realloc(node->data.chunks, chunk_count * sizeof(uint8_t*));
+		if (!new_chunks) {
+			errno = ENOMEM;
+			return -1;
+		}
+		memset(new_chunks + node->data.chunk_count, 0, (chunk_count - node->data.chunk_count) * sizeof(uint8_t*));
+		node->data.chunks = new_chunks;
+		node->data.chunk_count = chunk_count;
+	}
+
+	size_t total = 0;
+	while (total < length) {
+		uint64_t position = offset + total;
+		uint64_t chunk_offset = position % MEMFS_CHUNK_SIZE;
+		size_t chunk_length = MEMFS_CHUNK_SIZE - chunk_offset;
+		if (chunk_length > length - total) {
+			chunk_length = length - total;
+		}
+		uint8_t **chunk = &node->data.chunks[position / MEMFS_CHUNK_SIZE];
+		if (!*chunk) {
+			*chunk = memfs_chunk_alloc(memfs);
+			if (!*chunk) {
+				break;
+			}
+		}
+		memcpy(*chunk + chunk_offset, (const uint8_t*)buf + total, chunk_length);
+		total += chunk_length;
+	}
+
+	if (total == 0) {
+		return -1;
+	}
+	if (offset + total > node->data.size) {
+		node->data.size = offset + total;
+	}
+	node->mtime = node->ctime = memfs_now();
+	return total;
+}
+
+static int memfs_close(void *ctx, void *vfile) {
+	struct memfs_file_t *file = (struct memfs_file_t*)vfile;
+	memfs_release((struct memfs_t*)ctx, file->node);
+	free(file);
+	return 0;
+}
+
+static int memfs_mkdir(void *ctx, const char *path, mode_t mode) {
+	struct memfs_t *memfs = (struct memfs_t*)ctx;
+	const char *name;
+	size_t name_length;
+	struct memfs_node_t *dir = memfs_resolve(memfs, path, &name, &name_length);
+	if (!dir) {
+		if (errno == EBUSY) {
+			errno = EEXIST;
+		}
+		return -1;
+	}
+	if (memfs_find(memfs, dir, name, name_length)) {
+		errno = EEXIST;
+		return -1;
+	}
+	return memfs_node_new(memfs, dir, name, name_length, S_IFDIR | (mode & 0777 & ~MEMFS_UMASK)) ? 0 : -1;
+}
+
+/* Replaces an existing target like rename(2) does: a file only by a file,
+ * a directory only by a directory and only if that one is empty */
+static int memfs_rename(void *ctx, const char *old_path, const char *new_path) {
+	struct memfs_t *memfs = (struct memfs_t*)ctx;
+	const char *old_name, *new_name;
+	size_t old_name_length, new_name_length;
+	struct memfs_node_t *old_dir = memfs_resolve(memfs, old_path, &old_name, &old_name_length);
+	if (!old_dir) {
+		return -1;
+	}
+	struct memfs_node_t *node = memfs_find(memfs, old_dir, old_name, old_name_length);
+	if (!node) {
+		errno = ENOENT;
+		return -1;
+	}
+	struct memfs_node_t *new_dir = memfs_resolve(memfs, new_path, &new_name, &new_name_length);
+	if (!new_dir) {
+		return -1;
+	}
+	for (const struct memfs_node_t *ancestor = new_dir; ancestor; ancestor = ancestor->parent) {
+		if (ancestor == node) {
+			/* Cannot move a directory into itself */
+			errno = EINVAL;
+			return -1;
+		}
+	}
+
+	struct memfs_node_t *existing = memfs_find(memfs, new_dir, new_name, new_name_length);
+	if (existing == node) {
+		return 0;
+	}
+	if (existing) {
+		if (S_ISDIR(existing->mode) && !S_ISDIR(node->mode)) {
+			errno = EISDIR;
+			return -1;
+		}
+		if (!S_ISDIR(existing->mode) && S_ISDIR(node->mode)) {
+			errno = ENOTDIR;
+			return -1;
+		}
+		if (existing->children.count) {
+			errno = ENOTEMPTY;
+			return -1;
+		}
+	}
+
+	char *name = strndup(new_name, new_name_length);
+	if (!name || !memfs_children_reserve(new_dir)) {
+		free(name);
+		errno = ENOMEM;
+		return -1;
+	}
+	if (existing) {
+		memfs_remove(memfs, existing);
+	}
+	memfs_detach(memfs, node);
+	free(node->name);
+	node->name = name;
+	node->name_length = new_name_length;
+	memfs_attach(memfs, new_dir, node);
+	node->ctime = memfs_now();
+	return 0;
+}
+
+static int memfs_unlink(void *ctx, const char *path) {
+	struct memfs_t *memfs = (struct memfs_t*)ctx;
+	const char *name;
+	size_t name_length;
+	struct memfs_node_t *dir = memfs_resolve(memfs, path, &name, &name_length);
+	if (!dir) {
+		if (errno == EBUSY) {
+			errno = EISDIR;
+		}
+		return -1;
+	}
+	struct memfs_node_t *node = memfs_find(memfs, dir, name, name_length);
+	if (!node) {
+		errno = ENOENT;
+		return -1;
+	}
+	if (S_ISDIR(node->mode)) {
+		errno = EISDIR;
+		return -1;
+	}
+	memfs_remove(memfs, node);
+	return 0;
+}
+
+static const struct vfs_backend_ops_t memfs_ops = {
+	.stat = memfs_stat,
+	.opendir = memfs_opendir,
+	.readdir = memfs_readdir,
+	.closedir = memfs_closedir,
+	.open = memfs_open,
+	.fstat = memfs_fstat,
+	.pread = memfs_pread,
+	.pwrite = memfs_pwrite,
+	.close = memfs_close,
+	.mkdir = memfs_mkdir,
+	.rename = memfs_rename,
+	.unlink = memfs_unlink,
+};
+
+/* Creates an empty filesystem of which at most max_bytes (rounded up to
+ * whole chunks) are used for file data */
+struct memfs_t *memfs_new(uint64_t max_bytes) {
+	struct memfs_t *memfs = calloc(1, sizeof(struct memfs_t));
+	if (!memfs) {
+		return NULL;
+	}
+	memfs->backend = (struct vfs_backend_t) {
+		.name = "memfs",
+		.ops = &memfs_ops,
+		.ctx = memfs,
+	};
+	memfs->next_ino = 1;
+	memfs->storage.max_chunks = (max_bytes + MEMFS_CHUNK_SIZE - 1) / MEMFS_CHUNK_SIZE;
+	memfs->index.bucket_count = MEMFS_INITIAL_BUCKETS;
+	memfs->index.buckets = calloc(memfs->index.bucket_count, sizeof(struct memfs_node_t*));
+	if (!memfs->index.buckets) {
+		memfs_free(memfs);
+		return NULL;
+	}
+	memfs->root = memfs_node_new(memfs, NULL, "", 0, S_IFDIR | (0777 & ~MEMFS_UMASK));
+	if (!memfs->root) {
+		memfs_free(memfs);
+		return NULL;
+	}
+	return memfs;
+}
+
+const struct vfs_backend_t *memfs_backend(struct memfs_t *memfs) {
+	return &memfs->backend;
+}
+
+uint64_t memfs_used_bytes(const struct memfs_t *memfs) {
+	return memfs->storage.used_chunks * MEMFS_CHUNK_SIZE;
+}
+
+/* All files and directories must have been closed before */
+void memfs_free(struct memfs_t *memfs) {
+	if (!memfs) {
+		return;
+	}
+	if (memfs->root) {
+		memfs_node_free(memfs, memfs->root);
+	}
+	free(memfs->index.buckets);
+	struct memfs_slab_t *next;
+	for (struct memfs_slab_t *slab = memfs->storage.slabs; slab; slab = next) {
+		next = slab->next;
+		free(slab);
+	}
+	free(memfs);
+}
@@ -0,0 +1,116 @@
+/**
+ *	umsftpd - User-mode SFTP application.
+ *	Copyright (C) 2021-2021 Johannes Bauer
+ *
+ *	This file is part of umsftpd.
+ *
+ *	umsftpd is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; this program is ONLY licensed under
+ *	version 3 of the License, later versions are explicitly excluded.
+ *
+ *	umsftpd is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with umsftpd; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *	Johannes Bauer <JohannesBauer@gmx.de>
+**/
+
+#ifndef __MEMFS_H__
+#define __MEMFS_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+#include <sys/types.h>
+#include "vfsbackend.h"
+
+#define MEMFS_CHUNK_SIZE					(16 * 1024)
+#define MEMFS_SLAB_CHUNKS					64
+#define MEMFS_INITIAL_BUCKETS				64
+#define MEMFS_UMASK							022
+
+/* A file or directory. Nodes are indexed by (parent, name) in the hash
+ * table of the filesystem; directories additionally keep an unordered array
+ * of their children for listings. File data is held in fixed-size chunks,
+ * where a missing chunk is a hole that reads as zeros. A node that is
+ * removed while still open is only detached and freed on its last close. */
+struct memfs_node_t {
+	uint64_t ino;
+	struct memfs_node_t *parent;
+	char *name;
+	size_t name_length;
+	uint32_t hash;
+	struct memfs_node_t *hash_next;
+	mode_t mode;
+	uid_t uid;
+	gid_t gid;
+	struct timespec mtime, ctime, atime;
+	unsigned int references;
+	bool detached;
+	struct {
+		struct memfs_node_t **entries;
+		unsigned int count, alloced_count;
+	} children;
+	unsigned int child_index;
+	struct {
+		uint8_t **chunks;
+		uint64_t chunk_count;
+		uint64_t size;
+	} data;
+};
+
+/* Chunks are carved out of slabs and recycled through a free list; slabs
+ * are only released together with the filesystem */
+struct memfs_slab_t {
+	struct memfs_slab_t *next;
+	uint8_t data[];
+};
+
+struct memfs_chunk_t {
+	struct memfs_chunk_t *next_free;
+};
+
+struct memfs_dir_t {
+	struct memfs_node_t *node;
+	unsigned int position;
+};
+
+struct memfs_file_t {
+	struct memfs_node_t *node;
+	int flags;
+};
+
+/* A RAM-backed filesystem limited to max_bytes of file data, usable as the
+ * backend of one or more mounts; the target path of a mount names a
+ * directory within it. Not thread-safe. */
+struct memfs_t {
+	struct vfs_backend_t backend;
+	struct memfs_node_t *root;
+	uint64_t next_ino;
+	struct {
+		struct memfs_node_t **buckets;
+		unsigned int bucket_count;
+		unsigned int node_count;
+	} index;
+	struct {
+		struct memfs_slab_t *slabs;
+		struct memfs_chunk_t *free_chunks;
+		uint64_t used_chunks, max_chunks;
+	} storage;
+};
+
+/*************** AUTO GENERATED SECTION FOLLOWS ***************/
+struct memfs_t *memfs_new(uint64_t max_bytes);
+const struct vfs_backend_t *memfs_backend(struct memfs_t *memfs);
+uint64_t memfs_used_bytes(const struct memfs_t *memfs);
+void memfs_free(struct memfs_t *memfs);
+/***************  AUTO GENERATED SECTION ENDS   ***************/
+
+#endif
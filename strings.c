@@ -31,38 +31,6 @@
 
 #include "strings.h"
 
-void __attribute__((nonnull (1, 2))) path_split_mutable(char *path, path_split_callback_t callback, void *vctx) {
-	size_t len = strlen(path);
-	for (size_t i = 0; i < len; i++) {
-		bool is_full_path = (i == (len - 1));
-		bool do_continue = true;
-		if (path[i] == '/') {
-			if (i == 0) {
-				char saved = path[1];
-				path[1] = 0;
-				do_continue = callback(path, is_full_path, vctx);
-				path[1] = saved;
-			} else {
-				path[i] = 0;
-				do_continue = callback(path, is_full_path, vctx);
-				path[i] = '/';
-			}
-		} else if (is_full_path) {
-			callback(path, is_full_path, vctx);
-		}
-		if (!do_continue) {
-			break;
-		}
-	}
-}
-
-void __attribute__((nonnull (1, 2))) path_split(const char *path, path_split_callback_t callback, void *vctx) {
-	size_t len = strlen(path);
-	char copy[len + 1];
-	strcpy(copy, path);
-	path_split_mutable(copy, callback, vctx);
-}
-
 bool __attribute__((nonnull (1, 2))) pathcmp(const char *path1, const char *path2) {
 	int len1, len2;
 	len1 = strlen(path1);
@@ -180,33 +148,46 @@ bool __attribute__((nonnull (1))) path_contains_hidden(const char *path) {
 	return false;
 }
 
-static bool __attribute__((nonnull (1))) path_contains_symlink_callback(const char *path, bool is_full_path, void *vctx) {
-	struct symlink_check_response_t *ctx = (struct symlink_check_response_t*)vctx;
-	struct stat statbuf;
-	if (lstat(path, &statbuf)) {
-		/* Stat failed */
-		if (errno == ENOENT) {
-			ctx->file_not_found = true;
-		} else {
-			ctx->critical_error = true;
-		}
-	} else {
-		/* Stat successful, have symlink? */
-		if (S_ISLNK(statbuf.st_mode)) {
-			ctx->contains_symlink = true;
-		}
-	}
-	/* Continue only if no error and no symlink seen so far */
-	return (!ctx->file_not_found) && (!ctx->critical_error) && (!ctx->contains_symlink);
-}
-
 struct symlink_check_response_t __attribute__((nonnull (1))) path_contains_symlink(const char *path) {
 	struct symlink_check_response_t result = {
 		.critical_error = false,
 		.file_not_found = false,
 		.contains_symlink = false,
 	};
-	path_split(path, path_contains_symlink_callback, &result);
+
+	/* lstat(2) needs terminated strings, so we copy once and terminate each
+	 * prefix in place while iterating */
+	size_t len = strlen(path);
+	char copy[len + 1];
+	memcpy(copy, path, len + 1);
+
+	struct path_iter_t iter;
+	path_iter_init(&iter, copy, len);
+	while (path_iter_next(&iter)) {
+		char saved = copy[iter.prefix_length];
+		copy[iter.prefix_length] = 0;
+
+		struct stat statbuf;
+		if (lstat(copy, &statbuf)) {
+			/* Stat failed */
+			if (errno == ENOENT) {
+				result.file_not_found = true;
+			} else {
+				result.critical_error = true;
+			}
+		} else {
+			/* Stat successful, have symlink? */
+			if (S_ISLNK(statbuf.st_mode)) {
+				result.contains_symlink = true;
+			}
+		}
+		copy[iter.prefix_length] = saved;
+
+		/* Continue only if no error and no symlink seen so far */
+		if (result.file_not_found || result.critical_error || result.contains_symlink) {
+			break;
+		}
+	}
 	return result;
 }
 
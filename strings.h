@@ -25,8 +25,22 @@
 #define __STRINGS_H__
 
 #include <stdbool.h>
+#include <stddef.h>
 
-typedef bool (*path_split_callback_t)(const char *path, bool is_full_path, void *vctx);
+/* Iterates over all prefixes of a path without copying it. For "/foo/bar"
+ * this yields "/", "/foo" and "/foo/bar" (the last one with is_full_path
+ * set); the prefix is path[0 .. prefix_length) and the last path component
+ * of that prefix is component[0 .. component_length). */
+struct path_iter_t {
+	const char *path;
+	size_t length;
+	size_t position;
+	size_t last_slash;
+	size_t prefix_length;
+	const char *component;
+	size_t component_length;
+	bool is_full_path;
+};
 
 struct symlink_check_response_t {
 	bool critical_error;
@@ -35,8 +49,6 @@ struct symlink_check_response_t {
 };
 
 /*************** AUTO GENERATED SECTION FOLLOWS ***************/
-void __attribute__((nonnull (1, 2))) path_split_mutable(char *path, path_split_callback_t callback, void *vctx);
-void __attribute__((nonnull (1, 2))) path_split(const char *path, path_split_callback_t callback, void *vctx);
 bool __attribute__((nonnull (1, 2))) pathcmp(const char *path1, const char *path2);
 void __attribute__((nonnull (1))) truncate_trailing_slash(char *path);
 bool __attribute__((nonnull (1))) is_valid_path(const char *path);
@@ -48,4 +60,35 @@ void __attribute__((nonnull (1))) strip_crlf(char *string);
 const char *const_basename(const char *path);
 /***************  AUTO GENERATED SECTION ENDS   ***************/
 
+static inline void __attribute__((nonnull (1, 2))) path_iter_init(struct path_iter_t *iter, const char *path, size_t length) {
+	*iter = (struct path_iter_t) {
+		.path = path,
+		.length = length,
+		.component = path,
+	};
+}
+
+static inline bool __attribute__((nonnull (1))) path_iter_next(struct path_iter_t *iter) {
+	while (iter->position < iter->length) {
+		size_t i = iter->position++;
+		bool is_full_path = (i == (iter->length - 1));
+		size_t component_start = (iter->path[iter->last_slash] == '/') ? (iter->last_slash + 1) : 0;
+		if (iter->path[i] == '/') {
+			iter->prefix_length = (i == 0) ? 1 : i;
+			iter->component = iter->path + component_start;
+			iter->component_length = (i == 0) ? 0 : (i - component_start);
+			iter->last_slash = i;
+		} else if (is_full_path) {
+			iter->prefix_length = iter->length;
+			iter->component = iter->path + component_start;
+			iter->component_length = iter->length - component_start;
+		} else {
+			continue;
+		}
+		iter->is_full_path = is_full_path;
+		return true;
+	}
+	return false;
+}
+
 #endif
@@ -0,0 +1,413 @@
+/**
+ *	umsftpd - User-mode SFTP application.
+ *	Copyright (C) 2021-2021 Johannes Bauer
+ *
+ *	This file is part of umsftpd.
+ *
+ *	umsftpd is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; this program is ONLY licensed under
+ *	version 3 of the License, later versions are explicitly excluded.
+ *
+ *	umsftpd is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with umsftpd; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *	Johannes Bauer <JohannesBauer@gmx.de>
+**/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "tarstream.h"
+
+struct tarstream_ustar_header_t {
+	char name[100];
+	char mode[8];
+	char uid[8];
+	char gid[8];
+	char size[12];
+	char mtime[12];
+	char checksum[8];
+	char typeflag;
+	char linkname[100];
+	char magic[6];
+	char version[2];
+	char uname[32];
+	char gname[32];
+	char devmajor[8];
+	char devminor[8];
+	char prefix[155];
+	char padding[12];
+};
+
+_Static_assert(sizeof(struct tarstream_ustar_header_t) == TARSTREAM_BLOCK_SIZE, "ustar header must be exactly one block");
+
+uint64_t tarstream_padding(uint64_t size) {
+	return (TARSTREAM_BLOCK_SIZE - (size % TARSTREAM_BLOCK_SIZE)) % TARSTREAM_BLOCK_SIZE;
+}
+
+/* Writes a zero-terminated octal number into a field, returns false if the
+ * value does not fit */
+static bool tarstream_octal(char *field, size_t field_size, uint64_t value) {
+	for (int i = field_size - 2; i >= 0; i--) {
+		field[i] = '0' + (value & 7);
+		value >>= 3;
+	}
+	field[field_size - 1] = 0;
+	return value == 0;
+}
+
+/* Splits a path into the ustar prefix and name fields at a slash */
+static bool tarstream_split_path(struct tarstream_ustar_header_t *header, const char *path) {
+	size_t length = strlen(path);
+	if (length <= sizeof(header->name)) {
+		memcpy(header->name, path, length);
+		return true;
+	}
+	for (size_t i = length - 1; i > 0; i--) {
+		if ((path[i] == '/') && (i <= sizeof(header->prefix)) && (length - i - 1 <= sizeof(header->name))) {
+			memcpy(header->prefix, path, i);
+			memcpy(header->name, path + i + 1, length - i - 1);
+			return true;
+		}
+	}
+	return false;
+}
+
+static void tarstream_fill_header(struct tarstream_ustar_header_t *header, char typeflag, uint16_t permissions, uint32_t uid, uint32_t gid, uint64_t size, int64_t mtime) {
+	tarstream_octal(header->mode, sizeof(header->mode), permissions & 07777);
+	tarstream_octal(header->uid, sizeof(header->uid), uid & 07777777);
+	tarstream_octal(header->gid, sizeof(header->gid), gid & 07777777);
+	tarstream_octal(header->size, sizeof(header->size), size);
+	tarstream_octal(header->mtime, sizeof(header->mtime), (mtime > 0) ? mtime : 0);
+	header->typeflag = typeflag;
+	memcpy(header->magic, "ustar", 6);
+	memcpy(header->version, "00", 2);
+
+	unsigned int checksum = 0;
+	memset(header->checksum, ' ', sizeof(header->checksum));
+	for (unsigned int i = 0; i < sizeof(struct tarstream_ustar_header_t); i++) {
+		checksum += ((const uint8_t*)header)[i];
+	}
+	snprintf(header->checksum, sizeof(header->checksum), "%06o", checksum & 0777777);
+}
+
+/* A pax record is "<length> <key>=<value>\n" where the length includes the
+ * digits of the length itself */
+static size_t tarstream_pax_record(char *buffer, size_t buffer_size, const char *key, const char *value) {
+	size_t payload_length = 1 + strlen(key) + 1 + strlen(value) + 1;
+	size_t record_length = payload_length + 1;
+	while (record_length != payload_length + snprintf(NULL, 0, "%zu", record_length)) {
+		record_length++;
+	}
+	if (record_length >= buffer_size) {
+		return 0;
+	}
+	snprintf(buffer, buffer_size, "%zu %s=%s\n", record_length, key, value);
+	return record_length;
+}
+
+/* Serializes the header(s) of an entry into the buffer, which must be at
+ * least TARSTREAM_MAX_HEADER_SIZE bytes. Paths or sizes not representable in
+ * a plain ustar header are given in a preceding pax extended header. Returns
+ * the number of bytes written or 0 if the entry cannot be represented. */
+size_t tarstream_header(uint8_t *buffer, const struct tarstream_entry_t *entry) {
+	char path[TARSTREAM_MAX_PATH_LENGTH + 2];
+	size_t path_length = strlen(entry->path);
+	if ((path_length == 0) || (path_length >= TARSTREAM_MAX_PATH_LENGTH)) {
+		return 0;
+	}
+	strcpy(path, entry->path);
+	if (entry->is_directory && (path[path_length - 1] != '/')) {
+		strcat(path, "/");
+	}
+
+	struct tarstream_ustar_header_t header;
+	memset(&header, 0, sizeof(header));
+	bool need_pax_path = !tarstream_split_path(&header, path);
+	char size_field[12];
+	bool need_pax_size = !tarstream_octal(size_field, sizeof(size_field), entry->size);
+
+	size_t offset = 0;
+	if (need_pax_path || need_pax_size) {
+		char records[TARSTREAM_MAX_PATH_LENGTH + TARSTREAM_BLOCK_SIZE];
+		size_t records_length = 0;
+		if (need_pax_path) {
+			records_length += tarstream_pax_record(records + records_length, sizeof(records) - records_length, "path", path);
+			/* Readers without pax support get at least the file name */
+			const char *basename = strrchr(entry->path, '/');
+			basename = basename ? (basename + 1) : entry->path;
+			memset(&header, 0, sizeof(header));
+			strncpy(header.name, basename, sizeof(header.name));
+		}
+		if (need_pax_size) {
+			char size_value[24];
+			snprintf(size_value, sizeof(size_value), "%lu", (unsigned long)entry->size);
+			records_length += tarstream_pax_record(records + records_length, sizeof(records) - records_length, "size", size_value);
+		}
+
+		struct tarstream_ustar_header_t pax_header;
+		memset(&pax_header, 0, sizeof(pax_header));
+		strcpy(pax_header.name, "././@PaxHeader");
+		tarstream_fill_header(&pax_header, 'x', 0644, 0, 0, records_length, entry->mtime);
+		memcpy(buffer, &pax_header, sizeof(pax_header));
+		offset += sizeof(pax_header);
+		memcpy(buffer + offset, records, records_length);
+		memset(buffer + offset + records_length, 0, tarstream_padding(records_length));
+		offset += records_length + tarstream_padding(records_length);
+	}
+
+	tarstream_fill_header(&header, entry->is_directory ? '5' : '0', entry->permissions, entry->uid, entry->gid, need_pax_size ? 0 : entry->size, entry->mtime);
+	memcpy(buffer + offset, &header, sizeof(header));
+	offset += sizeof(header);
+	return offset;
+}
+
+void tarstream_parser_init(struct tarstream_parser_t *parser, tarstream_begin_callback_t begin, tarstream_data_callback_t data, tarstream_end_callback_t end, void *ctx) {
+	memset(parser, 0, sizeof(struct tarstream_parser_t));
+	parser->begin = begin;
+	parser->data = data;
+	parser->end = end;
+	parser->ctx = ctx;
+}
+
+static bool tarstream_parse_octal(const char *field, size_t field_size, uint64_t *value) {
+	*value = 0;
+	size_t i = 0;
+	while ((i < field_size) && (field[i] == ' ')) {
+		i++;
+	}
+	for (; (i < field_size) && (field[i] >= '0') && (field[i] <= '7'); i++) {
+		if (*value >> 61) {
+			return false;
+		}
+		*value = (*value << 3) | (field[i] - '0');
+	}
+	return (i == field_size) || (field[i] == 0) || (field[i] == ' ');
+}
+
+static bool tarstream_checksum_valid(const struct tarstream_ustar_header_t *header) {
+	uint64_t expected;
+	if (!tarstream_parse_octal(header->checksum, sizeof(header->checksum), &expected)) {
+		return false;
+	}
+	unsigned int checksum = 0;
+	for (unsigned int i = 0; i < sizeof(struct tarstream_ustar_header_t); i++) {
+		const uint8_t *byte = (const uint8_t*)header + i;
+		bool in_checksum = (byte >= (const uint8_t*)header->checksum) && (byte < (const uint8_t*)header->checksum + sizeof(header->checksum));
+		checksum += in_checksum ? ' ' : *byte;
+	}
+	return checksum == expected;
+}
+
+/* Only the "path" and "size" records of pax headers are used */
+static bool tarstream_apply_pax(struct tarstream_parser_t *parser) {
+	size_t position = 0;
+	while (position < parser->extended_length) {
+		char *record = parser->extended + position;
+		const char *space = memchr(record, ' ', parser->extended_length - position);
+		if (!space || (space == record) || !isdigit((unsigned char)record[0])) {
+			return false;
+		}
+		char *end;
+		unsigned long record_length = strtoul(record, &end, 10);
+		if ((end != space) || (record_length < 5) || (record_length > parser->extended_length - position) || (record[record_length - 1] != '\n')) {
+			return false;
+		}
+		record[record_length - 1] = 0;
+		const char *key = end + 1;
+		char *equals = strchr(key, '=');
+		if (!equals) {
+			return false;
+		}
+		*equals = 0;
+		const char *value = equals + 1;
+		if (!strcmp(key, "path")) {
+			if (strlen(value) >= sizeof(parser->path)) {
+				return false;
+			}
+			strcpy(parser->path, value);
+			parser->has_path = true;
+		} else if (!strcmp(key, "size")) {
+			parser->size = strtoull(value, &end, 10);
+			if (*end) {
+				return false;
+			}
+			parser->has_size = true;
+		}
+		position += record_length;
+	}
+	return true;
+}
+
+static bool tarstream_finish_extended(struct tarstream_parser_t *parser) {
+	/* The header size check leaves room for a terminator */
+	parser->extended[parser->extended_length] = 0;
+	if (parser->extended_type == 'x') {
+		return tarstream_apply_pax(parser);
+	} else if (parser->extended_type == 'L') {
+		/* GNU long name */
+		size_t length = strnlen(parser->extended, parser->extended_length);
+		if (length >= sizeof(parser->path)) {
+			return false;
+		}
+		memcpy(parser->path, parser->extended, length);
+		parser->path[length] = 0;
+		parser->has_path = true;
+	}
+	/* Global pax headers are ignored */
+	return true;
+}
+
+static bool tarstream_parse_header(struct tarstream_parser_t *parser) {
+	const struct tarstream_ustar_header_t *header = (const struct tarstream_ustar_header_t*)parser->block;
+	bool all_zero = true;
+	for (unsigned int i = 0; i < TARSTREAM_BLOCK_SIZE; i++) {
+		if (parser->block[i]) {
+			all_zero = false;
+			break;
+		}
+	}
+	if (all_zero) {
+		/* Two zero blocks mark the end of the archive */
+		if (++parser->zero_blocks == 2) {
+			parser->state = TARSTREAM_PARSE_FINISHED;
+		}
+		return true;
+	}
+	parser->zero_blocks = 0;
+
+	uint64_t size, mode, uid, gid, mtime;
+	if (!tarstream_checksum_valid(header) || !tarstream_parse_octal(header->size, sizeof(header->size), &size) || !tarstream_parse_octal(header->mode, sizeof(header->mode), &mode) || !tarstream_parse_octal(header->uid, sizeof(header->uid), &uid) || !tarstream_parse_octal(header->gid, sizeof(header->gid), &gid) || !tarstream_parse_octal(header->mtime, sizeof(header->mtime), &mtime)) {
+		return false;
+	}
+
+	if ((header->typeflag == 'x') || (header->typeflag == 'g') || (header->typeflag == 'L')) {
+		if (size >= sizeof(parser->extended)) {
+			return false;
+		}
+		parser->extended_type = header->typeflag;
+		parser->extended_length = 0;
+		parser->remaining = size;
+		parser->padding = tarstream_padding(size);
+		parser->state = TARSTREAM_PARSE_EXTENDED;
+		return true;
+	}
+
+	if (!parser->has_path) {
+		char path[sizeof(header->prefix) + 1 + sizeof(header->name) + 1];
+		size_t prefix_length = strnlen(header->prefix, sizeof(header->prefix));
+		size_t name_length = strnlen(header->name, sizeof(header->name));
+		size_t length = 0;
+		/* Old GNU archives use the prefix field for other data */
+		if (prefix_length && !memcmp(header->magic, "ustar", 6)) {
+			memcpy(path, header->prefix, prefix_length);
+			path[prefix_length] = '/';
+			length = prefix_length + 1;
+		}
+		memcpy(path + length, header->name, name_length);
+		path[length + name_length] = 0;
+		strcpy(parser->path, path);
+	}
+	if (parser->has_size) {
+		size = parser->size;
+	}
+
+	struct tarstream_entry_t entry = {
+		.path = parser->path,
+		.is_directory = (header->typeflag == '5'),
+		.is_special = (header->typeflag != '0') && (header->typeflag != 0) && (header->typeflag != '7') && (header->typeflag != '5'),
+		.size = size,
+		.permissions = mode & 07777,
+		.uid = uid,
+		.gid = gid,
+		.mtime = mtime,
+	};
+	parser->has_path = false;
+	parser->has_size = false;
+	if (!parser->begin(parser->ctx, &entry)) {
+		return false;
+	}
+	parser->remaining = size;
+	parser->padding = tarstream_padding(size);
+	if (size == 0) {
+		return parser->end(parser->ctx);
+	}
+	parser->state = TARSTREAM_PARSE_DATA;
+	return true;
+}
+
+/* Returns false on malformed input or when a callback failed; the parser
+ * then refuses all further input */
+bool tarstream_parse(struct tarstream_parser_t *parser, const void *data, size_t length) {
+	const uint8_t *bytes = (const uint8_t*)data;
+	while (length && (parser->state != TARSTREAM_PARSE_FAILED)) {
+		size_t chunk_length = length;
+		bool success = true;
+		switch (parser->state) {
+			case TARSTREAM_PARSE_HEADER:
+				if (chunk_length > TARSTREAM_BLOCK_SIZE - parser->block_filled) {
+					chunk_length = TARSTREAM_BLOCK_SIZE - parser->block_filled;
+				}
+				memcpy(parser->block + parser->block_filled, bytes, chunk_length);
+				parser->block_filled += chunk_length;
+				if (parser->block_filled == TARSTREAM_BLOCK_SIZE) {
+					parser->block_filled = 0;
+					success = tarstream_parse_header(parser);
+				}
+				break;
+
+			case TARSTREAM_PARSE_EXTENDED:
+			case TARSTREAM_PARSE_DATA:
+				if (chunk_length > parser->remaining) {
+					chunk_length = parser->remaining;
+				}
+				if (parser->state == TARSTREAM_PARSE_EXTENDED) {
+					memcpy(parser->extended + parser->extended_length, bytes, chunk_length);
+					parser->extended_length += chunk_length;
+				} else {
+					success = parser->data(parser->ctx, bytes, chunk_length);
+				}
+				parser->remaining -= chunk_length;
+				if (success && (parser->remaining == 0)) {
+					if (parser->state == TARSTREAM_PARSE_EXTENDED) {
+						success = tarstream_finish_extended(parser);
+					} else {
+						success = parser->end(parser->ctx);
+					}
+					parser->state = parser->padding ? TARSTREAM_PARSE_PADDING : TARSTREAM_PARSE_HEADER;
+				}
+				break;
+
+			case TARSTREAM_PARSE_PADDING:
+				if (chunk_length > parser->padding) {
+					chunk_length = parser->padding;
+				}
+				parser->padding -= chunk_length;
+				if (parser->padding == 0) {
+					parser->state = TARSTREAM_PARSE_HEADER;
+				}
+				break;
+
+			case TARSTREAM_PARSE_FINISHED:
+				/* Trailing blocks after the end marker are ignored */
+				break;
+
+			case TARSTREAM_PARSE_FAILED:
+				break;
+		}
+		if (!success) {
+			parser->state = TARSTREAM_PARSE_FAILED;
+			return false;
+		}
+		bytes += chunk_length;
+		length -= chunk_length;
+	}
+	return parser->state != TARSTREAM_PARSE_FAILED;
+}
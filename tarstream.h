@@ -0,0 +1,89 @@
+/**
+ *	umsftpd - User-mode SFTP application.
+ *	Copyright (C) 2021-2021 Johannes Bauer
+ *
+ *	This file is part of umsftpd.
+ *
+ *	umsftpd is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; this program is ONLY licensed under
+ *	version 3 of the License, later versions are explicitly excluded.
+ *
+ *	umsftpd is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with umsftpd; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *	Johannes Bauer <JohannesBauer@gmx.de>
+**/
+#ifndef __TARSTREAM_H__
+#define __TARSTREAM_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define TARSTREAM_BLOCK_SIZE				512
+#define TARSTREAM_MAX_PATH_LENGTH			4096
+
+/* Enough for a pax extended header carrying a maximum length path plus the
+ * ustar header of the entry itself */
+#define TARSTREAM_MAX_HEADER_SIZE			(TARSTREAM_MAX_PATH_LENGTH + (4 * TARSTREAM_BLOCK_SIZE))
+
+struct tarstream_entry_t {
+	const char *path;
+	bool is_directory;
+	bool is_special;
+	uint64_t size;
+	uint16_t permissions;
+	uint32_t uid, gid;
+	int64_t mtime;
+};
+
+typedef bool (*tarstream_begin_callback_t)(void *ctx, const struct tarstream_entry_t *entry);
+typedef bool (*tarstream_data_callback_t)(void *ctx, const void *data, size_t length);
+typedef bool (*tarstream_end_callback_t)(void *ctx);
+
+enum tarstream_parser_state_t {
+	TARSTREAM_PARSE_HEADER,
+	TARSTREAM_PARSE_EXTENDED,
+	TARSTREAM_PARSE_DATA,
+	TARSTREAM_PARSE_PADDING,
+	TARSTREAM_PARSE_FINISHED,
+	TARSTREAM_PARSE_FAILED,
+};
+
+/* Incremental parser for an archive arriving in arbitrarily sized pieces.
+ * Member data is passed through without being buffered; only headers and
+ * extended headers (pax or GNU long names) are held. */
+struct tarstream_parser_t {
+	enum tarstream_parser_state_t state;
+	uint8_t block[TARSTREAM_BLOCK_SIZE];
+	size_t block_filled;
+	uint64_t remaining, padding;
+	unsigned int zero_blocks;
+	char extended_type;
+	char extended[TARSTREAM_MAX_HEADER_SIZE];
+	size_t extended_length;
+	char path[TARSTREAM_MAX_PATH_LENGTH];
+	bool has_path;
+	uint64_t size;
+	bool has_size;
+	tarstream_begin_callback_t begin;
+	tarstream_data_callback_t data;
+	tarstream_end_callback_t end;
+	void *ctx;
+};
+
+/*************** AUTO GENERATED SECTION FOLLOWS ***************/
+uint64_t tarstream_padding(uint64_t size);
+size_t tarstream_header(uint8_t *buffer, const struct tarstream_entry_t *entry);
+void tarstream_parser_init(struct tarstream_parser_t *parser, tarstream_begin_callback_t begin, tarstream_data_callback_t data, tarstream_end_callback_t end, void *ctx);
+bool tarstream_parse(struct tarstream_parser_t *parser, const void *data, size_t length);
+/***************  AUTO GENERATED SECTION ENDS   ***************/
+
+#endif
@@ -0,0 +1,82 @@
+/**
+ *	umsftpd - User-mode SFTP application.
+ *	Copyright (C) 2021-2021 Johannes Bauer
+ *
+ *	This file is part of umsftpd.
+ *
+ *	umsftpd is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; this program is ONLY licensed under
+ *	version 3 of the License, later versions are explicitly excluded.
+ *
+ *	umsftpd is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with umsftpd; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *	Johannes Bauer <JohannesBauer@gmx.de>
+**/
+
+#include <stdio.h>
+#include <string.h>
+#include "testbench.h"
+#include "atomtable.h"
+#include "test_atomtable.h"
+
+void test_atomtable_create_destroy(void) {
+	struct atomtable_t *table = atomtable_new();
+	test_assert(table);
+	test_assert_int_eq(table->count, 0);
+	atomtable_free(table);
+}
+
+void test_atomtable_intern(void) {
+	struct atomtable_t *table = atomtable_new();
+	unsigned int foo, bar, foo_again;
+	test_assert_true(atomtable_intern(table, "foo", 3, &foo));
+	test_assert_true(atomtable_intern(table, "bar", 3, &bar));
+	test_assert_true(atomtable_intern(table, "foobar", 3, &foo_again));
+	test_assert_int_eq(table->count, 2);
+	test_assert(foo != bar);
+	test_assert_int_eq(foo, foo_again);
+	test_assert_str_eq(atomtable_string(table, foo), "foo");
+	test_assert_str_eq(atomtable_string(table, bar), "bar");
+	test_assert(atomtable_string(table, 2) == NULL);
+	atomtable_free(table);
+}
+
+void test_atomtable_lookup(void) {
+	struct atomtable_t *table = atomtable_new();
+	unsigned int atom, found;
+	test_assert_false(atomtable_lookup(table, "foo", 3, &found));
+	atomtable_intern(table, "foo", 3, &atom);
+	test_assert_true(atomtable_lookup(table, "foo", 3, &found));
+	test_assert_int_eq(found, atom);
+	test_assert_false(atomtable_lookup(table, "fo", 2, &found));
+	test_assert_false(atomtable_lookup(table, "", 0, &found));
+	atomtable_free(table);
+}
+
+void test_atomtable_rehash(void) {
+	struct atomtable_t *table = atomtable_new();
+	for (unsigned int i = 0; i < 1000; i++) {
+		char name[16];
+		snprintf(name, sizeof(name), "atom%u", i);
+		unsigned int atom;
+		test_assert_true(atomtable_intern(table, name, strlen(name), &atom));
+		test_assert_int_eq(atom, i);
+	}
+	test_assert_int_eq(table->count, 1000);
+	for (unsigned int i = 0; i < 1000; i++) {
+		char name[16];
+		snprintf(name, sizeof(name), "atom%u", i);
+		unsigned int atom;
+		test_assert_true(atomtable_lookup(table, name, strlen(name), &atom));
+		test_assert_int_eq(atom, i);
+	}
+	atomtable_free(table);
+}
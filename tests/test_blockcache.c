@@ -0,0 +1,100 @@
+/**
+ *	umsftpd - User-mode SFTP application.
+ *	Copyright (C) 2021-2021 Johannes Bauer
+ *
+ *	This file is part of umsftpd.
+ *
+ *	umsftpd is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; this program is ONLY licensed under
+ *	version 3 of the License, later versions are explicitly excluded.
+ *
+ *	umsftpd is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with umsftpd; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *	Johannes Bauer <JohannesBauer@gmx.de>
+**/
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "testbench.h"
+#include "blockcache.h"
+#include "test_blockcache.h"
+
+static const struct blockcache_file_t test_file = {
+	.dev = 1,
+	.ino = 1234,
+	.mtime_sec = 1600000000,
+	.size = BLOCKCACHE_BLOCK_SIZE + 10,
+};
+
+void test_blockcache_hit(void) {
+	struct blockcache_t *cache = blockcache_new(1024 * 1024, 1024 * 1024);
+	test_assert(cache);
+
+	char buffer[32];
+	test_assert_int_eq(blockcache_read(cache, &test_file, 1, 0, buffer, sizeof(buffer)), -1);
+	blockcache_insert(cache, &test_file, 1, "0123456789", 10);
+
+	test_assert_int_eq(blockcache_read(cache, &test_file, 1, 2, buffer, 4), 4);
+	test_assert_int_eq(memcmp(buffer, "2345", 4), 0);
+
+	/* Short read at the end of the file */
+	test_assert_int_eq(blockcache_read(cache, &test_file, 1, 8, buffer, sizeof(buffer)), 2);
+	test_assert_int_eq(blockcache_read(cache, &test_file, 1, 10, buffer, sizeof(buffer)), 0);
+	test_assert_int_eq(cache->stats->hits, 3);
+	test_assert_int_eq(cache->stats->misses, 1);
+
+	/* Different version of the file */
+	struct blockcache_file_t modified = test_file;
+	modified.mtime_nsec = 1;
+	test_assert_int_eq(blockcache_read(cache, &modified, 1, 0, buffer, sizeof(buffer)), -1);
+	blockcache_free(cache);
+}
+
+void test_blockcache_evict(void) {
+	/* A single set only */
+	struct blockcache_t *cache = blockcache_new(BLOCKCACHE_WAYS * BLOCKCACHE_BLOCK_SIZE * 3 / 2, 1024 * 1024);
+	test_assert(cache);
+	test_assert_int_eq(cache->set_count, 1);
+
+	char buffer[8];
+	for (unsigned int i = 0; i < BLOCKCACHE_WAYS; i++) {
+		blockcache_insert(cache, &test_file, i, "x", 1);
+	}
+	/* Reference block 0 so that the clock gives it a second chance */
+	test_assert_int_eq(blockcache_read(cache, &test_file, 0, 0, buffer, sizeof(buffer)), 1);
+	blockcache_insert(cache, &test_file, BLOCKCACHE_WAYS, "y", 1);
+	test_assert_int_eq(cache->stats->evictions, 1);
+	test_assert_int_eq(blockcache_read(cache, &test_file, 0, 0, buffer, sizeof(buffer)), 1);
+	test_assert_int_eq(blockcache_read(cache, &test_file, BLOCKCACHE_WAYS, 0, buffer, sizeof(buffer)), 1);
+	test_assert_int_eq(buffer[0], 'y');
+	blockcache_free(cache);
+}
+
+void test_blockcache_shared(void) {
+	struct blockcache_t *cache = blockcache_new(1024 * 1024, 1024 * 1024);
+	test_assert(cache);
+
+	pid_t pid = fork();
+	test_assert(pid != -1);
+	if (pid == 0) {
+		blockcache_insert(cache, &test_file, 0, "from child", 10);
+		_exit(0);
+	}
+	int status;
+	test_assert_int_eq(waitpid(pid, &status, 0), pid);
+
+	char buffer[16];
+	test_assert_int_eq(blockcache_read(cache, &test_file, 0, 0, buffer, sizeof(buffer)), 10);
+	test_assert_int_eq(memcmp(buffer, "from child", 10), 0);
+	blockcache_free(cache);
+}
@@ -0,0 +1,147 @@
+/**
+ *	umsftpd - User-mode SFTP application.
+ *	Copyright (C) 2021-2021 Johannes Bauer
+ *
+ *	This file is part of umsftpd.
+ *
+ *	umsftpd is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; this program is ONLY licensed under
+ *	version 3 of the License, later versions are explicitly excluded.
+ *
+ *	umsftpd is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with umsftpd; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *	Johannes Bauer <JohannesBauer@gmx.de>
+**/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "testbench.h"
+#include "changejournal.h"
+#include "test_changejournal.h"
+
+#define JOURNAL_FILENAME		"/tmp/umsftpd_test_changejournal"
+
+struct collected_t {
+	unsigned int count, limit;
+	char paths[16][64];
+	enum changejournal_kind_t kinds[16];
+};
+
+static bool collect(void *ctx, const struct changejournal_entry_t *entry) {
+	struct collected_t *collected = (struct collected_t*)ctx;
+	strcpy(collected->paths[collected->count], entry->path);
+	collected->kinds[collected->count] = entry->kind;
+	collected->count++;
+	return (collected->limit == 0) || (collected->count < collected->limit);
+}
+
+void test_changejournal_memory(void) {
+	struct changejournal_t *journal = changejournal_open(NULL, 4);
+	test_assert(journal);
+	test_assert_int_eq(changejournal_cursor(journal), 0);
+
+	/* Nothing recorded yet, cursor 0 is current */
+	struct collected_t collected = { 0 };
+	uint64_t cursor = 0;
+	test_assert_true(changejournal_since(journal, &cursor, "", 0, collect, &collected));
+	test_assert_int_eq(collected.count, 0);
+
+	test_assert_true(changejournal_record(journal, CHANGEJOURNAL_CREATE, "a/x", NULL));
+	test_assert_true(changejournal_record(journal, CHANGEJOURNAL_MODIFY, "b/y", NULL));
+	test_assert_true(changejournal_record(journal, CHANGEJOURNAL_RENAME, "c/z", "a/old"));
+	test_assert_true(changejournal_record(journal, CHANGEJOURNAL_MODIFY, "ab", NULL));
+	test_assert_int_eq(changejournal_cursor(journal), 4);
+
+	/* Renames match by either path, "ab" is not below "a" */
+	cursor = 0;
+	test_assert_true(changejournal_since(journal, &cursor, "a", 1, collect, &collected));
+	test_assert_int_eq(collected.count, 2);
+	test_assert_str_eq(collected.paths[0], "a/x");
+	test_assert_str_eq(collected.paths[1], "c/z");
+	test_assert_int_eq(collected.kinds[1], CHANGEJOURNAL_RENAME);
+	test_assert_int_eq(cursor, 4);
+
+	/* Paged */
+	collected = (struct collected_t) { .limit = 1 };
+	cursor = 1;
+	test_assert_true(changejournal_since(journal, &cursor, "", 0, collect, &collected));
+	test_assert_int_eq(collected.count, 1);
+	test_assert_str_eq(collected.paths[0], "b/y");
+	test_assert_int_eq(cursor, 2);
+
+	/* Change 1 drops out of the ring, a reader at 0 has missed it */
+	test_assert_true(changejournal_record(journal, CHANGEJOURNAL_REMOVE, "a/x", NULL));
+	collected = (struct collected_t) { 0 };
+	cursor = 0;
+	test_assert_false(changejournal_since(journal, &cursor, "", 0, collect, &collected));
+	test_assert_int_eq(collected.count, 0);
+	test_assert_int_eq(cursor, 5);
+	cursor = 1;
+	test_assert_true(changejournal_since(journal, &cursor, "", 0, collect, &collected));
+	test_assert_int_eq(collected.count, 4);
+
+	/* Cursor from the future */
+	cursor = 100;
+	test_assert_false(changejournal_since(journal, &cursor, "", 0, collect, &collected));
+	test_assert_int_eq(cursor, 5);
+	changejournal_free(journal);
+}
+
+void test_changejournal_persistent(void) {
+	unlink(JOURNAL_FILENAME);
+	struct changejournal_t *journal = changejournal_open(JOURNAL_FILENAME, 3);
+	test_assert(journal);
+	char path[32];
+	for (unsigned int i = 0; i < 10; i++) {
+		snprintf(path, sizeof(path), "file%u", i);
+		test_assert_true(changejournal_record(journal, CHANGEJOURNAL_CREATE, path, (i == 9) ? "old9" : NULL));
+	}
+	test_assert_true(journal->file_records <= 6);
+	changejournal_free(journal);
+
+	journal = changejournal_open(JOURNAL_FILENAME, 3);
+	test_assert(journal);
+	test_assert_int_eq(changejournal_cursor(journal), 10);
+	test_assert_int_eq(journal->count, 3);
+	struct collected_t collected = { 0 };
+	uint64_t cursor = 7;
+	test_assert_true(changejournal_since(journal, &cursor, "", 0, collect, &collected));
+	test_assert_int_eq(collected.count, 3);
+	test_assert_str_eq(collected.paths[0], "file7");
+	test_assert_str_eq(journal->entries[(journal->first + 2) % 3].old_path, "old9");
+	cursor = 6;
+	test_assert_false(changejournal_since(journal, &cursor, "", 0, collect, &collected));
+	test_assert_true(changejournal_record(journal, CHANGEJOURNAL_MODIFY, "file10", NULL));
+	changejournal_free(journal);
+
+	/* A torn record at the end is discarded */
+	FILE *f = fopen(JOURNAL_FILENAME, "a");
+	fwrite("\x0c\x00\x00", 3, 1, f);
+	fclose(f);
+	journal = changejournal_open(JOURNAL_FILENAME, 3);
+	test_assert(journal);
+	test_assert_int_eq(changejournal_cursor(journal), 11);
+	test_assert_true(changejournal_record(journal, CHANGEJOURNAL_MODIFY, "file11", NULL));
+	changejournal_free(journal);
+	journal = changejournal_open(JOURNAL_FILENAME, 3);
+	test_assert(journal);
+	test_assert_int_eq(changejournal_cursor(journal), 12);
+	test_assert_str_eq(journal->entries[(journal->first + 2) % 3].path, "file11");
+	changejournal_free(journal);
+
+	/* Not a journal */
+	f = fopen(JOURNAL_FILENAME, "w");
+	fputs("garbage", f);
+	fclose(f);
+	test_assert(!changejournal_open(JOURNAL_FILENAME, 3));
+	unlink(JOURNAL_FILENAME);
+}
@@ -0,0 +1,126 @@
+/**
+ *	umsftpd - User-mode SFTP application.
+ *	Copyright (C) 2021-2021 Johannes Bauer
+ *
+ *	This file is part of umsftpd.
+ *
+ *	umsftpd is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; this program is ONLY licensed under
+ *	version 3 of the License, later versions are explicitly excluded.
+ *
+ *	umsftpd is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with umsftpd; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *	Johannes Bauer <JohannesBauer@gmx.de>
+**/
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "testbench.h"
+#include "contentindex.h"
+#include "test_contentindex.h"
+
+#define INDEX_ROOT		"/tmp/umsftpd_test/index"
+#define INDEX_FILE		"/tmp/umsftpd_test/index.bin"
+
+static void create_file(const char *filename, const char *content) {
+	FILE *f = fopen(filename, "w");
+	test_assert(f);
+	fputs(content, f);
+	fclose(f);
+}
+
+static void create_tree(void) {
+	mkdir("/tmp/umsftpd_test", 0755);
+	mkdir(INDEX_ROOT, 0755);
+	mkdir(INDEX_ROOT "/sub", 0755);
+	mkdir(INDEX_ROOT "/sub/deeper", 0755);
+	create_file(INDEX_ROOT "/a", "1");
+	create_file(INDEX_ROOT "/z", "12");
+	create_file(INDEX_ROOT "/sub/b", "123");
+	create_file(INDEX_ROOT "/sub/deeper/c", "1234");
+	unlink(INDEX_ROOT "/link");
+	symlink("/etc", INDEX_ROOT "/link");
+}
+
+static void remove_tree(void) {
+	unlink(INDEX_ROOT "/link");
+	unlink(INDEX_ROOT "/sub/deeper/c");
+	unlink(INDEX_ROOT "/sub/b");
+	unlink(INDEX_ROOT "/z");
+	unlink(INDEX_ROOT "/a");
+	rmdir(INDEX_ROOT "/sub/deeper");
+	rmdir(INDEX_ROOT "/sub");
+	rmdir(INDEX_ROOT);
+	unlink(INDEX_FILE);
+}
+
+void test_contentindex_lookup(void) {
+	create_tree();
+	test_assert_true(contentindex_build(INDEX_ROOT, INDEX_FILE, false));
+	struct contentindex_t *index = contentindex_open(INDEX_FILE);
+	test_assert(index);
+	test_assert_int_eq(index->header->entry_count, 6);
+
+	const struct contentindex_entry_t *entry = contentindex_lookup(index, "", 0);
+	test_assert(entry);
+	test_assert_true(S_ISDIR(entry->mode));
+
+	entry = contentindex_lookup(index, "sub/deeper/c", 12);
+	test_assert(entry);
+	test_assert_true(S_ISREG(entry->mode));
+	test_assert_int_eq(entry->size, 4);
+
+	size_t name_length;
+	test_assert_str_eq(contentindex_entry_name(index, entry, &name_length), "c");
+	test_assert_int_eq(name_length, 1);
+
+	test_assert(contentindex_lookup(index, "sub/x", 5) == NULL);
+	test_assert(contentindex_lookup(index, "link", 4) == NULL);
+
+	contentindex_close(index);
+	remove_tree();
+}
+
+void test_contentindex_dir_range(void) {
+	create_tree();
+	test_assert_true(contentindex_build(INDEX_ROOT, INDEX_FILE, false));
+	struct contentindex_t *index = contentindex_open(INDEX_FILE);
+	test_assert(index);
+
+	unsigned int first, end;
+	test_assert_true(contentindex_dir_range(index, "", 0, &first, &end));
+	test_assert_int_eq(end - first, 3);
+	size_t name_length;
+	test_assert_str_eq(contentindex_entry_name(index, &index->entries[first], &name_length), "a");
+	test_assert_str_eq(contentindex_entry_name(index, &index->entries[first + 1], &name_length), "sub");
+	test_assert_str_eq(contentindex_entry_name(index, &index->entries[first + 2], &name_length), "z");
+
+	test_assert_true(contentindex_dir_range(index, "sub", 3, &first, &end));
+	test_assert_int_eq(end - first, 2);
+
+	test_assert_true(contentindex_dir_range(index, "sub/deeper", 10, &first, &end));
+	test_assert_int_eq(end - first, 1);
+
+	test_assert_false(contentindex_dir_range(index, "a", 1, &first, &end));
+	test_assert_false(contentindex_dir_range(index, "nonexistent", 11, &first, &end));
+
+	contentindex_close(index);
+	remove_tree();
+}
+
+void test_contentindex_corrupt(void) {
+	mkdir("/tmp/umsftpd_test", 0755);
+	create_file(INDEX_FILE, "UMSFTPIX but not really an index");
+	test_assert(contentindex_open(INDEX_FILE) == NULL);
+	unlink(INDEX_FILE);
+}
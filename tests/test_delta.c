@@ -0,0 +1,106 @@
+/**
+ *	umsftpd - User-mode SFTP application.
+ *	Copyright (C) 2021-2021 Johannes Bauer
+ *
+ *	This file is part of umsftpd.
+ *
+ *	umsftpd is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; this program is ONLY licensed under
+ *	version 3 of the License, later versions are explicitly excluded.
+ *
+ *	umsftpd is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with umsftpd; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *	Johannes Bauer <JohannesBauer@gmx.de>
+**/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "testbench.h"
+#include "delta.h"
+#include "test_delta.h"
+
+struct signature_collector_t {
+	unsigned int count;
+	uint64_t block_index[8];
+	uint32_t weak[8];
+	uint8_t strong[8][4];
+	unsigned int strong_length;
+};
+
+static void collect_signature(void *ctx, uint64_t block_index, uint32_t weak, const uint8_t *strong, unsigned int strong_length) {
+	struct signature_collector_t *collector = (struct signature_collector_t*)ctx;
+	if (collector->count < 8) {
+		collector->block_index[collector->count] = block_index;
+		collector->weak[collector->count] = weak;
+		memcpy(collector->strong[collector->count], strong, strong_length < 4 ? strong_length : 4);
+	}
+	collector->strong_length = strong_length;
+	collector->count++;
+}
+
+void test_delta_rolling(void) {
+	uint8_t data[4096];
+	for (unsigned int i = 0; i < sizeof(data); i++) {
+		data[i] = (i * 7919) ^ (i >> 3);
+	}
+
+	/* Rolling over the data must agree with computing each window afresh */
+	const unsigned int window = 700;
+	struct delta_rolling_t rolling;
+	delta_rolling_init(&rolling);
+	delta_rolling_update(&rolling, data, window);
+	for (unsigned int i = 0; i + window < sizeof(data); i++) {
+		test_assert_int_eq(delta_rolling_digest(&rolling), delta_weak_checksum(data + i, window));
+		delta_rolling_roll(&rolling, data[i], data[i + window]);
+	}
+
+	/* rsync's checksum of "abc": a = 0x126, b = 0x61 * 3 + 0x62 * 2 + 0x63 */
+	test_assert_int_eq(delta_weak_checksum("abc", 3), 0x24a0126);
+}
+
+void test_delta_signer(void) {
+	uint8_t data[1500];
+	memset(data, 0xaa, sizeof(data));
+
+	struct signature_collector_t collector = { 0 };
+	struct delta_signer_t *signer = delta_signer_new(512, FILEHASH_MD5, 4, collect_signature, &collector);
+	test_assert(signer);
+
+	/* Blocks span multiple updates */
+	test_assert_true(delta_signer_update(signer, data, 100));
+	test_assert_true(delta_signer_update(signer, data + 100, 1000));
+	test_assert_int_eq(collector.count, 2);
+	test_assert_true(delta_signer_update(signer, data + 1100, 400));
+	test_assert_true(delta_signer_finish(signer));
+	delta_signer_free(signer);
+
+	test_assert_int_eq(collector.count, 3);
+	test_assert_int_eq(collector.strong_length, 4);
+	test_assert_int_eq(collector.block_index[2], 2);
+	test_assert_int_eq(collector.weak[0], delta_weak_checksum(data, 512));
+	test_assert_int_eq(collector.weak[1], collector.weak[0]);
+	test_assert(!memcmp(collector.strong[0], collector.strong[1], 4));
+	test_assert_int_eq(collector.weak[2], delta_weak_checksum(data, 476));
+	test_assert(memcmp(collector.strong[0], collector.strong[2], 4));
+}
+
+void test_delta_signer_limits(void) {
+	struct signature_collector_t collector = { 0 };
+	test_assert(!delta_signer_new(DELTA_MIN_BLOCK_SIZE - 1, FILEHASH_MD5, 0, collect_signature, &collector));
+	test_assert(!delta_signer_new(DELTA_MAX_BLOCK_SIZE + 1, FILEHASH_MD5, 0, collect_signature, &collector));
+
+	/* An empty file has no blocks; strong length is capped to the digest */
+	struct delta_signer_t *signer = delta_signer_new(DELTA_MIN_BLOCK_SIZE, FILEHASH_SHA1, 100, collect_signature, &collector);
+	test_assert_int_eq(signer->strong_length, 20);
+	test_assert_true(delta_signer_finish(signer));
+	test_assert_int_eq(collector.count, 0);
+	delta_signer_free(signer);
+}
@@ -0,0 +1,147 @@
+/**
+ *	umsftpd - User-mode SFTP application.
+ *	Copyright (C) 2021-2021 Johannes Bauer
+ *
+ *	This file is part of umsftpd.
+ *
+ *	umsftpd is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; this program is ONLY licensed under
+ *	version 3 of the License, later versions are explicitly excluded.
+ *
+ *	umsftpd is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with umsftpd; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *	Johannes Bauer <JohannesBauer@gmx.de>
+**/
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "testbench.h"
+#include "dircache.h"
+#include "test_dircache.h"
+
+static struct dircache_listing_t *fill_listing(struct dircache_t *cache, const char *path, unsigned int entry_count) {
+	struct dircache_listing_t *listing = dircache_prepare(cache, path);
+	test_assert(listing);
+	for (unsigned int i = 0; i < entry_count; i++) {
+		struct vfs_dirent_t dirent = { 0 };
+		snprintf(dirent.filename, sizeof(dirent.filename), "entry%u", i);
+		test_assert_true(dircache_listing_append(cache, listing, &dirent));
+	}
+	return listing;
+}
+
+void test_dircache_hit(void) {
+	mkdir("/tmp/umsftpd_test", 0755);
+	struct dircache_t *cache = dircache_new(1024 * 1024);
+	test_assert(cache);
+
+	test_assert(dircache_get(cache, "/tmp/umsftpd_test") == NULL);
+	struct dircache_listing_t *listing = fill_listing(cache, "/tmp/umsftpd_test", 3);
+	test_assert_true(dircache_commit(cache, listing));
+	dircache_release(cache, listing);
+
+	listing = dircache_get(cache, "/tmp/umsftpd_test");
+	test_assert(listing);
+	test_assert_int_eq(listing->count, 3);
+	test_assert_str_eq(listing->entries[2].filename, "entry2");
+	dircache_release(cache, listing);
+
+	test_assert_int_eq(cache->stats.hits, 1);
+	test_assert_int_eq(cache->stats.misses, 1);
+	dircache_free(cache);
+}
+
+void test_dircache_invalidate(void) {
+	mkdir("/tmp/umsftpd_test", 0755);
+	unlink("/tmp/umsftpd_test/dircache");
+	struct dircache_t *cache = dircache_new(1024 * 1024);
+
+	struct dircache_listing_t *listing = fill_listing(cache, "/tmp/umsftpd_test", 1);
+	test_assert_true(dircache_commit(cache, listing));
+
+	/* Still referenced while the directory changes */
+	FILE *f = fopen("/tmp/umsftpd_test/dircache", "w");
+	test_assert(f);
+	fclose(f);
+	test_assert(dircache_get(cache, "/tmp/umsftpd_test") == NULL);
+	test_assert_int_eq(cache->stats.invalidations, 1);
+	test_assert_int_eq(listing->count, 1);
+	dircache_release(cache, listing);
+
+	/* Modification while filling prevents commit */
+	listing = fill_listing(cache, "/tmp/umsftpd_test", 1);
+	unlink("/tmp/umsftpd_test/dircache");
+	test_assert_false(dircache_commit(cache, listing));
+	dircache_release(cache, listing);
+	test_assert_int_eq(cache->used_memory, 0);
+
+	dircache_free(cache);
+}
+
+void test_dircache_evict(void) {
+	mkdir("/tmp/umsftpd_test", 0755);
+	mkdir("/tmp/umsftpd_test/a", 0755);
+	mkdir("/tmp/umsftpd_test/b", 0755);
+
+	/* Room for roughly one listing */
+	struct dircache_t *cache = dircache_new(16 * sizeof(struct vfs_dirent_t) + 512);
+
+	struct dircache_listing_t *listing = fill_listing(cache, "/tmp/umsftpd_test/a", 4);
+	test_assert_true(dircache_commit(cache, listing));
+	dircache_release(cache, listing);
+
+	listing = fill_listing(cache, "/tmp/umsftpd_test/b", 4);
+	test_assert_true(dircache_commit(cache, listing));
+	dircache_release(cache, listing);
+
+	test_assert_int_eq(cache->stats.evictions, 1);
+	test_assert(dircache_get(cache, "/tmp/umsftpd_test/a") == NULL);
+	listing = dircache_get(cache, "/tmp/umsftpd_test/b");
+	test_assert(listing);
+	dircache_release(cache, listing);
+
+	/* Listing that can never fit */
+	listing = dircache_prepare(cache, "/tmp/umsftpd_test/a");
+	bool fits = true;
+	for (unsigned int i = 0; (i < 100) && fits; i++) {
+		struct vfs_dirent_t dirent = { 0 };
+		fits = dircache_listing_append(cache, listing, &dirent);
+	}
+	test_assert_false(fits);
+	dircache_release(cache, listing);
+
+	dircache_free(cache);
+	rmdir("/tmp/umsftpd_test/a");
+	rmdir("/tmp/umsftpd_test/b");
+}
+
+void test_dircache_duplicate(void) {
+	mkdir("/tmp/umsftpd_test", 0755);
+	struct dircache_t *cache = dircache_new(1024 * 1024);
+
+	/* Two handles list the same directory concurrently */
+	struct dircache_listing_t *first = fill_listing(cache, "/tmp/umsftpd_test", 2);
+	struct dircache_listing_t *second = fill_listing(cache, "/tmp/umsftpd_test", 3);
+	test_assert_true(dircache_commit(cache, first));
+	size_t used_memory = cache->used_memory;
+	test_assert_false(dircache_commit(cache, second));
+	test_assert_int_eq(cache->used_memory, used_memory);
+	dircache_release(cache, second);
+	dircache_release(cache, first);
+
+	struct dircache_listing_t *listing = dircache_get(cache, "/tmp/umsftpd_test");
+	test_assert(listing == first);
+	test_assert_int_eq(listing->count, 2);
+	dircache_release(cache, listing);
+	dircache_free(cache);
+}
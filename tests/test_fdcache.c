@@ -0,0 +1,144 @@
+/**
+ *	umsftpd - User-mode SFTP application.
+ *	Copyright (C) 2021-2021 Johannes Bauer
+ *
+ *	This file is part of umsftpd.
+ *
+ *	umsftpd is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; this program is ONLY licensed under
+ *	version 3 of the License, later versions are explicitly excluded.
+ *
+ *	umsftpd is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with umsftpd; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *	Johannes Bauer <JohannesBauer@gmx.de>
+**/
+
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "testbench.h"
+#include "fdcache.h"
+#include "test_fdcache.h"
+
+static void create_file(const char *filename, const char *content, struct stat *statbuf) {
+	mkdir("/tmp/umsftpd_test", 0755);
+	FILE *f = fopen(filename, "w");
+	test_assert(f);
+	fputs(content, f);
+	fclose(f);
+	test_assert_int_eq(stat(filename, statbuf), 0);
+}
+
+void test_fdcache_shared(void) {
+	struct stat statbuf;
+	create_file("/tmp/umsftpd_test/fdcache_a", "shared", &statbuf);
+	struct fdcache_t *cache = fdcache_new(4);
+	test_assert(cache);
+
+	struct fdcache_entry_t *entry1 = fdcache_open(cache, "/tmp/umsftpd_test/fdcache_a", &statbuf);
+	test_assert(entry1);
+	struct fdcache_entry_t *entry2 = fdcache_open(cache, "/tmp/umsftpd_test/fdcache_a", &statbuf);
+	test_assert(entry1 == entry2);
+	test_assert_int_eq(entry1->refcount, 2);
+	test_assert_int_eq(cache->stats.hits, 1);
+	test_assert_int_eq(cache->stats.misses, 1);
+
+	char buffer[16];
+	test_assert_int_eq(pread(entry1->fd, buffer, sizeof(buffer), 2), 4);
+	test_assert_int_eq(memcmp(buffer, "ared", 4), 0);
+
+	fdcache_release(cache, entry1);
+	fdcache_release(cache, entry2);
+	test_assert_int_eq(cache->entry_count, 1);
+
+	test_assert(fdcache_open(cache, "/tmp/umsftpd_test/nonexistent", &statbuf) == NULL);
+	fdcache_free(cache);
+	unlink("/tmp/umsftpd_test/fdcache_a");
+}
+
+void test_fdcache_stale(void) {
+	struct stat statbuf;
+	create_file("/tmp/umsftpd_test/fdcache_a", "old", &statbuf);
+	struct fdcache_t *cache = fdcache_new(4);
+
+	struct fdcache_entry_t *old_entry = fdcache_open(cache, "/tmp/umsftpd_test/fdcache_a", &statbuf);
+	test_assert(old_entry);
+
+	/* Replaced by a different file while still in use */
+	unlink("/tmp/umsftpd_test/fdcache_a");
+	create_file("/tmp/umsftpd_test/fdcache_a", "new contents", &statbuf);
+	struct fdcache_entry_t *new_entry = fdcache_open(cache, "/tmp/umsftpd_test/fdcache_a", &statbuf);
+	test_assert(new_entry);
+	test_assert(new_entry != old_entry);
+	test_assert_int_eq(cache->stats.stale, 1);
+	test_assert_false(old_entry->cached);
+
+	char buffer[16];
+	test_assert_int_eq(pread(old_entry->fd, buffer, sizeof(buffer), 0), 3);
+	fdcache_release(cache, old_entry);
+	fdcache_release(cache, new_entry);
+	test_assert_int_eq(cache->entry_count, 1);
+
+	fdcache_free(cache);
+	unlink("/tmp/umsftpd_test/fdcache_a");
+}
+
+void test_fdcache_evict(void) {
+	struct stat statbuf_a, statbuf_b, statbuf_c;
+	create_file("/tmp/umsftpd_test/fdcache_a", "a", &statbuf_a);
+	create_file("/tmp/umsftpd_test/fdcache_b", "b", &statbuf_b);
+	create_file("/tmp/umsftpd_test/fdcache_c", "c", &statbuf_c);
+	struct fdcache_t *cache = fdcache_new(2);
+
+	fdcache_release(cache, fdcache_open(cache, "/tmp/umsftpd_test/fdcache_a", &statbuf_a));
+	fdcache_release(cache, fdcache_open(cache, "/tmp/umsftpd_test/fdcache_b", &statbuf_b));
+	fdcache_release(cache, fdcache_open(cache, "/tmp/umsftpd_test/fdcache_a", &statbuf_a));
+	fdcache_release(cache, fdcache_open(cache, "/tmp/umsftpd_test/fdcache_c", &statbuf_c));
+	test_assert_int_eq(cache->entry_count, 2);
+	test_assert_int_eq(cache->stats.evictions, 1);
+
+	/* b was least recently used */
+	fdcache_release(cache, fdcache_open(cache, "/tmp/umsftpd_test/fdcache_a", &statbuf_a));
+	test_assert_int_eq(cache->stats.hits, 2);
+	fdcache_release(cache, fdcache_open(cache, "/tmp/umsftpd_test/fdcache_b", &statbuf_b));
+	test_assert_int_eq(cache->stats.hits, 2);
+
+	fdcache_free(cache);
+	unlink("/tmp/umsftpd_test/fdcache_a");
+	unlink("/tmp/umsftpd_test/fdcache_b");
+	unlink("/tmp/umsftpd_test/fdcache_c");
+}
+
+void test_fdcache_identity(void) {
+	struct stat statbuf;
+	create_file("/tmp/umsftpd_test/fdcache_a", "checked", &statbuf);
+	struct fdcache_t *cache = fdcache_new(4);
+
+	/* Replaced between the caller's check and opening the descriptor */
+	struct stat checked = statbuf;
+	create_file("/tmp/umsftpd_test/fdcache_a", "replaced file", &statbuf);
+	errno = 0;
+	test_assert(fdcache_open(cache, "/tmp/umsftpd_test/fdcache_a", &checked) == NULL);
+	test_assert_int_eq(errno, ESTALE);
+	test_assert_int_eq(cache->entry_count, 0);
+	test_assert_int_eq(cache->stats.stale, 1);
+
+	/* Handles may outlive the cache */
+	struct fdcache_entry_t *entry = fdcache_open(cache, "/tmp/umsftpd_test/fdcache_a", &statbuf);
+	test_assert(entry);
+	fdcache_free(cache);
+	char buffer[16];
+	test_assert_int_eq(pread(entry->fd, buffer, sizeof(buffer), 0), 13);
+	fdcache_release(NULL, entry);
+	unlink("/tmp/umsftpd_test/fdcache_a");
+}
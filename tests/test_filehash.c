@@ -0,0 +1,103 @@
+/**
+ *	umsftpd - User-mode SFTP application.
+ *	Copyright (C) 2021-2021 Johannes Bauer
+ *
+ *	This file is part of umsftpd.
+ *
+ *	umsftpd is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; this program is ONLY licensed under
+ *	version 3 of the License, later versions are explicitly excluded.
+ *
+ *	umsftpd is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with umsftpd; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *	Johannes Bauer <JohannesBauer@gmx.de>
+**/
+
+#include <stdio.h>
+#include <string.h>
+#include "testbench.h"
+#include "filehash.h"
+#include "test_filehash.h"
+
+static void digest_hex(const uint8_t *digest, unsigned int length, char *hex) {
+	for (unsigned int i = 0; i < length; i++) {
+		sprintf(hex + (2 * i), "%02x", digest[i]);
+	}
+}
+
+void test_filehash_names(void) {
+	enum filehash_algorithm_t algorithm;
+	test_assert_true(filehash_algorithm_from_name("sha256", &algorithm));
+	test_assert_int_eq(algorithm, FILEHASH_SHA256);
+	test_assert_str_eq(filehash_algorithm_name(algorithm), "sha256");
+	test_assert_true(filehash_algorithm_from_name("md5", &algorithm));
+	test_assert_int_eq(algorithm, FILEHASH_MD5);
+	test_assert_false(filehash_algorithm_from_name("crc32", &algorithm));
+}
+
+void test_filehash_single(void) {
+	struct filehash_t *hash = filehash_new(FILEHASH_SHA256, 0);
+	test_assert(hash);
+	test_assert_true(filehash_update(hash, "a", 1));
+	test_assert_true(filehash_update(hash, "bc", 2));
+	test_assert_true(filehash_finish(hash));
+	test_assert_int_eq(hash->digest_count, 1);
+
+	char hex[65];
+	digest_hex(hash->digests, hash->digest_length, hex);
+	test_assert_str_eq(hex, "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+	filehash_free(hash);
+}
+
+void test_filehash_empty(void) {
+	struct filehash_t *hash = filehash_new(FILEHASH_MD5, 256);
+	test_assert_true(filehash_finish(hash));
+	test_assert_int_eq(hash->digest_count, 1);
+
+	char hex[33];
+	digest_hex(hash->digests, hash->digest_length, hex);
+	test_assert_str_eq(hex, "d41d8cd98f00b204e9800998ecf8427e");
+	filehash_free(hash);
+}
+
+void test_filehash_blocks(void) {
+	/* "abc" in blocks of one byte each */
+	struct filehash_t *hash = filehash_new(FILEHASH_SHA1, 1);
+	test_assert_true(filehash_update(hash, "abc", 3));
+	test_assert_true(filehash_finish(hash));
+	test_assert_int_eq(hash->digest_count, 3);
+
+	char hex[41];
+	digest_hex(hash->digests, hash->digest_length, hex);
+	test_assert_str_eq(hex, "86f7e437faa5a7fce15d1ddcb9eaeaea377667b8");
+	digest_hex(hash->digests + (2 * hash->digest_length), hash->digest_length, hex);
+	test_assert_str_eq(hex, "84a516841ba77a5b4648de2cd0dfcb30ea46dbb4");
+	filehash_free(hash);
+}
+
+void test_filehash_set_digest(void) {
+	uint8_t digest[64];
+	memset(digest, 0x5a, sizeof(digest));
+
+	struct filehash_t *hash = filehash_new(FILEHASH_BLAKE2B512, 0);
+	test_assert(hash);
+	test_assert_int_eq(hash->digest_length, 64);
+	test_assert_true(filehash_set_digest(hash, digest));
+	test_assert_int_eq(hash->digest_count, 1);
+	test_assert_int_eq(hash->digests[63], 0x5a);
+	test_assert_false(filehash_set_digest(hash, digest));
+	filehash_free(hash);
+
+	/* Blockwise digests cannot be given as a single value */
+	hash = filehash_new(FILEHASH_SHA1, 4);
+	test_assert_false(filehash_set_digest(hash, digest));
+	filehash_free(hash);
+}
@@ -0,0 +1,120 @@
+/**
+ *	umsftpd - User-mode SFTP application.
+ *	Copyright (C) 2021-2021 Johannes Bauer
+ *
+ *	This file is part of umsftpd.
+ *
+ *	umsftpd is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; this program is ONLY licensed under
+ *	version 3 of the License, later versions are explicitly excluded.
+ *
+ *	umsftpd is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with umsftpd; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *	Johannes Bauer <JohannesBauer@gmx.de>
+**/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fnmatch.h>
+#include "testbench.h"
+#include "globfilter.h"
+#include "test_globfilter.h"
+
+static bool match(const char *pattern, const char *name, enum globfilter_kind_t expected_kind) {
+	struct globfilter_t *filter = globfilter_new(pattern);
+	test_assert(filter);
+	test_assert_int_eq(filter->kind, expected_kind);
+	bool result = globfilter_match(filter, name);
+	globfilter_free(filter);
+	return result;
+}
+
+void test_globfilter_fast_paths(void) {
+	test_assert_true(match("*", "anything", GLOBFILTER_MATCH_ALL));
+	test_assert_true(match("**", ".hidden", GLOBFILTER_MATCH_ALL));
+
+	test_assert_true(match("report.txt", "report.txt", GLOBFILTER_LITERAL));
+	test_assert_false(match("report.txt", "report.txt2", GLOBFILTER_LITERAL));
+	test_assert_false(match("", "x", GLOBFILTER_LITERAL));
+
+	test_assert_true(match("upload_*", "upload_123", GLOBFILTER_PREFIX));
+	test_assert_true(match("upload_*", "upload_", GLOBFILTER_PREFIX));
+	test_assert_false(match("upload_*", "upload", GLOBFILTER_PREFIX));
+
+	test_assert_true(match("*.done", "batch7.done", GLOBFILTER_SUFFIX));
+	test_assert_true(match("*.done", ".done", GLOBFILTER_SUFFIX));
+	test_assert_false(match("*.done", "batch7.done.tmp", GLOBFILTER_SUFFIX));
+	test_assert_false(match("*.done", "done", GLOBFILTER_SUFFIX));
+
+	test_assert_true(match("*part*", "a.part.3", GLOBFILTER_SUBSTRING));
+	test_assert_true(match("*part*", "part", GLOBFILTER_SUBSTRING));
+	test_assert_false(match("*part*", "pa.rt", GLOBFILTER_SUBSTRING));
+}
+
+void test_globfilter_fnmatch(void) {
+	test_assert_true(match("file?.txt", "file1.txt", GLOBFILTER_FNMATCH));
+	test_assert_false(match("file?.txt", "file12.txt", GLOBFILTER_FNMATCH));
+	test_assert_true(match("[ab]*.log", "b_server.log", GLOBFILTER_FNMATCH));
+	test_assert_false(match("[ab]*.log", "c_server.log", GLOBFILTER_FNMATCH));
+	test_assert_true(match("a*b*c", "aXXbYYc", GLOBFILTER_FNMATCH));
+	test_assert_true(match("literal\\*", "literal*", GLOBFILTER_FNMATCH));
+	test_assert_false(match("literal\\*", "literal_", GLOBFILTER_FNMATCH));
+}
+
+void test_globset_matches_fnmatch(void) {
+	const char *patterns[] = { "*.done", "upload_*", "file?.txt", "[ab]*.log", "*.t[!a-m]p", "a*b*c", "literal\\*", "x[", "", "*" };
+	const char *names[] = { "batch.done", ".done", "done", "upload_", "upload", "file1.txt", "file12.txt", "b_server.log", "c_server.log", "x.tzp", "x.tap", "aXbYc", "abc", "acb", "literal*", "literal_", "x[", "x", "", "a.done.b" };
+	const unsigned int pattern_count = sizeof(patterns) / sizeof(patterns[0]);
+	const unsigned int name_count = sizeof(names) / sizeof(names[0]);
+
+	/* All patterns at once, each with its own label */
+	uint32_t labels[pattern_count];
+	for (unsigned int i = 0; i < pattern_count; i++) {
+		labels[i] = 1 << i;
+	}
+	struct globset_t *set = globset_compile(patterns, labels, pattern_count);
+	test_assert(set);
+	test_assert_int_eq(set->all_labels, (1 << pattern_count) - 1);
+	for (unsigned int j = 0; j < name_count; j++) {
+		uint32_t expected = 0;
+		for (unsigned int i = 0; i < pattern_count; i++) {
+			if (fnmatch(patterns[i], names[j], 0) == 0) {
+				expected |= labels[i];
+			}
+		}
+		test_assert_int_eq(globset_match(set, names[j], strlen(names[j])), expected);
+	}
+	globset_free(set);
+}
+
+void test_globset_shared_labels(void) {
+	const char *patterns[] = { "*.tmp", "*.part", "*.txt" };
+	const uint32_t labels[] = { 2, 2, 1 };
+	struct globset_t *set = globset_compile(patterns, labels, 3);
+	test_assert(set);
+	test_assert_int_eq(globset_match(set, "x.tmp", 5), 2);
+	test_assert_int_eq(globset_match(set, "x.part", 6), 2);
+	test_assert_int_eq(globset_match(set, "x.txt", 5), 1);
+	test_assert_int_eq(globset_match(set, "x.tmp.txt", 9), 1);
+	test_assert_int_eq(globset_match(set, "x.tmp.txt", 5), 2);
+	test_assert_int_eq(globset_match(set, "x.doc", 5), 0);
+	globset_free(set);
+
+	/* Unsupported character classes, and labels must be set */
+	const char *classes[] = { "[[:alpha:]]*" };
+	test_assert(!globset_compile(classes, labels, 1));
+	const uint32_t no_label[] = { 0 };
+	test_assert(!globset_compile(patterns, no_label, 1));
+
+	/* Too many states */
+	const char *explosive[] = { "*a?????????????" };
+	test_assert(!globset_compile(explosive, labels, 1));
+}
@@ -0,0 +1,246 @@
+/**
+ *	umsftpd - User-mode SFTP application.
+ *	Copyright (C) 2021-2021 Johannes Bauer
+ *
+ *	This file is part of umsftpd.
+ *
+ *	umsftpd is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; this program is ONLY licensed under
+ *	version 3 of the License, later versions are explicitly excluded.
+ *
+ *	umsftpd is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with umsftpd; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *	Johannes Bauer <JohannesBauer@gmx.de>
+**/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "testbench.h"
+#include "memfs.h"
+#include "test_memfs.h"
+
+static void *open_file(struct memfs_t *memfs, const char *path, int flags) {
+	const struct vfs_backend_t *backend = memfs_backend(memfs);
+	return backend->ops->open(backend->ctx, path, flags, 0666);
+}
+
+static ssize_t write_at(struct memfs_t *memfs, void *file, const char *data, uint64_t offset) {
+	const struct vfs_backend_t *backend = memfs_backend(memfs);
+	return backend->ops->pwrite(backend->ctx, file, data, strlen(data), offset);
+}
+
+static ssize_t read_at(struct memfs_t *memfs, void *file, char *buffer, size_t length, uint64_t offset) {
+	const struct vfs_backend_t *backend = memfs_backend(memfs);
+	ssize_t result = backend->ops->pread(backend->ctx, file, buffer, length, offset);
+	if (result >= 0) {
+		buffer[result] = 0;
+	}
+	return result;
+}
+
+static void close_file(struct memfs_t *memfs, void *file) {
+	const struct vfs_backend_t *backend = memfs_backend(memfs);
+	test_assert_int_eq(backend->ops->close(backend->ctx, file), 0);
+}
+
+static int stat_path(struct memfs_t *memfs, const char *path, struct stat *statbuf) {
+	const struct vfs_backend_t *backend = memfs_backend(memfs);
+	return backend->ops->stat(backend->ctx, path, statbuf);
+}
+
+void test_memfs_files(void) {
+	struct memfs_t *memfs = memfs_new(1024 * 1024);
+	test_assert(memfs);
+
+	struct stat statbuf;
+	test_assert_int_eq(stat_path(memfs, "/", &statbuf), 0);
+	test_assert_true(S_ISDIR(statbuf.st_mode));
+	test_assert_int_eq(stat_path(memfs, "/file", &statbuf), -1);
+	test_assert_int_eq(errno, ENOENT);
+	test_assert(!open_file(memfs, "/file", O_RDONLY));
+	test_assert_int_eq(errno, ENOENT);
+
+	void *file = open_file(memfs, "/file", O_WRONLY | O_CREAT | O_TRUNC);
+	test_assert(file);
+	test_assert_int_eq(write_at(memfs, file, "hello", 0), 5);
+	test_assert_int_eq(write_at(memfs, file, " world", 5), 6);
+	char buffer[64];
+	test_assert_int_eq(read_at(memfs, file, buffer, sizeof(buffer) - 1, 0), -1);
+	test_assert_int_eq(errno, EBADF);
+	close_file(memfs, file);
+
+	/* Empty components as in the mapped path of a mount at "/" */
+	test_assert_int_eq(stat_path(memfs, "//file", &statbuf), 0);
+	test_assert_true(S_ISREG(statbuf.st_mode));
+	test_assert_int_eq(statbuf.st_size, 11);
+	test_assert_int_eq(statbuf.st_mode & 0777, 0644);
+	test_assert(!open_file(memfs, "/file/sub", O_RDONLY));
+	test_assert_int_eq(errno, ENOTDIR);
+	test_assert(!open_file(memfs, "/file", O_WRONLY | O_CREAT | O_EXCL));
+	test_assert_int_eq(errno, EEXIST);
+	test_assert(!open_file(memfs, "/", O_RDONLY));
+	test_assert_int_eq(errno, EISDIR);
+
+	file = open_file(memfs, "/file", O_RDONLY);
+	test_assert_int_eq(read_at(memfs, file, buffer, sizeof(buffer) - 1, 0), 11);
+	test_assert_str_eq(buffer, "hello world");
+	test_assert_int_eq(read_at(memfs, file, buffer, 3, 6), 3);
+	test_assert_str_eq(buffer, "wor");
+	test_assert_int_eq(read_at(memfs, file, buffer, sizeof(buffer) - 1, 11), 0);
+	test_assert_int_eq(write_at(memfs, file, "x", 0), -1);
+	test_assert_int_eq(errno, EBADF);
+	close_file(memfs, file);
+
+	/* Appending ignores the offset */
+	file = open_file(memfs, "/file", O_WRONLY | O_CREAT | O_APPEND);
+	test_assert_int_eq(write_at(memfs, file, "!", 0), 1);
+	close_file(memfs, file);
+	file = open_file(memfs, "/file", O_RDONLY);
+	test_assert_int_eq(read_at(memfs, file, buffer, sizeof(buffer) - 1, 0), 12);
+	test_assert_str_eq(buffer, "hello world!");
+	close_file(memfs, file);
+
+	file = open_file(memfs, "/file", O_WRONLY | O_CREAT | O_TRUNC);
+	close_file(memfs, file);
+	test_assert_int_eq(stat_path(memfs, "/file", &statbuf), 0);
+	test_assert_int_eq(statbuf.st_size, 0);
+	test_assert_int_eq(memfs_used_bytes(memfs), 0);
+	memfs_free(memfs);
+}
+
+void test_memfs_sparse_and_limit(void) {
+	struct memfs_t *memfs = memfs_new(4 * MEMFS_CHUNK_SIZE);
+	void *file = open_file(memfs, "/sparse", O_WRONLY | O_CREAT | O_TRUNC);
+	test_assert_int_eq(write_at(memfs, file, "end", 3 * MEMFS_CHUNK_SIZE), 3);
+	close_file(memfs, file);
+	test_assert_int_eq(memfs_used_bytes(memfs), MEMFS_CHUNK_SIZE);
+
+	struct stat statbuf;
+	test_assert_int_eq(stat_path(memfs, "/sparse", &statbuf), 0);
+	test_assert_int_eq(statbuf.st_size, (3 * MEMFS_CHUNK_SIZE) + 3);
+	test_assert_int_eq(statbuf.st_blocks, MEMFS_CHUNK_SIZE / 512);
+
+	char buffer[16];
+	file = open_file(memfs, "/sparse", O_RDONLY);
+	test_assert_int_eq(read_at(memfs, file, buffer, 4, MEMFS_CHUNK_SIZE), 4);
+	test_assert_int_eq(memcmp(buffer, "\0\0\0\0", 4), 0);
+	test_assert_int_eq(read_at(memfs, file, buffer, 5, (3 * MEMFS_CHUNK_SIZE) - 2), 5);
+	test_assert_int_eq(memcmp(buffer, "\0\0end", 5), 0);
+	close_file(memfs, file);
+
+	/* Three chunks left; the fourth write only partially fits */
+	uint8_t *data = calloc(1, 4 * MEMFS_CHUNK_SIZE);
+	const struct vfs_backend_t *backend = memfs_backend(memfs);
+	file = open_file(memfs, "/large", O_WRONLY | O_CREAT | O_TRUNC);
+	test_assert_int_eq(backend->ops->pwrite(backend->ctx, file, data, 4 * MEMFS_CHUNK_SIZE, 0), 3 * MEMFS_CHUNK_SIZE);
+	test_assert_int_eq(backend->ops->pwrite(backend->ctx, file, data, MEMFS_CHUNK_SIZE, 3 * MEMFS_CHUNK_SIZE), -1);
+	test_assert_int_eq(errno, ENOSPC);
+	test_assert_int_eq(backend->ops->pwrite(backend->ctx, file, data, 1, 4 * MEMFS_CHUNK_SIZE), -1);
+	test_assert_int_eq(errno, EFBIG);
+	close_file(memfs, file);
+	free(data);
+	test_assert_int_eq(memfs_used_bytes(memfs), 4 * MEMFS_CHUNK_SIZE);
+
+	test_assert_int_eq(backend->ops->unlink(backend->ctx, "/large"), 0);
+	test_assert_int_eq(memfs_used_bytes(memfs), MEMFS_CHUNK_SIZE);
+	memfs_free(memfs);
+}
+
+static unsigned int count_entries(struct memfs_t *memfs, const char *path) {
+	const struct vfs_backend_t *backend = memfs_backend(memfs);
+	void *dir = backend->ops->opendir(backend->ctx, path);
+	test_assert(dir);
+	unsigned int count = 0;
+	char name[256];
+	struct stat statbuf;
+	while (backend->ops->readdir(backend->ctx, dir, name, sizeof(name), &statbuf) == 1) {
+		count++;
+	}
+	backend->ops->closedir(backend->ctx, dir);
+	return count;
+}
+
+void test_memfs_directories(void) {
+	struct memfs_t *memfs = memfs_new(1024 * 1024);
+	const struct vfs_backend_t *backend = memfs_backend(memfs);
+	test_assert_int_eq(backend->ops->mkdir(backend->ctx, "/a", 0755), 0);
+	test_assert_int_eq(backend->ops->mkdir(backend->ctx, "/a/b", 0755), 0);
+	test_assert_int_eq(backend->ops->mkdir(backend->ctx, "/a", 0755), -1);
+	test_assert_int_eq(errno, EEXIST);
+	test_assert_int_eq(backend->ops->mkdir(backend->ctx, "/x/y", 0755), -1);
+	test_assert_int_eq(errno, ENOENT);
+
+	/* Enough entries for the index to grow several times */
+	char path[64];
+	for (unsigned int i = 0; i < 1000; i++) {
+		snprintf(path, sizeof(path), "/a/b/file%u", i);
+		close_file(memfs, open_file(memfs, path, O_WRONLY | O_CREAT | O_TRUNC));
+	}
+	test_assert_int_eq(count_entries(memfs, "/a/b"), 1000);
+	struct stat statbuf;
+	for (unsigned int i = 0; i < 1000; i++) {
+		snprintf(path, sizeof(path), "/a/b/file%u", i);
+		test_assert_int_eq(stat_path(memfs, path, &statbuf), 0);
+	}
+	test_assert(!backend->ops->opendir(backend->ctx, "/a/b/file0"));
+	test_assert_int_eq(errno, ENOTDIR);
+
+	/* Files are renamed across directories and replace files */
+	test_assert_int_eq(backend->ops->rename(backend->ctx, "/a/b/file0", "/a/moved"), 0);
+	test_assert_int_eq(stat_path(memfs, "/a/b/file0", &statbuf), -1);
+	test_assert_int_eq(stat_path(memfs, "/a/moved", &statbuf), 0);
+	test_assert_int_eq(backend->ops->rename(backend->ctx, "/a/b/file1", "/a/moved"), 0);
+	test_assert_int_eq(count_entries(memfs, "/a"), 2);
+	test_assert_int_eq(count_entries(memfs, "/a/b"), 998);
+
+	/* Directories are moved with their contents, but never into themselves
+	 * or onto anything but an empty directory */
+	test_assert_int_eq(backend->ops->rename(backend->ctx, "/a/b", "/a/b/file2"), -1);
+	test_assert_int_eq(errno, EINVAL);
+	test_assert_int_eq(backend->ops->mkdir(backend->ctx, "/c", 0755), 0);
+	test_assert_int_eq(backend->ops->rename(backend->ctx, "/c", "/a/b"), -1);
+	test_assert_int_eq(errno, ENOTEMPTY);
+	test_assert_int_eq(backend->ops->rename(backend->ctx, "/a/moved", "/c"), -1);
+	test_assert_int_eq(errno, EISDIR);
+	test_assert_int_eq(backend->ops->rename(backend->ctx, "/a/b", "/c"), 0);
+	test_assert_int_eq(stat_path(memfs, "/c/file2", &statbuf), 0);
+	test_assert_int_eq(count_entries(memfs, "/a"), 1);
+
+	test_assert_int_eq(backend->ops->unlink(backend->ctx, "/c"), -1);
+	test_assert_int_eq(errno, EISDIR);
+	memfs_free(memfs);
+}
+
+void test_memfs_open_unlinked(void) {
+	struct memfs_t *memfs = memfs_new(1024 * 1024);
+	const struct vfs_backend_t *backend = memfs_backend(memfs);
+	void *file = open_file(memfs, "/file", O_WRONLY | O_CREAT | O_TRUNC);
+	write_at(memfs, file, "data", 0);
+	close_file(memfs, file);
+
+	file = open_file(memfs, "/file", O_RDONLY);
+	test_assert_int_eq(backend->ops->unlink(backend->ctx, "/file"), 0);
+	struct stat statbuf;
+	test_assert_int_eq(stat_path(memfs, "/file", &statbuf), -1);
+	test_assert_int_eq(count_entries(memfs, "/"), 0);
+
+	/* Still readable until closed */
+	char buffer[16];
+	test_assert_int_eq(read_at(memfs, file, buffer, sizeof(buffer) - 1, 0), 4);
+	test_assert_str_eq(buffer, "data");
+	test_assert_int_eq(memfs_used_bytes(memfs), MEMFS_CHUNK_SIZE);
+	close_file(memfs, file);
+	test_assert_int_eq(memfs_used_bytes(memfs), 0);
+	memfs_free(memfs);
+}
@@ -46,22 +46,26 @@ struct pathsplit_t {
 	int count;
 	struct {
 		char path[128];
+		char component[128];
 		bool is_full_path;
 	} result[10];
 };
 
-static bool pathsplit_callback(const char *path, bool is_full_path, void *vctx) {
-	struct pathsplit_t *ctx = (struct pathsplit_t*)vctx;
-	strcpy(ctx->result[ctx->count].path, path);
-	ctx->result[ctx->count].is_full_path = is_full_path;
-	ctx->count++;
-	return true;
+static void pathsplit_iterate(const char *path, struct pathsplit_t *ctx) {
+	struct path_iter_t iter;
+	path_iter_init(&iter, path, strlen(path));
+	while (path_iter_next(&iter)) {
+		snprintf(ctx->result[ctx->count].path, sizeof(ctx->result[ctx->count].path), "%.*s", (int)iter.prefix_length, path);
+		snprintf(ctx->result[ctx->count].component, sizeof(ctx->result[ctx->count].component), "%.*s", (int)iter.component_length, iter.component);
+		ctx->result[ctx->count].is_full_path = iter.is_full_path;
+		ctx->count++;
+	}
 }
 
-void test_path_split(void) {
+void test_path_iter(void) {
 	{
 		struct pathsplit_t splitctx = { 0 };
-		path_split("/foo/bar/moo/koo", pathsplit_callback, &splitctx);
+		pathsplit_iterate("/foo/bar/moo/koo", &splitctx);
 
 		test_assert_int_eq(splitctx.count, 5);
 		test_assert_str_eq(splitctx.result[0].path, "/");
@@ -69,6 +73,11 @@ void test_path_split(void) {
 		test_assert_str_eq(splitctx.result[2].path, "/foo/bar");
 		test_assert_str_eq(splitctx.result[3].path, "/foo/bar/moo");
 		test_assert_str_eq(splitctx.result[4].path, "/foo/bar/moo/koo");
+		test_assert_str_eq(splitctx.result[0].component, "");
+		test_assert_str_eq(splitctx.result[1].component, "foo");
+		test_assert_str_eq(splitctx.result[2].component, "bar");
+		test_assert_str_eq(splitctx.result[3].component, "moo");
+		test_assert_str_eq(splitctx.result[4].component, "koo");
 		test_assert(!splitctx.result[0].is_full_path);
 		test_assert(!splitctx.result[1].is_full_path);
 		test_assert(!splitctx.result[2].is_full_path);
@@ -78,12 +87,13 @@ void test_path_split(void) {
 
 	{
 		struct pathsplit_t splitctx = { 0 };
-		path_split("/foo/bar/", pathsplit_callback, &splitctx);
+		pathsplit_iterate("/foo/bar/", &splitctx);
 
 		test_assert_int_eq(splitctx.count, 3);
 		test_assert_str_eq(splitctx.result[0].path, "/");
 		test_assert_str_eq(splitctx.result[1].path, "/foo");
 		test_assert_str_eq(splitctx.result[2].path, "/foo/bar");
+		test_assert_str_eq(splitctx.result[2].component, "bar");
 		test_assert(!splitctx.result[0].is_full_path);
 		test_assert(!splitctx.result[1].is_full_path);
 		test_assert(splitctx.result[2].is_full_path);
@@ -91,18 +101,20 @@ void test_path_split(void) {
 
 	{
 		struct pathsplit_t splitctx = { 0 };
-		path_split("foo/bar", pathsplit_callback, &splitctx);
+		pathsplit_iterate("foo/bar", &splitctx);
 
 		test_assert_int_eq(splitctx.count, 2);
 		test_assert_str_eq(splitctx.result[0].path, "foo");
 		test_assert_str_eq(splitctx.result[1].path, "foo/bar");
+		test_assert_str_eq(splitctx.result[0].component, "foo");
+		test_assert_str_eq(splitctx.result[1].component, "bar");
 		test_assert(!splitctx.result[0].is_full_path);
 		test_assert(splitctx.result[1].is_full_path);
 	}
 
 	{
 		struct pathsplit_t splitctx = { 0 };
-		path_split("foo/bar/", pathsplit_callback, &splitctx);
+		pathsplit_iterate("foo/bar/", &splitctx);
 
 		test_assert_int_eq(splitctx.count, 2);
 		test_assert_str_eq(splitctx.result[0].path, "foo");
@@ -113,13 +125,14 @@ void test_path_split(void) {
 
 	{
 		struct pathsplit_t splitctx = { 0 };
-		path_split("/foo///", pathsplit_callback, &splitctx);
+		pathsplit_iterate("/foo///", &splitctx);
 
 		test_assert_int_eq(splitctx.count, 4);
 		test_assert_str_eq(splitctx.result[0].path, "/");
 		test_assert_str_eq(splitctx.result[1].path, "/foo");
 		test_assert_str_eq(splitctx.result[2].path, "/foo/");
 		test_assert_str_eq(splitctx.result[3].path, "/foo//");
+		test_assert_str_eq(splitctx.result[2].component, "");
 		test_assert(!splitctx.result[0].is_full_path);
 		test_assert(!splitctx.result[1].is_full_path);
 		test_assert(!splitctx.result[2].is_full_path);
@@ -128,7 +141,16 @@ void test_path_split(void) {
 
 	{
 		struct pathsplit_t splitctx = { 0 };
-		path_split("", pathsplit_callback, &splitctx);
+		pathsplit_iterate("/", &splitctx);
+
+		test_assert_int_eq(splitctx.count, 1);
+		test_assert_str_eq(splitctx.result[0].path, "/");
+		test_assert(splitctx.result[0].is_full_path);
+	}
+
+	{
+		struct pathsplit_t splitctx = { 0 };
+		pathsplit_iterate("", &splitctx);
 		test_assert(splitctx.count == 0);
 	}
 }
@@ -26,7 +26,7 @@
 
 /*************** AUTO GENERATED SECTION FOLLOWS ***************/
 void test_pathcmp(void);
-void test_path_split(void);
+void test_path_iter(void);
 void test_sanitize_path(void);
 void test_path_contains_hidden(void);
 /***************  AUTO GENERATED SECTION ENDS   ***************/
@@ -0,0 +1,211 @@
+/**
+ *	umsftpd - User-mode SFTP application.
+ *	Copyright (C) 2021-2021 Johannes Bauer
+ *
+ *	This file is part of umsftpd.
+ *
+ *	umsftpd is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; this program is ONLY licensed under
+ *	version 3 of the License, later versions are explicitly excluded.
+ *
+ *	umsftpd is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with umsftpd; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *	Johannes Bauer <JohannesBauer@gmx.de>
+**/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "testbench.h"
+#include "tarstream.h"
+#include "test_tarstream.h"
+
+static bool header_checksum_valid(const uint8_t *header) {
+	unsigned int checksum = 0;
+	for (unsigned int i = 0; i < TARSTREAM_BLOCK_SIZE; i++) {
+		checksum += ((i >= 148) && (i < 156)) ? ' ' : header[i];
+	}
+	return strtoul((const char*)header + 148, NULL, 8) == checksum;
+}
+
+void test_tarstream_file(void) {
+	uint8_t buffer[TARSTREAM_MAX_HEADER_SIZE];
+	struct tarstream_entry_t entry = {
+		.path = "dir/file.txt",
+		.size = 1234,
+		.permissions = 0644,
+		.uid = 1000,
+		.gid = 100,
+		.mtime = 1600000000,
+	};
+	test_assert_int_eq(tarstream_header(buffer, &entry), TARSTREAM_BLOCK_SIZE);
+	test_assert_str_eq((const char*)buffer, "dir/file.txt");
+	test_assert_str_eq((const char*)buffer + 100, "0000644");
+	test_assert_str_eq((const char*)buffer + 124, "00000002322");
+	test_assert_int_eq(buffer[156], '0');
+	test_assert_str_eq((const char*)buffer + 257, "ustar");
+	test_assert_true(header_checksum_valid(buffer));
+	test_assert_int_eq(tarstream_padding(1234), 302);
+	test_assert_int_eq(tarstream_padding(1024), 0);
+}
+
+void test_tarstream_directory(void) {
+	uint8_t buffer[TARSTREAM_MAX_HEADER_SIZE];
+	struct tarstream_entry_t entry = {
+		.path = "dir/subdir",
+		.is_directory = true,
+		.permissions = 0755,
+	};
+	test_assert_int_eq(tarstream_header(buffer, &entry), TARSTREAM_BLOCK_SIZE);
+	test_assert_str_eq((const char*)buffer, "dir/subdir/");
+	test_assert_int_eq(buffer[156], '5');
+	test_assert_true(header_checksum_valid(buffer));
+}
+
+void test_tarstream_long_path(void) {
+	uint8_t buffer[TARSTREAM_MAX_HEADER_SIZE];
+	char path[400];
+
+	/* Split into prefix and name */
+	memset(path, 'a', 120);
+	strcpy(path + 120, "/file");
+	struct tarstream_entry_t entry = {
+		.path = path,
+	};
+	test_assert_int_eq(tarstream_header(buffer, &entry), TARSTREAM_BLOCK_SIZE);
+	test_assert_str_eq((const char*)buffer, "file");
+	test_assert_int_eq(strnlen((const char*)buffer + 345, 155), 120);
+
+	/* Needs a pax header */
+	memset(path, 'b', 300);
+	strcpy(path + 300, "/file");
+	size_t length = tarstream_header(buffer, &entry);
+	test_assert_int_eq(length, 3 * TARSTREAM_BLOCK_SIZE);
+	test_assert_int_eq(buffer[156], 'x');
+	test_assert_true(header_checksum_valid(buffer));
+	test_assert(!strncmp((const char*)buffer + TARSTREAM_BLOCK_SIZE, "315 path=bbb", 12));
+	test_assert_int_eq(buffer[TARSTREAM_BLOCK_SIZE + 314], '\n');
+	test_assert_str_eq((const char*)buffer + (2 * TARSTREAM_BLOCK_SIZE), "file");
+	test_assert_true(header_checksum_valid(buffer + (2 * TARSTREAM_BLOCK_SIZE)));
+
+	/* Not representable at all */
+	char *huge_path = malloc(TARSTREAM_MAX_PATH_LENGTH + 1);
+	memset(huge_path, 'c', TARSTREAM_MAX_PATH_LENGTH);
+	huge_path[TARSTREAM_MAX_PATH_LENGTH] = 0;
+	entry.path = huge_path;
+	test_assert_int_eq(tarstream_header(buffer, &entry), 0);
+	free(huge_path);
+}
+
+void test_tarstream_large_file(void) {
+	uint8_t buffer[TARSTREAM_MAX_HEADER_SIZE];
+	struct tarstream_entry_t entry = {
+		.path = "huge",
+		.size = 10ULL * 1024 * 1024 * 1024,
+	};
+	test_assert_int_eq(tarstream_header(buffer, &entry), 3 * TARSTREAM_BLOCK_SIZE);
+	test_assert(!strncmp((const char*)buffer + TARSTREAM_BLOCK_SIZE, "20 size=10737418240\n", 20));
+}
+
+struct parsed_archive_t {
+	unsigned int members;
+	char last_path[TARSTREAM_MAX_PATH_LENGTH];
+	uint64_t last_size;
+	bool last_directory;
+	char data[64];
+	size_t data_length;
+	unsigned int ends;
+};
+
+static bool parsed_begin(void *ctx, const struct tarstream_entry_t *entry) {
+	struct parsed_archive_t *parsed = (struct parsed_archive_t*)ctx;
+	parsed->members++;
+	strcpy(parsed->last_path, entry->path);
+	parsed->last_size = entry->size;
+	parsed->last_directory = entry->is_directory;
+	parsed->data_length = 0;
+	return true;
+}
+
+static bool parsed_data(void *ctx, const void *data, size_t length) {
+	struct parsed_archive_t *parsed = (struct parsed_archive_t*)ctx;
+	memcpy(parsed->data + parsed->data_length, data, length);
+	parsed->data_length += length;
+	return true;
+}
+
+static bool parsed_end(void *ctx) {
+	struct parsed_archive_t *parsed = (struct parsed_archive_t*)ctx;
+	parsed->ends++;
+	return true;
+}
+
+void test_tarstream_parse(void) {
+	uint8_t archive[TARSTREAM_MAX_HEADER_SIZE + (6 * TARSTREAM_BLOCK_SIZE)];
+	char path[301];
+	memset(path, 'p', 300);
+	path[300] = 0;
+	struct tarstream_entry_t entry = {
+		.path = "dir",
+		.is_directory = true,
+	};
+	size_t length = tarstream_header(archive, &entry);
+	entry = (struct tarstream_entry_t) {
+		.path = path,
+		.size = 11,
+	};
+	length += tarstream_header(archive + length, &entry);
+	memcpy(archive + length, "hello world", 11);
+	memset(archive + length + 11, 0, tarstream_padding(11) + (2 * TARSTREAM_BLOCK_SIZE));
+	length += 11 + tarstream_padding(11) + (2 * TARSTREAM_BLOCK_SIZE);
+
+	/* Fed byte by byte, so that every boundary is crossed */
+	struct parsed_archive_t parsed = { 0 };
+	struct tarstream_parser_t parser;
+	tarstream_parser_init(&parser, parsed_begin, parsed_data, parsed_end, &parsed);
+	for (size_t i = 0; i < length; i++) {
+		test_assert_true(tarstream_parse(&parser, archive + i, 1));
+	}
+	test_assert_int_eq(parser.state, TARSTREAM_PARSE_FINISHED);
+	test_assert_int_eq(parsed.members, 2);
+	test_assert_int_eq(parsed.ends, 2);
+	test_assert_str_eq(parsed.last_path, path);
+	test_assert_int_eq(parsed.last_size, 11);
+	test_assert_int_eq(parsed.data_length, 11);
+	test_assert(!memcmp(parsed.data, "hello world", 11));
+}
+
+void test_tarstream_parse_corrupt(void) {
+	uint8_t archive[TARSTREAM_MAX_HEADER_SIZE];
+	struct tarstream_entry_t entry = {
+		.path = "file",
+	};
+	size_t length = tarstream_header(archive, &entry);
+	archive[0] = 'F';
+
+	struct parsed_archive_t parsed = { 0 };
+	struct tarstream_parser_t parser;
+	tarstream_parser_init(&parser, parsed_begin, parsed_data, parsed_end, &parsed);
+	test_assert_false(tarstream_parse(&parser, archive, length));
+	test_assert_false(tarstream_parse(&parser, archive, 1));
+	test_assert_int_eq(parsed.members, 0);
+
+	/* pax record whose length is never terminated by a space */
+	char path[301];
+	memset(path, 'p', 300);
+	path[300] = 0;
+	entry.path = path;
+	length = tarstream_header(archive, &entry);
+	size_t pax_length = strtoul((const char*)archive + 124, NULL, 8);
+	memset(archive + TARSTREAM_BLOCK_SIZE, '9', pax_length);
+	tarstream_parser_init(&parser, parsed_begin, parsed_data, parsed_end, &parsed);
+	test_assert_false(tarstream_parse(&parser, archive, length));
+	test_assert_int_eq(parsed.members, 0);
+}
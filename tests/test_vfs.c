@@ -22,10 +22,21 @@
 **/
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include <sys/stat.h>
+#include <sys/xattr.h>
+#include <errno.h>
+#include <limits.h>
+#include <fnmatch.h>
 #include "testbench.h"
 #include "vfs.h"
 #include "vfsdebug.h"
+#include "dircache.h"
+#include "contentindex.h"
+#include "fdcache.h"
+#include "memfs.h"
 #include "test_vfs.h"
 
 void test_empty_vfs(void) {
@@ -128,7 +139,28 @@ void test_vfs_lookup(void) {
 			.expect.result.flags = VFS_INODE_FLAG_READ_ONLY | VFS_INODE_FLAG_DISALLOW_UNLINK | VFS_INODE_FLAG_DISALLOW_CREATE_DIR | VFS_INODE_FLAG_DISALLOW_UNLINK | VFS_INODE_FLAG_ALLOW_SYMLINKS,
 			.expect.result.mountpoint = &(struct vfs_inode_t){ .virtual_path = "/this/is/deeply/nested", .target_path = "/home/joe/nested" },
 			.expect.result.inode = NULL,
-		}
+		},
+		{
+			.input.path = "/this/is/",
+			.expect.success = true,
+			.expect.result.flags = VFS_INODE_FLAG_READ_ONLY | VFS_INODE_FLAG_DISALLOW_CREATE_DIR | VFS_INODE_FLAG_DISALLOW_UNLINK,
+			.expect.result.mountpoint = NULL,
+			.expect.result.inode = &(struct vfs_inode_t){ .virtual_path = "/this/is", .target_path = NULL },
+		},
+		{
+			.input.path = "/this//is/deeply",
+			.expect.success = true,
+			.expect.result.flags = VFS_INODE_FLAG_READ_ONLY,
+			.expect.result.mountpoint = NULL,
+			.expect.result.inode = NULL,
+		},
+		{
+			.input.path = "/thisx/is",
+			.expect.success = true,
+			.expect.result.flags = VFS_INODE_FLAG_READ_ONLY,
+			.expect.result.mountpoint = NULL,
+			.expect.result.inode = NULL,
+		},
 	};
 	verify_vfs_lookups(vfs, expected_outcome, sizeof(expected_outcome) / sizeof(struct vfs_lookup_data_t));
 
@@ -181,3 +213,1590 @@ void test_vfs_opendir(void) {
 	vfs_close_handle(handle);
 	vfs_free(vfs);
 }
+
+void test_vfs_attrcache(void) {
+	mkdir("/tmp/umsftpd_test", 0755);
+	unlink("/tmp/umsftpd_test/attrcache");
+
+	struct vfs_t *vfs = vfs_init();
+	vfs_add_inode(vfs, "/", "/tmp/umsftpd_test", 0, 0);
+	vfs_freeze_inodes(vfs);
+	test_assert_true(vfs_attrcache_enable(vfs, 60000, 64));
+
+	/* Negative entry is cached, even if file appears behind our back */
+	struct vfs_dirent_t dirent;
+	test_assert_int_eq(vfs_stat(vfs, "/attrcache", &dirent), VFS_NO_SUCH_FILE_OR_DIRECTORY);
+	FILE *f = fopen("/tmp/umsftpd_test/attrcache", "w");
+	test_assert(f);
+	fclose(f);
+	test_assert_int_eq(vfs_stat(vfs, "attrcache", &dirent), VFS_NO_SUCH_FILE_OR_DIRECTORY);
+	test_assert_int_eq(vfs->attrcache.hits, 1);
+	test_assert_int_eq(vfs->attrcache.misses, 1);
+
+	/* Writing through the VFS invalidates */
+	struct vfs_handle_t *handle;
+	test_assert_int_eq(vfs_open(vfs, "/attrcache", FILEMODE_WRITE, &handle), VFS_OK);
+	size_t length = 3;
+	test_assert_int_eq(vfs_write(handle, "foo", &length), VFS_OK);
+	vfs_close_handle(handle);
+	test_assert_int_eq(vfs_stat(vfs, "/attrcache", &dirent), VFS_OK);
+	test_assert_int_eq(dirent.filesize, 3);
+	test_assert_str_eq(dirent.filename, "attrcache");
+	test_assert_int_eq(vfs->attrcache.misses, 2);
+
+	/* Positive entry is cached */
+	test_assert_int_eq(vfs_stat(vfs, "/attrcache", &dirent), VFS_OK);
+	test_assert_int_eq(dirent.filesize, 3);
+	test_assert_int_eq(vfs->attrcache.hits, 2);
+
+	vfs_free(vfs);
+	unlink("/tmp/umsftpd_test/attrcache");
+}
+
+void test_vfs_dircache(void) {
+	mkdir("/tmp/umsftpd_test", 0755);
+	mkdir("/tmp/umsftpd_test/listing", 0755);
+	FILE *f = fopen("/tmp/umsftpd_test/listing/file", "w");
+	test_assert(f);
+	fclose(f);
+
+	struct dircache_t *dircache = dircache_new(1024 * 1024);
+	struct vfs_t *vfs = vfs_init();
+	vfs_add_inode(vfs, "/", "/tmp/umsftpd_test/listing", VFS_INODE_FLAG_READ_ONLY, 0);
+	vfs_add_inode(vfs, "/file", NULL, 0, 0);
+	vfs_freeze_inodes(vfs);
+	vfs_set_dircache(vfs, dircache);
+
+	for (unsigned int i = 0; i < 2; i++) {
+		struct vfs_handle_t *handle;
+		test_assert_int_eq(vfs_opendir(vfs, "/", &handle), VFS_OK);
+		test_assert(handle->dir.listing);
+
+		/* Virtual directory shadows the mapped file */
+		struct vfs_dirent_t dirent;
+		test_assert_int_eq(vfs_readdir(handle, &dirent), VFS_OK);
+		test_assert_str_eq(dirent.filename, "file");
+		test_assert_false(dirent.is_file);
+		test_assert_int_eq(vfs_readdir(handle, &dirent), VFS_OK);
+		test_assert_true(dirent.eof);
+		vfs_close_handle(handle);
+	}
+	test_assert_int_eq(dircache->stats.hits, 1);
+	test_assert_int_eq(dircache->stats.misses, 1);
+
+	vfs_free(vfs);
+	dircache_free(dircache);
+	unlink("/tmp/umsftpd_test/listing/file");
+	rmdir("/tmp/umsftpd_test/listing");
+}
+
+void test_vfs_contentindex(void) {
+	mkdir("/tmp/umsftpd_test", 0755);
+	mkdir("/tmp/umsftpd_test/mirror", 0755);
+	unlink("/tmp/umsftpd_test/mirror/unindexed");
+	FILE *f = fopen("/tmp/umsftpd_test/mirror/indexed", "w");
+	test_assert(f);
+	fputs("content", f);
+	fclose(f);
+
+	test_assert_true(contentindex_build("/tmp/umsftpd_test/mirror", "/tmp/umsftpd_test/mirror.idx", false));
+	struct contentindex_t *index = contentindex_open("/tmp/umsftpd_test/mirror.idx");
+	test_assert(index);
+
+	/* Not part of the index, must not be visible */
+	f = fopen("/tmp/umsftpd_test/mirror/unindexed", "w");
+	test_assert(f);
+	fclose(f);
+
+	struct vfs_t *vfs = vfs_init();
+	vfs_add_inode(vfs, "/", NULL, VFS_INODE_FLAG_READ_ONLY, 0);
+	vfs_add_inode(vfs, "/mirror", "/tmp/umsftpd_test/mirror", 0, 0);
+	vfs_freeze_inodes(vfs);
+	test_assert_true(vfs_attach_contentindex(vfs, "/mirror", index));
+	test_assert_false(vfs_attach_contentindex(vfs, "/", index));
+
+	struct vfs_dirent_t dirent;
+	test_assert_int_eq(vfs_stat(vfs, "/mirror/indexed", &dirent), VFS_OK);
+	test_assert_int_eq(dirent.filesize, 7);
+	test_assert_int_eq(dirent.permissions & 0222, 0);
+	test_assert_int_eq(vfs_stat(vfs, "/mirror/unindexed", &dirent), VFS_NO_SUCH_FILE_OR_DIRECTORY);
+	test_assert_int_eq(vfs_stat(vfs, "/mirror", &dirent), VFS_OK);
+	test_assert_false(dirent.is_file);
+
+	struct vfs_handle_t *handle;
+	test_assert_int_eq(vfs_opendir(vfs, "/mirror", &handle), VFS_OK);
+	test_assert_int_eq(vfs_readdir(handle, &dirent), VFS_OK);
+	test_assert_str_eq(dirent.filename, "indexed");
+	test_assert_int_eq(vfs_readdir(handle, &dirent), VFS_OK);
+	test_assert_true(dirent.eof);
+	vfs_close_handle(handle);
+
+	test_assert_int_eq(vfs_open(vfs, "/mirror/unindexed", FILEMODE_READ, &handle), VFS_NO_SUCH_FILE_OR_DIRECTORY);
+	test_assert_int_eq(vfs_open(vfs, "/mirror/indexed", FILEMODE_READ, &handle), VFS_OK);
+	char buffer[16];
+	size_t length = sizeof(buffer);
+	test_assert_int_eq(vfs_read(handle, buffer, &length), VFS_OK);
+	test_assert_int_eq(length, 7);
+	vfs_close_handle(handle);
+
+	/* Replaced by a symlink after indexing, must not be followed */
+	f = fopen("/tmp/umsftpd_test/mirror_outside", "w");
+	test_assert(f);
+	fputs("outside", f);
+	fclose(f);
+	unlink("/tmp/umsftpd_test/mirror/indexed");
+	test_assert_int_eq(symlink("../mirror_outside", "/tmp/umsftpd_test/mirror/indexed"), 0);
+	test_assert_int_eq(vfs_open(vfs, "/mirror/indexed", FILEMODE_READ, &handle), VFS_NO_SUCH_FILE_OR_DIRECTORY);
+
+	vfs_free(vfs);
+	contentindex_close(index);
+	unlink("/tmp/umsftpd_test/mirror/indexed");
+	unlink("/tmp/umsftpd_test/mirror/unindexed");
+	unlink("/tmp/umsftpd_test/mirror_outside");
+	unlink("/tmp/umsftpd_test/mirror.idx");
+	rmdir("/tmp/umsftpd_test/mirror");
+}
+
+void test_vfs_fdcache(void) {
+	mkdir("/tmp/umsftpd_test", 0755);
+	FILE *f = fopen("/tmp/umsftpd_test/artifact", "w");
+	test_assert(f);
+	fputs("release artifact", f);
+	fclose(f);
+
+	struct fdcache_t *fdcache = fdcache_new(16);
+	struct vfs_t *vfs1 = vfs_init();
+	vfs_add_inode(vfs1, "/", "/tmp/umsftpd_test", VFS_INODE_FLAG_READ_ONLY, 0);
+	vfs_freeze_inodes(vfs1);
+	vfs_set_fdcache(vfs1, fdcache);
+	struct vfs_t *vfs2 = vfs_init();
+	vfs_add_inode(vfs2, "/", "/tmp/umsftpd_test", VFS_INODE_FLAG_READ_ONLY, 0);
+	vfs_freeze_inodes(vfs2);
+	vfs_set_fdcache(vfs2, fdcache);
+
+	/* Two sessions read the same file at independent offsets */
+	struct vfs_handle_t *handle1, *handle2;
+	test_assert_int_eq(vfs_open(vfs1, "/artifact", FILEMODE_READ, &handle1), VFS_OK);
+	test_assert_int_eq(vfs_open(vfs2, "/artifact", FILEMODE_READ, &handle2), VFS_OK);
+	test_assert(handle1->file.cached == handle2->file.cached);
+	test_assert_int_eq(fdcache->stats.hits, 1);
+
+	char buffer[32];
+	size_t length = 8;
+	test_assert_int_eq(vfs_read(handle1, buffer, &length), VFS_OK);
+	test_assert_int_eq(length, 8);
+	test_assert_int_eq(memcmp(buffer, "release ", 8), 0);
+
+	length = sizeof(buffer);
+	test_assert_int_eq(vfs_read(handle2, buffer, &length), VFS_OK);
+	test_assert_int_eq(length, 16);
+
+	length = sizeof(buffer);
+	test_assert_int_eq(vfs_read(handle1, buffer, &length), VFS_OK);
+	test_assert_int_eq(length, 8);
+	test_assert_int_eq(memcmp(buffer, "artifact", 8), 0);
+
+	length = sizeof(buffer);
+	test_assert_int_eq(vfs_read(handle1, buffer, &length), VFS_OK);
+	test_assert_int_eq(length, 0);
+
+	/* Shared descriptors have no stdio stream to write to */
+	length = 4;
+	test_assert_int_eq(vfs_write(handle1, "oops", &length), VFS_IO_ERROR);
+	test_assert_int_eq(length, 0);
+
+	vfs_close_handle(handle1);
+	vfs_close_handle(handle2);
+	test_assert_int_eq(vfs_open(vfs1, "/nonexistent", FILEMODE_READ, &handle1), VFS_NO_SUCH_FILE_OR_DIRECTORY);
+
+	vfs_free(vfs1);
+	vfs_free(vfs2);
+	fdcache_free(fdcache);
+	unlink("/tmp/umsftpd_test/artifact");
+}
+
+void test_vfs_blockcache(void) {
+	mkdir("/tmp/umsftpd_test", 0755);
+	FILE *f = fopen("/tmp/umsftpd_test/hot", "w");
+	test_assert(f);
+	for (unsigned int i = 0; i < BLOCKCACHE_BLOCK_SIZE + 100; i++) {
+		fputc('a' + (i % 26), f);
+	}
+	fclose(f);
+
+	struct blockcache_t *blockcache = blockcache_new(1024 * 1024, 1024 * 1024);
+	struct vfs_t *vfs = vfs_init();
+	vfs_add_inode(vfs, "/", "/tmp/umsftpd_test", VFS_INODE_FLAG_READ_ONLY, 0);
+	vfs_freeze_inodes(vfs);
+	vfs_set_blockcache(vfs, blockcache);
+
+	for (unsigned int i = 0; i < 2; i++) {
+		struct vfs_handle_t *handle;
+		test_assert_int_eq(vfs_open(vfs, "/hot", FILEMODE_READ, &handle), VFS_OK);
+		test_assert_true(handle->file.block_cached);
+
+		/* Crosses the block boundary */
+		char buffer[256];
+		size_t length = BLOCKCACHE_BLOCK_SIZE - 10;
+		char *large_buffer = malloc(length);
+		test_assert_int_eq(vfs_read(handle, large_buffer, &length), VFS_OK);
+		free(large_buffer);
+		length = sizeof(buffer);
+		test_assert_int_eq(vfs_read(handle, buffer, &length), VFS_OK);
+		test_assert_int_eq(length, 110);
+		test_assert_int_eq(buffer[0], 'a' + ((BLOCKCACHE_BLOCK_SIZE - 10) % 26));
+		test_assert_int_eq(buffer[109], 'a' + ((BLOCKCACHE_BLOCK_SIZE + 99) % 26));
+		vfs_close_handle(handle);
+	}
+	test_assert_int_eq(blockcache->stats->insertions, 2);
+	test_assert_int_eq(blockcache->stats->hits, 4);
+
+	vfs_free(vfs);
+	blockcache_free(blockcache);
+	unlink("/tmp/umsftpd_test/hot");
+}
+
+void test_vfs_mmap(void) {
+	mkdir("/tmp/umsftpd_test", 0755);
+	FILE *f = fopen("/tmp/umsftpd_test/large", "w");
+	test_assert(f);
+	for (unsigned int i = 0; i < 3 * 4096; i++) {
+		fputc('a' + (i % 26), f);
+	}
+	fclose(f);
+
+	struct vfs_t *vfs = vfs_init();
+	vfs_add_inode(vfs, "/", "/tmp/umsftpd_test", VFS_INODE_FLAG_READ_ONLY, 0);
+	vfs_freeze_inodes(vfs);
+	test_assert_true(vfs_set_mmap_threshold(vfs, 4096));
+
+	struct vfs_handle_t *handle;
+	test_assert_int_eq(vfs_open(vfs, "/large", FILEMODE_READ, &handle), VFS_OK);
+	test_assert(handle->file.mapping);
+
+	char buffer[4096];
+	size_t length = 100;
+	test_assert_int_eq(vfs_read(handle, buffer, &length), VFS_OK);
+	test_assert_int_eq(length, 100);
+	test_assert_int_eq(buffer[99], 'a' + (99 % 26));
+
+	/* Truncated while mapped must not crash */
+	test_assert_int_eq(truncate("/tmp/umsftpd_test/large", 0), 0);
+	length = sizeof(buffer);
+	test_assert_int_eq(vfs_read(handle, buffer, &length), VFS_IO_ERROR);
+	vfs_close_handle(handle);
+
+	/* Below the threshold */
+	f = fopen("/tmp/umsftpd_test/large", "w");
+	fputs("small", f);
+	fclose(f);
+	test_assert_int_eq(vfs_open(vfs, "/large", FILEMODE_READ, &handle), VFS_OK);
+	test_assert(handle->file.mapping == NULL);
+	vfs_close_handle(handle);
+
+	vfs_free(vfs);
+	unlink("/tmp/umsftpd_test/large");
+}
+
+static void check_pattern_file(const char *filename, unsigned int length) {
+	FILE *f = fopen(filename, "r");
+	test_assert(f);
+	unsigned int count = 0;
+	int c;
+	while ((c = fgetc(f)) != EOF) {
+		test_assert_int_eq(c, 'a' + (count % 26));
+		count++;
+	}
+	fclose(f);
+	test_assert_int_eq(count, length);
+}
+
+static void write_pattern(struct vfs_handle_t *handle, unsigned int start, unsigned int length, unsigned int chunk_size) {
+	char buffer[chunk_size];
+	for (unsigned int offset = 0; offset < length; offset += chunk_size) {
+		size_t chunk_length = ((length - offset) < chunk_size) ? (length - offset) : chunk_size;
+		for (unsigned int i = 0; i < chunk_length; i++) {
+			buffer[i] = 'a' + ((start + offset + i) % 26);
+		}
+		size_t written = chunk_length;
+		test_assert_int_eq(vfs_write(handle, buffer, &written), VFS_OK);
+		test_assert_int_eq(written, chunk_length);
+	}
+}
+
+void test_vfs_direct_io(void) {
+	mkdir("/tmp/umsftpd_test", 0755);
+	struct vfs_t *vfs = vfs_init();
+	vfs_add_inode(vfs, "/", "/tmp/umsftpd_test", VFS_INODE_FLAG_DIRECT_IO, 0);
+	vfs_freeze_inodes(vfs);
+
+	const unsigned int upload_length = VFS_DIRECT_IO_BUFFER_SIZE + 1000;
+	struct vfs_handle_t *handle;
+	test_assert_int_eq(vfs_open(vfs, "/upload", FILEMODE_WRITE, &handle), VFS_OK);
+	test_assert(handle->file.direct.staging);
+	write_pattern(handle, 0, upload_length, 4093);
+	vfs_close_handle(handle);
+	check_pattern_file("/tmp/umsftpd_test/upload", upload_length);
+
+	/* Appending starts at an unaligned offset */
+	test_assert_int_eq(vfs_open(vfs, "/upload", FILEMODE_APPEND, &handle), VFS_OK);
+	test_assert(handle->file.direct.staging);
+	write_pattern(handle, upload_length, 5000, 777);
+
+	/* Staged uploads cannot be read back */
+	char buffer[16];
+	size_t length = sizeof(buffer);
+	test_assert_int_eq(vfs_read(handle, buffer, &length), VFS_IO_ERROR);
+	length = sizeof(buffer);
+	test_assert_int_eq(vfs_read_at(handle, 100, buffer, &length), VFS_IO_ERROR);
+	test_assert_int_eq(length, 0);
+	vfs_close_handle(handle);
+	check_pattern_file("/tmp/umsftpd_test/upload", upload_length + 5000);
+
+	vfs_free(vfs);
+	unlink("/tmp/umsftpd_test/upload");
+}
+
+void test_vfs_access_hints(void) {
+	mkdir("/tmp/umsftpd_test", 0755);
+	FILE *f = fopen("/tmp/umsftpd_test/pattern", "w");
+	test_assert(f);
+	for (unsigned int i = 0; i < 100000; i++) {
+		fputc('a' + (i % 26), f);
+	}
+	fclose(f);
+
+	struct vfs_t *vfs = vfs_init();
+	vfs_add_inode(vfs, "/", "/tmp/umsftpd_test", VFS_INODE_FLAG_READ_ONLY, 0);
+	vfs_freeze_inodes(vfs);
+	vfs_set_access_hints(vfs, true);
+
+	struct vfs_handle_t *handle;
+	test_assert_int_eq(vfs_open(vfs, "/pattern", FILEMODE_READ, &handle), VFS_OK);
+
+	char buffer[4096];
+	const uint64_t sequential_offsets[] = { 0, 4096, 8192 };
+	for (unsigned int i = 0; i < 3; i++) {
+		size_t length = sizeof(buffer);
+		test_assert_int_eq(vfs_read_at(handle, sequential_offsets[i], buffer, &length), VFS_OK);
+		test_assert_int_eq(length, sizeof(buffer));
+	}
+	test_assert_int_eq(handle->file.access.pattern, VFS_ACCESS_SEQUENTIAL);
+
+	/* Seeking away must not immediately be taken as random access */
+	const uint64_t strided_offsets[] = { 30000, 40000, 50000, 60000 };
+	for (unsigned int i = 0; i < 4; i++) {
+		size_t length = 100;
+		test_assert_int_eq(vfs_read_at(handle, strided_offsets[i], buffer, &length), VFS_OK);
+		test_assert_int_eq(buffer[0], 'a' + (strided_offsets[i] % 26));
+	}
+	test_assert_int_eq(handle->file.access.pattern, VFS_ACCESS_STRIDED);
+
+	const uint64_t random_offsets[] = { 5, 33333, 777, 60001, 12 };
+	for (unsigned int i = 0; i < 5; i++) {
+		size_t length = 100;
+		test_assert_int_eq(vfs_read_at(handle, random_offsets[i], buffer, &length), VFS_OK);
+		test_assert_int_eq(buffer[0], 'a' + (random_offsets[i] % 26));
+	}
+	test_assert_int_eq(handle->file.access.pattern, VFS_ACCESS_RANDOM);
+
+	size_t length = sizeof(buffer);
+	test_assert_int_eq(vfs_read_at(handle, 99990, buffer, &length), VFS_OK);
+	test_assert_int_eq(length, 10);
+	vfs_close_handle(handle);
+
+	vfs_free(vfs);
+	unlink("/tmp/umsftpd_test/pattern");
+}
+
+void test_vfs_preallocate(void) {
+	mkdir("/tmp/umsftpd_test", 0755);
+	struct vfs_t *vfs = vfs_init();
+	vfs_add_inode(vfs, "/", "/tmp/umsftpd_test", 0, 0);
+	vfs_add_inode(vfs, "/direct", "/tmp/umsftpd_test", VFS_INODE_FLAG_DIRECT_IO, 0);
+	vfs_freeze_inodes(vfs);
+
+	const char *paths[] = { "/upload", "/direct/upload" };
+	for (unsigned int i = 0; i < 2; i++) {
+		struct vfs_handle_t *handle;
+		test_assert_int_eq(vfs_open(vfs, paths[i], FILEMODE_WRITE, &handle), VFS_OK);
+		test_assert_int_eq(vfs_preallocate(handle, 16 * 1024 * 1024), VFS_OK);
+
+		/* Size is only what was written so far */
+		struct stat statbuf;
+		test_assert_int_eq(stat("/tmp/umsftpd_test/upload", &statbuf), 0);
+		test_assert_int_eq(statbuf.st_size, 0);
+
+		/* Upload is aborted early */
+		size_t length = 5;
+		test_assert_int_eq(vfs_write(handle, "abort", &length), VFS_OK);
+		vfs_close_handle(handle);
+
+		test_assert_int_eq(stat("/tmp/umsftpd_test/upload", &statbuf), 0);
+		test_assert_int_eq(statbuf.st_size, 5);
+		test_assert(statbuf.st_blocks * 512 < 1024 * 1024);
+		unlink("/tmp/umsftpd_test/upload");
+	}
+
+	vfs_free(vfs);
+}
+
+void test_vfs_sparse(void) {
+	mkdir("/tmp/umsftpd_test", 0755);
+	const unsigned int data_offset = 2 * 1024 * 1024;
+	FILE *f = fopen("/tmp/umsftpd_test/sparse", "w");
+	test_assert(f);
+	fputc('A', f);
+	fseek(f, data_offset, SEEK_SET);
+	fputc('B', f);
+	fclose(f);
+
+	struct vfs_t *vfs = vfs_init();
+	vfs_add_inode(vfs, "/", "/tmp/umsftpd_test", VFS_INODE_FLAG_READ_ONLY, 0);
+	vfs_freeze_inodes(vfs);
+
+	struct vfs_handle_t *handle;
+	test_assert_int_eq(vfs_open(vfs, "/sparse", FILEMODE_READ, &handle), VFS_OK);
+	test_assert_true(handle->file.sparse);
+
+	uint64_t next_hole, next_data;
+	test_assert_int_eq(vfs_seek_data(handle, 0, false, &next_hole), VFS_OK);
+	test_assert(next_hole > 0);
+	test_assert(next_hole < data_offset);
+	test_assert_int_eq(vfs_seek_data(handle, next_hole, true, &next_data), VFS_OK);
+	test_assert(next_data > next_hole);
+	test_assert(next_data <= data_offset);
+	test_assert_int_eq(vfs_seek_data(handle, data_offset + 1, true, &next_data), VFS_NO_SUCH_FILE_OR_DIRECTORY);
+
+	static char buffer[64 * 1024];
+	unsigned int total = 0, nonzero = 0;
+	while (true) {
+		size_t length = sizeof(buffer);
+		test_assert_int_eq(vfs_read(handle, buffer, &length), VFS_OK);
+		if (length == 0) {
+			break;
+		}
+		for (size_t i = 0; i < length; i++) {
+			if (buffer[i]) {
+				test_assert((total + i == 0) || (total + i == data_offset));
+				nonzero++;
+			}
+		}
+		total += length;
+	}
+	test_assert_int_eq(total, data_offset + 1);
+	test_assert_int_eq(nonzero, 2);
+	vfs_close_handle(handle);
+
+	vfs_free(vfs);
+	unlink("/tmp/umsftpd_test/sparse");
+}
+
+void test_vfs_copy(void) {
+	mkdir("/tmp/umsftpd_test", 0755);
+	mkdir("/tmp/umsftpd_test/copy_src", 0755);
+	mkdir("/tmp/umsftpd_test/copy_dst", 0755);
+	FILE *f = fopen("/tmp/umsftpd_test/copy_src/file", "w");
+	test_assert(f);
+	for (unsigned int i = 0; i < 100000; i++) {
+		fputc('a' + (i % 26), f);
+	}
+	fclose(f);
+
+	struct vfs_t *vfs = vfs_init();
+	vfs_add_inode(vfs, "/", NULL, VFS_INODE_FLAG_READ_ONLY, 0);
+	vfs_add_inode(vfs, "/src", "/tmp/umsftpd_test/copy_src", 0, 0);
+	vfs_add_inode(vfs, "/dst", "/tmp/umsftpd_test/copy_dst", 0, VFS_INODE_FLAG_READ_ONLY);
+	vfs_add_inode(vfs, "/direct", "/tmp/umsftpd_test/copy_dst", VFS_INODE_FLAG_DIRECT_IO, VFS_INODE_FLAG_READ_ONLY);
+	vfs_add_inode(vfs, "/alias", "/tmp/umsftpd_test/copy_src", 0, VFS_INODE_FLAG_READ_ONLY);
+	vfs_freeze_inodes(vfs);
+
+	test_assert_int_eq(vfs_copy(vfs, "/src/file", "/dst/file"), VFS_OK);
+	check_pattern_file("/tmp/umsftpd_test/copy_dst/file", 100000);
+	test_assert_int_eq(vfs_copy(vfs, "/src/file", "/direct/file2"), VFS_OK);
+	check_pattern_file("/tmp/umsftpd_test/copy_dst/file2", 100000);
+
+	/* Destination is read-only, source does not exist, or is the same file */
+	test_assert_int_eq(vfs_copy(vfs, "/dst/file", "/src/file2"), VFS_PERMISSION_DENIED);
+	test_assert_int_eq(vfs_copy(vfs, "/src/nonexistent", "/dst/file3"), VFS_NO_SUCH_FILE_OR_DIRECTORY);
+	test_assert_int_eq(vfs_copy(vfs, "/src/file", "/alias/file"), VFS_PERMISSION_DENIED);
+	check_pattern_file("/tmp/umsftpd_test/copy_src/file", 100000);
+
+	/* Partial copy into an existing file, like the copy-data extension */
+	struct vfs_handle_t *src, *dst;
+	test_assert_int_eq(vfs_open(vfs, "/src/file", FILEMODE_READ, &src), VFS_OK);
+	test_assert_int_eq(vfs_open(vfs, "/dst/file", FILEMODE_WRITE, &dst), VFS_OK);
+	uint64_t copied;
+	test_assert_int_eq(vfs_copy_range(src, 26, 260, dst, 0, &copied), VFS_OK);
+	test_assert_int_eq(copied, 260);
+	test_assert_int_eq(vfs_copy_range(dst, 0, 0, src, 0, &copied), VFS_INTERNAL_ERROR);
+
+	/* Writing continues after the copied data */
+	write_pattern(dst, 260, 40, 16);
+	vfs_close_handle(dst);
+	vfs_close_handle(src);
+	check_pattern_file("/tmp/umsftpd_test/copy_dst/file", 300);
+
+	vfs_free(vfs);
+	unlink("/tmp/umsftpd_test/copy_src/file");
+	unlink("/tmp/umsftpd_test/copy_dst/file");
+	unlink("/tmp/umsftpd_test/copy_dst/file2");
+	rmdir("/tmp/umsftpd_test/copy_src");
+	rmdir("/tmp/umsftpd_test/copy_dst");
+}
+
+void test_vfs_check_file(void) {
+	mkdir("/tmp/umsftpd_test", 0755);
+	FILE *f = fopen("/tmp/umsftpd_test/verify", "w");
+	test_assert(f);
+	fputs("xxabcxx", f);
+	fclose(f);
+
+	struct vfs_t *vfs = vfs_init();
+	vfs_add_inode(vfs, "/", "/tmp/umsftpd_test", VFS_INODE_FLAG_READ_ONLY, 0);
+	vfs_freeze_inodes(vfs);
+
+	struct vfs_handle_t *handle;
+	test_assert_int_eq(vfs_open(vfs, "/verify", FILEMODE_READ, &handle), VFS_OK);
+
+	/* Two queued requests for the same range are served in one pass */
+	struct filehash_t *hashes[2] = {
+		filehash_new(FILEHASH_SHA256, 0),
+		filehash_new(FILEHASH_MD5, 0),
+	};
+	test_assert_int_eq(vfs_check_file(handle, 2, 3, hashes, 2), VFS_OK);
+	test_assert_int_eq(hashes[0]->digest_count, 1);
+	test_assert_int_eq(hashes[0]->digests[0], 0xba);
+	test_assert_int_eq(hashes[0]->digests[31], 0xad);
+	test_assert_int_eq(hashes[1]->digests[0], 0x90);
+	filehash_free(hashes[0]);
+	filehash_free(hashes[1]);
+
+	/* Up to the end of the file */
+	hashes[0] = filehash_new(FILEHASH_SHA1, 4);
+	test_assert_int_eq(vfs_check_file(handle, 0, 0, hashes, 1), VFS_OK);
+	test_assert_int_eq(hashes[0]->digest_count, 2);
+	filehash_free(hashes[0]);
+
+	vfs_close_handle(handle);
+	vfs_free(vfs);
+	unlink("/tmp/umsftpd_test/verify");
+}
+
+void test_vfs_upload_hash(void) {
+	mkdir("/tmp/umsftpd_test", 0755);
+	unlink("/tmp/umsftpd_test/hashed");
+
+	struct vfs_t *vfs = vfs_init();
+	vfs_add_inode(vfs, "/", "/tmp/umsftpd_test", 0, 0);
+	vfs_freeze_inodes(vfs);
+	vfs_set_upload_hashing(vfs, true, FILEHASH_SHA256);
+
+	struct vfs_handle_t *handle;
+	test_assert_int_eq(vfs_open(vfs, "/hashed", FILEMODE_WRITE, &handle), VFS_OK);
+	test_assert(handle->file.upload_hash);
+	size_t length = 1;
+	test_assert_int_eq(vfs_write(handle, "a", &length), VFS_OK);
+	length = 2;
+	test_assert_int_eq(vfs_write(handle, "bc", &length), VFS_OK);
+	vfs_close_handle(handle);
+
+	char value[VFS_HASH_XATTR_MAX_LENGTH];
+	ssize_t value_length = getxattr("/tmp/umsftpd_test/hashed", VFS_HASH_XATTR_PREFIX "sha256", value, sizeof(value) - 1);
+	if (value_length < 0) {
+		/* Filesystem without user xattrs, nothing more to test */
+		test_assert(errno == ENOTSUP);
+		vfs_free(vfs);
+		unlink("/tmp/umsftpd_test/hashed");
+		return;
+	}
+	value[value_length] = 0;
+	char *digest = strchr(strchr(value, ' ') + 1, ' ') + 1;
+	test_assert(!strncmp(digest, "ba7816bf", 8));
+	test_assert_int_eq(strlen(digest), 64);
+
+	/* A stored digest is used instead of reading the file */
+	memset(digest, '0', 64);
+	test_assert_int_eq(setxattr("/tmp/umsftpd_test/hashed", VFS_HASH_XATTR_PREFIX "sha256", value, strlen(value), 0), 0);
+	test_assert_int_eq(vfs_open(vfs, "/hashed", FILEMODE_READ, &handle), VFS_OK);
+	struct filehash_t *hash = filehash_new(FILEHASH_SHA256, 0);
+	test_assert_int_eq(vfs_check_file(handle, 0, 0, &hash, 1), VFS_OK);
+	test_assert_int_eq(hash->digest_count, 1);
+	test_assert_int_eq(hash->digests[0], 0x00);
+	filehash_free(hash);
+
+	/* Partial ranges are always computed */
+	hash = filehash_new(FILEHASH_SHA256, 0);
+	test_assert_int_eq(vfs_check_file(handle, 0, 2, &hash, 1), VFS_OK);
+	test_assert_int_eq(hash->digests[0], 0xfb);
+	filehash_free(hash);
+	vfs_close_handle(handle);
+
+	/* Modification outside of the VFS invalidates the stored digest */
+	FILE *f = fopen("/tmp/umsftpd_test/hashed", "a");
+	fputs("d", f);
+	fclose(f);
+	test_assert_int_eq(vfs_open(vfs, "/hashed", FILEMODE_READ, &handle), VFS_OK);
+	hash = filehash_new(FILEHASH_SHA256, 0);
+	test_assert_int_eq(vfs_check_file(handle, 0, 0, &hash, 1), VFS_OK);
+	test_assert_int_eq(hash->digests[0], 0x88);
+	filehash_free(hash);
+	vfs_close_handle(handle);
+
+	vfs_free(vfs);
+	unlink("/tmp/umsftpd_test/hashed");
+}
+
+static void count_signature(void *ctx, uint64_t block_index, uint32_t weak, const uint8_t *strong, unsigned int strong_length) {
+	unsigned int *count = (unsigned int*)ctx;
+	(*count)++;
+}
+
+void test_vfs_delta(void) {
+	mkdir("/tmp/umsftpd_test", 0755);
+	struct vfs_t *vfs = vfs_init();
+	vfs_add_inode(vfs, "/", "/tmp/umsftpd_test", 0, 0);
+	vfs_add_inode(vfs, "/ro", "/tmp/umsftpd_test", VFS_INODE_FLAG_READ_ONLY, 0);
+	vfs_freeze_inodes(vfs);
+
+	struct vfs_handle_t *handle;
+	test_assert_int_eq(vfs_open(vfs, "/delta", FILEMODE_WRITE, &handle), VFS_OK);
+	write_pattern(handle, 0, 1300, 100);
+	vfs_close_handle(handle);
+
+	/* Two full blocks and a short one */
+	unsigned int signature_count = 0;
+	struct delta_signer_t *signer = delta_signer_new(512, FILEHASH_MD5, 0, count_signature, &signature_count);
+	test_assert_int_eq(vfs_open(vfs, "/delta", FILEMODE_READ, &handle), VFS_OK);
+	test_assert_int_eq(vfs_delta_signature(handle, signer), VFS_OK);
+	test_assert_int_eq(signature_count, 3);
+	vfs_close_handle(handle);
+	delta_signer_free(signer);
+
+	struct vfs_delta_t *delta;
+	test_assert_int_eq(vfs_delta_begin(vfs, "/ro/delta", "/ro/delta", 512, &delta), VFS_PERMISSION_DENIED);
+
+	/* Discarded deltas leave the target untouched */
+	test_assert_int_eq(vfs_delta_begin(vfs, "/delta", "/delta", 512, &delta), VFS_OK);
+	test_assert_int_eq(vfs_delta_literal(delta, "XYZ", 3), VFS_OK);
+	test_assert_int_eq(vfs_delta_copy_blocks(delta, 3, 1), VFS_INTERNAL_ERROR);
+	test_assert_int_eq(vfs_delta_copy_blocks(delta, 1, 3), VFS_INTERNAL_ERROR);
+	test_assert_int_eq(vfs_delta_copy_blocks(delta, 0, (UINT64_MAX / 512) + 2), VFS_INTERNAL_ERROR);
+	test_assert_int_eq(delta->output_offset, 3);
+	test_assert_int_eq(vfs_delta_finish(delta, false), VFS_OK);
+	test_assert_int_eq(access("/tmp/umsftpd_test/delta" VFS_DELTA_TEMP_SUFFIX ".0", F_OK), -1);
+	check_pattern_file("/tmp/umsftpd_test/delta", 1300);
+
+	/* Blocks reordered around literal data, replacing the basis in place */
+	test_assert_int_eq(vfs_delta_begin(vfs, "/delta", "/delta", 512, &delta), VFS_OK);
+	test_assert_int_eq(vfs_delta_copy_blocks(delta, 2, 1), VFS_OK);
+	test_assert_int_eq(vfs_delta_literal(delta, "XYZ", 3), VFS_OK);
+	test_assert_int_eq(vfs_delta_copy_blocks(delta, 0, 2), VFS_OK);
+	test_assert_int_eq(delta->output_offset, 276 + 3 + 1024);
+	test_assert_int_eq(vfs_delta_finish(delta, true), VFS_OK);
+
+	FILE *f = fopen("/tmp/umsftpd_test/delta", "r");
+	char result[1400];
+	test_assert_int_eq(fread(result, 1, sizeof(result), f), 1303);
+	fclose(f);
+	test_assert_int_eq(result[0], 'a' + (1024 % 26));
+	test_assert(!memcmp(result + 276, "XYZ", 3));
+	test_assert_int_eq(result[279], 'a');
+	test_assert_int_eq(result[1302], 'a' + (1023 % 26));
+
+	/* Files that look like temporary files of another transfer survive */
+	f = fopen("/tmp/umsftpd_test/delta" VFS_DELTA_TEMP_SUFFIX, "w");
+	fputs("unrelated", f);
+	fclose(f);
+	f = fopen("/tmp/umsftpd_test/delta" VFS_DELTA_TEMP_SUFFIX ".0", "w");
+	fputs("in progress", f);
+	fclose(f);
+
+	/* Concurrent deltas of the same target do not share a temporary file */
+	struct vfs_delta_t *second_delta;
+	test_assert_int_eq(vfs_delta_begin(vfs, "/delta", "/delta", 512, &delta), VFS_OK);
+	test_assert_int_eq(vfs_delta_begin(vfs, "/delta", "/delta", 512, &second_delta), VFS_OK);
+	test_assert(strcmp(delta->output->mapped_path, second_delta->output->mapped_path));
+	test_assert_int_eq(vfs_delta_literal(delta, "first", 5), VFS_OK);
+	test_assert_int_eq(vfs_delta_literal(second_delta, "second", 6), VFS_OK);
+	test_assert_int_eq(vfs_delta_finish(second_delta, true), VFS_OK);
+	test_assert_int_eq(vfs_delta_finish(delta, true), VFS_OK);
+
+	f = fopen("/tmp/umsftpd_test/delta", "r");
+	test_assert_int_eq(fread(result, 1, sizeof(result), f), 5);
+	fclose(f);
+	test_assert(!memcmp(result, "first", 5));
+	f = fopen("/tmp/umsftpd_test/delta" VFS_DELTA_TEMP_SUFFIX, "r");
+	test_assert_int_eq(fread(result, 1, sizeof(result), f), 9);
+	fclose(f);
+	f = fopen("/tmp/umsftpd_test/delta" VFS_DELTA_TEMP_SUFFIX ".0", "r");
+	test_assert_int_eq(fread(result, 1, sizeof(result), f), 11);
+	fclose(f);
+	test_assert_int_eq(access("/tmp/umsftpd_test/delta" VFS_DELTA_TEMP_SUFFIX ".1", F_OK), -1);
+	test_assert_int_eq(access("/tmp/umsftpd_test/delta" VFS_DELTA_TEMP_SUFFIX ".2", F_OK), -1);
+
+	vfs_free(vfs);
+	unlink("/tmp/umsftpd_test/delta");
+	unlink("/tmp/umsftpd_test/delta" VFS_DELTA_TEMP_SUFFIX);
+	unlink("/tmp/umsftpd_test/delta" VFS_DELTA_TEMP_SUFFIX ".0");
+}
+
+void test_vfs_tar(void) {
+	mkdir("/tmp/umsftpd_test", 0755);
+	mkdir("/tmp/umsftpd_test/tartree", 0755);
+	mkdir("/tmp/umsftpd_test/tartree/sub", 0755);
+	FILE *f = fopen("/tmp/umsftpd_test/tartree/one", "w");
+	fputs("first", f);
+	fclose(f);
+	f = fopen("/tmp/umsftpd_test/tartree/sub/two", "w");
+	fputs("second file", f);
+	fclose(f);
+
+	struct vfs_t *vfs = vfs_init();
+	vfs_add_inode(vfs, "/", "/tmp/umsftpd_test", 0, 0);
+	vfs_freeze_inodes(vfs);
+
+	struct vfs_handle_t *handle;
+	test_assert_int_eq(vfs_open(vfs, "/tartree.tar", FILEMODE_READ, &handle), VFS_NO_SUCH_FILE_OR_DIRECTORY);
+	vfs_set_virtual_tar(vfs, true);
+	test_assert_int_eq(vfs_open(vfs, "/tartree/one.tar", FILEMODE_READ, &handle), VFS_NO_SUCH_FILE_OR_DIRECTORY);
+	test_assert_int_eq(vfs_open(vfs, "/tartree/.tar", FILEMODE_READ, &handle), VFS_NO_SUCH_FILE_OR_DIRECTORY);
+
+	/* Read in odd chunk sizes across header and data boundaries */
+	test_assert_int_eq(vfs_open(vfs, "/tartree.tar", FILEMODE_READ, &handle), VFS_OK);
+	uint8_t archive[16 * 512];
+	size_t archive_length = 0;
+	while (true) {
+		size_t length = 333;
+		test_assert(archive_length + length <= sizeof(archive));
+		test_assert_int_eq(vfs_read(handle, archive + archive_length, &length), VFS_OK);
+		if (length == 0) {
+			break;
+		}
+		archive_length += length;
+	}
+	size_t length = 10;
+	test_assert_int_eq(vfs_read_at(handle, 0, archive, &length), VFS_IO_ERROR);
+	length = 4;
+	test_assert_int_eq(vfs_write(handle, "oops", &length), VFS_IO_ERROR);
+	test_assert_int_eq(length, 0);
+	vfs_close_handle(handle);
+
+	/* Four headers, two data blocks and the end of archive marker */
+	test_assert_int_eq(archive_length, 8 * 512);
+	unsigned int found = 0;
+	for (size_t offset = 0; archive[offset]; offset += 512) {
+		const char *name = (const char*)archive + offset;
+		unsigned long size = strtoul(name + 124, NULL, 8);
+		if (!strcmp(name, "tartree/")) {
+			found |= 1;
+		} else if (!strcmp(name, "tartree/sub/")) {
+			found |= 2;
+		} else if (!strcmp(name, "tartree/one")) {
+			test_assert(!memcmp(archive + offset + 512, "first", size));
+			found |= 4;
+		} else if (!strcmp(name, "tartree/sub/two")) {
+			test_assert(!memcmp(archive + offset + 512, "second file", size));
+			found |= 8;
+		}
+		offset += (size + 511) / 512 * 512;
+	}
+	test_assert_int_eq(found, 15);
+	test_assert_int_eq(archive[archive_length - 1], 0);
+
+	vfs_free(vfs);
+	unlink("/tmp/umsftpd_test/tartree/sub/two");
+	unlink("/tmp/umsftpd_test/tartree/one");
+	rmdir("/tmp/umsftpd_test/tartree/sub");
+	rmdir("/tmp/umsftpd_test/tartree");
+}
+
+static void append_tar_member(uint8_t *archive, size_t *archive_length, const char *path, bool is_directory, const char *data) {
+	struct tarstream_entry_t entry = {
+		.path = path,
+		.is_directory = is_directory,
+		.size = data ? strlen(data) : 0,
+		.permissions = is_directory ? 0755 : 0644,
+	};
+	*archive_length += tarstream_header(archive + *archive_length, &entry);
+	if (data) {
+		memcpy(archive + *archive_length, data, entry.size);
+		memset(archive + *archive_length + entry.size, 0, tarstream_padding(entry.size));
+		*archive_length += entry.size + tarstream_padding(entry.size);
+	}
+}
+
+static enum vfs_error_t upload_tar(struct vfs_t *vfs, const char *path, const uint8_t *archive, size_t archive_length) {
+	struct vfs_handle_t *handle;
+	enum vfs_error_t result = vfs_open(vfs, path, FILEMODE_WRITE, &handle);
+	if (result != VFS_OK) {
+		return result;
+	}
+	for (size_t offset = 0; (result == VFS_OK) && (offset < archive_length); offset += 100) {
+		size_t length = ((archive_length - offset) < 100) ? (archive_length - offset) : 100;
+		result = vfs_write(handle, archive + offset, &length);
+	}
+	vfs_close_handle(handle);
+	return result;
+}
+
+void test_vfs_untar(void) {
+	mkdir("/tmp/umsftpd_test", 0755);
+	mkdir("/tmp/umsftpd_test/untar", 0755);
+	struct vfs_t *vfs = vfs_init();
+	vfs_add_inode(vfs, "/", "/tmp/umsftpd_test", 0, 0);
+	vfs_add_inode(vfs, "/nodirs", "/tmp/umsftpd_test", VFS_INODE_FLAG_DISALLOW_CREATE_DIR, 0);
+	vfs_add_inode(vfs, "/nohidden", "/tmp/umsftpd_test", VFS_INODE_FLAG_FILTER_HIDDEN, 0);
+	vfs_freeze_inodes(vfs);
+	vfs_set_virtual_tar(vfs, true);
+
+	uint8_t archive[16 * 512];
+	size_t archive_length = 0;
+	append_tar_member(archive, &archive_length, "./", true, NULL);
+	append_tar_member(archive, &archive_length, "./sub", true, NULL);
+	append_tar_member(archive, &archive_length, "./sub/file", false, "contents of file");
+	append_tar_member(archive, &archive_length, "/top", false, "x");
+	memset(archive + archive_length, 0, 1024);
+	archive_length += 1024;
+	test_assert_int_eq(upload_tar(vfs, "/untar.tar", archive, archive_length), VFS_OK);
+	test_assert_int_eq(access("/tmp/umsftpd_test/untar.tar", F_OK), -1);
+
+	char buffer[64] = { 0 };
+	FILE *f = fopen("/tmp/umsftpd_test/untar/sub/file", "r");
+	test_assert(f);
+	test_assert_int_eq(fread(buffer, 1, sizeof(buffer), f), 16);
+	fclose(f);
+	test_assert_str_eq(buffer, "contents of file");
+	struct stat statbuf;
+	test_assert_int_eq(stat("/tmp/umsftpd_test/untar/top", &statbuf), 0);
+	test_assert_int_eq(statbuf.st_size, 1);
+
+	/* Archive uploads cannot be read back, at any offset */
+	struct vfs_handle_t *handle;
+	test_assert_int_eq(vfs_open(vfs, "/untar.tar", FILEMODE_WRITE, &handle), VFS_OK);
+	test_assert(handle->file.untar);
+	size_t length = sizeof(buffer);
+	test_assert_int_eq(vfs_read_at(handle, 100, buffer, &length), VFS_IO_ERROR);
+	test_assert_int_eq(length, 0);
+	length = 1024;
+	test_assert_int_eq(vfs_write(handle, archive + archive_length - 1024, &length), VFS_OK);
+	vfs_close_handle(handle);
+
+	/* Existing directories may be reused, but no new ones created */
+	test_assert_int_eq(upload_tar(vfs, "/nodirs/untar.tar", archive, archive_length), VFS_OK);
+	archive_length = 0;
+	append_tar_member(archive, &archive_length, "newdir", true, NULL);
+	test_assert_int_eq(upload_tar(vfs, "/nodirs/untar.tar", archive, archive_length), VFS_PERMISSION_DENIED);
+	test_assert_int_eq(access("/tmp/umsftpd_test/untar/newdir", F_OK), -1);
+
+	archive_length = 0;
+	append_tar_member(archive, &archive_length, "sub/../../escaped", false, "x");
+	test_assert_int_eq(upload_tar(vfs, "/untar.tar", archive, archive_length), VFS_PERMISSION_DENIED);
+	test_assert_int_eq(access("/tmp/umsftpd_test/escaped", F_OK), -1);
+
+	archive_length = 0;
+	append_tar_member(archive, &archive_length, ".hidden", false, "x");
+	test_assert_int_eq(upload_tar(vfs, "/nohidden/untar.tar", archive, archive_length), VFS_PERMISSION_DENIED);
+	test_assert_int_eq(access("/tmp/umsftpd_test/untar/.hidden", F_OK), -1);
+
+	/* Without a directory of that name, a regular file is written */
+	test_assert_int_eq(upload_tar(vfs, "/untar/sub.tar.tar", (const uint8_t*)"plain", 5), VFS_OK);
+	test_assert_int_eq(stat("/tmp/umsftpd_test/untar/sub.tar.tar", &statbuf), 0);
+	test_assert_int_eq(statbuf.st_size, 5);
+
+	vfs_free(vfs);
+	unlink("/tmp/umsftpd_test/untar/sub.tar.tar");
+	unlink("/tmp/umsftpd_test/untar/sub/file");
+	unlink("/tmp/umsftpd_test/untar/top");
+	rmdir("/tmp/umsftpd_test/untar/sub");
+	rmdir("/tmp/umsftpd_test/untar");
+}
+
+struct walk_result_t {
+	unsigned int batches;
+	unsigned int entries;
+	unsigned int max_entries;
+	bool found_deepest, found_hidden_content;
+};
+
+static bool collect_walk(void *ctx, const struct vfs_walk_entry_t *entries, unsigned int count) {
+	struct walk_result_t *result = (struct walk_result_t*)ctx;
+	result->batches++;
+	for (unsigned int i = 0; i < count; i++) {
+		result->entries++;
+		if (!strcmp(entries[i].path, "a/b/c/deep")) {
+			test_assert(entries[i].dirent.is_file);
+			test_assert_int_eq(entries[i].dirent.filesize, 4);
+			result->found_deepest = true;
+		}
+		if (!strcmp(entries[i].path, ".hidden/inner")) {
+			result->found_hidden_content = true;
+		}
+	}
+	return !result->max_entries || (result->entries < result->max_entries);
+}
+
+void test_vfs_walk(void) {
+	mkdir("/tmp/umsftpd_test", 0755);
+	mkdir("/tmp/umsftpd_test/walk", 0755);
+	mkdir("/tmp/umsftpd_test/walk/a", 0755);
+	mkdir("/tmp/umsftpd_test/walk/a/b", 0755);
+	mkdir("/tmp/umsftpd_test/walk/a/b/c", 0755);
+	mkdir("/tmp/umsftpd_test/walk/.hidden", 0755);
+	mkdir("/tmp/umsftpd_test/walk/many", 0755);
+	FILE *f = fopen("/tmp/umsftpd_test/walk/a/b/c/deep", "w");
+	fputs("deep", f);
+	fclose(f);
+	f = fopen("/tmp/umsftpd_test/walk/.hidden/inner", "w");
+	fclose(f);
+	char filename[128];
+	for (unsigned int i = 0; i < 300; i++) {
+		snprintf(filename, sizeof(filename), "/tmp/umsftpd_test/walk/many/%u", i);
+		f = fopen(filename, "w");
+		fclose(f);
+	}
+
+	struct vfs_t *vfs = vfs_init();
+	vfs_add_inode(vfs, "/", "/tmp/umsftpd_test", 0, 0);
+	vfs_add_inode(vfs, "/nohidden", "/tmp/umsftpd_test", VFS_INODE_FLAG_FILTER_HIDDEN, 0);
+	vfs_freeze_inodes(vfs);
+
+	/* walk: a, .hidden, many; a/b; .hidden/inner; 300 in many; a/b/c; a/b/c/deep */
+	for (unsigned int threads = 0; threads <= 4; threads += 4) {
+		struct walk_result_t result = { 0 };
+		test_assert_int_eq(vfs_walk(vfs, "/walk", 0, threads, collect_walk, &result), VFS_OK);
+		test_assert_int_eq(result.entries, 307);
+		test_assert_int_eq(result.batches, 3);
+		test_assert_true(result.found_deepest);
+		test_assert_true(result.found_hidden_content);
+	}
+
+	/* Absurd thread counts are capped */
+	struct walk_result_t result = { 0 };
+	test_assert_int_eq(vfs_walk(vfs, "/walk", 0, UINT_MAX, collect_walk, &result), VFS_OK);
+	test_assert_int_eq(result.entries, 307);
+
+	result = (struct walk_result_t) { 0 };
+	test_assert_int_eq(vfs_walk(vfs, "/walk", 2, 2, collect_walk, &result), VFS_OK);
+	test_assert_int_eq(result.entries, 305);
+	test_assert_false(result.found_deepest);
+
+	/* Hidden directories are neither listed nor descended into */
+	result = (struct walk_result_t) { 0 };
+	test_assert_int_eq(vfs_walk(vfs, "/nohidden/walk", 0, 2, collect_walk, &result), VFS_OK);
+	test_assert_int_eq(result.entries, 305);
+	test_assert_false(result.found_hidden_content);
+
+	/* Stopped by the callback */
+	result = (struct walk_result_t) { .max_entries = 1 };
+	test_assert_int_eq(vfs_walk(vfs, "/walk", 0, 2, collect_walk, &result), VFS_OK);
+	test_assert_int_eq(result.batches, 1);
+
+	test_assert_int_eq(vfs_walk(vfs, "/walk/a/b/c/deep", 0, 0, collect_walk, &result), VFS_NOT_A_DIRECTORY);
+	test_assert_int_eq(vfs_walk(vfs, "/walk/missing", 0, 0, collect_walk, &result), VFS_NO_SUCH_FILE_OR_DIRECTORY);
+
+	vfs_free(vfs);
+	for (unsigned int i = 0; i < 300; i++) {
+		snprintf(filename, sizeof(filename), "/tmp/umsftpd_test/walk/many/%u", i);
+		unlink(filename);
+	}
+	unlink("/tmp/umsftpd_test/walk/a/b/c/deep");
+	unlink("/tmp/umsftpd_test/walk/.hidden/inner");
+	rmdir("/tmp/umsftpd_test/walk/a/b/c");
+	rmdir("/tmp/umsftpd_test/walk/a/b");
+	rmdir("/tmp/umsftpd_test/walk/a");
+	rmdir("/tmp/umsftpd_test/walk/.hidden");
+	rmdir("/tmp/umsftpd_test/walk/many");
+	rmdir("/tmp/umsftpd_test/walk");
+}
+
+void test_vfs_stat_many(void) {
+	mkdir("/tmp/umsftpd_test", 0755);
+	mkdir("/tmp/umsftpd_test/statmany", 0755);
+	char filename[128];
+	for (unsigned int i = 0; i < 100; i++) {
+		snprintf(filename, sizeof(filename), "/tmp/umsftpd_test/statmany/%u", i);
+		FILE *f = fopen(filename, "w");
+		for (unsigned int j = 0; j < i; j++) {
+			fputc('x', f);
+		}
+		fclose(f);
+	}
+	FILE *f = fopen("/tmp/umsftpd_test/statmany/.hidden", "w");
+	fclose(f);
+
+	struct vfs_t *vfs = vfs_init();
+	vfs_add_inode(vfs, "/", "/tmp/umsftpd_test", 0, 0);
+	vfs_add_inode(vfs, "/nohidden", "/tmp/umsftpd_test", VFS_INODE_FLAG_FILTER_HIDDEN, 0);
+	vfs_add_inode(vfs, "/virtual/dir", NULL, 0, 0);
+	vfs_freeze_inodes(vfs);
+
+	const unsigned int count = 106;
+	char names[count][64];
+	const char *paths[count];
+	for (unsigned int i = 0; i < 100; i++) {
+		snprintf(names[i], sizeof(names[i]), "/statmany/%u", i);
+	}
+	strcpy(names[100], "/statmany/missing");
+	strcpy(names[101], "/statmany");
+	strcpy(names[102], "/virtual");
+	strcpy(names[103], "/nohidden/statmany/.hidden");
+	strcpy(names[104], "/statmany/.hidden");
+	strcpy(names[105], "/statmany/5/below_file");
+	for (unsigned int i = 0; i < count; i++) {
+		paths[i] = names[i];
+	}
+
+	struct vfs_dirent_t dirents[count];
+	enum vfs_error_t results[count];
+	for (unsigned int pass = 0; pass < 3; pass++) {
+		if (pass == 2) {
+			test_assert_true(vfs_attrcache_enable(vfs, 10000, 64));
+		}
+		memset(dirents, 0, sizeof(dirents));
+		test_assert_int_eq(vfs_stat_many(vfs, paths, count, (pass == 0) ? 0 : 4, dirents, results), VFS_OK);
+		for (unsigned int i = 0; i < count; i++) {
+			struct vfs_dirent_t expected;
+			test_assert_int_eq(results[i], vfs_stat(vfs, paths[i], &expected));
+			if (results[i] == VFS_OK) {
+				test_assert_str_eq(dirents[i].filename, expected.filename);
+				test_assert_int_eq(dirents[i].is_file, expected.is_file);
+				test_assert_int_eq(dirents[i].filesize, expected.filesize);
+				test_assert_int_eq(dirents[i].permissions, expected.permissions);
+			}
+		}
+		test_assert_int_eq(dirents[42].filesize, 42);
+		test_assert_str_eq(dirents[42].filename, "42");
+		test_assert_int_eq(results[100], VFS_NO_SUCH_FILE_OR_DIRECTORY);
+		test_assert_false(dirents[101].is_file);
+		test_assert_int_eq(results[102], VFS_OK);
+		test_assert_false(dirents[102].is_file);
+		test_assert_true(results[103] != VFS_OK);
+		test_assert_int_eq(results[104], VFS_OK);
+		test_assert_true(results[105] != VFS_OK);
+	}
+	test_assert_int_eq(vfs_stat_many(vfs, paths, 0, 4, dirents, results), VFS_OK);
+
+	vfs_free(vfs);
+	for (unsigned int i = 0; i < 100; i++) {
+		snprintf(filename, sizeof(filename), "/tmp/umsftpd_test/statmany/%u", i);
+		unlink(filename);
+	}
+	unlink("/tmp/umsftpd_test/statmany/.hidden");
+	rmdir("/tmp/umsftpd_test/statmany");
+}
+
+static unsigned int count_filtered(struct vfs_t *vfs, const char *path, const char *pattern) {
+	struct vfs_handle_t *handle;
+	test_assert_int_eq(vfs_opendir_filtered(vfs, path, pattern, &handle), VFS_OK);
+	unsigned int count = 0;
+	while (true) {
+		struct vfs_dirent_t dirent;
+		test_assert_int_eq(vfs_readdir(handle, &dirent), VFS_OK);
+		if (dirent.eof) {
+			break;
+		}
+		if (pattern) {
+			test_assert_true(fnmatch(pattern, dirent.filename, 0) == 0);
+		}
+		count++;
+	}
+	vfs_close_handle(handle);
+	return count;
+}
+
+void test_vfs_readdir_filtered(void) {
+	mkdir("/tmp/umsftpd_test", 0755);
+	mkdir("/tmp/umsftpd_test/filtered", 0755);
+	char filename[128];
+	for (unsigned int i = 0; i < 50; i++) {
+		snprintf(filename, sizeof(filename), "/tmp/umsftpd_test/filtered/batch%u.%s", i, (i % 10 == 0) ? "done" : "data");
+		FILE *f = fopen(filename, "w");
+		fclose(f);
+	}
+
+	struct vfs_t *vfs = vfs_init();
+	vfs_add_inode(vfs, "/", "/tmp/umsftpd_test", 0, 0);
+	vfs_add_inode(vfs, "/filtered/virtual.done", NULL, 0, 0);
+	vfs_freeze_inodes(vfs);
+
+	for (unsigned int pass = 0; pass < 2; pass++) {
+		/* The second pass is served from the directory cache */
+		test_assert_int_eq(count_filtered(vfs, "/filtered", NULL), 51);
+		test_assert_int_eq(count_filtered(vfs, "/filtered", "*.done"), 6);
+		test_assert_int_eq(count_filtered(vfs, "/filtered", "batch1*"), 11);
+		test_assert_int_eq(count_filtered(vfs, "/filtered", "batch[0-4].data"), 4);
+		test_assert_int_eq(count_filtered(vfs, "/filtered", "virtual.done"), 1);
+		test_assert_int_eq(count_filtered(vfs, "/filtered", "nomatch*"), 0);
+		if (pass == 0) {
+			struct dircache_t *dircache = dircache_new(1024 * 1024);
+			vfs_set_dircache(vfs, dircache);
+			test_assert_int_eq(count_filtered(vfs, "/filtered", "*.done"), 6);
+			test_assert_int_eq(dircache->stats.misses, 1);
+			test_assert_int_eq(count_filtered(vfs, "/filtered", NULL), 51);
+		}
+	}
+
+	struct dircache_t *dircache = vfs->dircache;
+	vfs_free(vfs);
+	dircache_free(dircache);
+	for (unsigned int i = 0; i < 50; i++) {
+		snprintf(filename, sizeof(filename), "/tmp/umsftpd_test/filtered/batch%u.%s", i, (i % 10 == 0) ? "done" : "data");
+		unlink(filename);
+	}
+	rmdir("/tmp/umsftpd_test/filtered");
+}
+
+struct changes_t {
+	unsigned int count;
+	char paths[8][64];
+	enum changejournal_kind_t kinds[8];
+};
+
+static bool collect_change(void *ctx, const struct vfs_change_t *change) {
+	struct changes_t *changes = (struct changes_t*)ctx;
+	strcpy(changes->paths[changes->count], change->virtual_path);
+	changes->kinds[changes->count] = change->kind;
+	changes->count++;
+	return true;
+}
+
+static void write_file(struct vfs_t *vfs, const char *path, const char *content) {
+	struct vfs_handle_t *handle;
+	test_assert_int_eq(vfs_open(vfs, path, FILEMODE_WRITE, &handle), VFS_OK);
+	size_t length = strlen(content);
+	test_assert_int_eq(vfs_write(handle, content, &length), VFS_OK);
+	vfs_close_handle(handle);
+}
+
+void test_vfs_change_journal(void) {
+	mkdir("/tmp/umsftpd_test", 0755);
+	mkdir("/tmp/umsftpd_test/journal", 0755);
+	unlink("/tmp/umsftpd_test/journal/new");
+	unlink("/tmp/umsftpd_test/journal/.hidden");
+
+	struct vfs_t *vfs = vfs_init();
+	vfs_add_inode(vfs, "/", "/tmp/umsftpd_test", 0, 0);
+	vfs_add_inode(vfs, "/nohidden", "/tmp/umsftpd_test", VFS_INODE_FLAG_FILTER_HIDDEN, 0);
+	vfs_add_inode(vfs, "/unjournaled", "/tmp/umsftpd_test/journal", 0, 0);
+	vfs_add_inode(vfs, "/filtered", "/tmp/umsftpd_test/journal", 0, 0);
+	test_assert_true(vfs_add_name_filter(vfs, "/filtered", "*.secret", true));
+	test_assert_true(vfs_add_name_filter(vfs, "/filtered", "cache", true));
+	vfs_freeze_inodes(vfs);
+
+	uint64_t cursor = 0;
+	bool expired;
+	struct changes_t changes = { 0 };
+	test_assert_int_eq(vfs_changes_since(vfs, "/journal", &cursor, &expired, collect_change, &changes), VFS_PERMISSION_DENIED);
+
+	struct changejournal_t *journal = changejournal_open(NULL, 16);
+	struct changejournal_t *nohidden_journal = changejournal_open(NULL, 16);
+	struct changejournal_t *filtered_journal = changejournal_open(NULL, 16);
+	test_assert_true(vfs_attach_changejournal(vfs, "/", journal));
+	test_assert_true(vfs_attach_changejournal(vfs, "/nohidden", nohidden_journal));
+	test_assert_true(vfs_attach_changejournal(vfs, "/filtered", filtered_journal));
+	test_assert_false(vfs_attach_changejournal(vfs, "/journal", journal));
+
+	write_file(vfs, "/journal/new", "first");
+	write_file(vfs, "/journal/new", "second");
+	write_file(vfs, "/journal/.hidden", "x");
+	write_file(vfs, "/unjournaled/new", "third");
+	struct vfs_handle_t *handle;
+	test_assert_int_eq(vfs_open(vfs, "/journal/new", FILEMODE_READ, &handle), VFS_OK);
+	vfs_close_handle(handle);
+
+	struct vfs_delta_t *delta;
+	test_assert_int_eq(vfs_delta_begin(vfs, "/journal/new", "/journal/new", 512, &delta), VFS_OK);
+	test_assert_int_eq(vfs_delta_literal(delta, "delta", 5), VFS_OK);
+	test_assert_int_eq(vfs_delta_finish(delta, true), VFS_OK);
+
+	test_assert_int_eq(vfs_changes_since(vfs, "/journal", &cursor, &expired, collect_change, &changes), VFS_OK);
+	test_assert_false(expired);
+	test_assert_int_eq(changes.count, 4);
+	test_assert_str_eq(changes.paths[0], "/journal/new");
+	test_assert_int_eq(changes.kinds[0], CHANGEJOURNAL_CREATE);
+	test_assert_int_eq(changes.kinds[1], CHANGEJOURNAL_MODIFY);
+	test_assert_str_eq(changes.paths[2], "/journal/.hidden");
+	test_assert_int_eq(changes.kinds[2], CHANGEJOURNAL_CREATE);
+	test_assert_str_eq(changes.paths[3], "/journal/new");
+	test_assert_int_eq(changes.kinds[3], CHANGEJOURNAL_MODIFY);
+	test_assert_int_eq(cursor, 4);
+
+	/* Failed opens did not change anything */
+	test_assert_int_eq(vfs_open(vfs, "/journal/nonexistent_dir/file", FILEMODE_WRITE, &handle), VFS_NO_SUCH_FILE_OR_DIRECTORY);
+
+	/* Nothing new, and nothing outside the queried directory */
+	changes = (struct changes_t) { 0 };
+	test_assert_int_eq(vfs_changes_since(vfs, "/journal", &cursor, &expired, collect_change, &changes), VFS_OK);
+	test_assert_int_eq(changes.count, 0);
+	cursor = 0;
+	test_assert_int_eq(vfs_changes_since(vfs, "/other", &cursor, &expired, collect_change, &changes), VFS_OK);
+	test_assert_int_eq(changes.count, 0);
+	test_assert_int_eq(cursor, 4);
+
+	/* Hidden names are not reported to sessions that cannot see them */
+	write_file(vfs, "/nohidden/journal/new", "fourth");
+	test_assert_int_eq(vfs_open(vfs, "/nohidden/journal/.hidden", FILEMODE_WRITE, &handle), VFS_PERMISSION_DENIED);
+	changejournal_record(nohidden_journal, CHANGEJOURNAL_MODIFY, "journal/.hidden", NULL);
+	cursor = 0;
+	test_assert_int_eq(vfs_changes_since(vfs, "/nohidden", &cursor, &expired, collect_change, &changes), VFS_OK);
+	test_assert_int_eq(changes.count, 1);
+	test_assert_str_eq(changes.paths[0], "/nohidden/journal/new");
+	test_assert_int_eq(cursor, 2);
+	test_assert_int_eq(vfs_changes_since(vfs, "/nohidden/.x", &cursor, &expired, collect_change, &changes), VFS_PERMISSION_DENIED);
+
+	/* Neither are names excluded by the mount's name filters */
+	changejournal_record(filtered_journal, CHANGEJOURNAL_CREATE, "x.secret", NULL);
+	changejournal_record(filtered_journal, CHANGEJOURNAL_CREATE, "cache/x", NULL);
+	changejournal_record(filtered_journal, CHANGEJOURNAL_RENAME, "x", "x.secret");
+	changejournal_record(filtered_journal, CHANGEJOURNAL_CREATE, "sub/x.secret/y", NULL);
+	changejournal_record(filtered_journal, CHANGEJOURNAL_CREATE, "sub/cache.txt", NULL);
+	changes = (struct changes_t) { 0 };
+	cursor = 0;
+	test_assert_int_eq(vfs_changes_since(vfs, "/filtered", &cursor, &expired, collect_change, &changes), VFS_OK);
+	test_assert_int_eq(changes.count, 1);
+	test_assert_str_eq(changes.paths[0], "/filtered/sub/cache.txt");
+	test_assert_int_eq(cursor, 5);
+
+	vfs_free(vfs);
+	changejournal_free(journal);
+	changejournal_free(nohidden_journal);
+	changejournal_free(filtered_journal);
+	unlink("/tmp/umsftpd_test/journal/new");
+	unlink("/tmp/umsftpd_test/journal/.hidden");
+	rmdir("/tmp/umsftpd_test/journal");
+}
+
+static unsigned int count_listing(struct vfs_t *vfs, const char *path) {
+	return count_filtered(vfs, path, NULL);
+}
+
+void test_vfs_name_filter(void) {
+	mkdir("/tmp/umsftpd_test", 0755);
+	mkdir("/tmp/umsftpd_test/names", 0755);
+	mkdir("/tmp/umsftpd_test/names/sub", 0755);
+	mkdir("/tmp/umsftpd_test/names/cache", 0755);
+	mkdir("/tmp/umsftpd_test/names/.git", 0755);
+	const char *files[] = { "a.txt", "b.txt", "c.doc", "d.tmp", ".hidden.txt", "sub/e.txt", "sub/f.doc", "cache/g.txt" };
+	char filename[128];
+	for (unsigned int i = 0; i < sizeof(files) / sizeof(files[0]); i++) {
+		snprintf(filename, sizeof(filename), "/tmp/umsftpd_test/names/%s", files[i]);
+		FILE *f = fopen(filename, "w");
+		fclose(f);
+	}
+	symlink("c.doc", "/tmp/umsftpd_test/names/link.doc");
+	unlink("/tmp/umsftpd_test/names/new.doc");
+	unlink("/tmp/umsftpd_test/names/new.txt");
+
+	struct vfs_t *vfs = vfs_init();
+	vfs_add_inode(vfs, "/", "/tmp/umsftpd_test", 0, 0);
+	vfs_add_inode(vfs, "/filtered", "/tmp/umsftpd_test/names", VFS_INODE_FLAG_FILTER_HIDDEN | VFS_INODE_FLAG_ALLOW_SYMLINKS, 0);
+	test_assert_true(vfs_add_name_filter(vfs, "/filtered", "*.txt", false));
+	test_assert_true(vfs_add_name_filter(vfs, "/filtered", "*.tmp", true));
+	test_assert_true(vfs_add_name_filter(vfs, "/filtered", "cache", true));
+	test_assert_false(vfs_add_name_filter(vfs, "/nomount", "*", true));
+	vfs_freeze_inodes(vfs);
+	test_assert_false(vfs_add_name_filter(vfs, "/filtered", "*", true));
+
+	/* Unfiltered: a, b, c, d, .hidden, sub, cache, .git, link */
+	test_assert_int_eq(count_listing(vfs, "/names"), 9);
+	/* a.txt, b.txt and sub; link.doc is only dropped once stat shows it is a file */
+	test_assert_int_eq(count_listing(vfs, "/filtered"), 3);
+	test_assert_int_eq(count_listing(vfs, "/filtered/sub"), 1);
+
+	struct vfs_dirent_t dirent;
+	test_assert_int_eq(vfs_stat(vfs, "/filtered/a.txt", &dirent), VFS_OK);
+	test_assert_int_eq(vfs_stat(vfs, "/filtered/sub", &dirent), VFS_OK);
+	test_assert_int_eq(vfs_stat(vfs, "/filtered/c.doc", &dirent), VFS_NO_SUCH_FILE_OR_DIRECTORY);
+	test_assert_int_eq(vfs_stat(vfs, "/filtered/link.doc", &dirent), VFS_NO_SUCH_FILE_OR_DIRECTORY);
+	test_assert_int_eq(vfs_stat(vfs, "/filtered/d.tmp", &dirent), VFS_NO_SUCH_FILE_OR_DIRECTORY);
+	test_assert_int_eq(vfs_stat(vfs, "/filtered/cache", &dirent), VFS_NO_SUCH_FILE_OR_DIRECTORY);
+	test_assert_int_eq(vfs_stat(vfs, "/filtered/cache/g.txt", &dirent), VFS_NO_SUCH_FILE_OR_DIRECTORY);
+	test_assert_int_eq(vfs_stat(vfs, "/filtered/.hidden.txt", &dirent), VFS_PERMISSION_DENIED);
+
+	struct vfs_handle_t *handle;
+	test_assert_int_eq(vfs_open(vfs, "/filtered/sub/e.txt", FILEMODE_READ, &handle), VFS_OK);
+	vfs_close_handle(handle);
+	test_assert_int_eq(vfs_open(vfs, "/filtered/sub/f.doc", FILEMODE_READ, &handle), VFS_NO_SUCH_FILE_OR_DIRECTORY);
+	test_assert_int_eq(vfs_open(vfs, "/filtered/new.doc", FILEMODE_WRITE, &handle), VFS_PERMISSION_DENIED);
+	test_assert_int_eq(access("/tmp/umsftpd_test/names/new.doc", F_OK), -1);
+	test_assert_int_eq(vfs_open(vfs, "/filtered/new.txt", FILEMODE_WRITE, &handle), VFS_OK);
+	vfs_close_handle(handle);
+	test_assert_int_eq(vfs_opendir(vfs, "/filtered/cache", &handle), VFS_NO_SUCH_FILE_OR_DIRECTORY);
+
+	/* Delta transfers use a temporary file that does not match */
+	struct vfs_delta_t *delta;
+	test_assert_int_eq(vfs_delta_begin(vfs, "/filtered/a.txt", "/filtered/a.txt", 512, &delta), VFS_OK);
+	test_assert_int_eq(vfs_delta_finish(delta, true), VFS_OK);
+	test_assert_int_eq(vfs_delta_begin(vfs, "/filtered/a.txt", "/filtered/c.doc", 512, &delta), VFS_PERMISSION_DENIED);
+
+	/* The same policy applies to listings served from the directory cache */
+	struct dircache_t *dircache = dircache_new(1024 * 1024);
+	vfs_set_dircache(vfs, dircache);
+	for (unsigned int pass = 0; pass < 2; pass++) {
+		test_assert_int_eq(count_listing(vfs, "/filtered"), 4);
+	}
+
+	vfs_free(vfs);
+	dircache_free(dircache);
+	for (unsigned int i = 0; i < sizeof(files) / sizeof(files[0]); i++) {
+		snprintf(filename, sizeof(filename), "/tmp/umsftpd_test/names/%s", files[i]);
+		unlink(filename);
+	}
+	unlink("/tmp/umsftpd_test/names/link.doc");
+	unlink("/tmp/umsftpd_test/names/new.txt");
+	rmdir("/tmp/umsftpd_test/names/sub");
+	rmdir("/tmp/umsftpd_test/names/cache");
+	rmdir("/tmp/umsftpd_test/names/.git");
+	rmdir("/tmp/umsftpd_test/names");
+}
+
+struct backend_calls_t {
+	unsigned int stats, opens, readdirs;
+};
+
+static int counting_stat(void *ctx, const char *path, struct stat *statbuf) {
+	((struct backend_calls_t*)ctx)->stats++;
+	return vfsbackend_posix()->ops->stat(NULL, path, statbuf);
+}
+
+static void *counting_open(void *ctx, const char *path, int flags, mode_t mode) {
+	((struct backend_calls_t*)ctx)->opens++;
+	return vfsbackend_posix()->ops->open(NULL, path, flags, mode);
+}
+
+static int counting_readdir(void *ctx, void *dir, char *name, size_t name_size, struct stat *statbuf) {
+	((struct backend_calls_t*)ctx)->readdirs++;
+	return vfsbackend_posix()->ops->readdir(NULL, dir, name, name_size, statbuf);
+}
+
+static void read_file(struct vfs_t *vfs, const char *path, char *buffer, size_t buffer_size) {
+	struct vfs_handle_t *handle;
+	test_assert_int_eq(vfs_open(vfs, path, FILEMODE_READ, &handle), VFS_OK);
+	size_t length = buffer_size - 1;
+	test_assert_int_eq(vfs_read(handle, buffer, &length), VFS_OK);
+	buffer[length] = 0;
+	vfs_close_handle(handle);
+}
+
+void test_vfs_backend(void) {
+	mkdir("/tmp/umsftpd_test", 0755);
+	mkdir("/tmp/umsftpd_test/backend", 0755);
+	mkdir("/tmp/umsftpd_test/backend/sub", 0755);
+	mkdir("/tmp/umsftpd_test/backend/extracted", 0755);
+	FILE *f = fopen("/tmp/umsftpd_test/backend/sub/file", "w");
+	fprintf(f, "contents");
+	fclose(f);
+	symlink("sub/file", "/tmp/umsftpd_test/backend/link");
+
+	/* The same directory, once through the built-in host filesystem access
+	 * and once through the posix backend */
+	struct backend_calls_t calls = { 0 };
+	struct vfs_backend_ops_t ops = *vfsbackend_posix()->ops;
+	ops.stat = counting_stat;
+	ops.open = counting_open;
+	ops.readdir = counting_readdir;
+	struct vfs_backend_t backend = {
+		.name = "counting",
+		.ops = &ops,
+		.ctx = &calls,
+		.host_paths = true,
+	};
+	struct vfs_t *vfs = vfs_init();
+	vfs_add_inode(vfs, "/", "/tmp/umsftpd_test", 0, 0);
+	vfs_add_inode(vfs, "/native", "/tmp/umsftpd_test/backend", 0, 0);
+	vfs_add_inode(vfs, "/posix", "/tmp/umsftpd_test/backend", 0, 0);
+	test_assert_true(vfs_set_mount_backend(vfs, "/posix", &backend));
+	test_assert_false(vfs_set_mount_backend(vfs, "/nomount", &backend));
+	vfs_freeze_inodes(vfs);
+	vfs_set_virtual_tar(vfs, true);
+
+	test_assert_int_eq(count_listing(vfs, "/posix"), count_listing(vfs, "/native"));
+	test_assert_int_eq(count_listing(vfs, "/posix/sub"), 1);
+	test_assert_true(calls.readdirs > 0);
+
+	struct vfs_dirent_t native_dirent, posix_dirent;
+	test_assert_int_eq(vfs_stat(vfs, "/native/sub/file", &native_dirent), VFS_OK);
+	test_assert_int_eq(vfs_stat(vfs, "/posix/sub/file", &posix_dirent), VFS_OK);
+	test_assert_int_eq(posix_dirent.filesize, native_dirent.filesize);
+	test_assert_true(posix_dirent.is_file);
+	test_assert_true(calls.stats > 0);
+
+	/* The symlink policy still applies to host paths */
+	test_assert_int_eq(vfs_stat(vfs, "/posix/link", &posix_dirent), VFS_NO_SUCH_FILE_OR_DIRECTORY);
+
+	char buffer[64];
+	read_file(vfs, "/posix/sub/file", buffer, sizeof(buffer));
+	test_assert_str_eq(buffer, "contents");
+
+	write_file(vfs, "/posix/sub/file", "new");
+	struct vfs_handle_t *handle;
+	test_assert_int_eq(vfs_open(vfs, "/posix/sub/file", FILEMODE_APPEND, &handle), VFS_OK);
+	size_t length = 4;
+	test_assert_int_eq(vfs_write(handle, " end", &length), VFS_OK);
+	vfs_close_handle(handle);
+	read_file(vfs, "/native/sub/file", buffer, sizeof(buffer));
+	test_assert_str_eq(buffer, "new end");
+	test_assert_true(calls.opens >= 3);
+
+	test_assert_int_eq(vfs_copy(vfs, "/native/sub/file", "/posix/copy"), VFS_OK);
+	read_file(vfs, "/posix/copy", buffer, sizeof(buffer));
+	test_assert_str_eq(buffer, "new end");
+	test_assert_int_eq(vfs_copy(vfs, "/posix/copy", "/posix/copy"), VFS_PERMISSION_DENIED);
+
+	struct vfs_delta_t *delta;
+	test_assert_int_eq(vfs_delta_begin(vfs, "/posix/copy", "/posix/copy", 512, &delta), VFS_OK);
+	test_assert_int_eq(vfs_delta_literal(delta, "delta ", 6), VFS_OK);
+	test_assert_int_eq(vfs_delta_copy_blocks(delta, 0, 1), VFS_OK);
+	test_assert_int_eq(vfs_delta_finish(delta, true), VFS_OK);
+	read_file(vfs, "/native/copy", buffer, sizeof(buffer));
+	test_assert_str_eq(buffer, "delta new end");
+
+	uint8_t archive[8 * 512];
+	size_t archive_length = 0;
+	append_tar_member(archive, &archive_length, "./", true, NULL);
+	append_tar_member(archive, &archive_length, "./dir", true, NULL);
+	append_tar_member(archive, &archive_length, "./dir/file", false, "extracted");
+	memset(archive + archive_length, 0, 1024);
+	archive_length += 1024;
+	test_assert_int_eq(upload_tar(vfs, "/posix/extracted.tar", archive, archive_length), VFS_OK);
+	read_file(vfs, "/native/extracted/dir/file", buffer, sizeof(buffer));
+	test_assert_str_eq(buffer, "extracted");
+
+	vfs_free(vfs);
+	unlink("/tmp/umsftpd_test/backend/extracted/dir/file");
+	rmdir("/tmp/umsftpd_test/backend/extracted/dir");
+	rmdir("/tmp/umsftpd_test/backend/extracted");
+	unlink("/tmp/umsftpd_test/backend/copy");
+	unlink("/tmp/umsftpd_test/backend/link");
+	unlink("/tmp/umsftpd_test/backend/sub/file");
+	rmdir("/tmp/umsftpd_test/backend/sub");
+	rmdir("/tmp/umsftpd_test/backend");
+}
+
+void test_vfs_memfs(void) {
+	mkdir("/tmp/umsftpd_test", 0755);
+	FILE *f = fopen("/tmp/umsftpd_test/memfs_source", "w");
+	fprintf(f, "from disk");
+	fclose(f);
+
+	struct memfs_t *memfs = memfs_new(1024 * 1024);
+	const struct vfs_backend_t *backend = memfs_backend(memfs);
+	test_assert_int_eq(backend->ops->mkdir(backend->ctx, "/incoming", 0755), 0);
+	struct vfs_t *vfs = vfs_init();
+	vfs_add_inode(vfs, "/", "/tmp/umsftpd_test", 0, 0);
+	vfs_add_inode(vfs, "/staging", "/", 0, 0);
+	vfs_add_inode(vfs, "/readonly", "/incoming", VFS_INODE_FLAG_READ_ONLY, 0);
+	test_assert_true(vfs_set_mount_backend(vfs, "/staging", backend));
+	test_assert_true(vfs_set_mount_backend(vfs, "/readonly", backend));
+	vfs_freeze_inodes(vfs);
+	vfs_set_virtual_tar(vfs, true);
+
+	test_assert_int_eq(count_listing(vfs, "/staging"), 1);
+	write_file(vfs, "/staging/incoming/a", "first");
+	write_file(vfs, "/staging/b", "second");
+	test_assert_int_eq(count_listing(vfs, "/staging"), 2);
+	test_assert_int_eq(count_listing(vfs, "/readonly"), 1);
+	test_assert_int_eq(access("/tmp/umsftpd_test/b", F_OK), -1);
+
+	struct vfs_dirent_t dirent;
+	test_assert_int_eq(vfs_stat(vfs, "/readonly/a", &dirent), VFS_OK);
+	test_assert_true(dirent.is_file);
+	test_assert_int_eq(dirent.filesize, 5);
+	test_assert_int_eq(dirent.permissions & 0222, 0);
+	test_assert_int_eq(vfs_stat(vfs, "/staging/missing", &dirent), VFS_NO_SUCH_FILE_OR_DIRECTORY);
+	test_assert_int_eq(vfs_chdir(vfs, "/staging/incoming"), VFS_OK);
+	test_assert_int_eq(vfs_chdir(vfs, "/staging/b"), VFS_NOT_A_DIRECTORY);
+	test_assert_int_eq(vfs_chdir(vfs, "/"), VFS_OK);
+
+	struct vfs_handle_t *handle;
+	test_assert_int_eq(vfs_open(vfs, "/readonly/a", FILEMODE_WRITE, &handle), VFS_PERMISSION_DENIED);
+	test_assert_int_eq(vfs_open(vfs, "/staging/incoming", FILEMODE_READ, &handle), VFS_NOT_A_FILE);
+
+	/* Bulk stats are answered on the calling thread */
+	const char *paths[] = { "/staging/b", "/memfs_source", "/staging/missing" };
+	struct vfs_dirent_t dirents[3];
+	enum vfs_error_t results[3];
+	test_assert_int_eq(vfs_stat_many(vfs, paths, 3, 4, dirents, results), VFS_OK);
+	test_assert_int_eq(results[0], VFS_OK);
+	test_assert_int_eq(dirents[0].filesize, 6);
+	test_assert_int_eq(results[1], VFS_OK);
+	test_assert_int_eq(results[2], VFS_NO_SUCH_FILE_OR_DIRECTORY);
+
+	/* Copies between disk and memory in both directions */
+	test_assert_int_eq(vfs_copy(vfs, "/memfs_source", "/staging/copy"), VFS_OK);
+	test_assert_int_eq(vfs_copy(vfs, "/staging/copy", "/memfs_copy"), VFS_OK);
+	char buffer[64] = { 0 };
+	f = fopen("/tmp/umsftpd_test/memfs_copy", "r");
+	test_assert_int_eq(fread(buffer, 1, sizeof(buffer), f), 9);
+	fclose(f);
+	test_assert_str_eq(buffer, "from disk");
+
+	uint64_t offset;
+	test_assert_int_eq(vfs_open(vfs, "/staging/copy", FILEMODE_READ, &handle), VFS_OK);
+	test_assert_int_eq(vfs_seek_data(handle, 2, true, &offset), VFS_OK);
+	test_assert_int_eq(offset, 2);
+	test_assert_int_eq(vfs_seek_data(handle, 2, false, &offset), VFS_OK);
+	test_assert_int_eq(offset, 9);
+	size_t length = 4;
+	test_assert_int_eq(vfs_read_at(handle, 5, buffer, &length), VFS_OK);
+	test_assert_int_eq(length, 4);
+	test_assert_int_eq(memcmp(buffer, "disk", 4), 0);
+	vfs_close_handle(handle);
+
+	/* Delta transfers replace the target within memory */
+	struct vfs_delta_t *delta;
+	test_assert_int_eq(vfs_delta_begin(vfs, "/staging/copy", "/staging/copy", 512, &delta), VFS_OK);
+	test_assert_int_eq(vfs_delta_copy_blocks(delta, 0, 1), VFS_OK);
+	test_assert_int_eq(vfs_delta_literal(delta, " and delta", 10), VFS_OK);
+	test_assert_int_eq(vfs_delta_finish(delta, true), VFS_OK);
+	test_assert_int_eq(vfs_stat(vfs, "/staging/copy", &dirent), VFS_OK);
+	test_assert_int_eq(dirent.filesize, 19);
+	test_assert_int_eq(count_listing(vfs, "/staging"), 3);
+
+	/* Archive uploads create directories in memory */
+	test_assert_int_eq(backend->ops->mkdir(backend->ctx, "/unpacked", 0755), 0);
+	uint8_t archive[8 * 512];
+	size_t archive_length = 0;
+	append_tar_member(archive, &archive_length, "./", true, NULL);
+	append_tar_member(archive, &archive_length, "./dir", true, NULL);
+	append_tar_member(archive, &archive_length, "./dir/file", false, "unpacked");
+	memset(archive + archive_length, 0, 1024);
+	archive_length += 1024;
+	test_assert_int_eq(upload_tar(vfs, "/staging/unpacked.tar", archive, archive_length), VFS_OK);
+	test_assert_int_eq(vfs_stat(vfs, "/staging/unpacked/dir/file", &dirent), VFS_OK);
+	test_assert_int_eq(dirent.filesize, 8);
+
+	struct walk_result_t walked = { 0 };
+	test_assert_int_eq(vfs_walk(vfs, "/staging", 8, 2, collect_walk, &walked), VFS_OK);
+	test_assert_int_eq(walked.entries, 7);
+
+	vfs_free(vfs);
+	test_assert_true(memfs_used_bytes(memfs) > 0);
+	memfs_free(memfs);
+	unlink("/tmp/umsftpd_test/memfs_source");
+	unlink("/tmp/umsftpd_test/memfs_copy");
+}
+
+void test_vfs_freeze_failure(void) {
+	struct vfs_t *vfs = vfs_init();
+	vfs_add_inode(vfs, "/", "/tmp/umsftpd_test", 0, 0);
+	vfs_add_inode(vfs, "/a", "/tmp/umsftpd_test", 0, 0);
+	vfs_add_inode(vfs, "/a/b", "/tmp/umsftpd_test", 0, 0);
+	test_assert_true(vfs_add_name_filter(vfs, "/a/b", "[[:alpha:]]*", false));
+
+	/* The broken filter is only compiled after the parent inodes have been
+	 * linked; a retry must not see any of that partial state */
+	for (unsigned int attempt = 0; attempt < 2; attempt++) {
+		test_assert_false(vfs_freeze_inodes(vfs));
+		test_assert_false(vfs->inode.frozen);
+		test_assert_true(vfs->inode.root == NULL);
+		test_assert_true(vfs->atoms == NULL);
+		for (unsigned int i = 0; i < vfs->inode.count; i++) {
+			test_assert_int_eq(vfs->inode.data[i]->child_count, 0);
+			test_assert_int_eq(vfs->inode.data[i]->component_count, 0);
+			test_assert_true(vfs->inode.data[i]->components == NULL);
+		}
+	}
+	vfs_free(vfs);
+}
@@ -29,6 +29,30 @@ void test_empty_vfs(void);
 void test_vfs_lookup(void);
 void test_vfs_ro_root(void);
 void test_vfs_opendir(void);
+void test_vfs_attrcache(void);
+void test_vfs_dircache(void);
+void test_vfs_contentindex(void);
+void test_vfs_fdcache(void);
+void test_vfs_blockcache(void);
+void test_vfs_mmap(void);
+void test_vfs_direct_io(void);
+void test_vfs_access_hints(void);
+void test_vfs_preallocate(void);
+void test_vfs_sparse(void);
+void test_vfs_copy(void);
+void test_vfs_check_file(void);
+void test_vfs_upload_hash(void);
+void test_vfs_delta(void);
+void test_vfs_tar(void);
+void test_vfs_untar(void);
+void test_vfs_walk(void);
+void test_vfs_stat_many(void);
+void test_vfs_readdir_filtered(void);
+void test_vfs_change_journal(void);
+void test_vfs_name_filter(void);
+void test_vfs_backend(void);
+void test_vfs_memfs(void);
+void test_vfs_freeze_failure(void);
 /***************  AUTO GENERATED SECTION ENDS   ***************/
 
 #endif
@@ -31,10 +31,22 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <time.h>
+#include <signal.h>
+#include <setjmp.h>
+#include <sys/mman.h>
+#include <sys/xattr.h>
 
 #include "vfs.h"
 #include "logging.h"
 #include "strings.h"
+#include "dircache.h"
+#include "contentindex.h"
+#include "fdcache.h"
+#include "blockcache.h"
+#include "globfilter.h"
+#include "changejournal.h"
+#include "vfsbackend.h"
 
 static const char *mode_string_mapping[] = {
 	[FILEMODE_READ] = "r",
@@ -42,25 +54,25 @@ static const char *mode_string_mapping[] = {
 	[FILEMODE_APPEND] = "a",
 };
 
-static struct vfs_inode_t* vfs_add_single_inode(struct vfs_t *vfs, const char *virtual_path, const char *target_path, unsigned int flags_set, unsigned int flags_reset, struct vfs_inode_t *parent);
-
-struct vfs_lookup_traversal_t {
-	struct vfs_t *vfs;
-	struct vfs_lookup_result_t *map_result;
+static const int mode_flags_mapping[] = {
+	[FILEMODE_READ] = O_RDONLY,
+	[FILEMODE_WRITE] = O_WRONLY | O_CREAT | O_TRUNC,
+	[FILEMODE_APPEND] = O_WRONLY | O_CREAT | O_APPEND,
 };
 
-struct vfs_inode_adding_ctx_t {
-	struct vfs_t *vfs;
-	struct vfs_inode_t *previous;
-	unsigned int leaf_flags_set, leaf_flags_reset;
-	const char *leaf_target_path;
-};
+static struct vfs_inode_t* vfs_add_single_inode(struct vfs_t *vfs, const char *virtual_path, const char *target_path, unsigned int flags_set, unsigned int flags_reset, struct vfs_inode_t *parent);
 
 struct vfs_validate_constraints_ctx_t {
 	bool constraints_fulfilled;
 	unsigned int flags;
 };
 
+/* Set while a thread copies from a file mapping, so that a SIGBUS caused by
+ * a concurrently truncated file turns into an I/O error */
+static _Thread_local sigjmp_buf *vfs_sigbus_jmpbuf;
+static struct sigaction vfs_previous_sigbus_action;
+static bool vfs_sigbus_handler_installed;
+
 const char *vfs_error_str(enum vfs_error_t error_code) {
 	switch (error_code) {
 		case VFS_OK: return "success";
@@ -71,6 +83,7 @@ const char *vfs_error_str(enum vfs_error_t error_code) {
 		case VFS_NOT_A_DIRECTORY: return "not a directory";
 		case VFS_NOT_A_FILE: return "not a file";
 		case VFS_IO_ERROR: return "I/O error";
+		case VFS_FILE_EXISTS: return "file exists";
 	}
 	return "unknown error";
 }
@@ -86,18 +99,30 @@ static void vfs_set_error(struct vfs_t *vfs, enum vfs_internal_error_t error_cod
 	logmsg(LLVL_ERROR, "VFS error %d: %s", vfs->error.code, vfs->error.string);
 }
 
-static struct vfs_inode_t *vfs_find_inode(struct vfs_t *vfs, const char *virtual_path) {
+static struct vfs_inode_t *vfs_find_inode(struct vfs_t *vfs, const char *virtual_path, size_t length) {
+	/* Match with or without trailing slash */
+	if (length && (virtual_path[length - 1] == '/')) {
+		length--;
+	}
 	for (unsigned int i = 0; i < vfs->inode.count; i++) {
 		struct vfs_inode_t *inode = vfs->inode.data[i];
-
-		/* Search for match with trailing slash */
-		if (pathcmp(inode->virtual_path, virtual_path)) {
+		if ((inode->vlen == length) && !memcmp(inode->virtual_path, virtual_path, length)) {
 			return inode;
 		}
 	}
 	return NULL;
 }
 
+static struct vfs_inode_t *vfs_inode_child(const struct vfs_inode_t *inode, unsigned int atom) {
+	for (unsigned int i = 0; i < inode->child_count; i++) {
+		struct vfs_inode_t *child = inode->children[i];
+		if (child->components[child->component_count - 1] == atom) {
+			return child;
+		}
+	}
+	return NULL;
+}
+
 static bool vfs_set_cwd(struct vfs_t *vfs, const char *new_cwd) {
 	if (!is_absolute_path(new_cwd)) {
 		vfs_set_error(vfs, VFS_CWD_ILLEGAL, "working directory must be an absolute path");
@@ -121,22 +146,6 @@ static bool vfs_set_cwd(struct vfs_t *vfs, const char *new_cwd) {
 	return true;
 }
 
-static bool vfs_add_inode_splitter(const char *path, bool is_full_path, void *vctx) {
-	struct vfs_inode_adding_ctx_t *ctx = (struct vfs_inode_adding_ctx_t*)vctx;
-	struct vfs_inode_t *inode = vfs_find_inode(ctx->vfs, path);
-	if (!inode) {
-		/* Create this inode */
-		if (!is_full_path) {
-			ctx->previous = vfs_add_single_inode(ctx->vfs, path, NULL, 0, 0, ctx->previous);
-		} else {
-			ctx->previous = vfs_add_single_inode(ctx->vfs, path, ctx->leaf_target_path, ctx->leaf_flags_set, ctx->leaf_flags_reset, ctx->previous);
-		}
-	} else {
-		ctx->previous = inode;
-	}
-	return true;
-}
-
 static struct vfs_inode_t* vfs_add_single_inode(struct vfs_t *vfs, const char *virtual_path, const char *target_path, unsigned int flags_set, unsigned int flags_reset, struct vfs_inode_t *parent) {
 	char *vpath_copy = strdup(virtual_path);
 	if (!vpath_copy) {
@@ -201,35 +210,31 @@ bool vfs_add_inode(struct vfs_t *vfs, const char *virtual_path, const char *targ
 		return false;
 	}
 
-	if (vfs_find_inode(vfs, virtual_path)) {
+	size_t len = strlen(virtual_path);
+	if (vfs_find_inode(vfs, virtual_path, len)) {
 		vfs_set_error(vfs, VFS_ADD_INODE_ALREADY_EXISTS, "virtual path inode for '%s' is duplicate", virtual_path);
 		return false;
 	}
 
-	struct vfs_inode_adding_ctx_t ctx = {
-		.vfs = vfs,
-		.previous = NULL,
-		.leaf_flags_set = flags_set,
-		.leaf_flags_reset = flags_reset,
-		.leaf_target_path = target_path,
-	};
-	path_split(virtual_path, vfs_add_inode_splitter, &ctx);
-
-	return true;
-}
-
-static bool vfs_lookup_splitter(const char *path, bool is_full_path, void *vctx) {
-	struct vfs_lookup_traversal_t *ctx = (struct vfs_lookup_traversal_t*)vctx;
-	struct vfs_inode_t *inode = vfs_find_inode(ctx->vfs, path);
-	if (inode) {
-		ctx->map_result->flags = (ctx->map_result->flags | inode->flags_set) & ~inode->flags_reset;
-		if (is_full_path) {
-			ctx->map_result->inode = inode;
-		}
-		if (inode->target_path) {
-			ctx->map_result->mountpoint = inode;
+	/* Create all intermediate inodes which do not exist yet */
+	struct vfs_inode_t *previous = NULL;
+	struct path_iter_t iter;
+	path_iter_init(&iter, virtual_path, len);
+	while (path_iter_next(&iter)) {
+		struct vfs_inode_t *inode = vfs_find_inode(vfs, virtual_path, iter.prefix_length);
+		if (!inode) {
+			char prefix[iter.prefix_length + 1];
+			memcpy(prefix, virtual_path, iter.prefix_length);
+			prefix[iter.prefix_length] = 0;
+			if (!iter.is_full_path) {
+				inode = vfs_add_single_inode(vfs, prefix, NULL, 0, 0, previous);
+			} else {
+				inode = vfs_add_single_inode(vfs, prefix, target_path, flags_set, flags_reset, previous);
+			}
 		}
+		previous = inode;
 	}
+
 	return true;
 }
 
@@ -244,30 +249,49 @@ bool vfs_lookup(struct vfs_t *vfs, struct vfs_lookup_result_t *result, const cha
 		return false;
 	}
 
-	size_t len = strlen(path);
-	size_t total_len = len;
-
-	bool absolute_path = is_absolute_path(path);
-	if (!absolute_path) {
-		total_len += vfs->cwd.length;
-	}
-
-	char mpath[total_len + 1];
-	if (absolute_path) {
-		strcpy(mpath, path);
-	} else {
-		strcpy(mpath, vfs->cwd.path);
-		strcpy(mpath + vfs->cwd.length, path);
-	}
-
 	memset(result, 0, sizeof(*result));
 	result->flags = vfs->inode.base_flags;
 
-	struct vfs_lookup_traversal_t ctx = {
-		.vfs = vfs,
-		.map_result = result,
-	};
-	path_split(mpath, vfs_lookup_splitter, &ctx);
+	/* The first prefix of an absolute path always is the root inode. After
+	 * that, every component is hashed exactly once and then only compared by
+	 * its atom against the children of the deepest inode found so far. */
+	struct vfs_inode_t *current = NULL;
+	bool at_root = true;
+	struct path_iter_t iter;
+	path_iter_init(&iter, path, strlen(path));
+	while (path_iter_next(&iter)) {
+		struct vfs_inode_t *inode = NULL;
+		bool last_match = false;
+		if (at_root) {
+			inode = vfs->inode.root;
+			at_root = false;
+		} else if (iter.component_length == 0) {
+			/* Repeated slash, refers to the same inode once more but nothing
+			 * below it can match anymore */
+			inode = current;
+			last_match = !iter.is_full_path;
+		} else {
+			unsigned int atom;
+			if (atomtable_lookup(vfs->atoms, iter.component, iter.component_length, &atom)) {
+				inode = vfs_inode_child(current, atom);
+			}
+		}
+		if (!inode) {
+			break;
+		}
+
+		result->flags = (result->flags | inode->flags_set) & ~inode->flags_reset;
+		if (iter.is_full_path) {
+			result->inode = inode;
+		}
+		if (inode->target_path) {
+			result->mountpoint = inode;
+		}
+		current = inode;
+		if (last_match) {
+			break;
+		}
+	}
 	return true;
 }
 
@@ -279,14 +303,199 @@ static int vfs_inode_comparator(const void *velem1, const void *velem2) {
 	return strcmp(inode1->virtual_path, inode2->virtual_path);
 }
 
-void vfs_freeze_inodes(struct vfs_t *vfs) {
+/* Adds an include or exclude glob pattern to a mountpoint. Patterns apply to
+ * every path component below the mountpoint; if any include patterns are
+ * given, only files matching at least one of them are visible. */
+bool vfs_add_name_filter(struct vfs_t *vfs, const char *virtual_path, const char *pattern, bool exclude) {
+	if (vfs->inode.frozen) {
+		vfs_set_error(vfs, VFS_INODE_FINALIZATION_ERROR, "name filters can only be added before inodes are frozen");
+		return false;
+	}
+	struct vfs_inode_t *inode = vfs_find_inode(vfs, virtual_path, strlen(virtual_path));
+	if (!inode || !inode->target_path) {
+		vfs_set_error(vfs, VFS_NOT_MOUNTED, "vfs_add_name_filter() requires a mountpoint, but '%s' is not", virtual_path);
+		return false;
+	}
+
+	char **new_patterns = realloc(inode->filter_patterns, sizeof(char*) * (inode->filter_pattern_count + 1));
+	if (!new_patterns) {
+		vfs_set_error(vfs, VFS_OUT_OF_MEMORY, "vfs_add_name_filter() could not allocate pattern memory");
+		return false;
+	}
+	inode->filter_patterns = new_patterns;
+	uint32_t *new_labels = realloc(inode->filter_labels, sizeof(uint32_t) * (inode->filter_pattern_count + 1));
+	if (!new_labels) {
+		vfs_set_error(vfs, VFS_OUT_OF_MEMORY, "vfs_add_name_filter() could not allocate pattern memory");
+		return false;
+	}
+	inode->filter_labels = new_labels;
+	inode->filter_patterns[inode->filter_pattern_count] = strdup(pattern);
+	if (!inode->filter_patterns[inode->filter_pattern_count]) {
+		vfs_set_error(vfs, VFS_OUT_OF_MEMORY, "vfs_add_name_filter() could not copy pattern");
+		return false;
+	}
+	inode->filter_labels[inode->filter_pattern_count] = exclude ? VFS_NAME_FILTER_EXCLUDE : VFS_NAME_FILTER_INCLUDE;
+	inode->filter_pattern_count++;
+	return true;
+}
+
+static bool vfs_freeze_inode(struct vfs_t *vfs, struct vfs_inode_t *inode) {
+	struct path_iter_t iter;
+
+	path_iter_init(&iter, inode->virtual_path, inode->vlen);
+	while (path_iter_next(&iter)) {
+		if (iter.component_length) {
+			inode->component_count++;
+		}
+	}
+
+	if (inode->component_count) {
+		inode->components = calloc(inode->component_count, sizeof(unsigned int));
+		if (!inode->components) {
+			vfs_set_error(vfs, VFS_OUT_OF_MEMORY, "vfs_freeze_inodes() could not allocate component memory");
+			return false;
+		}
+	}
+
+	unsigned int index = 0;
+	path_iter_init(&iter, inode->virtual_path, inode->vlen);
+	while (path_iter_next(&iter)) {
+		if (iter.component_length) {
+			if (!atomtable_intern(vfs->atoms, iter.component, iter.component_length, &inode->components[index++])) {
+				vfs_set_error(vfs, VFS_OUT_OF_MEMORY, "vfs_freeze_inodes() could not intern path component");
+				return false;
+			}
+		}
+	}
+
+	if (inode->filter_pattern_count) {
+		inode->name_filter = globset_compile((const char *const*)inode->filter_patterns, inode->filter_labels, inode->filter_pattern_count);
+		if (!inode->name_filter) {
+			vfs_set_error(vfs, VFS_INODE_FINALIZATION_ERROR, "vfs_freeze_inodes() could not compile name filters of '%s'", inode->virtual_path);
+			return false;
+		}
+	}
+
+	if (inode->parent) {
+		struct vfs_inode_t **new_children = realloc(inode->parent->children, sizeof(struct vfs_inode_t*) * (inode->parent->child_count + 1));
+		if (!new_children) {
+			vfs_set_error(vfs, VFS_OUT_OF_MEMORY, "vfs_freeze_inodes() could not allocate child memory");
+			return false;
+		}
+		inode->parent->children = new_children;
+		inode->parent->children[inode->parent->child_count++] = inode;
+	} else if (inode->vlen == 0) {
+		vfs->inode.root = inode;
+	}
+	return true;
+}
+
+/* Undoes a partially completed vfs_freeze_inodes() so that a later attempt
+ * starts from the same state as the first one. */
+static void vfs_thaw_inodes(struct vfs_t *vfs) {
+	for (unsigned int i = 0; i < vfs->inode.count; i++) {
+		struct vfs_inode_t *inode = vfs->inode.data[i];
+		free(inode->components);
+		inode->components = NULL;
+		inode->component_count = 0;
+		free(inode->children);
+		inode->children = NULL;
+		inode->child_count = 0;
+		globset_free(inode->name_filter);
+		inode->name_filter = NULL;
+	}
+	vfs->inode.root = NULL;
+	atomtable_free(vfs->atoms);
+	vfs->atoms = NULL;
+}
+
+bool vfs_freeze_inodes(struct vfs_t *vfs) {
 	if (vfs->inode.frozen) {
 		vfs_set_error(vfs, VFS_INODE_FINALIZATION_ERROR, "inodes already frozen");
+		return false;
 	}
+
+	vfs->atoms = atomtable_new();
+	if (!vfs->atoms) {
+		vfs_set_error(vfs, VFS_OUT_OF_MEMORY, "vfs_freeze_inodes() could not allocate atom table");
+		return false;
+	}
+
 	if (vfs->inode.count) {
 		qsort(vfs->inode.data, vfs->inode.count, sizeof(struct vfs_inode_t*), vfs_inode_comparator);
 	}
+	for (unsigned int i = 0; i < vfs->inode.count; i++) {
+		if (!vfs_freeze_inode(vfs, vfs->inode.data[i])) {
+			vfs_thaw_inodes(vfs);
+			return false;
+		}
+	}
 	vfs->inode.frozen = true;
+	return true;
+}
+
+static uint64_t vfs_now_millis(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return ((uint64_t)now.tv_sec * 1000) + (now.tv_nsec / 1000000);
+}
+
+static void vfs_attrcache_clear(struct vfs_t *vfs) {
+	for (unsigned int i = 0; i < vfs->attrcache.slot_count; i++) {
+		free(vfs->attrcache.slots[i].virtual_path);
+	}
+	free(vfs->attrcache.slots);
+	vfs->attrcache.slots = NULL;
+	vfs->attrcache.slot_count = 0;
+}
+
+/* Attribute cache for vfs_stat(). It is direct-mapped by the hash of the
+ * sanitized virtual path, i.e., a colliding entry simply replaces the
+ * previous one. Successful results and nonexistent files are cached. */
+bool vfs_attrcache_enable(struct vfs_t *vfs, unsigned int ttl_millis, unsigned int slot_count) {
+	vfs_attrcache_clear(vfs);
+	vfs->attrcache.ttl_millis = ttl_millis;
+	if ((ttl_millis == 0) || (slot_count == 0)) {
+		/* Disable cache */
+		return true;
+	}
+
+	vfs->attrcache.slots = calloc(slot_count, sizeof(struct vfs_attrcache_entry_t));
+	if (!vfs->attrcache.slots) {
+		vfs_set_error(vfs, VFS_OUT_OF_MEMORY, "vfs_attrcache_enable() could not allocate %u cache slots", slot_count);
+		return false;
+	}
+	vfs->attrcache.slot_count = slot_count;
+	return true;
+}
+
+static struct vfs_attrcache_entry_t *vfs_attrcache_slot(struct vfs_t *vfs, const char *virtual_path, size_t length, uint32_t *hash) {
+	*hash = atomtable_hash(virtual_path, length);
+	return &vfs->attrcache.slots[*hash % vfs->attrcache.slot_count];
+}
+
+static void vfs_attrcache_invalidate_path(struct vfs_t *vfs, const char *virtual_path, size_t length) {
+	uint32_t hash;
+	struct vfs_attrcache_entry_t *entry = vfs_attrcache_slot(vfs, virtual_path, length, &hash);
+	if (entry->virtual_path && (entry->hash == hash) && !strncmp(entry->virtual_path, virtual_path, length) && (entry->virtual_path[length] == 0)) {
+		free(entry->virtual_path);
+		entry->virtual_path = NULL;
+	}
+}
+
+/* Drop the cached attributes of a modified node and of its parent directory,
+ * whose mtime changes when entries are created. */
+static void vfs_attrcache_invalidate(struct vfs_t *vfs, const char *virtual_path) {
+	if (!vfs->attrcache.slot_count) {
+		return;
+	}
+	vfs_attrcache_invalidate_path(vfs, virtual_path, strlen(virtual_path));
+
+	const char *last_slash = strrchr(virtual_path, '/');
+	if (last_slash) {
+		size_t parent_length = (last_slash == virtual_path) ? 1 : (last_slash - virtual_path);
+		vfs_attrcache_invalidate_path(vfs, virtual_path, parent_length);
+	}
 }
 
 struct vfs_t *vfs_init(void) {
@@ -314,9 +523,19 @@ void vfs_free(struct vfs_t *vfs) {
 		free(vfs->inode.data[i]->virtual_path);
 		free(vfs->inode.data[i]->target_path);
 		stringlist_free(vfs->inode.data[i]->virtual_subdirs);
+		free(vfs->inode.data[i]->components);
+		free(vfs->inode.data[i]->children);
+		for (unsigned int j = 0; j < vfs->inode.data[i]->filter_pattern_count; j++) {
+			free(vfs->inode.data[i]->filter_patterns[j]);
+		}
+		free(vfs->inode.data[i]->filter_patterns);
+		free(vfs->inode.data[i]->filter_labels);
+		globset_free(vfs->inode.data[i]->name_filter);
 		free(vfs->inode.data[i]);
 	}
 	free(vfs->inode.data);
+	atomtable_free(vfs->atoms);
+	vfs_attrcache_clear(vfs);
 	free(vfs);
 }
 
@@ -373,6 +592,120 @@ static char *vfs_map_path(struct vfs_t *vfs, const struct vfs_lookup_result_t *l
 	return result;
 }
 
+static const char *vfs_mount_relative_path(const struct vfs_inode_t *mountpoint, const char *virtual_path, size_t *length) {
+	size_t virtual_path_length = strlen(virtual_path);
+	if (virtual_path_length <= mountpoint->vlen) {
+		*length = 0;
+		return "";
+	}
+	*length = virtual_path_length - mountpoint->vlen - 1;
+	return virtual_path + mountpoint->vlen + 1;
+}
+
+/* The include patterns of a mount only restrict files, so that directories
+ * can always be traversed; excluded names are never visible */
+static bool vfs_name_permitted(const struct globset_t *name_filter, const char *name, size_t length, bool is_file) {
+	if (!name_filter) {
+		return true;
+	}
+	uint32_t labels = globset_match(name_filter, name, length);
+	if (labels & VFS_NAME_FILTER_EXCLUDE) {
+		return false;
+	}
+	if (is_file && (name_filter->all_labels & VFS_NAME_FILTER_INCLUDE) && !(labels & VFS_NAME_FILTER_INCLUDE)) {
+		return false;
+	}
+	return true;
+}
+
+static bool vfs_use_contentindex(const struct vfs_lookup_result_t *lookup) {
+	const struct contentindex_t *index = lookup->mountpoint->contentindex;
+	if (!index || lookup->mountpoint->backend || !(lookup->flags & VFS_INODE_FLAG_READ_ONLY)) {
+		return false;
+	}
+	bool index_follows_symlinks = (index->header->flags & CONTENTINDEX_FLAG_FOLLOW_SYMLINKS) != 0;
+	bool symlinks_allowed = (lookup->flags & VFS_INODE_FLAG_ALLOW_SYMLINKS) != 0;
+	return index_follows_symlinks == symlinks_allowed;
+}
+
+bool vfs_attach_contentindex(struct vfs_t *vfs, const char *virtual_path, const struct contentindex_t *index) {
+	struct vfs_inode_t *inode = vfs_find_inode(vfs, virtual_path, strlen(virtual_path));
+	if (!inode || !inode->target_path) {
+		vfs_set_error(vfs, VFS_NOT_MOUNTED, "vfs_attach_contentindex() requires a mountpoint, but '%s' is not", virtual_path);
+		return false;
+	}
+	inode->contentindex = index;
+	return true;
+}
+
+/* Changes made through the VFS below the mountpoint are recorded in the
+ * journal, which may be shared between all sessions of the process */
+bool vfs_attach_changejournal(struct vfs_t *vfs, const char *virtual_path, struct changejournal_t *journal) {
+	struct vfs_inode_t *inode = vfs_find_inode(vfs, virtual_path, strlen(virtual_path));
+	if (!inode || !inode->target_path) {
+		vfs_set_error(vfs, VFS_NOT_MOUNTED, "vfs_attach_changejournal() requires a mountpoint, but '%s' is not", virtual_path);
+		return false;
+	}
+	inode->changejournal = journal;
+	return true;
+}
+
+/* Serves the mount from the given storage backend instead of the host
+ * filesystem; the backend is not owned by the VFS and may be shared */
+bool vfs_set_mount_backend(struct vfs_t *vfs, const char *virtual_path, const struct vfs_backend_t *backend) {
+	struct vfs_inode_t *inode = vfs_find_inode(vfs, virtual_path, strlen(virtual_path));
+	if (!inode || !inode->target_path) {
+		vfs_set_error(vfs, VFS_NOT_MOUNTED, "vfs_set_mount_backend() requires a mountpoint, but '%s' is not", virtual_path);
+		return false;
+	}
+	inode->backend = backend;
+	return true;
+}
+
+/* Path operations on the storage of a mount; without a backend, the host
+ * filesystem is used directly */
+static int vfs_backend_stat(const struct vfs_backend_t *backend, const char *mapped_path, struct stat *statbuf) {
+	return backend ? backend->ops->stat(backend->ctx, mapped_path, statbuf) : stat(mapped_path, statbuf);
+}
+
+static int vfs_backend_mkdir(const struct vfs_backend_t *backend, const char *mapped_path, mode_t mode) {
+	return backend ? backend->ops->mkdir(backend->ctx, mapped_path, mode) : mkdir(mapped_path, mode);
+}
+
+static int vfs_backend_rename(const struct vfs_backend_t *backend, const char *old_mapped_path, const char *new_mapped_path) {
+	return backend ? backend->ops->rename(backend->ctx, old_mapped_path, new_mapped_path) : rename(old_mapped_path, new_mapped_path);
+}
+
+static int vfs_backend_unlink(const struct vfs_backend_t *backend, const char *mapped_path) {
+	return backend ? backend->ops->unlink(backend->ctx, mapped_path) : unlink(mapped_path);
+}
+
+static void vfs_journal_change(struct vfs_t *vfs, const char *virtual_path, enum changejournal_kind_t kind) {
+	struct vfs_lookup_result_t lookup;
+	if (!vfs_lookup(vfs, &lookup, virtual_path) || !lookup.mountpoint || !lookup.mountpoint->changejournal) {
+		return;
+	}
+	size_t relative_length;
+	const char *relative_path = vfs_mount_relative_path(lookup.mountpoint, virtual_path, &relative_length);
+	changejournal_record(lookup.mountpoint->changejournal, kind, relative_path, NULL);
+}
+
+static enum vfs_error_t vfs_check_symlinks(const struct vfs_handle_t *handle) {
+	struct symlink_check_response_t symlink = path_contains_symlink(handle->mapped_path);
+	if (symlink.critical_error) {
+		/* Error checking for symlinks, better reject */
+		logmsg(LLVL_ERROR, "vfs_check_symlinks() failed to check symlinks of %s: %s", handle->mapped_path, strerror(errno));
+		return VFS_INTERNAL_ERROR;
+	}
+	if (symlink.contains_symlink) {
+		/* Symlinks disallowed, but somewhere in real path symlinks are
+		 * present -> pretend this node does not exist */
+		logmsg(LLVL_DEBUG, "vfs_check_symlinks() returning 'no such file or directory' because disallowed symlinks present in \"%s\".", handle->virtual_path);
+		return VFS_NO_SUCH_FILE_OR_DIRECTORY;
+	}
+	return VFS_OK;
+}
+
 static enum vfs_error_t vfs_open_node(struct vfs_t *vfs, const char *path, struct vfs_handle_t **handle_ptr) {
 	*handle_ptr = NULL;
 
@@ -392,6 +725,7 @@ static enum vfs_error_t vfs_open_node(struct vfs_t *vfs, const char *path, struc
 		return VFS_INTERNAL_ERROR;
 	}
 
+	handle->vfs = vfs;
 	handle->virtual_path = sanitize_path(vfs->cwd.path, path);
 	if (!handle->virtual_path) {
 		vfs_set_error(vfs, VFS_SANITIZE_PATH_ERROR, "vfs_opendir() could not sanitize path successfully");
@@ -437,20 +771,36 @@ static enum vfs_error_t vfs_open_node(struct vfs_t *vfs, const char *path, struc
 			return VFS_INTERNAL_ERROR;
 		}
 
-		if (!(lookup.flags & VFS_INODE_FLAG_ALLOW_SYMLINKS)) {
-			struct symlink_check_response_t symlink = path_contains_symlink(handle->mapped_path);
-			if (symlink.critical_error) {
-				/* Error checking for symlinks, better reject */
-				logmsg(LLVL_ERROR, "vfs_open_node() failed to check symlinks of %s: %s", handle->mapped_path, strerror(errno));
-				vfs_close_handle(handle);
-				return VFS_INTERNAL_ERROR;
+		handle->mountpoint = lookup.mountpoint;
+		handle->backend = lookup.mountpoint->backend;
+		handle->name_filter = lookup.mountpoint->name_filter;
+		if (handle->name_filter) {
+			size_t relative_length;
+			const char *relative_path = vfs_mount_relative_path(lookup.mountpoint, handle->virtual_path, &relative_length);
+			struct path_iter_t iter;
+			path_iter_init(&iter, relative_path, relative_length);
+			while (path_iter_next(&iter)) {
+				if (iter.component_length && !vfs_name_permitted(handle->name_filter, iter.component, iter.component_length, false)) {
+					logmsg(LLVL_DEBUG, "vfs_open_node() returning 'no such file or directory' because \"%s\" is excluded by the mount.", handle->virtual_path);
+					vfs_close_handle(handle);
+					return VFS_NO_SUCH_FILE_OR_DIRECTORY;
+				}
 			}
-			if (symlink.contains_symlink) {
-				/* Symlinks disallowed, but somewhere in real path symlinks are
-				 * present -> pretend this node does not exist */
-				logmsg(LLVL_DEBUG, "vfs_open_node() returning 'no such file or directory' because disallowed symlinks present in \"%s\".", handle->virtual_path);
+		}
+		if (vfs_use_contentindex(&lookup)) {
+			/* The index of a read-only mount was built with the same symlink
+			 * policy and already omits everything behind disallowed symlinks.
+			 * The tree may have changed since, so vfs_open_file() checks the
+			 * path on disk again before opening it. */
+			size_t relative_length;
+			const char *relative_path = vfs_mount_relative_path(lookup.mountpoint, handle->virtual_path, &relative_length);
+			handle->contentindex = lookup.mountpoint->contentindex;
+			handle->index_entry = contentindex_lookup(handle->contentindex, relative_path, relative_length);
+		} else if (!(lookup.flags & VFS_INODE_FLAG_ALLOW_SYMLINKS) && (!handle->backend || handle->backend->host_paths)) {
+			enum vfs_error_t result = vfs_check_symlinks(handle);
+			if (result != VFS_OK) {
 				vfs_close_handle(handle);
-				return VFS_NO_SUCH_FILE_OR_DIRECTORY;
+				return result;
 			}
 		}
 	}
@@ -467,6 +817,9 @@ static enum vfs_error_t vfs_errno_to_vfs_error(int errnum) {
 		case ENOENT:
 			return VFS_NO_SUCH_FILE_OR_DIRECTORY;
 
+		case EEXIST:
+			return VFS_FILE_EXISTS;
+
 		default:
 			return VFS_INTERNAL_ERROR;
 	}
@@ -486,7 +839,7 @@ enum vfs_error_t vfs_chdir(struct vfs_t *vfs, const char *path) {
 		return success ? VFS_OK : VFS_INTERNAL_ERROR;
 	} else {
 		struct stat statbuf;
-		if (stat(handle->mapped_path, &statbuf)) {
+		if (vfs_backend_stat(handle->backend, handle->mapped_path, &statbuf)) {
 			enum vfs_error_t error_code = vfs_errno_to_vfs_error(errno);
 			logmsg(LLVL_WARN, "vfs_chdir() refused to change directory to mapped %s; stat failed", handle->mapped_path);
 			vfs_close_handle(handle);
@@ -510,76 +863,6 @@ enum vfs_error_t vfs_chdir(struct vfs_t *vfs, const char *path) {
 	return VFS_OK;
 }
 
-enum vfs_error_t vfs_opendir(struct vfs_t *vfs, const char *path, struct vfs_handle_t **handle_ptr) {
-	enum vfs_error_t result = vfs_open_node(vfs, path, handle_ptr);
-	if (result != VFS_OK) {
-		return result;
-	}
-
-	struct vfs_handle_t *handle = *handle_ptr;
-	handle->type = DIR_HANDLE;
-
-	handle->dir.dir = opendir(handle->mapped_path);
-	if (!handle->dir.dir) {
-		logmsg(LLVL_DEBUG, "vfs_opendir() cannot open %s (%s), but is a virtual directory at %p", handle->mapped_path, strerror(errno), handle->inode);
-
-//		logmsg(LLVL_WARN, "vfs_opendir() got invalid handle type %u", handle->type);
-//		vfs_set_error(vfs, VFS_OPENDIR_FAILED, "vfs_opendir() failed to call opendir(3) on \"%s\": %s", handle->mapped_path, strerror(errno));
-//		vfs_close_handle(handle);
-//		return vfs_errno_to_vfs_error(errno);
-	}
-
-	return VFS_OK;
-}
-
-enum vfs_error_t vfs_open(struct vfs_t *vfs, const char *path, enum vfs_filemode_t mode, struct vfs_handle_t **handle_ptr) {
-	enum vfs_error_t result = vfs_open_node(vfs, path, handle_ptr);
-	if (result != VFS_OK) {
-		return result;
-	}
-
-	struct vfs_handle_t *handle = *handle_ptr;
-	handle->type = FILE_HANDLE;
-
-	struct stat statbuf;
-	int stat_result = stat(handle->mapped_path, &statbuf);
-	if (stat_result == -1) {
-		/* stat failed; this is only okay if we're writing and the stat failed
-		 * because the file did not exist. */
-		if ((errno != ENOENT) || ((mode == FILEMODE_READ) && (errno != ENOENT))) {
-			enum vfs_error_t error_code = vfs_errno_to_vfs_error(errno);
-			logmsg(LLVL_DEBUG, "vfs_open() had error when running stat(): %s", strerror(errno));
-			vfs_close_handle(handle);
-			return error_code;
-		}
-	} else {
-		/* stat successful, then we require that it's actually a file */
-		if (!S_ISREG(statbuf.st_mode)) {
-			/* not a file */
-			logmsg(LLVL_DEBUG, "vfs_open() refusing to open non-file");
-			vfs_close_handle(handle);
-			return VFS_NOT_A_FILE;
-		}
-	}
-
-	if ((handle->flags & VFS_INODE_FLAG_READ_ONLY) && (mode != FILEMODE_READ)) {
-		/* Requesting writing on a readonly file */
-		logmsg(LLVL_DEBUG, "vfs_open() refusing to open file in write mode when flags indicate read-only");
-		vfs_close_handle(handle);
-		return VFS_PERMISSION_DENIED;
-	}
-
-	handle->file.file = fopen(handle->mapped_path, mode_string_mapping[mode]);
-	if (!handle->file.file) {
-		/* e.g., permission denied */
-		enum vfs_error_t error_code = vfs_errno_to_vfs_error(errno);
-		logmsg(LLVL_DEBUG, "vfs_open() got error when calling fopen()");
-		vfs_close_handle(handle);
-		return error_code;
-	}
-	return VFS_OK;
-}
-
 static void vfs_stat_virtual_directory(const char *virtual_dirname, struct vfs_dirent_t *vfs_dirent, unsigned int flags) {
 	*vfs_dirent = (struct vfs_dirent_t) {
 		.permissions = (flags & VFS_INODE_FLAG_READ_ONLY) ? 0555 : 0755,
@@ -588,6 +871,13 @@ static void vfs_stat_virtual_directory(const char *virtual_dirname, struct vfs_d
 	vfs_dirent->filename[VFS_MAX_FILENAME_LENGTH - 1] = 0;
 }
 
+static void vfs_dirent_apply_flags(struct vfs_dirent_t *vfs_dirent, unsigned int flags) {
+	if (flags & VFS_INODE_FLAG_READ_ONLY) {
+		/* Strip write permission flags if read-only handle */
+		vfs_dirent->permissions &= ~(S_IWUSR | S_IWGRP | S_IWOTH);
+	}
+}
+
 static void vfs_stat_statbuf(const struct stat *statbuf, struct vfs_dirent_t *vfs_dirent, unsigned int flags) {
 	vfs_dirent->eof = false;
 	vfs_dirent->is_file = S_ISREG(statbuf->st_mode);
@@ -598,74 +888,2293 @@ static void vfs_stat_statbuf(const struct stat *statbuf, struct vfs_dirent_t *vf
 	vfs_dirent->mtime = statbuf->st_mtim;
 	vfs_dirent->ctime = statbuf->st_ctim;
 	vfs_dirent->atime = statbuf->st_atim;
-	if (flags & VFS_INODE_FLAG_READ_ONLY) {
-		/* Strip write permission flags if read-only handle */
-		vfs_dirent->permissions &= ~(S_IWUSR | S_IWGRP | S_IWOTH);
-	}
+	vfs_dirent_apply_flags(vfs_dirent, flags);
 }
 
-enum vfs_error_t vfs_stat(struct vfs_t *vfs, const char *path, struct vfs_dirent_t *vfs_dirent) {
-	struct vfs_handle_t *handle;
-	enum vfs_error_t result = vfs_open_node(vfs, path, &handle);
+static void vfs_index_entry_statbuf(const struct contentindex_entry_t *entry, struct stat *statbuf) {
+	*statbuf = (struct stat) {
+		.st_mode = entry->mode,
+		.st_uid = entry->uid,
+		.st_gid = entry->gid,
+		.st_size = entry->size,
+		.st_mtim = { .tv_sec = entry->mtime_sec, .tv_nsec = entry->mtime_nsec },
+		.st_ctim = { .tv_sec = entry->ctime_sec, .tv_nsec = entry->ctime_nsec },
+		.st_atim = { .tv_sec = entry->atime_sec, .tv_nsec = entry->atime_nsec },
+	};
+}
+
+static bool vfs_is_shadowed_by_virtual(const struct vfs_handle_t *handle, const char *filename) {
+	if (handle->inode && handle->inode->child_count) {
+		unsigned int atom;
+		if (atomtable_lookup(handle->vfs->atoms, filename, strlen(filename), &atom) && vfs_inode_child(handle->inode, atom)) {
+			/* Provided by directory listing, but overridden by virtual directory */
+			return true;
+		}
+	}
+	return false;
+}
+
+/* Whether an entry of a mapped directory is left out of the listing, by the
+ * listing's own pattern, by the mount's policy or because it is shadowed. As
+ * long as an entry has not been stat'ed, is_file may be false for a file. */
+static bool vfs_is_filtered_out(const struct vfs_handle_t *handle, const char *filename, bool is_file) {
+	if (handle->dir.filter && !globfilter_match(handle->dir.filter, filename)) {
+		return true;
+	}
+	if ((handle->flags & VFS_INODE_FLAG_FILTER_HIDDEN) && (filename[0] == '.')) {
+		return true;
+	}
+	if (!vfs_name_permitted(handle->name_filter, filename, strlen(filename), is_file)) {
+		return true;
+	}
+	return vfs_is_shadowed_by_virtual(handle, filename);
+}
+
+/* Reads the next supported entry of a mapped directory, without applying any
+ * VFS flags. Without a handle, the raw contents are returned; otherwise,
+ * everything the handle filters out is skipped, where possible before it is
+ * ever stat'ed. */
+static enum vfs_error_t vfs_readdir_mapped(DIR *dir, const struct vfs_handle_t *handle, struct vfs_dirent_t *vfs_dirent) {
+	while (true) {
+		errno = 0;
+		struct dirent *dirent = readdir(dir);
+		if ((dirent == NULL) && (errno != 0)) {
+			/* An error occurred while trying to read the directory */
+			logmsg(LLVL_ERROR, "vfs_readdir() encountered an error while trying to read directory: %s", strerror(errno));
+			return VFS_INTERNAL_ERROR;
+		}
+
+		if (dirent == NULL) {
+			break;
+		}
+
+		if (!strcmp(dirent->d_name, ".") || !strcmp(dirent->d_name, "..")) {
+			/* We're omitting the '.' and '..' nodes in this listing */
+			continue;
+		}
+
+		if ((dirent->d_type != DT_REG) && (dirent->d_type != DT_DIR) && (dirent->d_type != DT_LNK)) {
+			/* No need to stat if there's a file node which we do not support
+			 * at all. */
+			continue;
+		}
+
+		if (handle && vfs_is_filtered_out(handle, dirent->d_name, dirent->d_type == DT_REG)) {
+			continue;
+		}
+
+		strncpy(vfs_dirent->filename, dirent->d_name, VFS_MAX_FILENAME_LENGTH - 1);
+		vfs_dirent->filename[VFS_MAX_FILENAME_LENGTH - 1] = 0;
+
+		errno = 0;
+		struct stat statbuf;
+		int stat_result = fstatat(dirfd(dir), vfs_dirent->filename, &statbuf, 0);
+		if (stat_result == -1) {
+			/* Possibly truncated filename, hence ENOENT. Also could be missing
+			 * permissions. In either case, do not return the node if we're not
+			 * allowed to stat it. */
+			logmsg(LLVL_WARN, "vfs_readdir() encountered error in fstatat: %s", strerror(errno));
+			continue;
+		}
+
+		unsigned int file_type = statbuf.st_mode & S_IFMT;
+		if ((file_type != S_IFDIR) && (file_type != S_IFREG)) {
+			/* Special file (block device, char device, FIFO, unknown) */
+			continue;
+		}
+		if (handle && (dirent->d_type == DT_LNK) && (file_type == S_IFREG) && vfs_is_filtered_out(handle, dirent->d_name, true)) {
+			/* Only now known to point to a file */
+			continue;
+		}
+		vfs_stat_statbuf(&statbuf, vfs_dirent, 0);
+		return VFS_OK;
+	}
+
+	vfs_dirent->eof = true;
+	return VFS_OK;
+}
+
+/* Like vfs_readdir_mapped(), but for a directory of a mount's backend */
+static enum vfs_error_t vfs_readdir_backend(const struct vfs_handle_t *handle, struct vfs_dirent_t *vfs_dirent) {
+	const struct vfs_backend_t *backend = handle->backend;
+	while (true) {
+		struct stat statbuf;
+		errno = 0;
+		int result = backend->ops->readdir(backend->ctx, handle->dir.backend_dir, vfs_dirent->filename, VFS_MAX_FILENAME_LENGTH, &statbuf);
+		if (result == -1) {
+			logmsg(LLVL_ERROR, "vfs_readdir() encountered an error while trying to read %s directory: %s", backend->name, strerror(errno));
+			return VFS_INTERNAL_ERROR;
+		}
+		if (result == 0) {
+			break;
+		}
+		if (!S_ISDIR(statbuf.st_mode) && !S_ISREG(statbuf.st_mode)) {
+			continue;
+		}
+		if (vfs_is_filtered_out(handle, vfs_dirent->filename, S_ISREG(statbuf.st_mode))) {
+			continue;
+		}
+		vfs_stat_statbuf(&statbuf, vfs_dirent, handle->flags);
+		return VFS_OK;
+	}
+
+	vfs_dirent->eof = true;
+	return VFS_OK;
+}
+
+/* Reads the complete mapped directory into a new directory cache listing.
+ * If this does not succeed (directory too large, modified while reading),
+ * the handle continues reading the directory itself. */
+static void vfs_opendir_fill_dircache(struct vfs_handle_t *handle) {
+	struct dircache_t *dircache = handle->vfs->dircache;
+	struct dircache_listing_t *listing = dircache_prepare(dircache, handle->mapped_path);
+	if (!listing) {
+		return;
+	}
+
+	bool success = true;
+	while (success) {
+		struct vfs_dirent_t vfs_dirent;
+		if (vfs_readdir_mapped(handle->dir.dir, NULL, &vfs_dirent) != VFS_OK) {
+			success = false;
+		} else if (vfs_dirent.eof) {
+			break;
+		} else {
+			success = dircache_listing_append(dircache, listing, &vfs_dirent);
+		}
+	}
+
+	if (success && dircache_commit(dircache, listing)) {
+		handle->dir.listing = listing;
+		closedir(handle->dir.dir);
+		handle->dir.dir = NULL;
+	} else {
+		dircache_release(dircache, listing);
+		rewinddir(handle->dir.dir);
+	}
+}
+
+void vfs_set_dircache(struct vfs_t *vfs, struct dircache_t *dircache) {
+	vfs->dircache = dircache;
+}
+
+void vfs_set_fdcache(struct vfs_t *vfs, struct fdcache_t *fdcache) {
+	vfs->fdcache = fdcache;
+}
+
+void vfs_set_blockcache(struct vfs_t *vfs, struct blockcache_t *blockcache) {
+	vfs->blockcache = blockcache;
+}
+
+static void vfs_sigbus_handler(int signum, siginfo_t *info, void *context) {
+	if (vfs_sigbus_jmpbuf) {
+		siglongjmp(*vfs_sigbus_jmpbuf, 1);
+	}
+	/* Not caused by a mapped read; the faulting access is repeated on return
+	 * and then handled by whatever was installed before */
+	sigaction(SIGBUS, &vfs_previous_sigbus_action, NULL);
+}
+
+bool vfs_set_mmap_threshold(struct vfs_t *vfs, uint64_t threshold) {
+	if (threshold && !vfs_sigbus_handler_installed) {
+		struct sigaction action = {
+			.sa_sigaction = vfs_sigbus_handler,
+			.sa_flags = SA_SIGINFO | SA_NODEFER,
+		};
+		sigemptyset(&action.sa_mask);
+		if (sigaction(SIGBUS, &action, &vfs_previous_sigbus_action)) {
+			logmsg(LLVL_ERROR, "vfs_set_mmap_threshold() could not install SIGBUS handler: %s", strerror(errno));
+			return false;
+		}
+		vfs_sigbus_handler_installed = true;
+	}
+	vfs->mmap_threshold = threshold;
+	return true;
+}
+
+/* Opens a directory of which only the entries matching a glob pattern (e.g.,
+ * "*.done" or "prefix*") are returned. A NULL pattern lists everything. */
+enum vfs_error_t vfs_opendir_filtered(struct vfs_t *vfs, const char *path, const char *pattern, struct vfs_handle_t **handle_ptr) {
+	enum vfs_error_t result = vfs_open_node(vfs, path, handle_ptr);
+	if (result != VFS_OK) {
+		return result;
+	}
+
+	struct vfs_handle_t *handle = *handle_ptr;
+	handle->type = DIR_HANDLE;
+	if (pattern) {
+		handle->dir.filter = globfilter_new(pattern);
+		if (!handle->dir.filter) {
+			vfs_close_handle(handle);
+			*handle_ptr = NULL;
+			return VFS_INTERNAL_ERROR;
+		}
+	}
+
+	if (handle->contentindex) {
+		size_t relative_length;
+		const char *relative_path = vfs_mount_relative_path(handle->mountpoint, handle->virtual_path, &relative_length);
+		handle->dir.index_listing = contentindex_dir_range(handle->contentindex, relative_path, relative_length, &handle->dir.index_position, &handle->dir.index_end);
+		if (!handle->dir.index_listing) {
+			logmsg(LLVL_DEBUG, "vfs_opendir() has no indexed directory %s, but is a virtual directory at %p", handle->mapped_path, handle->inode);
+		}
+		return VFS_OK;
+	}
+
+	if (handle->backend) {
+		handle->dir.backend_dir = handle->backend->ops->opendir(handle->backend->ctx, handle->mapped_path);
+		if (!handle->dir.backend_dir) {
+			logmsg(LLVL_DEBUG, "vfs_opendir() cannot open %s %s (%s), but is a virtual directory at %p", handle->backend->name, handle->mapped_path, strerror(errno), handle->inode);
+		}
+		return VFS_OK;
+	}
+
+	if (vfs->dircache && handle->mapped_path) {
+		handle->dir.listing = dircache_get(vfs->dircache, handle->mapped_path);
+		if (handle->dir.listing) {
+			/* Served entirely from memory */
+			return VFS_OK;
+		}
+	}
+
+	handle->dir.dir = opendir(handle->mapped_path);
+	if (handle->dir.dir && vfs->dircache && !handle->dir.filter) {
+		/* A filtered listing is incomplete and therefore never cached */
+		vfs_opendir_fill_dircache(handle);
+	} else if (!handle->dir.dir) {
+		logmsg(LLVL_DEBUG, "vfs_opendir() cannot open %s (%s), but is a virtual directory at %p", handle->mapped_path, strerror(errno), handle->inode);
+
+//		logmsg(LLVL_WARN, "vfs_opendir() got invalid handle type %u", handle->type);
+//		vfs_set_error(vfs, VFS_OPENDIR_FAILED, "vfs_opendir() failed to call opendir(3) on \"%s\": %s", handle->mapped_path, strerror(errno));
+//		vfs_close_handle(handle);
+//		return vfs_errno_to_vfs_error(errno);
+	}
+
+	return VFS_OK;
+}
+
+enum vfs_error_t vfs_opendir(struct vfs_t *vfs, const char *path, struct vfs_handle_t **handle_ptr) {
+	return vfs_opendir_filtered(vfs, path, NULL, handle_ptr);
+}
+
+static int vfs_file_fd(const struct vfs_handle_t *handle) {
+	if (handle->file.tar || handle->file.backend_file) {
+		return -1;
+	}
+	return handle->file.cached ? handle->file.cached->fd : fileno(handle->file.file);
+}
+
+/* Opens a file for writing with O_DIRECT. When appending, the partial block
+ * at the end of the file is read into the staging buffer so that all writes
+ * start at aligned offsets. Returns false if the regular path should be used
+ * instead (e.g., when the filesystem does not support O_DIRECT). */
+static bool vfs_open_direct(struct vfs_handle_t *handle, enum vfs_filemode_t mode) {
+	int open_flags = O_CREAT | O_DIRECT | O_CLOEXEC | ((mode == FILEMODE_APPEND) ? O_RDWR : (O_WRONLY | O_TRUNC));
+	int fd = open(handle->mapped_path, open_flags, 0666);
+	if (fd == -1) {
+		logmsg(LLVL_DEBUG, "vfs_open() could not open \"%s\" with O_DIRECT, using regular I/O: %s", handle->mapped_path, strerror(errno));
+		return false;
+	}
+
+	void *staging;
+	if (posix_memalign(&staging, VFS_DIRECT_IO_ALIGNMENT, VFS_DIRECT_IO_BUFFER_SIZE)) {
+		close(fd);
+		return false;
+	}
+
+	uint64_t start_offset = 0;
+	if (mode == FILEMODE_APPEND) {
+		struct stat statbuf;
+		if (fstat(fd, &statbuf)) {
+			free(staging);
+			close(fd);
+			return false;
+		}
+		start_offset = statbuf.st_size;
+	}
+	handle->file.direct.staging_offset = start_offset & ~(uint64_t)(VFS_DIRECT_IO_ALIGNMENT - 1);
+	handle->file.direct.staging_length = start_offset - handle->file.direct.staging_offset;
+	if (handle->file.direct.staging_length) {
+		ssize_t head_length = pread(fd, staging, VFS_DIRECT_IO_ALIGNMENT, handle->file.direct.staging_offset);
+		if ((head_length == -1) || ((size_t)head_length < handle->file.direct.staging_length)) {
+			logmsg(LLVL_DEBUG, "vfs_open() could not read unaligned head of \"%s\", using regular I/O", handle->mapped_path);
+			free(staging);
+			close(fd);
+			return false;
+		}
+	}
+	handle->file.direct.fd = fd;
+	handle->file.direct.staging = staging;
+	return true;
+}
+
+/* Files which occupy fewer blocks than their size suggests may contain
+ * holes. Those are read hole-aware; a statbuf from a content index does not
+ * contain block information, so the opened file is consulted in that case.
+ * Compressed filesystems also report fewer blocks, so the filesystem is
+ * asked for an actual hole before the file is treated as sparse. */
+static void vfs_open_detect_sparse(struct vfs_handle_t *handle, const struct stat *statbuf) {
+	struct stat file_statbuf;
+	if (!statbuf->st_ino) {
+		if (fstat(vfs_file_fd(handle), &file_statbuf)) {
+			return;
+		}
+		statbuf = &file_statbuf;
+	}
+	if (((uint64_t)statbuf->st_blocks * 512) >= (uint64_t)statbuf->st_size) {
+		return;
+	}
+	off_t hole_start = lseek(vfs_file_fd(handle), 0, SEEK_HOLE);
+	handle->file.sparse = (hole_start != -1) && (hole_start < statbuf->st_size);
+}
+
+/* Large files are read directly from a mapping of the file; if mapping fails,
+ * the regular read path is used. */
+static void vfs_open_mapping(struct vfs_handle_t *handle, uint64_t size) {
+	void *mapping = mmap(NULL, size, PROT_READ, MAP_SHARED, vfs_file_fd(handle), 0);
+	if (mapping == MAP_FAILED) {
+		logmsg(LLVL_DEBUG, "vfs_open() could not map \"%s\": %s", handle->mapped_path, strerror(errno));
+		return;
+	}
+	madvise(mapping, size, MADV_SEQUENTIAL);
+	handle->file.mapping = mapping;
+	handle->file.mapping_size = size;
+}
+
+/* Blocks are keyed by the identity of the opened file, so that a file
+ * replaced or modified in the meantime never hits stale blocks */
+static void vfs_open_blockcache(struct vfs_handle_t *handle) {
+	struct stat statbuf;
+	if (fstat(vfs_file_fd(handle), &statbuf)) {
+		return;
+	}
+	handle->file.identity = (struct blockcache_file_t) {
+		.dev = statbuf.st_dev,
+		.ino = statbuf.st_ino,
+		.mtime_sec = statbuf.st_mtim.tv_sec,
+		.mtime_nsec = statbuf.st_mtim.tv_nsec,
+		.size = statbuf.st_size,
+	};
+	handle->file.block_cached = blockcache_file_cacheable(handle->vfs->blockcache, &handle->file.identity);
+}
+
+/* None of the host filesystem specifics (caches, mappings, direct I/O,
+ * stored digests) apply to files of a backend; appending continues at the
+ * size the file has when it is opened */
+static enum vfs_error_t vfs_open_backend_file(struct vfs_handle_t *handle, enum vfs_filemode_t mode, bool exclusive) {
+	const struct vfs_backend_t *backend = handle->backend;
+	handle->file.backend_file = backend->ops->open(backend->ctx, handle->mapped_path, mode_flags_mapping[mode] | (exclusive ? O_EXCL : 0), 0666);
+	if (!handle->file.backend_file) {
+		enum vfs_error_t error_code = vfs_errno_to_vfs_error(errno);
+		logmsg(LLVL_DEBUG, "vfs_open() got error when opening %s file %s: %s", backend->name, handle->mapped_path, strerror(errno));
+		vfs_close_handle(handle);
+		return error_code;
+	}
+	if (mode == FILEMODE_APPEND) {
+		struct stat statbuf;
+		if (backend->ops->fstat(backend->ctx, handle->file.backend_file, &statbuf)) {
+			enum vfs_error_t error_code = vfs_errno_to_vfs_error(errno);
+			vfs_close_handle(handle);
+			return error_code;
+		}
+		handle->file.offset = statbuf.st_size;
+	}
+	return VFS_OK;
+}
+
+static int vfs_file_stat(const struct vfs_handle_t *handle, struct stat *statbuf) {
+	if (handle->file.backend_file) {
+		return handle->backend->ops->fstat(handle->backend->ctx, handle->file.backend_file, statbuf);
+	}
+	return fstat(vfs_file_fd(handle), statbuf);
+}
+
+/* Internal files (i.e., the temporary file of a delta transfer) are exempt
+ * from the mount's include patterns. When written, they are always created
+ * anew so that they can never replace any existing file. */
+static enum vfs_error_t vfs_open_file(struct vfs_t *vfs, const char *path, enum vfs_filemode_t mode, bool internal, struct vfs_handle_t **handle_ptr) {
+	enum vfs_error_t result = vfs_open_node(vfs, path, handle_ptr);
+	if (result != VFS_OK) {
+		return result;
+	}
+	bool exclusive = internal && (mode == FILEMODE_WRITE);
+
+	struct vfs_handle_t *handle = *handle_ptr;
+	handle->type = FILE_HANDLE;
+
+	struct stat statbuf;
+	int stat_result;
+	if (handle->contentindex && (mode == FILEMODE_READ)) {
+		/* Only the file contents are read from disk */
+		if (!handle->index_entry) {
+			vfs_close_handle(handle);
+			return VFS_NO_SUCH_FILE_OR_DIRECTORY;
+		}
+		if (!(handle->flags & VFS_INODE_FLAG_ALLOW_SYMLINKS)) {
+			/* A symlink swapped in after indexing must not be followed */
+			result = vfs_check_symlinks(handle);
+			if (result != VFS_OK) {
+				vfs_close_handle(handle);
+				return result;
+			}
+		}
+		vfs_index_entry_statbuf(handle->index_entry, &statbuf);
+		stat_result = 0;
+	} else {
+		stat_result = vfs_backend_stat(handle->backend, handle->mapped_path, &statbuf);
+	}
+	if (stat_result == -1) {
+		/* stat failed; this is only okay if we're writing and the stat failed
+		 * because the file did not exist. */
+		if ((errno != ENOENT) || ((mode == FILEMODE_READ) && (errno != ENOENT))) {
+			enum vfs_error_t error_code = vfs_errno_to_vfs_error(errno);
+			logmsg(LLVL_DEBUG, "vfs_open() had error when running stat(): %s", strerror(errno));
+			vfs_close_handle(handle);
+			return error_code;
+		}
+	} else {
+		if (exclusive) {
+			logmsg(LLVL_DEBUG, "vfs_open() refusing to reuse existing \"%s\"", handle->virtual_path);
+			vfs_close_handle(handle);
+			return VFS_FILE_EXISTS;
+		}
+		/* stat successful, then we require that it's actually a file */
+		if (!S_ISREG(statbuf.st_mode)) {
+			/* not a file */
+			logmsg(LLVL_DEBUG, "vfs_open() refusing to open non-file");
+			vfs_close_handle(handle);
+			return VFS_NOT_A_FILE;
+		}
+	}
+
+	if (!internal && !vfs_name_permitted(handle->name_filter, const_basename(handle->virtual_path), strlen(const_basename(handle->virtual_path)), true)) {
+		logmsg(LLVL_DEBUG, "vfs_open() refusing to open \"%s\" not included by the mount", handle->virtual_path);
+		vfs_close_handle(handle);
+		return (mode == FILEMODE_READ) ? VFS_NO_SUCH_FILE_OR_DIRECTORY : VFS_PERMISSION_DENIED;
+	}
+
+	if ((handle->flags & VFS_INODE_FLAG_READ_ONLY) && (mode != FILEMODE_READ)) {
+		/* Requesting writing on a readonly file */
+		logmsg(LLVL_DEBUG, "vfs_open() refusing to open file in write mode when flags indicate read-only");
+		vfs_close_handle(handle);
+		return VFS_PERMISSION_DENIED;
+	}
+
+	if (mode != FILEMODE_READ) {
+		vfs_attrcache_invalidate(vfs, handle->virtual_path);
+		handle->file.created = (stat_result == -1);
+	}
+
+	/* The mode is only recorded once the file is actually open, so that a
+	 * failed open is not journaled as a change when the handle is closed */
+	if (handle->backend) {
+		result = vfs_open_backend_file(handle, mode, exclusive);
+		if (result == VFS_OK) {
+			handle->file.mode = mode;
+		}
+		return result;
+	}
+	if ((mode == FILEMODE_READ) && (stat_result == 0) && vfs->fdcache) {
+		/* Shared descriptor, only valid while the file is unchanged */
+		handle->file.cached = fdcache_open(vfs->fdcache, handle->mapped_path, &statbuf);
+		if (!handle->file.cached) {
+			enum vfs_error_t error_code = vfs_errno_to_vfs_error(errno);
+			logmsg(LLVL_DEBUG, "vfs_open() got error when opening cached descriptor: %s", strerror(errno));
+			vfs_close_handle(handle);
+			return error_code;
+		}
+	} else if ((mode != FILEMODE_READ) && !exclusive && (handle->flags & VFS_INODE_FLAG_DIRECT_IO) && vfs_open_direct(handle, mode)) {
+		/* Written through aligned staging buffer, bypassing the page cache */
+	} else {
+		handle->file.file = fopen(handle->mapped_path, exclusive ? "wx" : mode_string_mapping[mode]);
+		if (!handle->file.file) {
+			/* e.g., permission denied */
+			enum vfs_error_t error_code = vfs_errno_to_vfs_error(errno);
+			logmsg(LLVL_DEBUG, "vfs_open() got error when calling fopen()");
+			vfs_close_handle(handle);
+			return error_code;
+		}
+	}
+	handle->file.mode = mode;
+
+	if ((mode == FILEMODE_WRITE) && vfs->upload_hash.enabled) {
+		/* Appending would not hash what was there before */
+		handle->file.upload_hash = filehash_new(vfs->upload_hash.algorithm, 0);
+	}
+	if ((mode == FILEMODE_READ) && (stat_result == 0)) {
+		vfs_open_detect_sparse(handle, &statbuf);
+	}
+	if ((mode == FILEMODE_READ) && !handle->file.sparse && vfs->mmap_threshold && (stat_result == 0) && (statbuf.st_size > 0) && ((uint64_t)statbuf.st_size >= vfs->mmap_threshold)) {
+		vfs_open_mapping(handle, statbuf.st_size);
+	}
+	if ((mode == FILEMODE_READ) && !handle->file.sparse && !handle->file.mapping && vfs->blockcache) {
+		vfs_open_blockcache(handle);
+	}
+	return VFS_OK;
+}
+
+static bool vfs_tar_push_header(struct vfs_tar_t *tar, const struct vfs_dirent_t *dirent) {
+	struct tarstream_entry_t entry = {
+		.path = tar->virtual_path + tar->archive_offset,
+		.is_directory = !dirent->is_file,
+		.size = dirent->is_file ? dirent->filesize : 0,
+		.permissions = dirent->permissions,
+		.uid = dirent->uid,
+		.gid = dirent->gid,
+		.mtime = dirent->mtime.tv_sec,
+	};
+	tar->header_length = tarstream_header(tar->header, &entry);
+	tar->header_position = 0;
+	tar->file_remaining = entry.size;
+	tar->padding_remaining = tarstream_padding(entry.size);
+	return tar->header_length != 0;
+}
+
+/* Advances to the next entry of the walk, depth first. Entries that cannot
+ * be opened (e.g., filtered or disallowed symlinks) are left out. */
+static enum vfs_error_t vfs_tar_next_entry(struct vfs_t *vfs, struct vfs_tar_t *tar) {
+	vfs_close_handle(tar->file);
+	tar->file = NULL;
+	while (tar->depth) {
+		size_t path_length = tar->levels[tar->depth - 1].path_length;
+		struct vfs_dirent_t dirent;
+		enum vfs_error_t result = vfs_readdir(tar->levels[tar->depth - 1].dir, &dirent);
+		if ((result != VFS_OK) || dirent.eof) {
+			vfs_close_handle(tar->levels[tar->depth - 1].dir);
+			tar->depth--;
+			if (result != VFS_OK) {
+				return result;
+			}
+			continue;
+		}
+
+		size_t name_length = strlen(dirent.filename);
+		if (path_length + 1 + name_length >= sizeof(tar->virtual_path)) {
+			logmsg(LLVL_WARN, "vfs_read() leaving \"%s\" out of archive, path too long", dirent.filename);
+			continue;
+		}
+		tar->virtual_path[path_length] = '/';
+		memcpy(tar->virtual_path + path_length + 1, dirent.filename, name_length + 1);
+		if (!vfs_tar_push_header(tar, &dirent)) {
+			continue;
+		}
+
+		if (dirent.is_file) {
+			if (vfs_open_file(vfs, tar->virtual_path, FILEMODE_READ, false, &tar->file) != VFS_OK) {
+				tar->file = NULL;
+				continue;
+			}
+		} else {
+			if (tar->depth == VFS_TAR_MAX_DEPTH) {
+				logmsg(LLVL_WARN, "vfs_read() leaving \"%s\" out of archive, nested too deeply", tar->virtual_path);
+				continue;
+			}
+			if (vfs_opendir(vfs, tar->virtual_path, &tar->levels[tar->depth].dir) != VFS_OK) {
+				continue;
+			}
+			tar->levels[tar->depth].path_length = path_length + 1 + name_length;
+			tar->depth++;
+		}
+		return VFS_OK;
+	}
+
+	/* End of archive marker */
+	memset(tar->header, 0, 2 * TARSTREAM_BLOCK_SIZE);
+	tar->header_length = 2 * TARSTREAM_BLOCK_SIZE;
+	tar->header_position = 0;
+	tar->finished = true;
+	return VFS_OK;
+}
+
+static void vfs_close_tar(struct vfs_tar_t *tar) {
+	vfs_close_handle(tar->file);
+	while (tar->depth) {
+		vfs_close_handle(tar->levels[--tar->depth].dir);
+	}
+	free(tar);
+}
+
+/* "<dir>.tar" is a read-only virtual file with the contents of <dir> as tar
+ * archive, so that a whole tree can be fetched in a single transfer */
+static enum vfs_error_t vfs_open_tar(struct vfs_t *vfs, const char *path, struct vfs_handle_t **handle_ptr) {
+	enum vfs_error_t result = vfs_open_node(vfs, path, handle_ptr);
+	if (result != VFS_OK) {
+		return result;
+	}
+	struct vfs_handle_t *handle = *handle_ptr;
+	handle->type = FILE_HANDLE;
+	handle->file.mode = FILEMODE_READ;
+
+	struct vfs_tar_t *tar = calloc(1, sizeof(struct vfs_tar_t));
+	if (!tar) {
+		vfs_close_handle(handle);
+		*handle_ptr = NULL;
+		return VFS_INTERNAL_ERROR;
+	}
+	handle->file.tar = tar;
+
+	size_t dir_length = strlen(handle->virtual_path) - strlen(VFS_TAR_SUFFIX);
+	memcpy(tar->virtual_path, handle->virtual_path, dir_length);
+	tar->virtual_path[dir_length] = 0;
+
+	/* A plain ".tar" does not name any directory */
+	struct vfs_dirent_t dirent;
+	result = VFS_NO_SUCH_FILE_OR_DIRECTORY;
+	if ((dir_length > 1) && (tar->virtual_path[dir_length - 1] != '/')) {
+		result = vfs_stat(vfs, tar->virtual_path, &dirent);
+		if ((result == VFS_OK) && dirent.is_file) {
+			result = VFS_NO_SUCH_FILE_OR_DIRECTORY;
+		}
+	}
+	if (result == VFS_OK) {
+		result = vfs_opendir(vfs, tar->virtual_path, &tar->levels[0].dir);
+	}
+	if (result != VFS_OK) {
+		vfs_close_handle(handle);
+		*handle_ptr = NULL;
+		return result;
+	}
+	tar->depth = 1;
+	tar->levels[0].path_length = dir_length;
+	tar->archive_offset = strrchr(tar->virtual_path, '/') - tar->virtual_path + 1;
+	vfs_tar_push_header(tar, &dirent);
+	return VFS_OK;
+}
+
+/* Members are only ever created below the target directory: absolute names
+ * are made relative and names with ".." components are refused */
+static bool vfs_untar_member_path(struct vfs_untar_t *untar, const char *name) {
+	while ((name[0] == '/') || ((name[0] == '.') && (name[1] == '/'))) {
+		name += (name[0] == '/') ? 1 : 2;
+	}
+	for (const char *component = name; *component; ) {
+		size_t component_length = strcspn(component, "/");
+		if ((component_length == 2) && !strncmp(component, "..", 2)) {
+			return false;
+		}
+		component += component_length;
+		component += (*component == '/') ? 1 : 0;
+	}
+
+	size_t name_length = strlen(name);
+	while (name_length && (name[name_length - 1] == '/')) {
+		name_length--;
+	}
+	if (untar->base_length + 1 + name_length >= sizeof(untar->virtual_path)) {
+		return false;
+	}
+	untar->virtual_path[untar->base_length] = 0;
+	if (name_length) {
+		untar->virtual_path[untar->base_length] = '/';
+		memcpy(untar->virtual_path + untar->base_length + 1, name, name_length);
+		untar->virtual_path[untar->base_length + 1 + name_length] = 0;
+	}
+	return true;
+}
+
+/* Resolves a member with the policy of the mount it lands on. Returns the
+ * mapped path if the member may be created (or already exists). */
+static enum vfs_error_t vfs_untar_check_member(struct vfs_untar_t *untar, unsigned int disallow_create_flag, char **mapped_path, const struct vfs_backend_t **backend, struct stat *statbuf, bool *exists) {
+	struct vfs_handle_t *node;
+	enum vfs_error_t result = vfs_open_node(untar->vfs, untar->virtual_path, &node);
+	if (result != VFS_OK) {
+		return result;
+	}
+	if (!node->mapped_path) {
+		vfs_close_handle(node);
+		return VFS_PERMISSION_DENIED;
+	}
+
+	*exists = (vfs_backend_stat(node->backend, node->mapped_path, statbuf) == 0);
+	if ((node->flags & VFS_INODE_FLAG_READ_ONLY) || (!*exists && (node->flags & disallow_create_flag))) {
+		logmsg(LLVL_DEBUG, "vfs_write() refusing to extract \"%s\" because of mount flags", node->virtual_path);
+		vfs_close_handle(node);
+		return VFS_PERMISSION_DENIED;
+	}
+	*mapped_path = node->mapped_path;
+	*backend = node->backend;
+	node->mapped_path = NULL;
+	vfs_close_handle(node);
+	return VFS_OK;
+}
+
+static bool vfs_untar_begin(void *ctx, const struct tarstream_entry_t *entry) {
+	struct vfs_untar_t *untar = (struct vfs_untar_t*)ctx;
+	if (!vfs_untar_member_path(untar, entry->path)) {
+		logmsg(LLVL_WARN, "vfs_write() refusing to extract archive member \"%s\" outside of target", entry->path);
+		untar->error = VFS_PERMISSION_DENIED;
+		return false;
+	}
+	if (entry->is_special) {
+		/* Links and device nodes are never created through the VFS */
+		logmsg(LLVL_DEBUG, "vfs_write() skipping special archive member \"%s\"", entry->path);
+		return true;
+	}
+	if (untar->virtual_path[untar->base_length] == 0) {
+		/* The target directory itself */
+		return true;
+	}
+
+	char *mapped_path;
+	const struct vfs_backend_t *backend;
+	struct stat statbuf;
+	bool exists;
+	untar->error = vfs_untar_check_member(untar, entry->is_directory ? VFS_INODE_FLAG_DISALLOW_CREATE_DIR : VFS_INODE_FLAG_DISALLOW_CREATE_FILE, &mapped_path, &backend, &statbuf, &exists);
+	if (untar->error != VFS_OK) {
+		return false;
+	}
+
+	if (entry->is_directory) {
+		if (exists && !S_ISDIR(statbuf.st_mode)) {
+			untar->error = VFS_NOT_A_DIRECTORY;
+		} else if (!exists && vfs_backend_mkdir(backend, mapped_path, (entry->permissions & 0777) | S_IRWXU)) {
+			logmsg(LLVL_DEBUG, "vfs_write() could not create directory \"%s\": %s", mapped_path, strerror(errno));
+			untar->error = vfs_errno_to_vfs_error(errno);
+		} else if (!exists) {
+			vfs_journal_change(untar->vfs, untar->virtual_path, CHANGEJOURNAL_CREATE);
+		}
+		vfs_attrcache_invalidate(untar->vfs, untar->virtual_path);
+	} else {
+		untar->error = vfs_open_file(untar->vfs, untar->virtual_path, FILEMODE_WRITE, false, &untar->member);
+	}
+	free(mapped_path);
+	return untar->error == VFS_OK;
+}
+
+static bool vfs_untar_data(void *ctx, const void *data, size_t length) {
+	struct vfs_untar_t *untar = (struct vfs_untar_t*)ctx;
+	if (!untar->member) {
+		return true;
+	}
+	size_t written = length;
+	untar->error = vfs_write(untar->member, data, &written);
+	return untar->error == VFS_OK;
+}
+
+static bool vfs_untar_end(void *ctx) {
+	struct vfs_untar_t *untar = (struct vfs_untar_t*)ctx;
+	vfs_close_handle(untar->member);
+	untar->member = NULL;
+	return true;
+}
+
+static void vfs_close_untar(struct vfs_untar_t *untar) {
+	if (untar->parser.state != TARSTREAM_PARSE_FINISHED) {
+		logmsg(LLVL_WARN, "vfs_close_handle() closing archive upload into \"%s\" before its end", untar->virtual_path);
+	}
+	vfs_close_handle(untar->member);
+	free(untar);
+}
+
+/* Writing "<dir>.tar" (which must not exist as a file) unpacks the uploaded
+ * archive into <dir> instead, so that many small files can be uploaded in
+ * a single transfer */
+static enum vfs_error_t vfs_open_untar(struct vfs_t *vfs, const char *path, struct vfs_handle_t **handle_ptr) {
+	enum vfs_error_t result = vfs_open_node(vfs, path, handle_ptr);
+	if (result != VFS_OK) {
+		return result;
+	}
+	struct vfs_handle_t *handle = *handle_ptr;
+	handle->type = FILE_HANDLE;
+
+	/* Anything but an upload next to an existing directory is a regular file
+	 * upload, for which no archive state is set up at all */
+	struct stat statbuf;
+	char dir_path[TARSTREAM_MAX_PATH_LENGTH];
+	size_t dir_length = strlen(handle->virtual_path) - strlen(VFS_TAR_SUFFIX);
+	result = VFS_NO_SUCH_FILE_OR_DIRECTORY;
+	if ((!handle->mapped_path || vfs_backend_stat(handle->backend, handle->mapped_path, &statbuf)) && (dir_length > 1) && (dir_length < sizeof(dir_path)) && (handle->virtual_path[dir_length - 1] != '/')) {
+		memcpy(dir_path, handle->virtual_path, dir_length);
+		dir_path[dir_length] = 0;
+		struct vfs_dirent_t dirent;
+		result = vfs_stat(vfs, dir_path, &dirent);
+		if ((result == VFS_OK) && dirent.is_file) {
+			result = VFS_NO_SUCH_FILE_OR_DIRECTORY;
+		}
+	}
+	if (result == VFS_OK) {
+		struct vfs_handle_t *dir;
+		result = vfs_open_node(vfs, dir_path, &dir);
+		if ((result == VFS_OK) && (dir->flags & VFS_INODE_FLAG_READ_ONLY)) {
+			result = VFS_PERMISSION_DENIED;
+		}
+		vfs_close_handle(dir);
+	}
+	struct vfs_untar_t *untar = NULL;
+	if (result == VFS_OK) {
+		untar = calloc(1, sizeof(struct vfs_untar_t));
+		if (!untar) {
+			result = VFS_INTERNAL_ERROR;
+		}
+	}
+	if (result != VFS_OK) {
+		vfs_close_handle(handle);
+		*handle_ptr = NULL;
+		return result;
+	}
+
+	untar->vfs = vfs;
+	memcpy(untar->virtual_path, dir_path, dir_length + 1);
+	untar->base_length = dir_length;
+	tarstream_parser_init(&untar->parser, vfs_untar_begin, vfs_untar_data, vfs_untar_end, untar);
+	handle->file.untar = untar;
+	handle->file.mode = FILEMODE_WRITE;
+	return VFS_OK;
+}
+
+static bool vfs_is_tar_path(const char *path) {
+	size_t length = strlen(path);
+	return (length > strlen(VFS_TAR_SUFFIX)) && !strcmp(path + length - strlen(VFS_TAR_SUFFIX), VFS_TAR_SUFFIX);
+}
+
+enum vfs_error_t vfs_open(struct vfs_t *vfs, const char *path, enum vfs_filemode_t mode, struct vfs_handle_t **handle_ptr) {
+	bool virtual_tar = vfs->virtual_tar && path && vfs_is_tar_path(path);
+	if (virtual_tar && (mode == FILEMODE_WRITE)) {
+		enum vfs_error_t untar_result = vfs_open_untar(vfs, path, handle_ptr);
+		if (untar_result != VFS_NO_SUCH_FILE_OR_DIRECTORY) {
+			return untar_result;
+		}
+	}
+
+	enum vfs_error_t result = vfs_open_file(vfs, path, mode, false, handle_ptr);
+	if (virtual_tar && (result == VFS_NO_SUCH_FILE_OR_DIRECTORY) && (mode == FILEMODE_READ)) {
+		enum vfs_error_t tar_result = vfs_open_tar(vfs, path, handle_ptr);
+		if (tar_result != VFS_NO_SUCH_FILE_OR_DIRECTORY) {
+			return tar_result;
+		}
+	}
+	return result;
+}
+
+void vfs_set_virtual_tar(struct vfs_t *vfs, bool enabled) {
+	vfs->virtual_tar = enabled;
+}
+
+static enum vfs_error_t vfs_stat_finish(int stat_result, const struct stat *statbuf, unsigned int flags, const struct globset_t *name_filter, struct vfs_dirent_t *vfs_dirent) {
+	if (stat_result == -1) {
+		/* stat failed */
+		return vfs_errno_to_vfs_error(errno);
+	}
+	if (S_ISREG(statbuf->st_mode) && !vfs_name_permitted(name_filter, vfs_dirent->filename, strlen(vfs_dirent->filename), true)) {
+		return VFS_NO_SUCH_FILE_OR_DIRECTORY;
+	}
+	vfs_stat_statbuf(statbuf, vfs_dirent, flags);
+	return VFS_OK;
+}
+
+/* Everything about a stat that does not need to touch the disk. For mapped
+ * files of the host filesystem, the dirent is only completed by
+ * vfs_stat_finish(). */
+static enum vfs_error_t vfs_stat_resolve(struct vfs_t *vfs, const char *path, struct vfs_dirent_t *vfs_dirent, char **mapped_path, unsigned int *flags, const struct globset_t **name_filter) {
+	*mapped_path = NULL;
+	struct vfs_handle_t *handle;
+	enum vfs_error_t result = vfs_open_node(vfs, path, &handle);
+	if (result != VFS_OK) {
+		return result;
+	}
+
+	if (handle->inode) {
+		/* Virtual directory */
+		vfs_stat_virtual_directory(const_basename(handle->virtual_path), vfs_dirent, handle->flags);
+		vfs_close_handle(handle);
+		return VFS_OK;
+	}
+
+	/* Mapped directory */
+	strncpy(vfs_dirent->filename, const_basename(handle->virtual_path), VFS_MAX_FILENAME_LENGTH - 1);
+	vfs_dirent->filename[VFS_MAX_FILENAME_LENGTH - 1] = 0;
+	if (handle->contentindex) {
+		if (!handle->index_entry) {
+			vfs_close_handle(handle);
+			return VFS_NO_SUCH_FILE_OR_DIRECTORY;
+		}
+		struct stat statbuf;
+		vfs_index_entry_statbuf(handle->index_entry, &statbuf);
+		result = vfs_stat_finish(0, &statbuf, handle->flags, handle->name_filter, vfs_dirent);
+	} else if (handle->backend) {
+		/* Backends need not be thread-safe, so their files are never
+		 * handed to the workers of a bulk stat */
+		struct stat statbuf;
+		errno = 0;
+		int stat_result = vfs_backend_stat(handle->backend, handle->mapped_path, &statbuf);
+		result = vfs_stat_finish(stat_result, &statbuf, handle->flags, handle->name_filter, vfs_dirent);
+	} else {
+		*mapped_path = handle->mapped_path;
+		*flags = handle->flags;
+		*name_filter = handle->name_filter;
+		handle->mapped_path = NULL;
+	}
+	vfs_close_handle(handle);
+	return result;
+}
+
+static enum vfs_error_t vfs_stat_uncached(struct vfs_t *vfs, const char *path, struct vfs_dirent_t *vfs_dirent) {
+	char *mapped_path;
+	unsigned int flags;
+	const struct globset_t *name_filter;
+	enum vfs_error_t result = vfs_stat_resolve(vfs, path, vfs_dirent, &mapped_path, &flags, &name_filter);
+	if ((result != VFS_OK) || !mapped_path) {
+		return result;
+	}
+
+	struct stat statbuf;
+	errno = 0;
+	result = vfs_stat_finish(stat(mapped_path, &statbuf), &statbuf, flags, name_filter, vfs_dirent);
+	free(mapped_path);
+	return result;
+}
+
+static bool vfs_attrcache_lookup(struct vfs_t *vfs, const char *virtual_path, uint64_t now, uint32_t *hash, struct vfs_dirent_t *vfs_dirent, enum vfs_error_t *result) {
+	struct vfs_attrcache_entry_t *entry = vfs_attrcache_slot(vfs, virtual_path, strlen(virtual_path), hash);
+	if (entry->virtual_path && (entry->hash == *hash) && (now < entry->expires_millis) && !strcmp(entry->virtual_path, virtual_path)) {
+		vfs->attrcache.hits++;
+		if (entry->result == VFS_OK) {
+			*vfs_dirent = entry->dirent;
+		}
+		*result = entry->result;
+		return true;
+	}
+	vfs->attrcache.misses++;
+	return false;
+}
+
+/* Takes ownership of the virtual path */
+static void vfs_attrcache_store(struct vfs_t *vfs, char *virtual_path, uint64_t now, uint32_t hash, enum vfs_error_t result, const struct vfs_dirent_t *vfs_dirent) {
+	if ((result != VFS_OK) && (result != VFS_NO_SUCH_FILE_OR_DIRECTORY)) {
+		free(virtual_path);
+		return;
+	}
+	struct vfs_attrcache_entry_t *entry = &vfs->attrcache.slots[hash % vfs->attrcache.slot_count];
+	free(entry->virtual_path);
+	entry->virtual_path = virtual_path;
+	entry->hash = hash;
+	entry->expires_millis = now + vfs->attrcache.ttl_millis;
+	entry->result = result;
+	if (result == VFS_OK) {
+		entry->dirent = *vfs_dirent;
+	}
+}
+
+enum vfs_error_t vfs_stat(struct vfs_t *vfs, const char *path, struct vfs_dirent_t *vfs_dirent) {
+	if (!vfs->attrcache.slot_count) {
+		return vfs_stat_uncached(vfs, path, vfs_dirent);
+	}
+
+	char *virtual_path = sanitize_path(vfs->cwd.path, path);
+	if (!virtual_path) {
+		vfs_set_error(vfs, VFS_SANITIZE_PATH_ERROR, "vfs_stat() could not sanitize path successfully");
+		return VFS_INTERNAL_ERROR;
+	}
+
+	uint64_t now = vfs_now_millis();
+	uint32_t hash;
+	enum vfs_error_t result;
+	if (vfs_attrcache_lookup(vfs, virtual_path, now, &hash, vfs_dirent, &result)) {
+		free(virtual_path);
+		return result;
+	}
+
+	result = vfs_stat_uncached(vfs, virtual_path, vfs_dirent);
+	vfs_attrcache_store(vfs, virtual_path, now, hash, result, vfs_dirent);
+	return result;
+}
+
+static int vfs_stat_job_parent_comparator(const void *velem1, const void *velem2) {
+	const struct vfs_stat_job_t *job1 = *((const struct vfs_stat_job_t**)velem1);
+	const struct vfs_stat_job_t *job2 = *((const struct vfs_stat_job_t**)velem2);
+	if (job1->parent_length != job2->parent_length) {
+		return (job1->parent_length < job2->parent_length) ? -1 : 1;
+	}
+	return strncmp(job1->mapped_path, job2->mapped_path, job1->parent_length);
+}
+
+/* Each distinct parent directory is opened once and all files within it
+ * are then looked up relative to it, saving the repeated path walk */
+static void vfs_stat_many_open_parents(struct vfs_stat_many_t *batch) {
+	struct vfs_stat_job_t **sorted = malloc(batch->job_count * sizeof(struct vfs_stat_job_t*));
+	if (!sorted) {
+		return;
+	}
+	unsigned int sorted_count = 0;
+	for (unsigned int i = 0; i < batch->job_count; i++) {
+		if (batch->jobs[i].name) {
+			sorted[sorted_count++] = &batch->jobs[i];
+		}
+	}
+	qsort(sorted, sorted_count, sizeof(struct vfs_stat_job_t*), vfs_stat_job_parent_comparator);
+
+	for (unsigned int i = 0; i < sorted_count; i++) {
+		if ((i > 0) && !vfs_stat_job_parent_comparator(&sorted[i - 1], &sorted[i])) {
+			sorted[i]->parent_fd = sorted[i - 1]->parent_fd;
+			continue;
+		}
+		char parent[sorted[i]->parent_length + 1];
+		memcpy(parent, sorted[i]->mapped_path, sorted[i]->parent_length);
+		parent[sorted[i]->parent_length] = 0;
+		sorted[i]->parent_fd = open(sorted[i]->parent_length ? parent : "/", O_PATH | O_DIRECTORY | O_CLOEXEC);
+		sorted[i]->owns_parent_fd = (sorted[i]->parent_fd != -1);
+	}
+	free(sorted);
+}
+
+static void vfs_stat_many_job(struct vfs_stat_job_t *job) {
+	errno = 0;
+	if (job->parent_fd != -1) {
+		job->stat_result = fstatat(job->parent_fd, job->name, &job->statbuf, 0);
+	} else {
+		job->stat_result = stat(job->mapped_path, &job->statbuf);
+	}
+	job->stat_errno = errno;
+}
+
+static void *vfs_stat_many_worker(void *arg) {
+	struct vfs_stat_many_t *batch = (struct vfs_stat_many_t*)arg;
+	unsigned int index;
+	while ((index = atomic_fetch_add_explicit(&batch->next_job, 1, memory_order_relaxed)) < batch->job_count) {
+		vfs_stat_many_job(&batch->jobs[index]);
+	}
+	return NULL;
+}
+
+/* Stats many paths at once, e.g., for a bulk stat SFTP extension, with one
+ * result per path. Path resolution and the attribute cache are handled on
+ * the calling thread, while the remaining stat calls are spread across up
+ * to thread_count worker threads. Returns an error only if the request as a
+ * whole could not be processed. */
+enum vfs_error_t vfs_stat_many(struct vfs_t *vfs, const char *const *paths, unsigned int count, unsigned int thread_count, struct vfs_dirent_t *vfs_dirents, enum vfs_error_t *results) {
+	struct vfs_stat_many_t batch = {
+		.jobs = calloc(count ? count : 1, sizeof(struct vfs_stat_job_t)),
+	};
+	if (!batch.jobs) {
+		return VFS_INTERNAL_ERROR;
+	}
+
+	uint64_t now = vfs_now_millis();
+	for (unsigned int i = 0; i < count; i++) {
+		char *virtual_path = sanitize_path(vfs->cwd.path, paths[i]);
+		if (!virtual_path) {
+			results[i] = VFS_INTERNAL_ERROR;
+			continue;
+		}
+
+		uint32_t hash = 0;
+		if (vfs->attrcache.slot_count && vfs_attrcache_lookup(vfs, virtual_path, now, &hash, &vfs_dirents[i], &results[i])) {
+			free(virtual_path);
+			continue;
+		}
+
+		char *mapped_path;
+		unsigned int flags;
+		const struct globset_t *name_filter;
+		results[i] = vfs_stat_resolve(vfs, virtual_path, &vfs_dirents[i], &mapped_path, &flags, &name_filter);
+		if (mapped_path) {
+			struct vfs_stat_job_t *job = &batch.jobs[batch.job_count++];
+			job->index = i;
+			job->virtual_path = virtual_path;
+			job->hash = hash;
+			job->mapped_path = mapped_path;
+			job->flags = flags;
+			job->name_filter = name_filter;
+			const char *slash = strrchr(mapped_path, '/');
+			if (slash && slash[1]) {
+				job->name = slash + 1;
+				job->parent_length = slash - mapped_path;
+			}
+			job->parent_fd = -1;
+		} else if (vfs->attrcache.slot_count) {
+			vfs_attrcache_store(vfs, virtual_path, now, hash, results[i], &vfs_dirents[i]);
+		} else {
+			free(virtual_path);
+		}
+	}
+
+	vfs_stat_many_open_parents(&batch);
+	if (thread_count > batch.job_count / VFS_STAT_MANY_JOBS_PER_THREAD) {
+		thread_count = batch.job_count / VFS_STAT_MANY_JOBS_PER_THREAD;
+	}
+	if (thread_count > VFS_STAT_MANY_MAX_THREADS) {
+		thread_count = VFS_STAT_MANY_MAX_THREADS;
+	}
+	pthread_t threads[thread_count + 1];
+	unsigned int started_threads = 0;
+	while ((started_threads < thread_count) && !pthread_create(&threads[started_threads], NULL, vfs_stat_many_worker, &batch)) {
+		started_threads++;
+	}
+	vfs_stat_many_worker(&batch);
+	for (unsigned int i = 0; i < started_threads; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	for (unsigned int i = 0; i < batch.job_count; i++) {
+		struct vfs_stat_job_t *job = &batch.jobs[i];
+		errno = job->stat_errno;
+		results[job->index] = vfs_stat_finish(job->stat_result, &job->statbuf, job->flags, job->name_filter, &vfs_dirents[job->index]);
+		if (vfs->attrcache.slot_count) {
+			vfs_attrcache_store(vfs, job->virtual_path, now, job->hash, results[job->index], &vfs_dirents[job->index]);
+		} else {
+			free(job->virtual_path);
+		}
+		if (job->owns_parent_fd) {
+			close(job->parent_fd);
+		}
+		free(job->mapped_path);
+	}
+	free(batch.jobs);
+	return VFS_OK;
+}
+
+/* Positional reads do not use the stdio stream, the offset is kept in the
+ * handle instead */
+static enum vfs_error_t vfs_read_tar(struct vfs_handle_t *handle, void *ptr, size_t *length) {
+	struct vfs_tar_t *tar = handle->file.tar;
+	uint8_t *bytes = (uint8_t*)ptr;
+	enum vfs_error_t result = VFS_OK;
+	size_t total = 0;
+	while (total < *length) {
+		size_t chunk_length = *length - total;
+		if (tar->header_position < tar->header_length) {
+			if (chunk_length > tar->header_length - tar->header_position) {
+				chunk_length = tar->header_length - tar->header_position;
+			}
+			memcpy(bytes + total, tar->header + tar->header_position, chunk_length);
+			tar->header_position += chunk_length;
+		} else if (tar->file_remaining) {
+			if (chunk_length > tar->file_remaining) {
+				chunk_length = tar->file_remaining;
+			}
+			if (tar->file) {
+				result = vfs_read(tar->file, bytes + total, &chunk_length);
+				if (result != VFS_OK) {
+					break;
+				}
+			}
+			if (!tar->file || (chunk_length == 0)) {
+				/* File shrank since its header was written, but the archive
+				 * must contain as much data as announced */
+				vfs_close_handle(tar->file);
+				tar->file = NULL;
+				chunk_length = (*length - total < tar->file_remaining) ? (*length - total) : tar->file_remaining;
+				memset(bytes + total, 0, chunk_length);
+			}
+			tar->file_remaining -= chunk_length;
+		} else if (tar->padding_remaining) {
+			if (chunk_length > tar->padding_remaining) {
+				chunk_length = tar->padding_remaining;
+			}
+			memset(bytes + total, 0, chunk_length);
+			tar->padding_remaining -= chunk_length;
+		} else if (tar->finished) {
+			break;
+		} else {
+			result = vfs_tar_next_entry(handle->vfs, tar);
+			if (result != VFS_OK) {
+				break;
+			}
+			continue;
+		}
+		total += chunk_length;
+	}
+	*length = total;
+	handle->file.offset += total;
+	return result;
+}
+
+static bool vfs_file_positional(const struct vfs_handle_t *handle) {
+	return handle->file.mapping || handle->file.sparse || handle->file.block_cached || handle->file.cached || handle->file.backend_file;
+}
+
+static enum vfs_error_t vfs_backend_pread_full(const struct vfs_handle_t *handle, void *ptr, size_t *length, uint64_t offset) {
+	const struct vfs_backend_t *backend = handle->backend;
+	size_t total = 0;
+	while (total < *length) {
+		ssize_t result = backend->ops->pread(backend->ctx, handle->file.backend_file, (uint8_t*)ptr + total, *length - total, offset + total);
+		if (result == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			*length = total;
+			return VFS_IO_ERROR;
+		}
+		if (result == 0) {
+			break;
+		}
+		total += result;
+	}
+	*length = total;
+	return VFS_OK;
+}
+
+static bool vfs_backend_pwrite_full(const struct vfs_handle_t *handle, const void *ptr, size_t length, uint64_t offset) {
+	const struct vfs_backend_t *backend = handle->backend;
+	size_t total = 0;
+	while (total < length) {
+		ssize_t result = backend->ops->pwrite(backend->ctx, handle->file.backend_file, (const uint8_t*)ptr + total, length - total, offset + total);
+		if (result == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		total += result;
+	}
+	return true;
+}
+
+static enum vfs_error_t vfs_pread_full(int fd, void *ptr, size_t *length, uint64_t offset) {
+	size_t total = 0;
+	while (total < *length) {
+		ssize_t result = pread(fd, (uint8_t*)ptr + total, *length - total, offset + total);
+		if (result == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			*length = total;
+			return VFS_IO_ERROR;
+		}
+		if (result == 0) {
+			break;
+		}
+		total += result;
+	}
+	*length = total;
+	return VFS_OK;
+}
+
+static enum vfs_error_t vfs_read_mapping(struct vfs_handle_t *handle, void *ptr, size_t *length) {
+	if (handle->file.offset >= handle->file.mapping_size) {
+		*length = 0;
+		return VFS_OK;
+	}
+	if (*length > handle->file.mapping_size - handle->file.offset) {
+		*length = handle->file.mapping_size - handle->file.offset;
+	}
+
+	sigjmp_buf jmpbuf;
+	if (sigsetjmp(jmpbuf, 0)) {
+		vfs_sigbus_jmpbuf = NULL;
+		logmsg(LLVL_ERROR, "vfs_read() caught SIGBUS, \"%s\" was truncated while mapped", handle->mapped_path);
+		*length = 0;
+		return VFS_IO_ERROR;
+	}
+	vfs_sigbus_jmpbuf = &jmpbuf;
+	memcpy(ptr, (const uint8_t*)handle->file.mapping + handle->file.offset, *length);
+	vfs_sigbus_jmpbuf = NULL;
+	return VFS_OK;
+}
+
+/* Data regions are read, holes are zero-filled without touching the disk.
+ * The extent of the last hole found is remembered so that a sequential reader
+ * does not need to query it for every request. */
+static enum vfs_error_t vfs_read_sparse(struct vfs_handle_t *handle, void *ptr, size_t *length) {
+	int fd = vfs_file_fd(handle);
+	size_t total = 0;
+	while (total < *length) {
+		uint64_t position = handle->file.offset + total;
+		size_t remaining = *length - total;
+
+		if ((position >= handle->file.hole.start) && (position < handle->file.hole.end)) {
+			size_t zero_length = handle->file.hole.end - position;
+			if (zero_length > remaining) {
+				zero_length = remaining;
+			}
+			memset((uint8_t*)ptr + total, 0, zero_length);
+			total += zero_length;
+			continue;
+		}
+
+		off_t hole_start = lseek(fd, position, SEEK_HOLE);
+		if (hole_start == -1) {
+			if (errno == ENXIO) {
+				/* At or beyond end of file */
+				break;
+			}
+			*length = total;
+			return VFS_IO_ERROR;
+		}
+
+		if ((uint64_t)hole_start > position) {
+			size_t data_length = hole_start - position;
+			if (data_length > remaining) {
+				data_length = remaining;
+			}
+			size_t read_length = data_length;
+			enum vfs_error_t result = vfs_pread_full(fd, (uint8_t*)ptr + total, &read_length, position);
+			total += read_length;
+			if (result != VFS_OK) {
+				*length = total;
+				return result;
+			}
+			if (read_length < data_length) {
+				/* File was truncated in the meantime */
+				break;
+			}
+			continue;
+		}
+
+		uint64_t hole_end;
+		off_t data_start = lseek(fd, position, SEEK_DATA);
+		if (data_start == -1) {
+			if (errno != ENXIO) {
+				*length = total;
+				return VFS_IO_ERROR;
+			}
+			/* Hole extends up to the end of the file */
+			struct stat statbuf;
+			if (fstat(fd, &statbuf)) {
+				*length = total;
+				return VFS_IO_ERROR;
+			}
+			hole_end = statbuf.st_size;
+		} else {
+			hole_end = data_start;
+		}
+		if (hole_end <= position) {
+			break;
+		}
+		handle->file.hole.start = position;
+		handle->file.hole.end = hole_end;
+	}
+	*length = total;
+	return VFS_OK;
+}
+
+/* Serves a read block by block from the shared block cache, reading and
+ * inserting whole blocks on a miss. */
+static enum vfs_error_t vfs_read_blockcache(struct vfs_handle_t *handle, void *ptr, size_t *length) {
+	struct blockcache_t *cache = handle->vfs->blockcache;
+	size_t total = 0;
+	while (total < *length) {
+		uint64_t position = handle->file.offset + total;
+		uint64_t block = position / BLOCKCACHE_BLOCK_SIZE;
+		size_t block_offset = position % BLOCKCACHE_BLOCK_SIZE;
+		size_t chunk_length = BLOCKCACHE_BLOCK_SIZE - block_offset;
+		if (chunk_length > *length - total) {
+			chunk_length = *length - total;
+		}
+
+		ssize_t copied = blockcache_read(cache, &handle->file.identity, block, block_offset, (uint8_t*)ptr + total, chunk_length);
+		if (copied == -1) {
+			uint8_t block_data[BLOCKCACHE_BLOCK_SIZE];
+			size_t block_length = BLOCKCACHE_BLOCK_SIZE;
+			if (vfs_pread_full(vfs_file_fd(handle), block_data, &block_length, block * BLOCKCACHE_BLOCK_SIZE) != VFS_OK) {
+				*length = total;
+				return VFS_IO_ERROR;
+			}
+			blockcache_insert(cache, &handle->file.identity, block, block_data, block_length);
+			copied = 0;
+			if (block_offset < block_length) {
+				copied = block_length - block_offset;
+				if ((size_t)copied > chunk_length) {
+					copied = chunk_length;
+				}
+				memcpy((uint8_t*)ptr + total, block_data + block_offset, copied);
+			}
+		}
+		total += copied;
+		if ((size_t)copied < chunk_length) {
+			/* End of file */
+			break;
+		}
+	}
+	*length = total;
+	return VFS_OK;
+}
+
+/* Each request is classified by its offset relative to the previous one. A
+ * new pattern is only adopted after it was seen repeatedly, random access
+ * needs more confirmations since the first requests after a seek of an
+ * otherwise sequential or strided reader look random as well. */
+static void vfs_access_track(struct vfs_handle_t *handle, uint64_t offset, size_t length) {
+	struct vfs_access_tracker_t *access = &handle->file.access;
+	int fd = vfs_file_fd(handle);
+
+	if (access->has_previous) {
+		enum vfs_access_pattern_t candidate;
+		int64_t delta = offset - access->last_offset;
+		if (offset == access->last_end) {
+			candidate = VFS_ACCESS_SEQUENTIAL;
+		} else if (delta && (delta == access->stride)) {
+			candidate = VFS_ACCESS_STRIDED;
+		} else {
+			candidate = VFS_ACCESS_RANDOM;
+		}
+		access->stride = delta;
+
+		if (candidate == access->candidate) {
+			access->confirmations++;
+		} else {
+			access->candidate = candidate;
+			access->confirmations = 1;
+		}
+
+		unsigned int required_confirmations = (candidate == VFS_ACCESS_RANDOM) ? VFS_ACCESS_RANDOM_CONFIRMATIONS : VFS_ACCESS_CONFIRMATIONS;
+		if ((access->confirmations >= required_confirmations) && (candidate != access->pattern)) {
+			static const int pattern_advice[] = {
+				[VFS_ACCESS_SEQUENTIAL] = POSIX_FADV_SEQUENTIAL,
+				[VFS_ACCESS_STRIDED] = POSIX_FADV_NORMAL,
+				[VFS_ACCESS_RANDOM] = POSIX_FADV_RANDOM,
+			};
+			logmsg(LLVL_TRACE, "vfs_read() access pattern of \"%s\" changed from %d to %d", handle->virtual_path, access->pattern, candidate);
+			access->pattern = candidate;
+			access->dropped_until = offset;
+			posix_fadvise(fd, 0, 0, pattern_advice[candidate]);
+		}
+	}
+
+	if (access->pattern == VFS_ACCESS_SEQUENTIAL) {
+		/* Pages behind the reader are not going to be needed again; the
+		 * kernel only drops pages that are entirely within the range */
+		if (offset >= access->dropped_until + VFS_ACCESS_DROP_BEHIND_WINDOW) {
+			posix_fadvise(fd, access->dropped_until, offset - access->dropped_until, POSIX_FADV_DONTNEED);
+			access->dropped_until = offset;
+		}
+	} else if ((access->pattern == VFS_ACCESS_STRIDED) && ((int64_t)offset + access->stride >= 0)) {
+		posix_fadvise(fd, offset + access->stride, length, POSIX_FADV_WILLNEED);
+	}
+
+	access->has_previous = true;
+	access->last_offset = offset;
+	access->last_end = offset + length;
+}
+
+enum vfs_error_t vfs_read(struct vfs_handle_t *handle, void *ptr, size_t *length) {
+	if (handle->type != FILE_HANDLE) {
+		logmsg(LLVL_WARN, "vfs_read() got invalid handle type %u", handle->type);
+		return VFS_INTERNAL_ERROR;
+	}
+	if (handle->file.mode != FILEMODE_READ) {
+		logmsg(LLVL_WARN, "vfs_read() refusing to read from \"%s\" not opened for reading", handle->virtual_path);
+		*length = 0;
+		return VFS_IO_ERROR;
+	}
+	if (handle->file.tar) {
+		return vfs_read_tar(handle, ptr, length);
+	}
+	if (handle->file.untar) {
+		logmsg(LLVL_WARN, "vfs_read() cannot read from archive upload");
+		return VFS_INTERNAL_ERROR;
+	}
+
+	if (handle->vfs->access_hints && !handle->file.cached && !handle->file.mapping && !handle->file.backend_file) {
+		/* Hints are not given for shared descriptors, which would affect all
+		 * sessions, nor for mappings, which are advised on their own */
+		vfs_access_track(handle, handle->file.offset, *length);
+	}
+
+	if (vfs_file_positional(handle)) {
+		enum vfs_error_t result;
+		if (handle->file.mapping) {
+			result = vfs_read_mapping(handle, ptr, length);
+		} else if (handle->file.sparse) {
+			result = vfs_read_sparse(handle, ptr, length);
+		} else if (handle->file.block_cached) {
+			result = vfs_read_blockcache(handle, ptr, length);
+		} else if (handle->file.backend_file) {
+			result = vfs_backend_pread_full(handle, ptr, length, handle->file.offset);
+		} else {
+			result = vfs_pread_full(vfs_file_fd(handle), ptr, length, handle->file.offset);
+		}
+		handle->file.offset += *length;
+		if (result != VFS_OK) {
+			logmsg(LLVL_ERROR, "vfs_read() had I/O error when reading from file: %s", strerror(errno));
+		}
+		return result;
+	}
+
+	errno = 0;
+	*length = fread(ptr, 1, *length, handle->file.file);
+	int fread_errno = errno;
+	handle->file.offset += *length;
+
+	if (errno) {
+		logmsg(LLVL_ERROR, "vfs_read() had I/O error when reading from file: %s", strerror(fread_errno));
+	}
+	return (fread_errno == 0) ? VFS_OK : VFS_IO_ERROR;
+}
+
+/* Reads at an explicit offset, as SFTP read requests carry one */
+enum vfs_error_t vfs_read_at(struct vfs_handle_t *handle, uint64_t offset, void *ptr, size_t *length) {
+	if (handle->type != FILE_HANDLE) {
+		logmsg(LLVL_WARN, "vfs_read_at() got invalid handle type %u", handle->type);
+		return VFS_INTERNAL_ERROR;
+	}
+	if (handle->file.mode != FILEMODE_READ) {
+		logmsg(LLVL_WARN, "vfs_read_at() refusing to read from \"%s\" not opened for reading", handle->virtual_path);
+		*length = 0;
+		return VFS_IO_ERROR;
+	}
+
+	if (offset != handle->file.offset) {
+		if (handle->file.tar) {
+			logmsg(LLVL_DEBUG, "vfs_read_at() cannot seek in archive stream of \"%s\"", handle->virtual_path);
+			return VFS_IO_ERROR;
+		}
+		if (!vfs_file_positional(handle) && fseeko(handle->file.file, offset, SEEK_SET)) {
+			logmsg(LLVL_ERROR, "vfs_read_at() could not seek to offset %lu: %s", offset, strerror(errno));
+			return VFS_IO_ERROR;
+		}
+		handle->file.offset = offset;
+	}
+	return vfs_read(handle, ptr, length);
+}
+
+static int vfs_write_fd(const struct vfs_handle_t *handle) {
+	return handle->file.direct.staging ? handle->file.direct.fd : fileno(handle->file.file);
+}
+
+/* Reserves space for an upload of known size (e.g., when the client sent the
+ * size along with the open request). The file size is left unchanged, so the
+ * file only ever appears as large as what was actually written. Filesystems
+ * without fallocate() support simply do not get the reservation. */
+enum vfs_error_t vfs_preallocate(struct vfs_handle_t *handle, uint64_t size) {
+	if ((handle->type != FILE_HANDLE) || (handle->file.mode == FILEMODE_READ)) {
+		logmsg(LLVL_WARN, "vfs_preallocate() requires a file handle opened for writing");
+		return VFS_INTERNAL_ERROR;
+	}
+	if ((size == 0) || handle->file.untar || handle->file.backend_file) {
+		/* Archive uploads have no single file to reserve space for, backends
+		 * do not support reservations */
+		return VFS_OK;
+	}
+
+	int fd = vfs_write_fd(handle);
+	if (fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, size)) {
+		if ((errno == EOPNOTSUPP) || (errno == ENOSYS)) {
+			logmsg(LLVL_DEBUG, "vfs_preallocate() not supported for \"%s\", continuing without", handle->mapped_path);
+			return VFS_OK;
+		}
+		enum vfs_error_t error_code = vfs_errno_to_vfs_error(errno);
+		logmsg(LLVL_DEBUG, "vfs_preallocate() failed to reserve %lu bytes for \"%s\": %s", size, handle->mapped_path, strerror(errno));
+		return error_code;
+	}
+	handle->file.preallocated = true;
+	return VFS_OK;
+}
+
+/* Releases whatever was reserved beyond the data actually written, e.g.,
+ * when an upload was aborted early */
+static void vfs_release_preallocation(struct vfs_handle_t *handle) {
+	int fd = vfs_write_fd(handle);
+	struct stat statbuf;
+	if (handle->file.file) {
+		fflush(handle->file.file);
+	}
+	if (fstat(fd, &statbuf) || ftruncate(fd, statbuf.st_size)) {
+		logmsg(LLVL_ERROR, "vfs_close_handle() could not release preallocated space of \"%s\": %s", handle->mapped_path, strerror(errno));
+	}
+}
+
+/* Like lseek() with SEEK_DATA or SEEK_HOLE: finds the next offset at or after
+ * the given one where data (or a hole) begins, so that cooperating clients
+ * can skip holes entirely. The end of the file counts as a hole. */
+enum vfs_error_t vfs_seek_data(struct vfs_handle_t *handle, uint64_t offset, bool find_data, uint64_t *result_offset) {
+	if ((handle->type != FILE_HANDLE) || (handle->file.mode != FILEMODE_READ)) {
+		logmsg(LLVL_WARN, "vfs_seek_data() requires a file handle opened for reading");
+		return VFS_INTERNAL_ERROR;
+	}
+
+	if (handle->file.backend_file) {
+		/* Backend files have no holes */
+		struct stat statbuf;
+		if (vfs_file_stat(handle, &statbuf)) {
+			return vfs_errno_to_vfs_error(errno);
+		}
+		if (offset >= (uint64_t)statbuf.st_size) {
+			return VFS_NO_SUCH_FILE_OR_DIRECTORY;
+		}
+		*result_offset = find_data ? offset : (uint64_t)statbuf.st_size;
+		return VFS_OK;
+	}
+
+	off_t result = lseek(vfs_file_fd(handle), offset, find_data ? SEEK_DATA : SEEK_HOLE);
+	if (result == -1) {
+		/* ENXIO: no more data after offset, or offset beyond end of file */
+		return (errno == ENXIO) ? VFS_NO_SUCH_FILE_OR_DIRECTORY : vfs_errno_to_vfs_error(errno);
+	}
+	if (!vfs_file_positional(handle) && fseeko(handle->file.file, handle->file.offset, SEEK_SET)) {
+		/* Restore stdio position, lseek() moved the underlying descriptor */
+		return VFS_IO_ERROR;
+	}
+	*result_offset = result;
+	return VFS_OK;
+}
+
+void vfs_set_access_hints(struct vfs_t *vfs, bool enabled) {
+	vfs->access_hints = enabled;
+}
+
+static bool vfs_pwrite_full(int fd, const void *ptr, size_t length, uint64_t offset) {
+	size_t total = 0;
+	while (total < length) {
+		ssize_t result = pwrite(fd, (const uint8_t*)ptr + total, length - total, offset + total);
+		if (result == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		total += result;
+	}
+	return true;
+}
+
+static enum vfs_error_t vfs_write_direct(struct vfs_handle_t *handle, const void *ptr, size_t *length) {
+	size_t total = 0;
+	while (total < *length) {
+		size_t chunk_length = VFS_DIRECT_IO_BUFFER_SIZE - handle->file.direct.staging_length;
+		if (chunk_length > *length - total) {
+			chunk_length = *length - total;
+		}
+		memcpy(handle->file.direct.staging + handle->file.direct.staging_length, (const uint8_t*)ptr + total, chunk_length);
+		handle->file.direct.staging_length += chunk_length;
+		total += chunk_length;
+
+		if (handle->file.direct.staging_length == VFS_DIRECT_IO_BUFFER_SIZE) {
+			if (!vfs_pwrite_full(handle->file.direct.fd, handle->file.direct.staging, VFS_DIRECT_IO_BUFFER_SIZE, handle->file.direct.staging_offset)) {
+				*length = total - chunk_length;
+				return VFS_IO_ERROR;
+			}
+			handle->file.direct.staging_offset += VFS_DIRECT_IO_BUFFER_SIZE;
+			handle->file.direct.staging_length = 0;
+		}
+	}
+	return VFS_OK;
+}
+
+/* The unaligned tail is written as a zero-padded full block and the file
+ * is then truncated to its actual length */
+static void vfs_flush_direct(struct vfs_handle_t *handle) {
+	bool success = true;
+	size_t tail_length = handle->file.direct.staging_length;
+	if (tail_length || handle->file.preallocated) {
+		size_t padded_length = (tail_length + VFS_DIRECT_IO_ALIGNMENT - 1) & ~(size_t)(VFS_DIRECT_IO_ALIGNMENT - 1);
+		memset(handle->file.direct.staging + tail_length, 0, padded_length - tail_length);
+		success = vfs_pwrite_full(handle->file.direct.fd, handle->file.direct.staging, padded_length, handle->file.direct.staging_offset);
+		if (success) {
+			success = (ftruncate(handle->file.direct.fd, handle->file.direct.staging_offset + tail_length) == 0);
+		}
+	}
+	if (!success) {
+		logmsg(LLVL_ERROR, "vfs_close_handle() failed to write tail of \"%s\": %s", handle->mapped_path, strerror(errno));
+	}
+}
+
+/* Uploads are hashed while passing through the write path; anything that
+ * breaks the sequence of data (e.g., a positional copy) discards the hash */
+static void vfs_upload_hash_discard(struct vfs_handle_t *handle) {
+	filehash_free(handle->file.upload_hash);
+	handle->file.upload_hash = NULL;
+}
+
+static void vfs_upload_hash_update(struct vfs_handle_t *handle, const void *ptr, size_t length) {
+	if (handle->file.upload_hash && !filehash_update(handle->file.upload_hash, ptr, length)) {
+		vfs_upload_hash_discard(handle);
+	}
+}
+
+/* Stored as "<mtime> <size> <hex digest>", so that it can only ever be used
+ * for exactly the file version it was computed over */
+static void vfs_upload_hash_store(struct vfs_handle_t *handle) {
+	struct filehash_t *hash = handle->file.upload_hash;
+	int fd = vfs_write_fd(handle);
+	struct stat statbuf;
+	if (handle->file.file) {
+		fflush(handle->file.file);
+	}
+	if (!filehash_finish(hash) || fstat(fd, &statbuf)) {
+		return;
+	}
+
+	char name[VFS_HASH_XATTR_MAX_LENGTH];
+	char value[VFS_HASH_XATTR_MAX_LENGTH];
+	snprintf(name, sizeof(name), VFS_HASH_XATTR_PREFIX "%s", filehash_algorithm_name(hash->algorithm));
+	int value_length = snprintf(value, sizeof(value), "%ld.%09ld %lu ", (long)statbuf.st_mtim.tv_sec, (long)statbuf.st_mtim.tv_nsec, (unsigned long)statbuf.st_size);
+	for (unsigned int i = 0; (i < hash->digest_length) && (value_length + 2 < (int)sizeof(value)); i++) {
+		value_length += snprintf(value + value_length, sizeof(value) - value_length, "%02x", hash->digests[i]);
+	}
+	if (fsetxattr(fd, name, value, value_length, 0)) {
+		logmsg(LLVL_DEBUG, "vfs_close_handle() could not store upload digest of \"%s\": %s", handle->mapped_path, strerror(errno));
+	}
+}
+
+/* Uses a digest stored at upload time if it was computed over exactly the
+ * current version of the whole file */
+static bool vfs_upload_hash_load(struct vfs_handle_t *handle, uint64_t length, struct filehash_t *hash) {
+	int fd = vfs_file_fd(handle);
+	struct stat statbuf;
+	if (fstat(fd, &statbuf) || (length && (length != (uint64_t)statbuf.st_size))) {
+		return false;
+	}
+
+	char name[VFS_HASH_XATTR_MAX_LENGTH];
+	char value[VFS_HASH_XATTR_MAX_LENGTH];
+	snprintf(name, sizeof(name), VFS_HASH_XATTR_PREFIX "%s", filehash_algorithm_name(hash->algorithm));
+	ssize_t value_length = fgetxattr(fd, name, value, sizeof(value) - 1);
+	if (value_length <= 0) {
+		return false;
+	}
+	value[value_length] = 0;
+
+	long mtime_sec, mtime_nsec;
+	unsigned long size;
+	int hex_offset;
+	if ((sscanf(value, "%ld.%ld %lu %n", &mtime_sec, &mtime_nsec, &size, &hex_offset) != 3) || (mtime_sec != statbuf.st_mtim.tv_sec) || (mtime_nsec != statbuf.st_mtim.tv_nsec) || (size != (unsigned long)statbuf.st_size)) {
+		return false;
+	}
+	const char *hex = value + hex_offset;
+	if (strlen(hex) != 2 * hash->digest_length) {
+		return false;
+	}
+	uint8_t digest[EVP_MAX_MD_SIZE];
+	for (unsigned int i = 0; i < hash->digest_length; i++) {
+		if (sscanf(hex + (2 * i), "%2hhx", &digest[i]) != 1) {
+			return false;
+		}
+	}
+	return filehash_set_digest(hash, digest);
+}
+
+void vfs_set_upload_hashing(struct vfs_t *vfs, bool enabled, enum filehash_algorithm_t algorithm) {
+	vfs->upload_hash.enabled = enabled;
+	vfs->upload_hash.algorithm = algorithm;
+}
+
+static enum vfs_error_t vfs_write_untar(struct vfs_handle_t *handle, const void *ptr, size_t *length) {
+	struct vfs_untar_t *untar = handle->file.untar;
+	if (!tarstream_parse(&untar->parser, ptr, *length)) {
+		*length = 0;
+		return (untar->error != VFS_OK) ? untar->error : VFS_IO_ERROR;
+	}
+	return VFS_OK;
+}
+
+enum vfs_error_t vfs_write(struct vfs_handle_t *handle, const void *ptr, size_t *length) {
+	if (handle->type != FILE_HANDLE) {
+		logmsg(LLVL_WARN, "vfs_write() got invalid handle type %u", handle->type);
+		return VFS_INTERNAL_ERROR;
+	}
+	if (handle->file.mode == FILEMODE_READ) {
+		logmsg(LLVL_WARN, "vfs_write() refusing to write to \"%s\" opened for reading", handle->virtual_path);
+		*length = 0;
+		return VFS_IO_ERROR;
+	}
+	if (handle->file.untar) {
+		return vfs_write_untar(handle, ptr, length);
+	}
+
+	vfs_attrcache_invalidate(handle->vfs, handle->virtual_path);
+
+	if (handle->file.direct.staging) {
+		enum vfs_error_t result = vfs_write_direct(handle, ptr, length);
+		vfs_upload_hash_update(handle, ptr, *length);
+		if (result != VFS_OK) {
+			logmsg(LLVL_ERROR, "vfs_write() had I/O error when writing to file: %s", strerror(errno));
+		}
+		return result;
+	}
+
+	if (handle->file.backend_file) {
+		if (!vfs_backend_pwrite_full(handle, ptr, *length, handle->file.offset)) {
+			logmsg(LLVL_ERROR, "vfs_write() had I/O error when writing to %s file: %s", handle->backend->name, strerror(errno));
+			*length = 0;
+			return VFS_IO_ERROR;
+		}
+		handle->file.offset += *length;
+		vfs_upload_hash_update(handle, ptr, *length);
+		return VFS_OK;
+	}
+
+	errno = 0;
+	*length = fwrite(ptr, 1, *length, handle->file.file);
+	int fwrite_errno = errno;
+	vfs_upload_hash_update(handle, ptr, *length);
+
+	if (errno) {
+		logmsg(LLVL_ERROR, "vfs_write() had I/O error when writing to file: %s", strerror(fwrite_errno));
+	}
+	return (fwrite_errno == 0) ? VFS_OK : VFS_IO_ERROR;
+}
+
+/* Copies through a bounce buffer when copy_file_range() is not possible
+ * (e.g., across filesystems on older kernels or for O_DIRECT targets) */
+static enum vfs_error_t vfs_copy_buffered(struct vfs_handle_t *src, uint64_t src_offset, uint64_t length, struct vfs_handle_t *dst, uint64_t dst_offset, uint64_t *copied) {
+	uint8_t *buffer = malloc(VFS_COPY_BUFFER_SIZE);
+	if (!buffer) {
+		return VFS_INTERNAL_ERROR;
+	}
+
+	enum vfs_error_t result = VFS_OK;
+	while ((length == 0) || (*copied < length)) {
+		size_t chunk_length = VFS_COPY_BUFFER_SIZE;
+		if (length && (chunk_length > length - *copied)) {
+			chunk_length = length - *copied;
+		}
+		result = vfs_read_at(src, src_offset + *copied, buffer, &chunk_length);
+		if ((result != VFS_OK) || (chunk_length == 0)) {
+			break;
+		}
+
+		if (dst->file.direct.staging) {
+			size_t written = chunk_length;
+			result = vfs_write(dst, buffer, &written);
+			if (result != VFS_OK) {
+				break;
+			}
+		} else if (dst->file.backend_file) {
+			if (!vfs_backend_pwrite_full(dst, buffer, chunk_length, dst_offset + *copied)) {
+				logmsg(LLVL_ERROR, "vfs_copy() failed writing to \"%s\": %s", dst->mapped_path, strerror(errno));
+				result = VFS_IO_ERROR;
+				break;
+			}
+		} else if (!vfs_pwrite_full(fileno(dst->file.file), buffer, chunk_length, dst_offset + *copied)) {
+			logmsg(LLVL_ERROR, "vfs_copy() failed writing to \"%s\": %s", dst->mapped_path, strerror(errno));
+			result = VFS_IO_ERROR;
+			break;
+		}
+		*copied += chunk_length;
+	}
+	free(buffer);
+	return result;
+}
+
+/* Data is copied within the kernel using copy_file_range(), which can share
+ * extents (reflink) on filesystems supporting it */
+static enum vfs_error_t vfs_copy_kernel(struct vfs_handle_t *src, uint64_t src_offset, uint64_t length, struct vfs_handle_t *dst, uint64_t dst_offset, uint64_t *copied) {
+	fflush(dst->file.file);
+	int src_fd = vfs_file_fd(src);
+	int dst_fd = fileno(dst->file.file);
+	while ((length == 0) || (*copied < length)) {
+		size_t chunk_length = VFS_COPY_CHUNK_SIZE;
+		if (length && (chunk_length > length - *copied)) {
+			chunk_length = length - *copied;
+		}
+		loff_t src_position = src_offset + *copied;
+		loff_t dst_position = dst_offset + *copied;
+		ssize_t result = copy_file_range(src_fd, &src_position, dst_fd, &dst_position, chunk_length, 0);
+		if (result == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if ((errno == EXDEV) || (errno == EINVAL) || (errno == ENOSYS) || (errno == EOPNOTSUPP)) {
+				logmsg(LLVL_DEBUG, "vfs_copy_range() cannot use copy_file_range() from \"%s\" to \"%s\": %s", src->mapped_path, dst->mapped_path, strerror(errno));
+				return vfs_copy_buffered(src, src_offset, length, dst, dst_offset, copied);
+			}
+			logmsg(LLVL_ERROR, "vfs_copy_range() failed copying from \"%s\" to \"%s\": %s", src->mapped_path, dst->mapped_path, strerror(errno));
+			return vfs_errno_to_vfs_error(errno);
+		}
+		if (result == 0) {
+			break;
+		}
+		*copied += result;
+	}
+	return VFS_OK;
+}
+
+/* Server-side copy of a range between two open handles, as requested by the
+ * "copy-data" SFTP extension. A length of zero copies up to the end of the
+ * source file. Permissions were checked when the handles were opened. Like
+ * after vfs_write(), the destination's position is right after the copied
+ * data. */
+enum vfs_error_t vfs_copy_range(struct vfs_handle_t *src, uint64_t src_offset, uint64_t length, struct vfs_handle_t *dst, uint64_t dst_offset, uint64_t *copied) {
+	*copied = 0;
+	if ((src->type != FILE_HANDLE) || (dst->type != FILE_HANDLE) || (src->file.mode != FILEMODE_READ) || (dst->file.mode != FILEMODE_WRITE) || dst->file.untar) {
+		logmsg(LLVL_WARN, "vfs_copy_range() requires a source opened for reading and a destination opened for writing");
+		return VFS_INTERNAL_ERROR;
+	}
+	if (dst->file.direct.staging && (dst_offset != dst->file.direct.staging_offset + dst->file.direct.staging_length)) {
+		logmsg(LLVL_WARN, "vfs_copy_range() can only append to a destination opened for direct I/O");
+		return VFS_INTERNAL_ERROR;
+	}
+
+	vfs_attrcache_invalidate(dst->vfs, dst->virtual_path);
+	vfs_upload_hash_discard(dst);
+	enum vfs_error_t result;
+	if (dst->file.direct.staging || src->file.tar || src->file.backend_file || dst->file.backend_file) {
+		result = vfs_copy_buffered(src, src_offset, length, dst, dst_offset, copied);
+	} else {
+		result = vfs_copy_kernel(src, src_offset, length, dst, dst_offset, copied);
+	}
+
+	/* Data was written around the stream's position (direct I/O staging
+	 * keeps track of its own) */
+	if (dst->file.file && fseeko(dst->file.file, dst_offset + *copied, SEEK_SET)) {
+		logmsg(LLVL_ERROR, "vfs_copy_range() could not seek in \"%s\": %s", dst->mapped_path, strerror(errno));
+		if (result == VFS_OK) {
+			result = VFS_IO_ERROR;
+		}
+	}
+	if (dst->file.backend_file) {
+		dst->file.offset = dst_offset + *copied;
+	}
+	return result;
+}
+
+enum vfs_error_t vfs_copy(struct vfs_t *vfs, const char *src_path, const char *dst_path) {
+	struct vfs_handle_t *src;
+	enum vfs_error_t result = vfs_open(vfs, src_path, FILEMODE_READ, &src);
+	if (result != VFS_OK) {
+		return result;
+	}
+
+	/* Opening the destination truncates it, which must never happen to the
+	 * source itself (e.g., when reachable through two mounts) */
+	struct vfs_handle_t *dst_node;
+	if (vfs_open_node(vfs, dst_path, &dst_node) == VFS_OK) {
+		struct stat src_statbuf, dst_statbuf;
+		bool same_file = dst_node->mapped_path && (dst_node->backend == src->backend) && !vfs_backend_stat(dst_node->backend, dst_node->mapped_path, &dst_statbuf) && !vfs_file_stat(src, &src_statbuf) && (src_statbuf.st_dev == dst_statbuf.st_dev) && (src_statbuf.st_ino == dst_statbuf.st_ino);
+		vfs_close_handle(dst_node);
+		if (same_file) {
+			logmsg(LLVL_DEBUG, "vfs_copy() refusing to copy \"%s\" onto itself", src_path);
+			vfs_close_handle(src);
+			return VFS_PERMISSION_DENIED;
+		}
+	}
+
+	struct vfs_handle_t *dst;
+	result = vfs_open(vfs, dst_path, FILEMODE_WRITE, &dst);
+	if (result != VFS_OK) {
+		vfs_close_handle(src);
+		return result;
+	}
+
+	uint64_t copied;
+	result = vfs_copy_range(src, 0, 0, dst, 0, &copied);
+	vfs_close_handle(dst);
+	vfs_close_handle(src);
+	return result;
+}
+
+/* Feeds a byte range of a file to one or more hashes (e.g., for several
+ * queued check-file requests on the same range) in a single pass of large,
+ * aligned reads. A length of zero hashes up to the end of the file. */
+enum vfs_error_t vfs_check_file(struct vfs_handle_t *handle, uint64_t offset, uint64_t length, struct filehash_t **hashes, unsigned int hash_count) {
+	if ((handle->type != FILE_HANDLE) || (handle->file.mode != FILEMODE_READ)) {
+		logmsg(LLVL_WARN, "vfs_check_file() requires a file handle opened for reading");
+		return VFS_INTERNAL_ERROR;
+	}
+
+	/* Whole-file digests stored at upload time are answered instantly */
+	struct filehash_t *pending_hashes[hash_count];
+	unsigned int pending_count = 0;
+	for (unsigned int i = 0; i < hash_count; i++) {
+		if ((offset == 0) && (hashes[i]->block_size == 0) && vfs_upload_hash_load(handle, length, hashes[i])) {
+			continue;
+		}
+		pending_hashes[pending_count++] = hashes[i];
+	}
+	if (pending_count == 0) {
+		return VFS_OK;
+	}
+	hashes = pending_hashes;
+	hash_count = pending_count;
+
+	void *buffer;
+	if (posix_memalign(&buffer, VFS_DIRECT_IO_ALIGNMENT, VFS_HASH_READ_SIZE)) {
+		return VFS_INTERNAL_ERROR;
+	}
+
+	enum vfs_error_t result = VFS_OK;
+	uint64_t hashed = 0;
+	while ((length == 0) || (hashed < length)) {
+		/* After the first read, reads start at aligned offsets */
+		uint64_t position = offset + hashed;
+		size_t chunk_length = VFS_HASH_READ_SIZE - (position % VFS_HASH_READ_SIZE);
+		if (length && (chunk_length > length - hashed)) {
+			chunk_length = length - hashed;
+		}
+		result = vfs_read_at(handle, position, buffer, &chunk_length);
+		if ((result != VFS_OK) || (chunk_length == 0)) {
+			break;
+		}
+		for (unsigned int i = 0; i < hash_count; i++) {
+			if (!filehash_update(hashes[i], buffer, chunk_length)) {
+				result = VFS_INTERNAL_ERROR;
+			}
+		}
+		if (result != VFS_OK) {
+			break;
+		}
+		hashed += chunk_length;
+	}
+	free(buffer);
+
+	if (result == VFS_OK) {
+		for (unsigned int i = 0; i < hash_count; i++) {
+			if (!filehash_finish(hashes[i])) {
+				result = VFS_INTERNAL_ERROR;
+			}
+		}
+	}
+	return result;
+}
+
+/* Block signatures of an existing file for the delta transfer extension,
+ * passed to the signer's callback while the file is being read */
+enum vfs_error_t vfs_delta_signature(struct vfs_handle_t *handle, struct delta_signer_t *signer) {
+	if ((handle->type != FILE_HANDLE) || (handle->file.mode != FILEMODE_READ)) {
+		logmsg(LLVL_WARN, "vfs_delta_signature() requires a file handle opened for reading");
+		return VFS_INTERNAL_ERROR;
+	}
+
+	void *buffer;
+	if (posix_memalign(&buffer, VFS_DIRECT_IO_ALIGNMENT, VFS_HASH_READ_SIZE)) {
+		return VFS_INTERNAL_ERROR;
+	}
+
+	enum vfs_error_t result = VFS_OK;
+	uint64_t offset = 0;
+	while (true) {
+		size_t chunk_length = VFS_HASH_READ_SIZE;
+		result = vfs_read_at(handle, offset, buffer, &chunk_length);
+		if ((result != VFS_OK) || (chunk_length == 0)) {
+			break;
+		}
+		if (!delta_signer_update(signer, buffer, chunk_length)) {
+			result = VFS_INTERNAL_ERROR;
+			break;
+		}
+		offset += chunk_length;
+	}
+	free(buffer);
+
+	if ((result == VFS_OK) && !delta_signer_finish(signer)) {
+		result = VFS_INTERNAL_ERROR;
+	}
+	return result;
+}
+
+/* The output is written to a temporary file next to the target, which
+ * undergoes the usual permission checks when it is created. Every delta gets
+ * a temporary file of its own and never reuses an existing file, even one
+ * left behind by an earlier transfer. Basis and target may be the same
+ * file. */
+enum vfs_error_t vfs_delta_begin(struct vfs_t *vfs, const char *basis_path, const char *target_path, uint32_t block_size, struct vfs_delta_t **delta_ptr) {
+	*delta_ptr = NULL;
+	if ((block_size < DELTA_MIN_BLOCK_SIZE) || (block_size > DELTA_MAX_BLOCK_SIZE)) {
+		logmsg(LLVL_WARN, "vfs_delta_begin() refusing block size of %u bytes", block_size);
+		return VFS_INTERNAL_ERROR;
+	}
+
+	struct vfs_handle_t *target;
+	enum vfs_error_t result = vfs_open_node(vfs, target_path, &target);
 	if (result != VFS_OK) {
 		return result;
 	}
-
-	if (handle->inode) {
-		/* Virtual directory */
-		vfs_stat_virtual_directory(const_basename(handle->virtual_path), vfs_dirent, handle->flags);
-		vfs_close_handle(handle);
-		return VFS_OK;
+	const char *target_name = const_basename(target->virtual_path);
+	if (!target->mapped_path || (target->flags & VFS_INODE_FLAG_READ_ONLY) || !vfs_name_permitted(target->name_filter, target_name, strlen(target_name), true)) {
+		logmsg(LLVL_DEBUG, "vfs_delta_begin() refusing to replace \"%s\"", target->virtual_path);
+		vfs_close_handle(target);
+		return VFS_PERMISSION_DENIED;
 	}
 
-	/* Mapped directory */
-	errno = 0;
-	struct stat statbuf;
-	int stat_result = stat(handle->mapped_path, &statbuf);
-	if (stat_result == -1) {
-		/* stat failed */
-		enum vfs_error_t error_code = vfs_errno_to_vfs_error(errno);
-		vfs_close_handle(handle);
-		return error_code;
+	struct vfs_delta_t *delta = calloc(1, sizeof(struct vfs_delta_t));
+	if (!delta) {
+		vfs_close_handle(target);
+		return VFS_INTERNAL_ERROR;
+	}
+	delta->block_size = block_size;
+	delta->backend = target->backend;
+	delta->target_mapped_path = target->mapped_path;
+	delta->target_virtual_path = target->virtual_path;
+	target->mapped_path = NULL;
+	target->virtual_path = NULL;
+	vfs_close_handle(target);
+
+	size_t temp_path_size = strlen(delta->target_virtual_path) + strlen(VFS_DELTA_TEMP_SUFFIX) + 12;
+	char *temp_path = malloc(temp_path_size);
+	if (!temp_path) {
+		vfs_delta_finish(delta, false);
+		return VFS_INTERNAL_ERROR;
 	}
 
-	strncpy(vfs_dirent->filename, const_basename(handle->virtual_path), VFS_MAX_FILENAME_LENGTH - 1);
-	vfs_dirent->filename[VFS_MAX_FILENAME_LENGTH - 1] = 0;
-	vfs_stat_statbuf(&statbuf, vfs_dirent, handle->flags);
-	vfs_close_handle(handle);
+	result = vfs_open(vfs, basis_path, FILEMODE_READ, &delta->basis);
+	if (result == VFS_OK) {
+		struct stat statbuf;
+		if (vfs_file_stat(delta->basis, &statbuf)) {
+			result = vfs_errno_to_vfs_error(errno);
+		} else {
+			delta->basis_size = statbuf.st_size;
+			result = VFS_FILE_EXISTS;
+			for (unsigned int attempt = 0; (attempt < VFS_DELTA_TEMP_ATTEMPTS) && (result == VFS_FILE_EXISTS); attempt++) {
+				snprintf(temp_path, temp_path_size, "%s%s.%u", delta->target_virtual_path, VFS_DELTA_TEMP_SUFFIX, attempt);
+				result = vfs_open_file(vfs, temp_path, FILEMODE_WRITE, true, &delta->output);
+			}
+		}
+	}
+	free(temp_path);
+	if (result != VFS_OK) {
+		vfs_delta_finish(delta, false);
+		return result;
+	}
+	/* Only the replaced target is a change worth recording */
+	delta->output->file.unjournaled = true;
+	*delta_ptr = delta;
 	return VFS_OK;
 }
 
-enum vfs_error_t vfs_read(struct vfs_handle_t *handle, void *ptr, size_t *length) {
-	if (handle->type != FILE_HANDLE) {
-		logmsg(LLVL_WARN, "vfs_read() got invalid handle type %u", handle->type);
+/* Copies a run of blocks from the basis file; the last block of the basis
+ * may be short */
+enum vfs_error_t vfs_delta_copy_blocks(struct vfs_delta_t *delta, uint64_t first_block, uint64_t block_count) {
+	uint64_t offset = first_block * delta->block_size;
+	if ((block_count == 0) || (first_block > delta->basis_size / delta->block_size) || (offset >= delta->basis_size) || (block_count > (delta->basis_size - offset + delta->block_size - 1) / delta->block_size)) {
+		/* Checked before multiplying, a client-supplied count could wrap */
+		logmsg(LLVL_WARN, "vfs_delta_copy_blocks() got reference to blocks %lu+%lu outside of basis", (unsigned long)first_block, (unsigned long)block_count);
 		return VFS_INTERNAL_ERROR;
 	}
+	uint64_t length = block_count * delta->block_size;
+	if (length > delta->basis_size - offset) {
+		length = delta->basis_size - offset;
+	}
 
-	errno = 0;
-	*length = fread(ptr, 1, *length, handle->file.file);
-	int fread_errno = errno;
+	uint64_t copied;
+	enum vfs_error_t result = vfs_copy_range(delta->basis, offset, length, delta->output, delta->output_offset, &copied);
+	delta->output_offset += copied;
+	if ((result == VFS_OK) && (copied != length)) {
+		/* Basis was truncated underneath us */
+		result = VFS_IO_ERROR;
+	}
+	return result;
+}
 
-	if (errno) {
-		logmsg(LLVL_ERROR, "vfs_read() had I/O error when reading from file: %s", strerror(fread_errno));
+enum vfs_error_t vfs_delta_literal(struct vfs_delta_t *delta, const void *data, size_t length) {
+	size_t written = length;
+	enum vfs_error_t result = vfs_write(delta->output, data, &written);
+	delta->output_offset += written;
+	return result;
+}
+
+/* Either atomically replaces the target with the assembled file or discards
+ * it; the delta is freed in any case */
+enum vfs_error_t vfs_delta_finish(struct vfs_delta_t *delta, bool commit) {
+	enum vfs_error_t result = VFS_OK;
+	if (delta->output) {
+		if (delta->output->file.file && fflush(delta->output->file.file)) {
+			logmsg(LLVL_ERROR, "vfs_delta_finish() failed to flush \"%s\": %s", delta->output->mapped_path, strerror(errno));
+			commit = false;
+			result = VFS_IO_ERROR;
+		}
+		struct vfs_t *vfs = delta->output->vfs;
+		char *temp_mapped_path = strdup(delta->output->mapped_path);
+		vfs_close_handle(delta->output);
+
+		if (!temp_mapped_path) {
+			result = VFS_INTERNAL_ERROR;
+		} else if (commit) {
+			struct stat statbuf;
+			bool target_existed = (vfs_backend_stat(delta->backend, delta->target_mapped_path, &statbuf) == 0);
+			if (vfs_backend_rename(delta->backend, temp_mapped_path, delta->target_mapped_path)) {
+				logmsg(LLVL_ERROR, "vfs_delta_finish() failed to replace \"%s\": %s", delta->target_mapped_path, strerror(errno));
+				result = vfs_errno_to_vfs_error(errno);
+				vfs_backend_unlink(delta->backend, temp_mapped_path);
+			} else {
+				vfs_journal_change(vfs, delta->target_virtual_path, target_existed ? CHANGEJOURNAL_MODIFY : CHANGEJOURNAL_CREATE);
+			}
+			vfs_attrcache_invalidate(vfs, delta->target_virtual_path);
+		} else {
+			vfs_backend_unlink(delta->backend, temp_mapped_path);
+		}
+		free(temp_mapped_path);
 	}
-	return (fread_errno == 0) ? VFS_OK : VFS_IO_ERROR;
+	vfs_close_handle(delta->basis);
+	free(delta->target_mapped_path);
+	free(delta->target_virtual_path);
+	free(delta);
+	return result;
 }
 
-enum vfs_error_t vfs_write(struct vfs_handle_t *handle, const void *ptr, size_t *length) {
-	if (handle->type != FILE_HANDLE) {
-		logmsg(LLVL_WARN, "vfs_write() got invalid handle type %u", handle->type);
-		return VFS_INTERNAL_ERROR;
+static char *vfs_join_path(const char *path, const char *name) {
+	size_t path_length = strlen(path);
+	char *joined = malloc(path_length + 1 + strlen(name) + 1);
+	if (joined) {
+		bool separator = path_length && (path[path_length - 1] != '/');
+		sprintf(joined, "%s%s%s", path, separator ? "/" : "", name);
 	}
+	return joined;
+}
 
-	errno = 0;
-	*length = fwrite(ptr, 1, *length, handle->file.file);
-	int fwrite_errno = errno;
+/* Changes are recorded per mount, independent of the session; only those
+ * this session could also access are reported */
+static bool vfs_change_visible(struct vfs_t *vfs, const struct vfs_inode_t *mountpoint, const char *virtual_path) {
+	if (!virtual_path) {
+		return true;
+	}
+	struct vfs_lookup_result_t lookup;
+	if (!vfs_lookup(vfs, &lookup, virtual_path) || (lookup.mountpoint != mountpoint)) {
+		return false;
+	}
+	if (lookup.flags & VFS_INODE_FLAG_FILTER_ALL) {
+		return false;
+	}
+	if ((lookup.flags & VFS_INODE_FLAG_FILTER_HIDDEN) && path_contains_hidden(virtual_path)) {
+		return false;
+	}
+	if (mountpoint->name_filter) {
+		/* Only files are journaled, so the last component is matched as one */
+		size_t relative_length;
+		const char *relative_path = vfs_mount_relative_path(mountpoint, virtual_path, &relative_length);
+		struct path_iter_t iter;
+		path_iter_init(&iter, relative_path, relative_length);
+		while (path_iter_next(&iter)) {
+			if (iter.component_length && !vfs_name_permitted(mountpoint->name_filter, iter.component, iter.component_length, iter.is_full_path)) {
+				return false;
+			}
+		}
+	}
+	return true;
+}
 
-	if (errno) {
-		logmsg(LLVL_ERROR, "vfs_write() had I/O error when writing to file: %s", strerror(fwrite_errno));
+static bool vfs_change_forward(void *ctx, const struct changejournal_entry_t *entry) {
+	struct vfs_change_query_t *query = (struct vfs_change_query_t*)ctx;
+	/* The root inode has an empty virtual path */
+	const char *mountpoint_path = query->mountpoint->vlen ? query->mountpoint->virtual_path : "/";
+	struct vfs_change_t change = {
+		.cursor = entry->cursor,
+		.timestamp = entry->timestamp,
+		.kind = entry->kind,
+		.virtual_path = vfs_join_path(mountpoint_path, entry->path),
+		.old_virtual_path = entry->old_path ? vfs_join_path(mountpoint_path, entry->old_path) : NULL,
+	};
+	bool proceed = true;
+	if (!change.virtual_path || (entry->old_path && !change.old_virtual_path)) {
+		query->result = VFS_INTERNAL_ERROR;
+		proceed = false;
+	} else if (vfs_change_visible(query->vfs, query->mountpoint, change.virtual_path) && vfs_change_visible(query->vfs, query->mountpoint, change.old_virtual_path)) {
+		proceed = query->callback(query->ctx, &change);
 	}
-	return (fwrite_errno == 0) ? VFS_OK : VFS_IO_ERROR;
+	free(change.virtual_path);
+	free(change.old_virtual_path);
+	return proceed;
+}
+
+/* Reports all changes below path that happened after the cursor, e.g., for
+ * an incremental sync extension. The cursor is advanced past the reported
+ * changes. If the journal no longer reaches back to the cursor, expired is
+ * set and the cursor is moved to the most recent change: the client then
+ * needs to rescan the tree and can continue from the new cursor. */
+enum vfs_error_t vfs_changes_since(struct vfs_t *vfs, const char *path, uint64_t *cursor, bool *expired, vfs_change_callback_t callback, void *ctx) {
+	struct vfs_handle_t *handle;
+	enum vfs_error_t result = vfs_open_node(vfs, path, &handle);
+	if (result != VFS_OK) {
+		return result;
+	}
+	if (!handle->mountpoint || !handle->mountpoint->changejournal) {
+		logmsg(LLVL_DEBUG, "vfs_changes_since() has no change journal for \"%s\"", handle->virtual_path);
+		vfs_close_handle(handle);
+		return VFS_PERMISSION_DENIED;
+	}
+
+	struct vfs_change_query_t query = {
+		.vfs = vfs,
+		.mountpoint = handle->mountpoint,
+		.callback = callback,
+		.ctx = ctx,
+		.result = VFS_OK,
+	};
+	size_t relative_length;
+	const char *relative_path = vfs_mount_relative_path(handle->mountpoint, handle->virtual_path, &relative_length);
+	*expired = !changejournal_since(handle->mountpoint->changejournal, cursor, relative_path, relative_length, vfs_change_forward, &query);
+	vfs_close_handle(handle);
+	return query.result;
 }
 
 enum vfs_error_t vfs_readdir(struct vfs_handle_t *handle, struct vfs_dirent_t *vfs_dirent) {
@@ -674,73 +3183,364 @@ enum vfs_error_t vfs_readdir(struct vfs_handle_t *handle, struct vfs_dirent_t *v
 		return VFS_INTERNAL_ERROR;
 	}
 
-	if (!handle->inode && !handle->dir.dir) {
+	if (!handle->inode && !handle->dir.dir && !handle->dir.backend_dir && !handle->dir.listing && !handle->dir.index_listing && !handle->dir.prefetched) {
 		logmsg(LLVL_ERROR, "vfs_readdir() has neither inode nor open directory");
 		return VFS_INTERNAL_ERROR;
 	}
 
 	if (handle->inode) {
-		if (handle->dir.internal_node_index < handle->inode->virtual_subdirs->count) {
+		while (handle->dir.internal_node_index < handle->inode->virtual_subdirs->count) {
 			const char *virtual_dirname = handle->inode->virtual_subdirs->strings[handle->dir.internal_node_index];
 			handle->dir.internal_node_index++;
+			if (handle->dir.filter && !globfilter_match(handle->dir.filter, virtual_dirname)) {
+				continue;
+			}
+			if ((handle->flags & VFS_INODE_FLAG_FILTER_HIDDEN) && (virtual_dirname[0] == '.')) {
+				continue;
+			}
 			vfs_stat_virtual_directory(virtual_dirname, vfs_dirent, handle->flags);
 			return VFS_OK;
 		}
 	}
 
-	while (handle->dir.dir) {
-		errno = 0;
-		struct dirent *dirent = readdir(handle->dir.dir);
-		if ((dirent == NULL) && (errno != 0)) {
-			/* An error occurred while trying to read the directory */
-			logmsg(LLVL_ERROR, "vfs_readdir() encountered an error while trying to read directory: %s", strerror(errno));
-			return VFS_INTERNAL_ERROR;
+	if (handle->dir.listing) {
+		while (handle->dir.listing_index < handle->dir.listing->count) {
+			const struct vfs_dirent_t *cached_dirent = &handle->dir.listing->entries[handle->dir.listing_index++];
+			if (vfs_is_filtered_out(handle, cached_dirent->filename, cached_dirent->is_file)) {
+				continue;
+			}
+			*vfs_dirent = *cached_dirent;
+			vfs_dirent_apply_flags(vfs_dirent, handle->flags);
+			return VFS_OK;
 		}
+	}
 
-		if (dirent == NULL) {
-			break;
+	if (handle->dir.index_listing) {
+		while (handle->dir.index_position < handle->dir.index_end) {
+			const struct contentindex_entry_t *entry = &handle->contentindex->entries[handle->dir.index_position++];
+			size_t name_length;
+			const char *name = contentindex_entry_name(handle->contentindex, entry, &name_length);
+			if (vfs_is_filtered_out(handle, name, S_ISREG(entry->mode))) {
+				continue;
+			}
+			strncpy(vfs_dirent->filename, name, VFS_MAX_FILENAME_LENGTH - 1);
+			vfs_dirent->filename[VFS_MAX_FILENAME_LENGTH - 1] = 0;
+
+			struct stat statbuf;
+			vfs_index_entry_statbuf(entry, &statbuf);
+			vfs_stat_statbuf(&statbuf, vfs_dirent, handle->flags);
+			return VFS_OK;
+		}
+	}
+
+	if (handle->dir.prefetched) {
+		while (handle->dir.prefetched_index < handle->dir.prefetched_count) {
+			const struct vfs_dirent_t *prefetched_dirent = &handle->dir.prefetched[handle->dir.prefetched_index++];
+			if (vfs_is_filtered_out(handle, prefetched_dirent->filename, prefetched_dirent->is_file)) {
+				continue;
+			}
+			*vfs_dirent = *prefetched_dirent;
+			vfs_dirent_apply_flags(vfs_dirent, handle->flags);
+			return VFS_OK;
 		}
+	}
 
-		if (!strcmp(dirent->d_name, ".") || !strcmp(dirent->d_name, "..")) {
-			/* We're omitting the '.' and '..' nodes in this listing */
-			continue;
+	if (handle->dir.backend_dir) {
+		return vfs_readdir_backend(handle, vfs_dirent);
+	}
+
+	while (handle->dir.dir) {
+		enum vfs_error_t result = vfs_readdir_mapped(handle->dir.dir, handle, vfs_dirent);
+		if ((result != VFS_OK) || vfs_dirent->eof) {
+			return result;
 		}
+		vfs_dirent_apply_flags(vfs_dirent, handle->flags);
+		return VFS_OK;
+	}
 
-		if ((dirent->d_type != DT_REG) && (dirent->d_type != DT_DIR) && (dirent->d_type != DT_LNK)) {
-			/* No need to stat if there's a file node which we do not support
-			 * at all. */
-			continue;
+	vfs_dirent->eof = true;
+	return VFS_OK;
+}
+
+/* Reads the raw contents of a directory. Touches no VFS state and hence
+ * runs on the worker threads of a walk. */
+static void vfs_walk_prefetch(struct vfs_walk_directory_t *directory) {
+	DIR *dir = opendir(directory->mapped_path);
+	if (!dir) {
+		return;
+	}
+	unsigned int alloced_count = 32;
+	directory->entries = malloc(alloced_count * sizeof(struct vfs_dirent_t));
+	while (directory->entries) {
+		struct vfs_dirent_t dirent;
+		if (vfs_readdir_mapped(dir, NULL, &dirent) != VFS_OK) {
+			break;
 		}
+		if (dirent.eof) {
+			directory->prefetched = true;
+			break;
+		}
+		if (directory->entry_count == alloced_count) {
+			struct vfs_dirent_t *new_entries = realloc(directory->entries, 2 * alloced_count * sizeof(struct vfs_dirent_t));
+			if (!new_entries) {
+				break;
+			}
+			directory->entries = new_entries;
+			alloced_count *= 2;
+		}
+		directory->entries[directory->entry_count++] = dirent;
+	}
+	closedir(dir);
+	if (!directory->prefetched) {
+		free(directory->entries);
+		directory->entries = NULL;
+		directory->entry_count = 0;
+	}
+}
 
-		if (handle->inode && stringlist_contains(handle->inode->virtual_subdirs, dirent->d_name)) {
-			/* Provided by directory listing, but overridden by virtual directory */
+/* Claims the next directory to read ahead; called with the lock held */
+static struct vfs_walk_directory_t *vfs_walk_claim(struct vfs_walk_t *walk) {
+	while (walk->cursor && (walk->cursor->state != VFS_WALK_PENDING)) {
+		walk->cursor = walk->cursor->next;
+	}
+	if (!walk->cursor || (walk->read_ahead >= VFS_WALK_PREFETCH_WINDOW)) {
+		return NULL;
+	}
+	struct vfs_walk_directory_t *directory = walk->cursor;
+	walk->cursor = directory->next;
+	directory->state = VFS_WALK_RUNNING;
+	walk->read_ahead++;
+	return directory;
+}
+
+static void *vfs_walk_worker(void *arg) {
+	struct vfs_walk_t *walk = (struct vfs_walk_t*)arg;
+	pthread_mutex_lock(&walk->lock);
+	while (!walk->stopping) {
+		struct vfs_walk_directory_t *directory = vfs_walk_claim(walk);
+		if (!directory) {
+			pthread_cond_wait(&walk->work_available, &walk->lock);
 			continue;
 		}
+		pthread_mutex_unlock(&walk->lock);
+		vfs_walk_prefetch(directory);
+		pthread_mutex_lock(&walk->lock);
+		directory->state = VFS_WALK_DONE;
+		pthread_cond_broadcast(&walk->work_done);
+	}
+	pthread_mutex_unlock(&walk->lock);
+	return NULL;
+}
 
-		strncpy(vfs_dirent->filename, dirent->d_name, VFS_MAX_FILENAME_LENGTH - 1);
-		vfs_dirent->filename[VFS_MAX_FILENAME_LENGTH - 1] = 0;
+static void vfs_walk_free_directory(struct vfs_walk_directory_t *directory) {
+	free(directory->virtual_path);
+	free(directory->relative_path);
+	free(directory->mapped_path);
+	free(directory->entries);
+	free(directory);
+}
 
-		errno = 0;
-		struct stat statbuf;
-		int stat_result = fstatat(dirfd(handle->dir.dir), vfs_dirent->filename, &statbuf, 0);
-		if (stat_result == -1) {
-			/* Possibly truncated filename, hence ENOENT. Also could be missing
-			 * permissions. In either case, do not return the node if we're not
-			 * allowed to stat it. */
-			logmsg(LLVL_WARN, "vfs_readdir() encountered error in fstatat: %s", strerror(errno));
-			continue;
+/* Queues a directory for listing if the VFS allows opening it at all; the
+ * same filter and symlink checks as for any other access apply */
+static void vfs_walk_enqueue(struct vfs_walk_t *walk, const char *virtual_path, const char *relative_path, unsigned int depth) {
+	struct vfs_handle_t *node;
+	if (vfs_open_node(walk->vfs, virtual_path, &node) != VFS_OK) {
+		return;
+	}
+	struct vfs_walk_directory_t *directory = calloc(1, sizeof(struct vfs_walk_directory_t));
+	if (!directory) {
+		vfs_close_handle(node);
+		return;
+	}
+	directory->virtual_path = strdup(virtual_path);
+	directory->relative_path = strdup(relative_path);
+	directory->depth = depth;
+	if (node->mapped_path && !node->contentindex && !node->backend) {
+		directory->mapped_path = node->mapped_path;
+		node->mapped_path = NULL;
+	} else {
+		/* Nothing on disk to read ahead */
+		directory->state = VFS_WALK_DONE;
+	}
+	vfs_close_handle(node);
+	if (!directory->virtual_path || !directory->relative_path) {
+		vfs_walk_free_directory(directory);
+		return;
+	}
+
+	pthread_mutex_lock(&walk->lock);
+	if (walk->tail) {
+		walk->tail->next = directory;
+	} else {
+		walk->head = directory;
+	}
+	walk->tail = directory;
+	if (!walk->cursor) {
+		walk->cursor = directory;
+	}
+	pthread_cond_signal(&walk->work_available);
+	pthread_mutex_unlock(&walk->lock);
+}
+
+/* Takes the next directory to be reported off the queue, waiting for its
+ * read ahead if that is in progress */
+static struct vfs_walk_directory_t *vfs_walk_dequeue(struct vfs_walk_t *walk) {
+	pthread_mutex_lock(&walk->lock);
+	struct vfs_walk_directory_t *directory = walk->head;
+	if (directory) {
+		while (directory->state == VFS_WALK_RUNNING) {
+			pthread_cond_wait(&walk->work_done, &walk->lock);
+		}
+		if (directory->state == VFS_WALK_PENDING) {
+			/* Not read ahead, listed through the VFS directly */
+			directory->state = VFS_WALK_DONE;
+		} else if (directory->mapped_path) {
+			walk->read_ahead--;
+			pthread_cond_signal(&walk->work_available);
+		}
+		walk->head = directory->next;
+		if (!walk->head) {
+			walk->tail = NULL;
+		}
+		if (walk->cursor == directory) {
+			walk->cursor = directory->next;
 		}
+	}
+	pthread_mutex_unlock(&walk->lock);
+	return directory;
+}
 
-		unsigned int file_type = statbuf.st_mode & S_IFMT;
-		if ((file_type != S_IFDIR) && (file_type != S_IFREG)) {
-			/* Special file (block device, char device, FIFO, unknown) */
-			continue;
+static bool vfs_walk_flush(struct vfs_walk_t *walk) {
+	bool proceed = true;
+	if (walk->batch_count) {
+		proceed = walk->callback(walk->callback_ctx, walk->batch, walk->batch_count);
+	}
+	for (unsigned int i = 0; i < walk->batch_count; i++) {
+		free(walk->batch[i].path);
+	}
+	walk->batch_count = 0;
+	return proceed;
+}
+
+static bool vfs_walk_directory(struct vfs_walk_t *walk, struct vfs_walk_directory_t *directory, unsigned int max_depth) {
+	struct vfs_handle_t *dir;
+	if (vfs_opendir(walk->vfs, directory->virtual_path, &dir) != VFS_OK) {
+		return true;
+	}
+	if (dir->dir.dir && directory->prefetched) {
+		closedir(dir->dir.dir);
+		dir->dir.dir = NULL;
+		dir->dir.prefetched = directory->entries;
+		dir->dir.prefetched_count = directory->entry_count;
+		directory->entries = NULL;
+	}
+
+	bool proceed = true;
+	while (proceed) {
+		struct vfs_dirent_t dirent;
+		if ((vfs_readdir(dir, &dirent) != VFS_OK) || dirent.eof) {
+			break;
+		}
+		char *relative_path = vfs_join_path(directory->relative_path, dirent.filename);
+		if (!relative_path) {
+			break;
+		}
+		if (!dirent.is_file && (directory->depth + 1 < max_depth)) {
+			char *virtual_path = vfs_join_path(directory->virtual_path, dirent.filename);
+			if (virtual_path) {
+				vfs_walk_enqueue(walk, virtual_path, relative_path, directory->depth + 1);
+				free(virtual_path);
+			}
+		}
+		walk->batch[walk->batch_count++] = (struct vfs_walk_entry_t) {
+			.path = relative_path,
+			.dirent = dirent,
+		};
+		if (walk->batch_count == VFS_WALK_BATCH_SIZE) {
+			proceed = vfs_walk_flush(walk);
 		}
-		vfs_stat_statbuf(&statbuf, vfs_dirent, handle->flags);
-		return VFS_OK;
 	}
+	vfs_close_handle(dir);
+	return proceed;
+}
 
-	vfs_dirent->eof = true;
+/* Recursive listing of a subtree for the recursive listing SFTP extension.
+ * Entries are reported breadth first in batches, with paths relative to the
+ * listed directory; a max_depth of 1 lists only the directory itself.
+ * Directories are read ahead by up to thread_count worker threads, while the
+ * VFS itself is only ever used by the calling thread. The callback may stop
+ * the walk by returning false. */
+enum vfs_error_t vfs_walk(struct vfs_t *vfs, const char *path, unsigned int max_depth, unsigned int thread_count, vfs_walk_callback_t callback, void *callback_ctx) {
+	struct vfs_dirent_t root_dirent;
+	enum vfs_error_t result = vfs_stat(vfs, path, &root_dirent);
+	if (result != VFS_OK) {
+		return result;
+	}
+	if (root_dirent.is_file) {
+		return VFS_NOT_A_DIRECTORY;
+	}
+	if ((max_depth == 0) || (max_depth > VFS_WALK_MAX_DEPTH)) {
+		max_depth = VFS_WALK_MAX_DEPTH;
+	}
+
+	struct vfs_walk_t *walk = calloc(1, sizeof(struct vfs_walk_t));
+	if (!walk) {
+		return VFS_INTERNAL_ERROR;
+	}
+	walk->vfs = vfs;
+	walk->callback = callback;
+	walk->callback_ctx = callback_ctx;
+	pthread_mutex_init(&walk->lock, NULL);
+	pthread_cond_init(&walk->work_available, NULL);
+	pthread_cond_init(&walk->work_done, NULL);
+
+	char *virtual_path = sanitize_path(vfs->cwd.path, path);
+	if (virtual_path) {
+		vfs_walk_enqueue(walk, virtual_path, "", 0);
+		free(virtual_path);
+	}
+
+	/* Workers never run further ahead than the prefetch window, so more
+	 * threads than that would only ever sit idle */
+	if (thread_count > VFS_WALK_PREFETCH_WINDOW) {
+		thread_count = VFS_WALK_PREFETCH_WINDOW;
+	}
+	pthread_t threads[thread_count + 1];
+	unsigned int started_threads = 0;
+	while ((started_threads < thread_count) && !pthread_create(&threads[started_threads], NULL, vfs_walk_worker, walk)) {
+		started_threads++;
+	}
+
+	bool proceed = true;
+	struct vfs_walk_directory_t *directory;
+	while (proceed && (directory = vfs_walk_dequeue(walk))) {
+		proceed = vfs_walk_directory(walk, directory, max_depth);
+		vfs_walk_free_directory(directory);
+	}
+	if (proceed) {
+		vfs_walk_flush(walk);
+	}
+
+	pthread_mutex_lock(&walk->lock);
+	walk->stopping = true;
+	pthread_cond_broadcast(&walk->work_available);
+	pthread_mutex_unlock(&walk->lock);
+	for (unsigned int i = 0; i < started_threads; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	/* Left over when the walk was stopped early */
+	while ((directory = walk->head)) {
+		walk->head = directory->next;
+		vfs_walk_free_directory(directory);
+	}
+	for (unsigned int i = 0; i < walk->batch_count; i++) {
+		free(walk->batch[i].path);
+	}
+	pthread_cond_destroy(&walk->work_done);
+	pthread_cond_destroy(&walk->work_available);
+	pthread_mutex_destroy(&walk->lock);
+	free(walk);
 	return VFS_OK;
 }
 
@@ -748,16 +3548,60 @@ void vfs_close_handle(struct vfs_handle_t *handle) {
 	if (!handle) {
 		return;
 	}
-	free(handle->mapped_path);
-	free(handle->virtual_path);
 	if (handle->type == DIR_HANDLE) {
 		if (handle->dir.dir) {
 			closedir(handle->dir.dir);
 		}
+		if (handle->dir.backend_dir) {
+			handle->backend->ops->closedir(handle->backend->ctx, handle->dir.backend_dir);
+		}
+		if (handle->dir.listing) {
+			dircache_release(handle->vfs->dircache, handle->dir.listing);
+		}
+		free(handle->dir.prefetched);
+		globfilter_free(handle->dir.filter);
 	} else if (handle->type == FILE_HANDLE) {
+		if (handle->file.tar) {
+			vfs_close_tar(handle->file.tar);
+		}
+		if (handle->file.untar) {
+			vfs_close_untar(handle->file.untar);
+		}
+		if (handle->file.direct.staging) {
+			vfs_flush_direct(handle);
+		}
+		if (handle->file.preallocated && handle->file.file) {
+			vfs_release_preallocation(handle);
+		}
+		if (handle->file.upload_hash) {
+			vfs_upload_hash_store(handle);
+			vfs_upload_hash_discard(handle);
+		}
 		if (handle->file.file) {
 			fclose(handle->file.file);
 		}
+		if (handle->file.backend_file && handle->backend->ops->close(handle->backend->ctx, handle->file.backend_file)) {
+			logmsg(LLVL_ERROR, "vfs_close_handle() failed to close %s file \"%s\": %s", handle->backend->name, handle->mapped_path, strerror(errno));
+		}
+		if (handle->file.direct.staging) {
+			close(handle->file.direct.fd);
+			free(handle->file.direct.staging);
+		}
+		if (handle->file.mode != FILEMODE_READ) {
+			/* Size and times are final only now that data is flushed */
+			vfs_attrcache_invalidate(handle->vfs, handle->virtual_path);
+			if (!handle->file.untar && !handle->file.unjournaled) {
+				vfs_journal_change(handle->vfs, handle->virtual_path, handle->file.created ? CHANGEJOURNAL_CREATE : CHANGEJOURNAL_MODIFY);
+			}
+		}
+		if (handle->file.mapping) {
+			munmap(handle->file.mapping, handle->file.mapping_size);
+		}
+		if (handle->file.cached) {
+			fdcache_release(handle->vfs->fdcache, handle->file.cached);
+		}
 	}
+	free(handle->mapped_path);
+	free(handle->virtual_path);
 	free(handle);
 }
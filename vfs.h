@@ -28,9 +28,20 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <time.h>
 #include <dirent.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include "stringlist.h"
+#include "atomtable.h"
+#include "blockcache.h"
+#include "filehash.h"
+#include "delta.h"
+#include "tarstream.h"
+#include "globfilter.h"
+#include "changejournal.h"
+#include "vfsbackend.h"
 
 #define VFS_MAX_ERROR_LENGTH					128
 #define VFS_MAX_FILENAME_LENGTH					256
@@ -42,6 +53,34 @@
 #define VFS_INODE_FLAG_DISALLOW_CREATE_DIR		(1 << 4)
 #define VFS_INODE_FLAG_DISALLOW_UNLINK			(1 << 5)
 #define VFS_INODE_FLAG_ALLOW_SYMLINKS			(1 << 6)
+#define VFS_INODE_FLAG_DIRECT_IO				(1 << 7)
+
+#define VFS_NAME_FILTER_INCLUDE					(1 << 0)
+#define VFS_NAME_FILTER_EXCLUDE					(1 << 1)
+
+#define VFS_DIRECT_IO_ALIGNMENT					4096
+#define VFS_DIRECT_IO_BUFFER_SIZE				(1024 * 1024)
+
+#define VFS_ACCESS_CONFIRMATIONS				2
+#define VFS_ACCESS_RANDOM_CONFIRMATIONS			4
+#define VFS_ACCESS_DROP_BEHIND_WINDOW			(8 * 1024 * 1024)
+
+#define VFS_COPY_CHUNK_SIZE						(64 * 1024 * 1024)
+#define VFS_COPY_BUFFER_SIZE					(256 * 1024)
+#define VFS_HASH_READ_SIZE						(1024 * 1024)
+#define VFS_HASH_XATTR_PREFIX					"user.umsftpd."
+#define VFS_HASH_XATTR_MAX_LENGTH				256
+#define VFS_DELTA_TEMP_SUFFIX					".umsftpd-delta"
+#define VFS_DELTA_TEMP_ATTEMPTS					64
+
+#define VFS_TAR_SUFFIX							".tar"
+#define VFS_TAR_MAX_DEPTH						64
+
+#define VFS_WALK_MAX_DEPTH						64
+#define VFS_WALK_BATCH_SIZE						128
+#define VFS_WALK_PREFETCH_WINDOW				32
+#define VFS_STAT_MANY_JOBS_PER_THREAD			32
+#define VFS_STAT_MANY_MAX_THREADS				16
 
 struct vfs_inode_t {
 	struct vfs_inode_t *parent;
@@ -50,6 +89,23 @@ struct vfs_inode_t {
 	char *target_path;
 	size_t vlen, tlen;
 	struct stringlist_t *virtual_subdirs;
+	const struct contentindex_t *contentindex;
+	struct changejournal_t *changejournal;
+	const struct vfs_backend_t *backend;
+	char **filter_patterns;
+	uint32_t *filter_labels;
+	unsigned int filter_pattern_count;
+
+	/* Populated when inodes are frozen: the compiled name filter of a
+	 * mountpoint, if it has any patterns */
+	struct globset_t *name_filter;
+
+	/* Populated when inodes are frozen: the atoms of all virtual path
+	 * components and the direct children of this inode */
+	unsigned int *components;
+	unsigned int component_count;
+	struct vfs_inode_t **children;
+	unsigned int child_count;
 };
 
 struct vfs_lookup_result_t {
@@ -69,23 +125,107 @@ enum vfs_filemode_t {
 	FILEMODE_APPEND,
 };
 
+enum vfs_access_pattern_t {
+	VFS_ACCESS_UNKNOWN,
+	VFS_ACCESS_SEQUENTIAL,
+	VFS_ACCESS_STRIDED,
+	VFS_ACCESS_RANDOM,
+};
+
+struct vfs_access_tracker_t {
+	enum vfs_access_pattern_t pattern, candidate;
+	unsigned int confirmations;
+	bool has_previous;
+	uint64_t last_offset, last_end;
+	int64_t stride;
+	uint64_t dropped_until;
+};
+
+/* A directory tree streamed as tar archive while it is being walked; only
+ * one file and one open directory per level are held at any time */
+struct vfs_tar_t {
+	struct {
+		struct vfs_handle_t *dir;
+		size_t path_length;
+	} levels[VFS_TAR_MAX_DEPTH];
+	unsigned int depth;
+	char virtual_path[TARSTREAM_MAX_PATH_LENGTH];
+	size_t archive_offset;
+	struct vfs_handle_t *file;
+	uint64_t file_remaining, padding_remaining;
+	uint8_t header[TARSTREAM_MAX_HEADER_SIZE];
+	size_t header_length, header_position;
+	bool finished;
+};
+
 struct vfs_handle_t {
+	struct vfs_t *vfs;
 	enum vfs_handle_type_t type;
 	char *virtual_path;
 	char *mapped_path;
 	const struct vfs_inode_t *inode;
+	const struct vfs_inode_t *mountpoint;
+	const struct vfs_backend_t *backend;
 	unsigned int flags;
+	const struct globset_t *name_filter;
+	const struct contentindex_t *contentindex;
+	const struct contentindex_entry_t *index_entry;
 	union {
 		struct {
 			DIR *dir;
+			void *backend_dir;
 			unsigned int internal_node_index;
+			struct dircache_listing_t *listing;
+			unsigned int listing_index;
+			bool index_listing;
+			unsigned int index_position, index_end;
+			struct vfs_dirent_t *prefetched;
+			unsigned int prefetched_count, prefetched_index;
+			struct globfilter_t *filter;
 		} dir;
 		struct {
 			FILE *file;
+			void *backend_file;
+			enum vfs_filemode_t mode;
+			struct fdcache_entry_t *cached;
+			uint64_t offset;
+			bool block_cached;
+			struct blockcache_file_t identity;
+			void *mapping;
+			uint64_t mapping_size;
+			struct vfs_access_tracker_t access;
+			bool preallocated;
+			bool created, unjournaled;
+			struct filehash_t *upload_hash;
+			struct vfs_tar_t *tar;
+			struct vfs_untar_t *untar;
+			bool sparse;
+			struct {
+				uint64_t start, end;
+			} hole;
+			struct {
+				int fd;
+				uint8_t *staging;
+				size_t staging_length;
+				uint64_t staging_offset;
+			} direct;
 		} file;
 	};
 };
 
+/* A file being assembled from blocks of an existing basis file and literal
+ * data, replacing the target only once complete */
+struct vfs_delta_t {
+	struct vfs_handle_t *basis;
+	struct vfs_handle_t *output;
+	const struct vfs_backend_t *backend;
+	char *target_mapped_path;
+	char *target_virtual_path;
+	uint32_t block_size;
+	uint64_t basis_size;
+	uint64_t output_offset;
+};
+
 struct vfs_dirent_t {
 	char filename[VFS_MAX_FILENAME_LENGTH];
 	bool eof;
@@ -125,6 +265,107 @@ enum vfs_error_t {
 	VFS_NOT_A_FILE,
 	VFS_INTERNAL_ERROR,
 	VFS_IO_ERROR,
+	VFS_FILE_EXISTS,
+};
+
+/* An uploaded tar stream being unpacked into a directory while it arrives;
+ * every member is created with the same checks as a regular upload */
+struct vfs_untar_t {
+	struct vfs_t *vfs;
+	struct tarstream_parser_t parser;
+	char virtual_path[TARSTREAM_MAX_PATH_LENGTH];
+	size_t base_length;
+	struct vfs_handle_t *member;
+	enum vfs_error_t error;
+};
+
+/* A change reported by vfs_changes_since(), with paths in the VFS */
+struct vfs_change_t {
+	uint64_t cursor;
+	int64_t timestamp;
+	enum changejournal_kind_t kind;
+	char *virtual_path;
+	char *old_virtual_path;
+};
+
+typedef bool (*vfs_change_callback_t)(void *ctx, const struct vfs_change_t *change);
+
+struct vfs_change_query_t {
+	struct vfs_t *vfs;
+	const struct vfs_inode_t *mountpoint;
+	vfs_change_callback_t callback;
+	void *ctx;
+	enum vfs_error_t result;
+};
+
+enum vfs_walk_state_t {
+	VFS_WALK_PENDING,
+	VFS_WALK_RUNNING,
+	VFS_WALK_DONE,
+};
+
+/* A directory queued for listing; its raw contents may be read ahead by a
+ * worker thread while earlier directories are still being reported */
+struct vfs_walk_directory_t {
+	char *virtual_path;
+	char *relative_path;
+	char *mapped_path;
+	unsigned int depth;
+	enum vfs_walk_state_t state;
+	struct vfs_dirent_t *entries;
+	unsigned int entry_count;
+	bool prefetched;
+	struct vfs_walk_directory_t *next;
+};
+
+struct vfs_walk_entry_t {
+	char *path;
+	struct vfs_dirent_t dirent;
+};
+
+typedef bool (*vfs_walk_callback_t)(void *ctx, const struct vfs_walk_entry_t *entries, unsigned int count);
+
+struct vfs_walk_t {
+	struct vfs_t *vfs;
+	pthread_mutex_t lock;
+	pthread_cond_t work_available, work_done;
+	struct vfs_walk_directory_t *head, *tail, *cursor;
+	unsigned int read_ahead;
+	bool stopping;
+	struct vfs_walk_entry_t batch[VFS_WALK_BATCH_SIZE];
+	unsigned int batch_count;
+	vfs_walk_callback_t callback;
+	void *callback_ctx;
+};
+
+/* A path of a bulk stat that needs to be looked up on disk */
+struct vfs_stat_job_t {
+	unsigned int index;
+	char *virtual_path;
+	uint32_t hash;
+	char *mapped_path;
+	const char *name;
+	size_t parent_length;
+	int parent_fd;
+	bool owns_parent_fd;
+	unsigned int flags;
+	const struct globset_t *name_filter;
+	int stat_result, stat_errno;
+	struct stat statbuf;
+};
+
+struct vfs_stat_many_t {
+	struct vfs_stat_job_t *jobs;
+	unsigned int job_count;
+	atomic_uint next_job;
+};
+
+struct vfs_attrcache_entry_t {
+	char *virtual_path;
+	uint32_t hash;
+	uint64_t expires_millis;
+	enum vfs_error_t result;
+	struct vfs_dirent_t dirent;
 };
 
 struct vfs_t {
@@ -140,8 +381,26 @@ struct vfs_t {
 		unsigned int base_flags;
 		unsigned int count;
 		struct vfs_inode_t **data;
+		struct vfs_inode_t *root;
 		bool frozen;
 	} inode;
+	struct atomtable_t *atoms;
+	struct dircache_t *dircache;
+	struct fdcache_t *fdcache;
+	struct blockcache_t *blockcache;
+	uint64_t mmap_threshold;
+	bool access_hints;
+	bool virtual_tar;
+	struct {
+		bool enabled;
+		enum filehash_algorithm_t algorithm;
+	} upload_hash;
+	struct {
+		unsigned int ttl_millis;
+		unsigned int slot_count;
+		struct vfs_attrcache_entry_t *slots;
+		unsigned int hits, misses;
+	} attrcache;
 	struct {
 		unsigned int alloced_size;
 		unsigned int length;
@@ -153,16 +412,43 @@ struct vfs_t {
 const char *vfs_error_str(enum vfs_error_t error_code);
 bool vfs_add_inode(struct vfs_t *vfs, const char *virtual_path, const char *target_path, unsigned int flags_set, unsigned int flags_reset);
 bool vfs_lookup(struct vfs_t *vfs, struct vfs_lookup_result_t *result, const char *path);
-void vfs_freeze_inodes(struct vfs_t *vfs);
+bool vfs_add_name_filter(struct vfs_t *vfs, const char *virtual_path, const char *pattern, bool exclude);
+bool vfs_freeze_inodes(struct vfs_t *vfs);
+bool vfs_attrcache_enable(struct vfs_t *vfs, unsigned int ttl_millis, unsigned int slot_count);
 struct vfs_t *vfs_init(void);
 void vfs_free(struct vfs_t *vfs);
+bool vfs_attach_contentindex(struct vfs_t *vfs, const char *virtual_path, const struct contentindex_t *index);
+bool vfs_attach_changejournal(struct vfs_t *vfs, const char *virtual_path, struct changejournal_t *journal);
+bool vfs_set_mount_backend(struct vfs_t *vfs, const char *virtual_path, const struct vfs_backend_t *backend);
 enum vfs_error_t vfs_chdir(struct vfs_t *vfs, const char *path);
+void vfs_set_dircache(struct vfs_t *vfs, struct dircache_t *dircache);
+void vfs_set_fdcache(struct vfs_t *vfs, struct fdcache_t *fdcache);
+void vfs_set_blockcache(struct vfs_t *vfs, struct blockcache_t *blockcache);
+bool vfs_set_mmap_threshold(struct vfs_t *vfs, uint64_t threshold);
+enum vfs_error_t vfs_opendir_filtered(struct vfs_t *vfs, const char *path, const char *pattern, struct vfs_handle_t **handle_ptr);
 enum vfs_error_t vfs_opendir(struct vfs_t *vfs, const char *path, struct vfs_handle_t **handle_ptr);
 enum vfs_error_t vfs_open(struct vfs_t *vfs, const char *path, enum vfs_filemode_t mode, struct vfs_handle_t **handle_ptr);
+void vfs_set_virtual_tar(struct vfs_t *vfs, bool enabled);
 enum vfs_error_t vfs_stat(struct vfs_t *vfs, const char *path, struct vfs_dirent_t *vfs_dirent);
+enum vfs_error_t vfs_stat_many(struct vfs_t *vfs, const char *const *paths, unsigned int count, unsigned int thread_count, struct vfs_dirent_t *vfs_dirents, enum vfs_error_t *results);
 enum vfs_error_t vfs_read(struct vfs_handle_t *handle, void *ptr, size_t *length);
+enum vfs_error_t vfs_read_at(struct vfs_handle_t *handle, uint64_t offset, void *ptr, size_t *length);
+enum vfs_error_t vfs_preallocate(struct vfs_handle_t *handle, uint64_t size);
+enum vfs_error_t vfs_seek_data(struct vfs_handle_t *handle, uint64_t offset, bool find_data, uint64_t *result_offset);
+void vfs_set_access_hints(struct vfs_t *vfs, bool enabled);
+void vfs_set_upload_hashing(struct vfs_t *vfs, bool enabled, enum filehash_algorithm_t algorithm);
 enum vfs_error_t vfs_write(struct vfs_handle_t *handle, const void *ptr, size_t *length);
+enum vfs_error_t vfs_copy_range(struct vfs_handle_t *src, uint64_t src_offset, uint64_t length, struct vfs_handle_t *dst, uint64_t dst_offset, uint64_t *copied);
+enum vfs_error_t vfs_copy(struct vfs_t *vfs, const char *src_path, const char *dst_path);
+enum vfs_error_t vfs_check_file(struct vfs_handle_t *handle, uint64_t offset, uint64_t length, struct filehash_t **hashes, unsigned int hash_count);
+enum vfs_error_t vfs_delta_signature(struct vfs_handle_t *handle, struct delta_signer_t *signer);
+enum vfs_error_t vfs_delta_begin(struct vfs_t *vfs, const char *basis_path, const char *target_path, uint32_t block_size, struct vfs_delta_t **delta_ptr);
+enum vfs_error_t vfs_delta_copy_blocks(struct vfs_delta_t *delta, uint64_t first_block, uint64_t block_count);
+enum vfs_error_t vfs_delta_literal(struct vfs_delta_t *delta, const void *data, size_t length);
+enum vfs_error_t vfs_delta_finish(struct vfs_delta_t *delta, bool commit);
+enum vfs_error_t vfs_changes_since(struct vfs_t *vfs, const char *path, uint64_t *cursor, bool *expired, vfs_change_callback_t callback, void *ctx);
 enum vfs_error_t vfs_readdir(struct vfs_handle_t *handle, struct vfs_dirent_t *vfs_dirent);
+enum vfs_error_t vfs_walk(struct vfs_t *vfs, const char *path, unsigned int max_depth, unsigned int thread_count, vfs_walk_callback_t callback, void *callback_ctx);
 void vfs_close_handle(struct vfs_handle_t *handle);
 /***************  AUTO GENERATED SECTION ENDS   ***************/
 
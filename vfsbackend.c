@@ -0,0 +1,146 @@
+/**
+ *	umsftpd - User-mode SFTP application.
+ *	Copyright (C) 2021-2021 Johannes Bauer
+ *
+ *	This file is part of umsftpd.
+ *
+ *	umsftpd is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; this program is ONLY licensed under
+ *	version 3 of the License, later versions are explicitly excluded.
+ *
+ *	umsftpd is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with umsftpd; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *	Johannes Bauer <JohannesBauer@gmx.de>
+**/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include "vfsbackend.h"
+
+struct vfsbackend_posix_file_t {
+	int fd;
+};
+
+static int vfsbackend_posix_stat(void *ctx, const char *path, struct stat *statbuf) {
+	return stat(path, statbuf);
+}
+
+static void *vfsbackend_posix_opendir(void *ctx, const char *path) {
+	return opendir(path);
+}
+
+/* Entries which vanish or cannot be stat'ed in between are left out */
+static int vfsbackend_posix_readdir(void *ctx, void *vdir, char *name, size_t name_size, struct stat *statbuf) {
+	DIR *dir = (DIR*)vdir;
+	while (true) {
+		errno = 0;
+		struct dirent *dirent = readdir(dir);
+		if (!dirent) {
+			return errno ? -1 : 0;
+		}
+		if (!strcmp(dirent->d_name, ".") || !strcmp(dirent->d_name, "..")) {
+			continue;
+		}
+		if ((dirent->d_type != DT_REG) && (dirent->d_type != DT_DIR) && (dirent->d_type != DT_LNK) && (dirent->d_type != DT_UNKNOWN)) {
+			continue;
+		}
+		if ((strlen(dirent->d_name) >= name_size) || fstatat(dirfd(dir), dirent->d_name, statbuf, 0)) {
+			continue;
+		}
+		strcpy(name, dirent->d_name);
+		return 1;
+	}
+}
+
+static void vfsbackend_posix_closedir(void *ctx, void *dir) {
+	closedir((DIR*)dir);
+}
+
+static void *vfsbackend_posix_open(void *ctx, const char *path, int flags, mode_t mode) {
+	struct vfsbackend_posix_file_t *file = malloc(sizeof(struct vfsbackend_posix_file_t));
+	if (!file) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	file->fd = open(path, flags | O_CLOEXEC, mode);
+	if (file->fd == -1) {
+		int saved_errno = errno;
+		free(file);
+		errno = saved_errno;
+		return NULL;
+	}
+	return file;
+}
+
+static int vfsbackend_posix_fstat(void *ctx, void *vfile, struct stat *statbuf) {
+	return fstat(((struct vfsbackend_posix_file_t*)vfile)->fd, statbuf);
+}
+
+static ssize_t vfsbackend_posix_pread(void *ctx, void *vfile, void *buf, size_t length, uint64_t offset) {
+	return pread(((struct vfsbackend_posix_file_t*)vfile)->fd, buf, length, offset);
+}
+
+static ssize_t vfsbackend_posix_pwrite(void *ctx, void *vfile, const void *buf, size_t length, uint64_t offset) {
+	return pwrite(((struct vfsbackend_posix_file_t*)vfile)->fd, buf, length, offset);
+}
+
+static int vfsbackend_posix_close(void *ctx, void *vfile) {
+	struct vfsbackend_posix_file_t *file = (struct vfsbackend_posix_file_t*)vfile;
+	int result = close(file->fd);
+	free(file);
+	return result;
+}
+
+static int vfsbackend_posix_mkdir(void *ctx, const char *path, mode_t mode) {
+	return mkdir(path, mode);
+}
+
+static int vfsbackend_posix_rename(void *ctx, const char *old_path, const char *new_path) {
+	return rename(old_path, new_path);
+}
+
+static int vfsbackend_posix_unlink(void *ctx, const char *path) {
+	return unlink(path);
+}
+
+static const struct vfs_backend_ops_t vfsbackend_posix_ops = {
+	.stat = vfsbackend_posix_stat,
+	.opendir = vfsbackend_posix_opendir,
+	.readdir = vfsbackend_posix_readdir,
+	.closedir = vfsbackend_posix_closedir,
+	.open = vfsbackend_posix_open,
+	.fstat = vfsbackend_posix_fstat,
+	.pread = vfsbackend_posix_pread,
+	.pwrite = vfsbackend_posix_pwrite,
+	.close = vfsbackend_posix_close,
+	.mkdir = vfsbackend_posix_mkdir,
+	.rename = vfsbackend_posix_rename,
+	.unlink = vfsbackend_posix_unlink,
+};
+
+static const struct vfs_backend_t vfsbackend_posix_backend = {
+	.name = "posix",
+	.ops = &vfsbackend_posix_ops,
+	.host_paths = true,
+};
+
+/* Plain libc calls on the host filesystem. Mounts without a backend use the
+ * built-in host filesystem path instead, which additionally has descriptor,
+ * block and directory caching, mappings and direct I/O; this one serves as
+ * a reference for other backends and for comparing them. */
+const struct vfs_backend_t *vfsbackend_posix(void) {
+	return &vfsbackend_posix_backend;
+}
@@ -0,0 +1,69 @@
+/**
+ *	umsftpd - User-mode SFTP application.
+ *	Copyright (C) 2021-2021 Johannes Bauer
+ *
+ *	This file is part of umsftpd.
+ *
+ *	umsftpd is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; this program is ONLY licensed under
+ *	version 3 of the License, later versions are explicitly excluded.
+ *
+ *	umsftpd is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with umsftpd; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *	Johannes Bauer <JohannesBauer@gmx.de>
+**/
+
+#ifndef __VFSBACKEND_H__
+#define __VFSBACKEND_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/* Storage operations of a mount. Paths are mapped paths, i.e., the target
+ * path of the mount followed by the path relative to the mountpoint. All
+ * operations follow the libc convention of failing with -1 (or NULL) and
+ * setting errno, so that errors are reported like those of the host
+ * filesystem. Directory and file handles are opaque to the VFS. */
+struct vfs_backend_ops_t {
+	int (*stat)(void *ctx, const char *path, struct stat *statbuf);
+	void *(*opendir)(void *ctx, const char *path);
+	/* Returns 1 for an entry (never "." or ".."), 0 at the end */
+	int (*readdir)(void *ctx, void *dir, char *name, size_t name_size, struct stat *statbuf);
+	void (*closedir)(void *ctx, void *dir);
+	/* Flags are those of open(2), i.e., O_RDONLY or O_WRONLY combined with
+	 * O_CREAT and either O_TRUNC or O_APPEND */
+	void *(*open)(void *ctx, const char *path, int flags, mode_t mode);
+	int (*fstat)(void *ctx, void *file, struct stat *statbuf);
+	ssize_t (*pread)(void *ctx, void *file, void *buf, size_t length, uint64_t offset);
+	ssize_t (*pwrite)(void *ctx, void *file, const void *buf, size_t length, uint64_t offset);
+	int (*close)(void *ctx, void *file);
+	int (*mkdir)(void *ctx, const char *path, mode_t mode);
+	int (*rename)(void *ctx, const char *old_path, const char *new_path);
+	int (*unlink)(void *ctx, const char *path);
+};
+
+/* A backend instance; host_paths is set if mapped paths are paths of the
+ * host filesystem, to which the symlink policy of the mount applies */
+struct vfs_backend_t {
+	const char *name;
+	const struct vfs_backend_ops_t *ops;
+	void *ctx;
+	bool host_paths;
+};
+
+/*************** AUTO GENERATED SECTION FOLLOWS ***************/
+const struct vfs_backend_t *vfsbackend_posix(void);
+/***************  AUTO GENERATED SECTION ENDS   ***************/
+
+#endif
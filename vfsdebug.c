@@ -25,6 +25,9 @@
 #include <sys/stat.h>
 #include "strings.h"
 #include "vfsdebug.h"
+#include "dircache.h"
+#include "contentindex.h"
+#include "fdcache.h"
 
 typedef bool (*vfs_shell_callback_t)(struct vfs_t *vfs, const char *cmd, unsigned int argument_count, const char **arguments);
 
@@ -84,6 +87,9 @@ static void vfs_dump_flags(FILE *f, unsigned int flags) {
 	if (flags & VFS_INODE_FLAG_DISALLOW_UNLINK) {
 		fprintf(f, " DISALLOW_UNLINK");
 	}
+	if (flags & VFS_INODE_FLAG_DIRECT_IO) {
+		fprintf(f, " DIRECT_IO");
+	}
 }
 
 static void vfs_dump_inode_target(FILE *f, const struct vfs_inode_t *inode) {
@@ -98,6 +104,18 @@ static void vfs_dump_inode_target(FILE *f, const struct vfs_inode_t *inode) {
 		vfs_dump_flags(f, inode->flags_reset);
 		fprintf(f, "]");
 	}
+	if (inode->backend) {
+		fprintf(f, " [%s backend]", inode->backend->name);
+	}
+	if (inode->contentindex) {
+		fprintf(f, " [indexed, %u entries]", inode->contentindex->header->entry_count);
+	}
+	for (unsigned int i = 0; i < inode->filter_pattern_count; i++) {
+		fprintf(f, " [%s %s]", (inode->filter_labels[i] & VFS_NAME_FILTER_EXCLUDE) ? "exclude" : "include", inode->filter_patterns[i]);
+	}
+	if (inode->name_filter) {
+		fprintf(f, " [name filter, %u states]", inode->name_filter->state_count);
+	}
 }
 
 void vfs_dump(FILE *f, const struct vfs_t *vfs) {
@@ -106,6 +124,28 @@ void vfs_dump(FILE *f, const struct vfs_t *vfs) {
 		fprintf(f, "   Last error: %d (%s)\n", vfs->error.code, vfs->error.string);
 	}
 	fprintf(f, "   Max handles: %d, Inodes: %d\n", vfs->handles.max_count, vfs->inode.count);
+	if (vfs->attrcache.slot_count) {
+		fprintf(f, "   Attribute cache: %u slots, TTL %u ms, %u hits, %u misses\n", vfs->attrcache.slot_count, vfs->attrcache.ttl_millis, vfs->attrcache.hits, vfs->attrcache.misses);
+	}
+	if (vfs->dircache) {
+		const struct dircache_t *dircache = vfs->dircache;
+		uint64_t lookups = dircache->stats.hits + dircache->stats.misses;
+		fprintf(f, "   Directory cache: %zu of %zu bytes used, %lu hits, %lu misses (%.1f%% hit rate), %lu invalidations, %lu evictions, %lu uncacheable\n", dircache->used_memory, dircache->max_memory, dircache->stats.hits, dircache->stats.misses, lookups ? (100.0 * dircache->stats.hits / lookups) : 0.0, dircache->stats.invalidations, dircache->stats.evictions, dircache->stats.uncacheable);
+	}
+	if (vfs->fdcache) {
+		const struct fdcache_t *fdcache = vfs->fdcache;
+		uint64_t lookups = fdcache->stats.hits + fdcache->stats.misses;
+		fprintf(f, "   Descriptor cache: %u of %u descriptors cached, %lu hits, %lu misses (%.1f%% hit rate), %lu stale, %lu evictions\n", fdcache->entry_count, fdcache->max_entries, fdcache->stats.hits, fdcache->stats.misses, lookups ? (100.0 * fdcache->stats.hits / lookups) : 0.0, fdcache->stats.stale, fdcache->stats.evictions);
+	}
+	if (vfs->blockcache) {
+		const struct blockcache_t *blockcache = vfs->blockcache;
+		uint64_t hits = blockcache->stats->hits;
+		uint64_t lookups = hits + blockcache->stats->misses;
+		fprintf(f, "   Block cache: %u blocks of %u bytes, %lu hits (%.1f%% hit rate), %lu insertions, %lu evictions\n", blockcache->set_count * BLOCKCACHE_WAYS, BLOCKCACHE_BLOCK_SIZE, hits, lookups ? (100.0 * hits / lookups) : 0.0, (uint64_t)blockcache->stats->insertions, (uint64_t)blockcache->stats->evictions);
+	}
+	if (vfs->mmap_threshold) {
+		fprintf(f, "   Files from %lu bytes on are read through mmap\n", vfs->mmap_threshold);
+	}
 	fprintf(f, "   Base flags: 0x%x ", vfs->inode.base_flags);
 	vfs_dump_flags(f, vfs->inode.base_flags);
 	fprintf(f, "\n");
@@ -351,6 +391,7 @@ void vfs_shell(struct vfs_t *vfs) {
 
 #ifdef __VFS_SHELL__
 #include "logging.h"
+#include "memfs.h"
 
 int main(int argc, char **argv) {
 	llvl_set(LLVL_TRACE);
@@ -363,9 +404,15 @@ int main(int argc, char **argv) {
 	vfs_add_inode(vfs, "/virt/abcd", NULL, VFS_INODE_FLAG_READ_ONLY, 0);
 	vfs_add_inode(vfs, "/b", "/bin", VFS_INODE_FLAG_READ_ONLY, 0);
 	vfs_add_inode(vfs, "/incoming", "/tmp/incoming", 0, VFS_INODE_FLAG_READ_ONLY);
+	vfs_add_inode(vfs, "/staging", "/", 0, VFS_INODE_FLAG_READ_ONLY);
+	struct memfs_t *memfs = memfs_new(64 * 1024 * 1024);
+	if (memfs) {
+		vfs_set_mount_backend(vfs, "/staging", memfs_backend(memfs));
+	}
 	vfs_freeze_inodes(vfs);
 	vfs_shell(vfs);
 	vfs_free(vfs);
+	memfs_free(memfs);
 	return 0;
 }
 #endif